@@ -0,0 +1,306 @@
+#include "../include/bitmap.h"
+#include "../src/bitmap.c"
+
+#include <stdio.h>
+#include <time.h>
+
+// Not a test, just numbers. Run it from a release build if you want them to mean anything.
+
+#define BENCH_BITS 65536
+#define BENCH_ROUNDS 2000
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// What ffz used to be, kept around so there's something to compare against
+static size_t ffz_bit_loop(const bitmap_t *const bitmap) {
+    size_t result = 0;
+    for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+    }
+    return (result == bitmap->bit_count ? SIZE_MAX : result);
+}
+
+static size_t ffz_kernel(const bitmap_t *const bitmap, skip_kernel_t kernel) {
+    const skip_kernel_t saved = skip_words;
+    skip_words = kernel;
+    const size_t result = bitmap_ffz(bitmap);
+    skip_words = saved;
+    return result;
+}
+
+// volatile so the compiler can't decide the loops are pointless
+static volatile size_t sink;
+
+static void bench_fill(const char *const name, const bitmap_t *const bitmap) {
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        sink = ffz_bit_loop(bitmap);
+    }
+    const double loop_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        sink = ffz_kernel(bitmap, skip_words_scalar);
+    }
+    const double scalar_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    printf("%-12s bit loop %10.1f ns   word %8.1f ns", name, loop_ns, scalar_ns);
+
+#ifdef BITMAP_X86
+    if (__builtin_cpu_supports("avx2")) {
+        start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            sink = ffz_kernel(bitmap, skip_words_avx2);
+        }
+        printf("   avx2 %8.1f ns", (now_ns() - start) / BENCH_ROUNDS);
+    }
+#endif
+
+    // built on a copy so the columns above keep measuring the plain scan
+    bitmap_t *summarized = bitmap_import(bitmap->bit_count, bitmap->data);
+    if (summarized && bitmap_enable_summary(summarized)) {
+        start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            sink = bitmap_ffz(summarized);
+        }
+        printf("   summary %8.1f ns", (now_ns() - start) / BENCH_ROUNDS);
+    }
+    bitmap_destroy(summarized);
+    puts("");
+}
+
+static double time_count(const bitmap_t *const bitmap, count_kernel_t kernel) {
+    const count_kernel_t saved = count_kernel;
+    count_kernel = kernel;
+    const double start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        sink = bitmap_total_set(bitmap);
+    }
+    const double result = (now_ns() - start) / BENCH_ROUNDS;
+    count_kernel = saved;
+    return result;
+}
+
+static void bench_total_set(const size_t n_bits) {
+    bitmap_t *bitmap = bitmap_create(n_bits);
+    if (!bitmap) {
+        return;
+    }
+    for (size_t i = 0; i < bitmap->byte_count; ++i) {
+        bitmap->data[i] = (uint8_t) (i * 37);
+    }
+
+    printf("%-12zu table %10.1f ns", n_bits, time_count(bitmap, count_bytes_table));
+#ifdef BITMAP_X86
+    if (__builtin_cpu_supports("popcnt")) {
+        printf("   popcnt %8.1f ns", time_count(bitmap, count_bytes_popcnt));
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        printf("   avx2 %8.1f ns", time_count(bitmap, count_bytes_avx2));
+    }
+#endif
+    bitmap_enable_count(bitmap);
+    printf("   counted %8.1f ns\n", time_count(bitmap, count_kernel));
+    bitmap_destroy(bitmap);
+}
+
+// What for_each used to be
+static void for_each_bit_loop(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
+    for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
+        if (bitmap_test(bitmap, idx)) {
+            func(idx, arg);
+        }
+    }
+}
+
+static void count_bit(size_t bit, void *arg) {
+    *(size_t *) arg += bit;
+}
+
+static void count_run(size_t start, size_t length, void *arg) {
+    *(size_t *) arg += start + length;
+}
+
+static void bench_for_each(const char *const name, const bitmap_t *const bitmap) {
+    size_t total = 0;
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        for_each_bit_loop(bitmap, count_bit, &total);
+    }
+    const double loop_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        bitmap_for_each(bitmap, count_bit, &total);
+    }
+    const double each_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        bitmap_for_each_run(bitmap, count_run, &total);
+    }
+    const double run_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+    sink = total;
+    printf("%-12s bit loop %10.1f ns   for_each %8.1f ns   runs %8.1f ns\n", name, loop_ns, each_ns, run_ns);
+}
+
+// What comparing an FBM against a reachability map used to take
+static size_t first_difference_bit_loop(const bitmap_t *const a, const bitmap_t *const b) {
+    for (size_t i = 0; i < a->bit_count; ++i) {
+        if (bitmap_test(a, i) != bitmap_test(b, i)) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static void bench_algebra(const size_t n_bits) {
+    bitmap_t *a = bitmap_create(n_bits), *b = bitmap_create(n_bits);
+    if (a && b) {
+        // identical right up to the last bit, the worst case for the compare
+        bitmap_format(a, 0x5A);
+        bitmap_format(b, 0x5A);
+        bitmap_flip(b, n_bits - 1);
+
+        double start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            sink = first_difference_bit_loop(a, b);
+        }
+        const double loop_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            sink = bitmap_first_difference(a, b);
+        }
+        const double diff_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            bitmap_xor(a, b);
+        }
+        const double xor_ns = (now_ns() - start) / BENCH_ROUNDS;
+
+        const combine_kernel_t saved = combine_kernel;
+        combine_kernel = combine_bytes_scalar;
+        start = now_ns();
+        for (int i = 0; i < BENCH_ROUNDS; ++i) {
+            bitmap_xor(a, b);
+        }
+        const double xor_scalar_ns = (now_ns() - start) / BENCH_ROUNDS;
+        combine_kernel = saved;
+
+        printf("%-12zu diff bit loop %10.1f ns   diff %8.1f ns   xor word %8.1f ns   xor %8.1f ns\n", n_bits,
+               loop_ns, diff_ns, xor_scalar_ns, xor_ns);
+    }
+    bitmap_destroy(a);
+    bitmap_destroy(b);
+}
+
+// Heap bytes behind the bits (not counting the bitmap_t itself)
+static size_t footprint(const bitmap_t *const bitmap) {
+    if (!FLAG_CHECK(bitmap, COMPRESSED)) {
+        return bitmap->byte_count;
+    }
+    size_t total = bitmap->chunk_count * sizeof(container_t);
+    for (size_t chunk = 0; chunk < bitmap->chunk_count; ++chunk) {
+        total += bitmap->chunks[chunk].capacity * sizeof(uint16_t);
+        total += bitmap->chunks[chunk].words ? CHUNK_WORDS * sizeof(uint64_t) : 0;
+    }
+    return total;
+}
+
+static double time_ffz(const bitmap_t *const bitmap) {
+    const double start = now_ns();
+    for (int i = 0; i < BENCH_ROUNDS; ++i) {
+        sink = bitmap_ffz(bitmap);
+    }
+    return (now_ns() - start) / BENCH_ROUNDS;
+}
+
+static void bench_compressed_case(const char *const name, const bitmap_t *const flat) {
+    // the serialized form is the easy way from one layout to the other
+    const size_t size = bitmap_serialize(flat, NULL, 0);
+    uint8_t *const serial = (uint8_t *) malloc(size);
+    if (!serial) {
+        return;
+    }
+    bitmap_serialize(flat, serial, size);
+    bitmap_t *const compressed = bitmap_deserialize(serial, size);
+    free(serial);
+    if (!compressed) {
+        return;
+    }
+    printf("%-14s flat %9zu B %10.1f ns   compressed %9zu B %10.1f ns   serialized %9zu B\n", name, footprint(flat),
+           time_ffz(flat), footprint(compressed), time_ffz(compressed), size);
+    bitmap_destroy(compressed);
+}
+
+static void bench_compressed(const size_t n_bits) {
+    bitmap_t *const flat = bitmap_create(n_bits);
+    if (!flat) {
+        return;
+    }
+    printf("\nffz and memory, %zu bits\n", n_bits);
+    bench_compressed_case("empty", flat);
+
+    bitmap_format(flat, 0xFF);
+    bitmap_reset(flat, n_bits - 1);
+    bench_compressed_case("nearly full", flat);
+
+    // a used device: full with scattered frees
+    for (size_t i = 0; i < n_bits; i += 4093) {
+        bitmap_reset(flat, i);
+    }
+    bench_compressed_case("scattered free", flat);
+
+    bitmap_format(flat, 0x00);
+    for (size_t i = 0; i < n_bits; i += 3) {
+        bitmap_set(flat, i);
+    }
+    bench_compressed_case("noise", flat);
+    bitmap_destroy(flat);
+}
+
+int main() {
+    bitmap_t *bitmap = bitmap_create(BENCH_BITS);
+    if (!bitmap) {
+        return 1;
+    }
+
+    printf("ffz over %d bits, %d rounds each\n", BENCH_BITS, BENCH_ROUNDS);
+
+    bench_fill("empty", bitmap);
+
+    memset(bitmap->data, 0xFF, bitmap->byte_count / 2);
+    bench_fill("half full", bitmap);
+
+    bitmap_format(bitmap, 0xFF);
+    bitmap_reset(bitmap, BENCH_BITS - 1);
+    bench_fill("nearly full", bitmap);
+
+    printf("\nfor_each over %d bits, %d rounds each\n", BENCH_BITS, BENCH_ROUNDS);
+    bitmap_format(bitmap, 0x00);
+    for (size_t i = 0; i < BENCH_BITS; i += 997) {
+        bitmap_set(bitmap, i);
+    }
+    bench_for_each("sparse", bitmap);
+    bitmap_set_range(bitmap, 0, BENCH_BITS / 2);
+    bench_for_each("half run", bitmap);
+
+    bitmap_destroy(bitmap);
+
+    printf("\ntotal_set, %d rounds each\n", BENCH_ROUNDS);
+    bench_total_set(BENCH_BITS);
+    bench_total_set(BENCH_BITS * 64);
+
+    printf("\nfirst difference and xor, %d rounds each\n", BENCH_ROUNDS);
+    bench_algebra(BENCH_BITS);
+
+    bench_compressed(BENCH_BITS);
+    bench_compressed(BENCH_BITS * 256);
+    return 0;
+}
@@ -13,6 +13,13 @@ extern "C" {
 
 typedef struct bitmap bitmap_t;
 
+// Cursor for walking a bitmap, see bitmap_iter_init
+// (it's just a position, so it's fine on the stack and there's nothing to free)
+typedef struct {
+    const bitmap_t *bitmap;
+    size_t position;
+} bitmap_iter_t;
+
 // WARNING: Bit requests outside the bitmap and NULL pointers WILL result in a segfault
 // This was originally a high performance C++ library, so the C translation assumes you're using it right.
 
@@ -47,12 +54,118 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets requested bit in bitmap and reports what it was before
+///  In atomic mode exactly one of any number of racing callers sees false
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return State of the bit before it was set
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Sets a range of bits in bitmap
+///  (ranges that run past the end of the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to set
+/// \param count The number of bits to set
+///
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Clears a range of bits in bitmap
+///  (ranges that run past the end of the bitmap are ignored)
+/// \param bitmap The bitmap
+/// \param start The first bit to clear
+/// \param count The number of bits to clear
+///
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks if every bit in a range is set
+/// \param bitmap The bitmap
+/// \param start The first bit to check
+/// \param count The number of bits to check
+/// \return true if all count bits are set, false if not or on error
+///
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Checks if any bit in a range is set
+/// \param bitmap The bitmap
+/// \param start The first bit to check
+/// \param count The number of bits to check
+/// \return true if at least one of the count bits is set, false if not or on error
+///
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Counts the set bits in a range
+/// \param bitmap The bitmap
+/// \param start The first bit to count
+/// \param count The number of bits to count
+/// \return the number of set bits in the range, 0 on error
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
 ///
 void bitmap_invert(bitmap_t *const bitmap);
 
+///
+/// Sets dst to dst & src
+///  Both bitmaps must be the same size, either can be an overlay
+/// \param dst The bitmap to modify
+/// \param src The bitmap to combine in (may be dst)
+/// \return true on success, false on error/size mismatch
+///
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Sets dst to dst | src
+///  Both bitmaps must be the same size, either can be an overlay
+/// \param dst The bitmap to modify
+/// \param src The bitmap to combine in (may be dst)
+/// \return true on success, false on error/size mismatch
+///
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Sets dst to dst ^ src
+///  Both bitmaps must be the same size, either can be an overlay
+/// \param dst The bitmap to modify
+/// \param src The bitmap to combine in (may be dst)
+/// \return true on success, false on error/size mismatch
+///
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Sets dst to dst & ~src (clears everything set in src)
+///  Both bitmaps must be the same size, either can be an overlay
+/// \param dst The bitmap to modify
+/// \param src The bitmap to combine in (may be dst)
+/// \return true on success, false on error/size mismatch
+///
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src);
+
+///
+/// Compares two bitmaps
+/// \param a A bitmap
+/// \param b Another bitmap
+/// \return true if they're the same size with the same bits set, false otherwise/on error
+///
+bool bitmap_equal(const bitmap_t *const a, const bitmap_t *const b);
+
+///
+/// Finds the first bit that differs between two bitmaps of the same size
+/// \param a A bitmap
+/// \param b Another bitmap
+/// \return The first differing bit, SIZE_MAX if they match or on error/size mismatch
+///
+size_t bitmap_first_difference(const bitmap_t *const a, const bitmap_t *const b);
+
 ///
 /// Find first set
 /// \param bitmap The bitmap
@@ -67,6 +180,32 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first zero at or after a given bit
+/// \param bitmap The bitmap
+/// \param start The bit to start looking from
+/// \return The first zero bit address at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Find a run of zeroes
+/// \param bitmap The bitmap
+/// \param start The bit to start looking from
+/// \param count The length of the run needed
+/// \return The first bit of the first run of count zeroes at or after start, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count);
+
+///
+/// Finds a cleared bit and sets it, ffz_from and set in one step
+///  In atomic mode this is safe to race, every caller gets a different bit
+/// \param bitmap The bitmap
+/// \param start The bit to start looking from
+/// \return The bit claimed, SIZE_MAX on error/nothing free at or after start
+///
+size_t bitmap_claim_zero(bitmap_t *const bitmap, const size_t start);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -82,6 +221,37 @@ size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+///
+/// For each loop for all runs of set bits
+///  Called once per run instead of once per bit, runs are maximal and in order
+/// \param bitmap The bitmap
+/// \param func The function to apply (parameters are the first bit of the run and its length)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg);
+
+///
+/// Starts an iterator at the requested bit
+/// \param iter The iterator to set up
+/// \param bitmap The bitmap to walk, don't destroy it while iterating
+/// \param start The first bit to consider
+///
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start);
+
+///
+/// Finds the next set bit and moves the iterator past it
+/// \param iter The iterator
+/// \return The set bit found, SIZE_MAX when there are no more (or on error)
+///
+size_t bitmap_iter_next_set(bitmap_iter_t *const iter);
+
+///
+/// Finds the next cleared bit and moves the iterator past it
+/// \param iter The iterator
+/// \return The cleared bit found, SIZE_MAX when there are no more (or on error)
+///
+size_t bitmap_iter_next_zero(bitmap_iter_t *const iter);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -112,11 +282,40 @@ size_t bitmap_get_bytes(const bitmap_t *const bitmap);
 ///
 bitmap_t *bitmap_create(const size_t n_bits);
 
+///
+/// Creates a bitmap kept as compressed containers instead of a flat array (zero initialized)
+///  Every 64K bits is stored as a sorted list, a run list or a plain bitset, whichever is smallest,
+///  so mostly full and mostly empty maps take next to no memory. Everything in here works on it except
+///  bitmap_export (returns NULL, there's no flat copy to hand out) and the summary and atomic modes.
+///  A change that needs memory it can't get leaves those 64K bits as they were: bitmap_test_and_set says
+///  the bit was already set, bitmap_and/or/xor/andnot return false, and the void calls just skip them.
+/// \param n_bits
+/// \return New compressed bitmap pointer, NULL on error
+///
+bitmap_t *bitmap_create_compressed(const size_t n_bits);
+
+///
+/// Writes the bitmap (either layout) out in the compressed form
+/// \param bitmap The bitmap
+/// \param buffer Where to write it, can be NULL to just ask how big it is
+/// \param size The size of buffer
+/// \return The bytes the whole thing needs (the buffer is only complete if size is at least that), 0 on error
+///
+size_t bitmap_serialize(const bitmap_t *const bitmap, void *const buffer, const size_t size);
+
+///
+/// Creates a compressed bitmap from bitmap_serialize's output
+/// \param buffer The serialized bitmap
+/// \param size The size of buffer
+/// \return New compressed bitmap pointer, NULL on error/anything malformed
+///
+bitmap_t *bitmap_deserialize(const void *const buffer, const size_t size);
+
 ///
 /// Gets pointer to the internal data for exporting
 ///  Be sure to query the bit and byte size if it's unknown
 /// \param bitmap The bitmap
-/// \return Pointer for writing
+/// \return Pointer for writing, NULL for compressed bitmaps
 ///
 const uint8_t *bitmap_export(const bitmap_t *const bitmap);
 
@@ -140,6 +339,33 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
+///
+/// Attaches a summary tree to the bitmap so ffz only has to probe a few words
+///  no matter how full it is. The tree is kept up to date by every bitmap_ call,
+///  so don't write to the data behind the bitmap's back (overlays included) once this is on.
+/// \param bitmap The bitmap
+/// \return true if the summary is available, false on error
+///
+bool bitmap_enable_summary(bitmap_t *const bitmap);
+
+///
+/// Keeps a running count of set bits so bitmap_total_set is O(1)
+///  Same rules as the summary, don't write to the data behind the bitmap's back once this is on.
+/// \param bitmap The bitmap
+/// \return true if the count is available, false on error
+///
+bool bitmap_enable_count(bitmap_t *const bitmap);
+
+///
+/// Makes set, reset, flip, test_and_set, claim_zero and the range set/reset safe to call from multiple threads
+///  Works with the summary and the count, turn those on first since enabling them isn't thread safe.
+///  Format, invert and the enables are still single threaded, do those before sharing the bitmap.
+///  Requires the data to be 8 byte aligned (anything from create, import, or an overlay on malloc/mmap'd memory)
+/// \param bitmap The bitmap
+/// \return true if atomic mode is on, false on error/misaligned data
+///
+bool bitmap_enable_atomic(bitmap_t *const bitmap);
+
 ///
 /// Destructs and destroys bitmap object
 /// \param bitmap The bitmap
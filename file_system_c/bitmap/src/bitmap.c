@@ -1,14 +1,63 @@
 #include "bitmap.h"
 
-// Just the one for now. Indicates we're an overlay and should not free
+// x86 gets a runtime-selected vector kernel for scanning, everybody else gets the word loop
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITMAP_X86 1
+#include <immintrin.h>
+#endif
+
+// OVERLAY indicates we're an overlay and should not free
+// SUMMARY indicates the summary levels are allocated and being kept up to date
+// COUNTED indicates set_count is being kept up to date
+// ATOMIC indicates bit changes have to go through the __atomic builtins (see ATOMIC MODE)
+// COMPRESSED indicates there is no data, the bits live in chunks (see COMPRESSED CONTAINERS)
 // (also, make sure that ALL is as wide as ll of the flags)
-typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
+typedef enum {
+    NONE = 0x00,
+    OVERLAY = 0x01,
+    SUMMARY = 0x02,
+    COUNTED = 0x04,
+    ATOMIC = 0x08,
+    COMPRESSED = 0x10,
+    ALL = 0xFF
+} BITMAP_FLAGS;
+
+// 64^8 words is more bits than anybody is going to ask for
+#define SUMMARY_LEVEL_MAX 8
+
+// Compressed bitmaps are split into chunks of 64K bits, each stored as whichever container is smallest
+#define CHUNK_SHIFT 16
+#define CHUNK_BITS (UINT32_C(1) << CHUNK_SHIFT)
+#define CHUNK_WORDS (CHUNK_BITS >> 6)
+#define CHUNK_NONE UINT32_MAX
+
+typedef enum { CONTAINER_ARRAY, CONTAINER_BITSET, CONTAINER_RUN } container_type_t;
+
+typedef struct {
+    container_type_t type;
+    uint32_t cardinality;  // bits set in the chunk
+    uint32_t size;         // ARRAY: entries, RUN: runs, BITSET: unused
+    uint32_t capacity;     // uint16_t's allocated in values
+    uint16_t *values;      // ARRAY: the set bits, sorted. RUN: (first, last) pairs, sorted and never touching
+    uint64_t *words;       // BITSET: CHUNK_WORDS words
+} container_t;
 
 struct bitmap {
     unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
     uint8_t *data;
     size_t bit_count, byte_count;
+    // Summary tree for ffz, only there if SUMMARY is set
+    // Bit n of level 0 is set if data word n has a zero in it, bit n of level k is set if word n of level k - 1
+    // is non-zero. The top level is always a single word. All levels share the one allocation.
+    unsigned summary_levels;
+    uint64_t *summary[SUMMARY_LEVEL_MAX];
+    size_t summary_words[SUMMARY_LEVEL_MAX];
+    // Running total of set bits, only valid if COUNTED is set
+    size_t set_count;
+    // Only there if COMPRESSED is set, and then data isn't
+    container_t *chunks;
+    size_t chunk_count;
 };
 
 
@@ -25,6 +74,9 @@ static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
 // Mask for all bits at index i and lower
 static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
 
+// Mask for all bits at index i and higher
+static const uint8_t mask_up_inclusive[8] = {0xFF, 0xFE, 0xFC, 0xF8, 0xF0, 0xE0, 0xC0, 0x80};
+
 // Inverted mask
 static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
 
@@ -58,44 +110,338 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Finds the first bit at or after start that matches value, SIZE_MAX if there isn't one
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t start, const bool value);
+
+// Splits a bit range into the bytes it covers and masks for the partial bytes on either end
+// (first == last means it's all in one byte and only head_mask matters)
+// Returns false if the range is empty or runs off the end
+typedef struct {
+    size_t first, last;
+    uint8_t head_mask, tail_mask;
+} byte_range_t;
+static bool bitmap_byte_range(const bitmap_t *const bitmap, const size_t start, const size_t count,
+                              byte_range_t *const range);
+
+// Checks that every byte is pattern, a word at a time
+static bool bytes_match(const uint8_t *const data, const size_t n_bytes, const uint8_t pattern);
+
+// Total bits set in n_bytes of data, using whatever the CPU is best at (see POPULATION COUNT)
+static size_t count_bytes(const uint8_t *const data, const size_t n_bytes);
+
+// Summary upkeep, the word given is the data word that changed
+static void summary_update(bitmap_t *const bitmap, const size_t word);
+static void summary_rebuild(bitmap_t *const bitmap);
+
+// Thread safe versions of the bit and range changes, see ATOMIC MODE
+typedef enum { BIT_SET, BIT_RESET, BIT_FLIP } bit_op_t;
+static bool atomic_bit_update(bitmap_t *const bitmap, const size_t bit, const bit_op_t op);
+static void atomic_range_update(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value);
+static size_t atomic_claim_zero(bitmap_t *const bitmap, const size_t start);
+
+// Whole bitmap combining and comparing, see BITMAP ALGEBRA
+typedef enum { OP_AND, OP_OR, OP_XOR, OP_ANDNOT } combine_op_t;
+static bool bitmap_combine(bitmap_t *const dst, const bitmap_t *const src, const combine_op_t op);
+static size_t first_difference_bytes(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes);
+
+// The compressed layout's versions of everything, see COMPRESSED CONTAINERS
+static bool compressed_test(const bitmap_t *const bitmap, const size_t bit);
+static bool compressed_update(bitmap_t *const bitmap, const size_t bit, const bool value);
+static bool compressed_range_update(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value);
+static size_t compressed_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count);
+static size_t compressed_scan(const bitmap_t *const bitmap, const size_t start, const bool value);
+static size_t compressed_total_set(const bitmap_t *const bitmap);
+static bool compressed_format(bitmap_t *const bitmap, const uint8_t pattern);
+static bool compressed_invert(bitmap_t *const bitmap);
+static void compressed_destroy(bitmap_t *const bitmap);
+static bool chunked_combine(bitmap_t *const dst, const bitmap_t *const src, const combine_op_t op);
+static size_t chunked_first_difference(const bitmap_t *const a, const bitmap_t *const b);
+
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        compressed_update(bitmap, bit, true);
+        return;
+    }
+    if (FLAG_CHECK(bitmap, ATOMIC)) {
+        atomic_bit_update(bitmap, bit, BIT_SET);
+        return;
+    }
+    if (FLAG_CHECK(bitmap, COUNTED) && !bitmap_test(bitmap, bit)) {
+        ++bitmap->set_count;
+    }
     bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_update(bitmap, bit >> 6);
+    }
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        compressed_update(bitmap, bit, false);
+        return;
+    }
+    if (FLAG_CHECK(bitmap, ATOMIC)) {
+        atomic_bit_update(bitmap, bit, BIT_RESET);
+        return;
+    }
+    if (FLAG_CHECK(bitmap, COUNTED) && bitmap_test(bitmap, bit)) {
+        --bitmap->set_count;
+    }
     bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_update(bitmap, bit >> 6);
+    }
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        return compressed_test(bitmap, bit);
+    }
     return bitmap->data[bit >> 3] & mask[bit & 0x07];
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        if (!compressed_update(bitmap, bit, true)) {
+            compressed_update(bitmap, bit, false);
+        }
+        return;
+    }
+    if (FLAG_CHECK(bitmap, ATOMIC)) {
+        atomic_bit_update(bitmap, bit, BIT_FLIP);
+        return;
+    }
+    if (FLAG_CHECK(bitmap, COUNTED)) {
+        bitmap->set_count += bitmap_test(bitmap, bit) ? (size_t) -1 : 1;
+    }
     bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_update(bitmap, bit >> 6);
+    }
+}
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        return !compressed_update(bitmap, bit, true);
+    }
+    if (FLAG_CHECK(bitmap, ATOMIC)) {
+        return atomic_bit_update(bitmap, bit, BIT_SET);
+    }
+    const bool was_set = bitmap_test(bitmap, bit);
+    bitmap_set(bitmap, bit);
+    return was_set;
+}
+
+void bitmap_set_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    byte_range_t range;
+    if (bitmap_byte_range(bitmap, start, count, &range)) {
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            compressed_range_update(bitmap, start, count, true);
+            return;
+        }
+        if (FLAG_CHECK(bitmap, ATOMIC)) {
+            atomic_range_update(bitmap, start, count, true);
+            return;
+        }
+        if (FLAG_CHECK(bitmap, COUNTED)) {
+            bitmap->set_count += count - bitmap_count_range(bitmap, start, count);
+        }
+        if (range.first == range.last) {
+            bitmap->data[range.first] |= range.head_mask;
+        } else {
+            bitmap->data[range.first] |= range.head_mask;
+            memset(bitmap->data + range.first + 1, 0xFF, range.last - range.first - 1);
+            bitmap->data[range.last] |= range.tail_mask;
+        }
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            for (size_t word = start >> 6; word <= (start + count - 1) >> 6; ++word) {
+                summary_update(bitmap, word);
+            }
+        }
+    }
+}
+
+void bitmap_reset_range(bitmap_t *const bitmap, const size_t start, const size_t count) {
+    byte_range_t range;
+    if (bitmap_byte_range(bitmap, start, count, &range)) {
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            compressed_range_update(bitmap, start, count, false);
+            return;
+        }
+        if (FLAG_CHECK(bitmap, ATOMIC)) {
+            atomic_range_update(bitmap, start, count, false);
+            return;
+        }
+        if (FLAG_CHECK(bitmap, COUNTED)) {
+            bitmap->set_count -= bitmap_count_range(bitmap, start, count);
+        }
+        if (range.first == range.last) {
+            bitmap->data[range.first] &= ~range.head_mask;
+        } else {
+            bitmap->data[range.first] &= ~range.head_mask;
+            memset(bitmap->data + range.first + 1, 0x00, range.last - range.first - 1);
+            bitmap->data[range.last] &= ~range.tail_mask;
+        }
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            for (size_t word = start >> 6; word <= (start + count - 1) >> 6; ++word) {
+                summary_update(bitmap, word);
+            }
+        }
+    }
+}
+
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    byte_range_t range;
+    if (bitmap_byte_range(bitmap, start, count, &range)) {
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            return compressed_count_range(bitmap, start, count) == count;
+        }
+        if (range.first == range.last) {
+            return (bitmap->data[range.first] & range.head_mask) == range.head_mask;
+        }
+        if ((bitmap->data[range.first] & range.head_mask) != range.head_mask ||
+            (bitmap->data[range.last] & range.tail_mask) != range.tail_mask) {
+            return false;
+        }
+        return bytes_match(bitmap->data + range.first + 1, range.last - range.first - 1, 0xFF);
+    }
+    return false;
+}
+
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    byte_range_t range;
+    if (bitmap_byte_range(bitmap, start, count, &range)) {
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            return compressed_count_range(bitmap, start, count) != 0;
+        }
+        if (range.first == range.last) {
+            return bitmap->data[range.first] & range.head_mask;
+        }
+        if ((bitmap->data[range.first] & range.head_mask) || (bitmap->data[range.last] & range.tail_mask)) {
+            return true;
+        }
+        return !bytes_match(bitmap->data + range.first + 1, range.last - range.first - 1, 0x00);
+    }
+    return false;
+}
+
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    size_t total = 0;
+    byte_range_t range;
+    if (bitmap_byte_range(bitmap, start, count, &range)) {
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            return compressed_count_range(bitmap, start, count);
+        }
+        if (range.first == range.last) {
+            return bit_totals[bitmap->data[range.first] & range.head_mask];
+        }
+        total += bit_totals[bitmap->data[range.first] & range.head_mask];
+        total += count_bytes(bitmap->data + range.first + 1, range.last - range.first - 1);
+        total += bit_totals[bitmap->data[range.last] & range.tail_mask];
+    }
+    return total;
 }
 
 void bitmap_invert(bitmap_t *const bitmap) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        compressed_invert(bitmap);
+        return;
+    }
     for (size_t byte = 0; byte < bitmap->byte_count; ++byte) {
         bitmap->data[byte] = ~bitmap->data[byte];
     }
+    if (FLAG_CHECK(bitmap, COUNTED)) {
+        bitmap->set_count = bitmap->bit_count - bitmap->set_count;
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_rebuild(bitmap);
+    }
+}
+
+bool bitmap_and(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_AND);
+}
+
+bool bitmap_or(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_OR);
+}
+
+bool bitmap_xor(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_XOR);
+}
+
+bool bitmap_andnot(bitmap_t *const dst, const bitmap_t *const src) {
+    return bitmap_combine(dst, src, OP_ANDNOT);
+}
+
+bool bitmap_equal(const bitmap_t *const a, const bitmap_t *const b) {
+    return a && b && a->bit_count == b->bit_count && bitmap_first_difference(a, b) == SIZE_MAX;
+}
+
+size_t bitmap_first_difference(const bitmap_t *const a, const bitmap_t *const b) {
+    if (a && b && a->bit_count == b->bit_count) {
+        if (FLAG_CHECK(a, COMPRESSED) || FLAG_CHECK(b, COMPRESSED)) {
+            return chunked_first_difference(a, b);
+        }
+        // Anything found past bit_count is the undetermined tail, which doesn't count
+        const size_t byte = first_difference_bytes(a->data, b->data, a->byte_count);
+        if (byte < a->byte_count) {
+            const size_t result = (byte << 3) + (size_t) __builtin_ctz(a->data[byte] ^ b->data[byte]);
+            return result < a->bit_count ? result : SIZE_MAX;
+        }
+    }
+    return SIZE_MAX;
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return bitmap_scan(bitmap, 0, true);
     }
     return SIZE_MAX;
 }
 
 size_t bitmap_ffz(const bitmap_t *const bitmap) {
     if (bitmap) {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) {
+        return bitmap_scan(bitmap, 0, false);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_from(const bitmap_t *const bitmap, const size_t start) {
+    if (bitmap) {
+        return bitmap_scan(bitmap, start, false);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    if (bitmap && count) {
+        size_t run_start = bitmap_scan(bitmap, start, false);
+        while (run_start != SIZE_MAX) {
+            // the run ends at the next one, or the end of the bitmap
+            size_t run_end = bitmap_scan(bitmap, run_start, true);
+            if (run_end == SIZE_MAX) {
+                run_end = bitmap->bit_count;
+            }
+            if (run_end - run_start >= count) {
+                return run_start;
+            }
+            run_start = bitmap_scan(bitmap, run_end, false);
+        }
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_claim_zero(bitmap_t *const bitmap, const size_t start) {
+    if (bitmap) {
+        if (FLAG_CHECK(bitmap, ATOMIC)) {
+            return atomic_claim_zero(bitmap, start);
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        const size_t result = bitmap_scan(bitmap, start, false);
+        if (result != SIZE_MAX) {
+            bitmap_set(bitmap, result);
+        }
+        return result;
     }
     return SIZE_MAX;
 }
@@ -103,11 +449,15 @@ size_t bitmap_ffz(const bitmap_t *const bitmap) {
 size_t bitmap_total_set(const bitmap_t *const bitmap) {
     size_t total = 0;
     if (bitmap) {
+        if (FLAG_CHECK(bitmap, COUNTED)) {
+            return __atomic_load_n(&bitmap->set_count, __ATOMIC_RELAXED);
+        }
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            return compressed_total_set(bitmap);
+        }
         // If we have leftover, stop a byte early because we have to handle it differently.
         size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) {
-            total += bit_totals[bitmap->data[idx]];
-        }
+        total += count_bytes(bitmap->data, stop);
         if (bitmap->leftover_bits) {
             // haha, this is readable
             // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
@@ -119,18 +469,80 @@ size_t bitmap_total_set(const bitmap_t *const bitmap) {
     return total;
 }
 
+// bitmap_for_each is just bitmap_for_each_run with the runs unrolled
+typedef struct {
+    void (*func)(size_t, void *);
+    void *arg;
+} for_each_bit_t;
+
+static void for_each_bit_of_run(size_t start, size_t length, void *arg) {
+    const for_each_bit_t *const each = (const for_each_bit_t *) arg;
+    for (size_t idx = start; idx < start + length; ++idx) {
+        each->func(idx, each->arg);
+    }
+}
+
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg) {
     if (bitmap && func) {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) {
-            if (bitmap_test(bitmap, idx)) {
-                func(idx, arg);
+        for_each_bit_t each = {func, arg};
+        bitmap_for_each_run(bitmap, for_each_bit_of_run, &each);
+    }
+}
+
+void bitmap_for_each_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg) {
+    if (bitmap && func) {
+        size_t start = bitmap_scan(bitmap, 0, true);
+        while (start != SIZE_MAX) {
+            size_t end = bitmap_scan(bitmap, start, false);
+            if (end == SIZE_MAX) {
+                end = bitmap->bit_count;
             }
+            func(start, end - start, arg);
+            start = bitmap_scan(bitmap, end, true);
         }
     }
 }
 
+void bitmap_iter_init(bitmap_iter_t *const iter, const bitmap_t *const bitmap, const size_t start) {
+    if (iter) {
+        iter->bitmap = bitmap;
+        iter->position = start;
+    }
+}
+
+// Shared by both directions, parks the iterator at the end once it runs out
+static size_t bitmap_iter_next(bitmap_iter_t *const iter, const bool value) {
+    if (iter && iter->bitmap) {
+        const size_t result = bitmap_scan(iter->bitmap, iter->position, value);
+        iter->position = result == SIZE_MAX ? iter->bitmap->bit_count : result + 1;
+        return result;
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_iter_next_set(bitmap_iter_t *const iter) {
+    return bitmap_iter_next(iter, true);
+}
+
+size_t bitmap_iter_next_zero(bitmap_iter_t *const iter) {
+    return bitmap_iter_next(iter, false);
+}
+
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        compressed_format(bitmap, pattern);
+        return;
+    }
     memset(bitmap->data, pattern, bitmap->byte_count);
+    if (FLAG_CHECK(bitmap, COUNTED)) {
+        // pattern isn't guaranteed for the leftover bits, so just count it
+        bitmap->flags &= ~COUNTED;
+        bitmap->set_count = bitmap_total_set(bitmap);
+        bitmap->flags |= COUNTED;
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_rebuild(bitmap);
+    }
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) {
@@ -145,6 +557,11 @@ bitmap_t *bitmap_create(const size_t n_bits) {
     return bitmap_initialize(n_bits, NONE);
 }
 
+bitmap_t *bitmap_create_compressed(const size_t n_bits) {
+    return bitmap_initialize(n_bits, COMPRESSED);
+}
+
+// NULL for compressed bitmaps, their data pointer is never set
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) {
     return bitmap->data;
 }
@@ -171,12 +588,76 @@ bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) {
     return NULL;
 }
 
+bool bitmap_enable_summary(bitmap_t *const bitmap) {
+    if (bitmap && !FLAG_CHECK(bitmap, COMPRESSED)) {
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            return true;
+        }
+        // Figure out how big each level is, stopping once a level fits in a word
+        size_t level_words[SUMMARY_LEVEL_MAX];
+        size_t total_words = 0;
+        size_t items = (bitmap->byte_count + 7) >> 3;
+        unsigned levels = 0;
+        do {
+            if (levels == SUMMARY_LEVEL_MAX) {
+                return false;
+            }
+            items = (items + 63) >> 6;
+            level_words[levels++] = items;
+            total_words += items;
+        } while (items > 1);
+
+        uint64_t *words = (uint64_t *) calloc(total_words, sizeof(uint64_t));
+        if (words) {
+            bitmap->summary_levels = levels;
+            for (unsigned level = 0; level < levels; ++level) {
+                bitmap->summary[level] = words;
+                bitmap->summary_words[level] = level_words[level];
+                words += level_words[level];
+            }
+            bitmap->flags |= SUMMARY;
+            summary_rebuild(bitmap);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool bitmap_enable_count(bitmap_t *const bitmap) {
+    if (bitmap) {
+        // compressed chunks keep their own cardinality, so they've effectively always got it
+        if (!FLAG_CHECK(bitmap, COUNTED) && !FLAG_CHECK(bitmap, COMPRESSED)) {
+            bitmap->set_count = bitmap_total_set(bitmap);
+            bitmap->flags |= COUNTED;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool bitmap_enable_atomic(bitmap_t *const bitmap) {
+    // Claims CAS whole words, so they have to be aligned and the hardware has to do it without a lock
+    // (compressed bitmaps have no data, so they're turned down here too)
+    if (bitmap && bitmap->data && ((uintptr_t) bitmap->data & 0x07) == 0 && __atomic_always_lock_free(8, 0)) {
+        bitmap->flags |= ATOMIC;
+        return true;
+    }
+    return false;
+}
+
 void bitmap_destroy(bitmap_t *bitmap) {
     if (bitmap) {
         if (!FLAG_CHECK(bitmap, OVERLAY)) {
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            // level 0 is the start of the allocation
+            free(bitmap->summary[0]);
+        }
+        if (FLAG_CHECK(bitmap, COMPRESSED)) {
+            compressed_destroy(bitmap);
+        }
         free(bitmap);
     }
 }
@@ -187,11 +668,51 @@ void bitmap_destroy(bitmap_t *bitmap) {
 ///
 //
 
+static bool bitmap_byte_range(const bitmap_t *const bitmap, const size_t start, const size_t count,
+                              byte_range_t *const range) {
+    if (bitmap && count && start < bitmap->bit_count && count <= bitmap->bit_count - start) {
+        const size_t end = start + count - 1;
+        range->first = start >> 3;
+        range->last = end >> 3;
+        if (range->first == range->last) {
+            range->head_mask = mask_up_inclusive[start & 0x07] & mask_down_inclusive[end & 0x07];
+            range->tail_mask = 0x00;
+        } else {
+            range->head_mask = mask_up_inclusive[start & 0x07];
+            range->tail_mask = mask_down_inclusive[end & 0x07];
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool bytes_match(const uint8_t *const data, const size_t n_bytes, const uint8_t pattern) {
+    const uint64_t expected = UINT64_C(0x0101010101010101) * pattern;
+    uint64_t word;
+    size_t idx = 0;
+    for (; idx + 8 <= n_bytes; idx += 8) {
+        memcpy(&word, data + idx, 8);
+        if (word != expected) {
+            return false;
+        }
+    }
+    for (; idx < n_bytes; ++idx) {
+        if (data[idx] != pattern) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
     if (n_bits) {  // must be non-zero
         bitmap_t *bitmap = (bitmap_t *) malloc(sizeof(bitmap_t));
         if (bitmap) {
             bitmap->flags = flags;
+            bitmap->summary_levels = 0;
+            bitmap->set_count = 0;
+            bitmap->chunks = NULL;
+            bitmap->chunk_count = 0;
             bitmap->bit_count = n_bits;
             bitmap->byte_count = n_bits >> 3;
             bitmap->leftover_bits = n_bits & 0x07;
@@ -207,6 +728,14 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
                 // don't mess with data, caller will set it
                 bitmap->data = NULL;
                 return bitmap;
+            } else if (FLAG_CHECK(bitmap, COMPRESSED)) {
+                // zeroed containers are empty arrays, which is exactly an all clear chunk
+                bitmap->data = NULL;
+                bitmap->chunk_count = (n_bits + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+                bitmap->chunks = (container_t *) calloc(bitmap->chunk_count, sizeof(container_t));
+                if (bitmap->chunks) {
+                    return bitmap;
+                }
             } else {
                 bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
                 if (bitmap->data) {
@@ -219,3 +748,1414 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags) {
     }
     return NULL;
 }
+
+//
+///
+// SCANNING ENGINE
+///
+//
+
+// ffs/ffz used to walk bit by bit, which is 65536 bitmap_test calls on a full FBM.
+// Instead we pull 64 bits at a time and throw away words that are all the wrong value.
+// The data store is still uint8_t, so words get assembled with memcpy (which the compiler
+// turns into a plain unaligned load) and byte swapped on big endian so that bit n of the
+// map is always bit n & 63 of word n >> 6.
+
+static inline uint64_t word_from_bytes(uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return __builtin_bswap64(word);
+#else
+    return word;
+#endif
+}
+
+// Loads word idx, the bytes past the end of the bitmap come back as zero
+static inline uint64_t load_word(const uint8_t *const data, const size_t byte_count, const size_t idx) {
+    uint64_t word = 0;
+    const size_t offset = idx << 3;
+    memcpy(&word, data + offset, (byte_count - offset) < 8 ? (byte_count - offset) : 8);
+    return word_from_bytes(word);
+}
+
+// Skip kernels walk forward from word idx over whole words that are entirely !value
+// and return the first word that may contain value (or full_words if they ran out).
+// They only ever look at full words, the partial word at the end is handled by bitmap_scan.
+typedef size_t (*skip_kernel_t)(const uint8_t *const data, const size_t full_words, size_t idx, const bool value);
+
+static size_t skip_words_scalar(const uint8_t *const data, const size_t full_words, size_t idx, const bool value) {
+    const uint64_t skip = value ? 0 : UINT64_MAX;
+    uint64_t word;
+    for (; idx < full_words; ++idx) {
+        memcpy(&word, data + (idx << 3), 8);
+        if (word != skip) {
+            break;
+        }
+    }
+    return idx;
+}
+
+#ifdef BITMAP_X86
+// Four words per compare. Mostly full and mostly empty maps are the whole reason this exists,
+// so the loop is just load, test, repeat. Whatever is left over goes to the scalar loop.
+__attribute__((target("avx2"))) static size_t skip_words_avx2(const uint8_t *const data, const size_t full_words,
+                                                               size_t idx, const bool value) {
+    const __m256i ones = _mm256_set1_epi8((char) 0xFF);
+    if (value) {
+        for (; idx + 4 <= full_words; idx += 4) {
+            const __m256i lane = _mm256_loadu_si256((const __m256i *) (data + (idx << 3)));
+            if (!_mm256_testz_si256(lane, lane)) {
+                break;
+            }
+        }
+    } else {
+        for (; idx + 4 <= full_words; idx += 4) {
+            const __m256i lane = _mm256_loadu_si256((const __m256i *) (data + (idx << 3)));
+            if (!_mm256_testc_si256(lane, ones)) {
+                break;
+            }
+        }
+    }
+    return skip_words_scalar(data, full_words, idx, value);
+}
+#endif
+
+static skip_kernel_t skip_words = skip_words_scalar;
+
+// Picks the scan kernels once when the library is loaded so nothing has to check later
+// Population count kernels, see POPULATION COUNT
+typedef size_t (*count_kernel_t)(const uint8_t *const data, const size_t n_bytes);
+static size_t count_bytes_table(const uint8_t *const data, const size_t n_bytes);
+#ifdef BITMAP_X86
+static size_t count_bytes_popcnt(const uint8_t *const data, const size_t n_bytes);
+static size_t count_bytes_avx2(const uint8_t *const data, const size_t n_bytes);
+#endif
+static count_kernel_t count_kernel = count_bytes_table;
+
+// Algebra kernels, see BITMAP ALGEBRA
+typedef void (*combine_kernel_t)(uint8_t *const dst, const uint8_t *const src, const size_t n_bytes,
+                                 const combine_op_t op);
+typedef size_t (*difference_kernel_t)(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes);
+static void combine_bytes_scalar(uint8_t *const dst, const uint8_t *const src, const size_t n_bytes,
+                                 const combine_op_t op);
+static size_t difference_bytes_scalar(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes);
+#ifdef BITMAP_X86
+static void combine_bytes_avx2(uint8_t *const dst, const uint8_t *const src, const size_t n_bytes,
+                               const combine_op_t op);
+static size_t difference_bytes_avx2(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes);
+#endif
+static combine_kernel_t combine_kernel = combine_bytes_scalar;
+static difference_kernel_t difference_kernel = difference_bytes_scalar;
+
+__attribute__((constructor)) static void bitmap_select_kernels(void) {
+#ifdef BITMAP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        count_kernel = count_bytes_popcnt;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        skip_words = skip_words_avx2;
+        count_kernel = count_bytes_avx2;
+        combine_kernel = combine_bytes_avx2;
+        difference_kernel = difference_bytes_avx2;
+    }
+#endif
+}
+
+// Zero search through the summary tree, see the bottom of the file
+static size_t summary_scan_zero(const bitmap_t *const bitmap, const size_t start);
+
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t start, const bool value) {
+    if (start >= bitmap->bit_count) {
+        return SIZE_MAX;
+    }
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        return compressed_scan(bitmap, start, value);
+    }
+    if (!value && FLAG_CHECK(bitmap, SUMMARY)) {
+        return summary_scan_zero(bitmap, start);
+    }
+    // Flip the words when looking for zeroes so we're always looking for a one
+    const uint64_t flip = value ? 0 : UINT64_MAX;
+    const size_t full_words = bitmap->byte_count >> 3;
+    const size_t word_total = (bitmap->byte_count + 7) >> 3;
+
+    size_t idx = start >> 6;
+    uint64_t bits = (load_word(bitmap->data, bitmap->byte_count, idx) ^ flip) & (UINT64_MAX << (start & 63));
+    while (!bits) {
+        idx = skip_words(bitmap->data, full_words, idx + 1, value);
+        if (idx >= word_total) {
+            return SIZE_MAX;
+        }
+        bits = load_word(bitmap->data, bitmap->byte_count, idx) ^ flip;
+    }
+    // Bits past bit_count are undetermined (and the padding from load_word flips to a one)
+    // but anything found out there is past the end anyway
+    const size_t result = (idx << 6) + (size_t) __builtin_ctzll(bits);
+    return result < bitmap->bit_count ? result : SIZE_MAX;
+}
+
+//
+///
+// SUMMARY TREE
+///
+//
+
+// Even skipping words, ffz on a nearly full map is still a walk over the whole thing.
+// The summary tree keeps one bit per data word saying "there's a zero in here" and then
+// summarizes that the same way until a level fits in a single word. 65536 bits is 1024 words,
+// which is 16 words of level 0 and one word of level 1, so any free bit is three probes away.
+
+// Valid bits of data word idx, only the last word can be short
+static inline uint64_t word_valid_mask(const bitmap_t *const bitmap, const size_t idx) {
+    const size_t remaining = bitmap->bit_count - (idx << 6);
+    return remaining >= 64 ? UINT64_MAX : (UINT64_C(1) << remaining) - 1;
+}
+
+static inline bool word_has_zero(const bitmap_t *const bitmap, const size_t idx) {
+    return (~load_word(bitmap->data, bitmap->byte_count, idx) & word_valid_mask(bitmap, idx)) != 0;
+}
+
+static void summary_update_atomic(bitmap_t *const bitmap, const size_t word);
+
+static void summary_update(bitmap_t *const bitmap, const size_t word) {
+    if (FLAG_CHECK(bitmap, ATOMIC)) {
+        summary_update_atomic(bitmap, word);
+        return;
+    }
+    size_t idx = word;
+    if (word_has_zero(bitmap, word)) {
+        // Mark the path all the way up, stopping when it was already marked
+        for (unsigned level = 0; level < bitmap->summary_levels; ++level, idx >>= 6) {
+            uint64_t *const entry = &bitmap->summary[level][idx >> 6];
+            const uint64_t bit = UINT64_C(1) << (idx & 63);
+            if (*entry & bit) {
+                break;
+            }
+            *entry |= bit;
+        }
+    } else {
+        // Clear upwards for as long as we're emptying out words
+        for (unsigned level = 0; level < bitmap->summary_levels; ++level, idx >>= 6) {
+            uint64_t *const entry = &bitmap->summary[level][idx >> 6];
+            *entry &= ~(UINT64_C(1) << (idx & 63));
+            if (*entry) {
+                break;
+            }
+        }
+    }
+}
+
+static void summary_rebuild(bitmap_t *const bitmap) {
+    size_t items = (bitmap->byte_count + 7) >> 3;
+    for (unsigned level = 0; level < bitmap->summary_levels; ++level) {
+        memset(bitmap->summary[level], 0x00, bitmap->summary_words[level] * sizeof(uint64_t));
+        for (size_t idx = 0; idx < items; ++idx) {
+            const bool marked = level ? bitmap->summary[level - 1][idx] != 0 : word_has_zero(bitmap, idx);
+            if (marked) {
+                bitmap->summary[level][idx >> 6] |= UINT64_C(1) << (idx & 63);
+            }
+        }
+        items = bitmap->summary_words[level];
+    }
+}
+
+// Summary word idx of the given level, atomic mode changes them under us so it has to be an atomic load
+static inline uint64_t summary_word(const bitmap_t *const bitmap, const unsigned level, const size_t idx) {
+    return FLAG_CHECK(bitmap, ATOMIC) ? __atomic_load_n(&bitmap->summary[level][idx], __ATOMIC_RELAXED)
+                                      : bitmap->summary[level][idx];
+}
+
+// First marked entry at or after idx in the given level, SIZE_MAX if there isn't one
+static size_t summary_next(const bitmap_t *const bitmap, const unsigned level, const size_t idx) {
+    size_t word = idx >> 6;
+    if (word >= bitmap->summary_words[level]) {
+        return SIZE_MAX;
+    }
+    uint64_t bits = summary_word(bitmap, level, word) & (UINT64_MAX << (idx & 63));
+    while (!bits) {
+        if (level + 1 == bitmap->summary_levels) {
+            return SIZE_MAX;
+        }
+        // Ask the level above which of our words is next
+        word = summary_next(bitmap, level + 1, word + 1);
+        if (word == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        bits = summary_word(bitmap, level, word);
+    }
+    return (word << 6) + (size_t) __builtin_ctzll(bits);
+}
+
+static size_t summary_scan_zero(const bitmap_t *const bitmap, const size_t start) {
+    const size_t word_total = (bitmap->byte_count + 7) >> 3;
+    size_t idx = start >> 6;
+    uint64_t bits = ~load_word(bitmap->data, bitmap->byte_count, idx) & word_valid_mask(bitmap, idx) &
+                    (UINT64_MAX << (start & 63));
+    while (!bits) {
+        idx = summary_next(bitmap, 0, idx + 1);
+        if (idx >= word_total) {
+            return SIZE_MAX;
+        }
+        bits = ~load_word(bitmap->data, bitmap->byte_count, idx) & word_valid_mask(bitmap, idx);
+    }
+    return (idx << 6) + (size_t) __builtin_ctzll(bits);
+}
+
+//
+///
+// POPULATION COUNT
+///
+//
+
+// The byte table is still the fallback, but anything made in the last decade can do better.
+// POPCNT does a word per instruction, and with AVX2 we can do the Harley-Seal carry-save adder
+// trick (Mula, Kurz, Lemire - "Faster Population Counts Using AVX2 Instructions") which only
+// does one real vector popcount per 16 vectors of input.
+
+static size_t count_bytes(const uint8_t *const data, const size_t n_bytes) {
+    return count_kernel(data, n_bytes);
+}
+
+static size_t count_bytes_table(const uint8_t *const data, const size_t n_bytes) {
+    size_t total = 0;
+    for (size_t idx = 0; idx < n_bytes; ++idx) {
+        total += bit_totals[data[idx]];
+    }
+    return total;
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("popcnt"))) static size_t count_bytes_popcnt(const uint8_t *const data, const size_t n_bytes) {
+    size_t total = 0;
+    size_t idx = 0;
+    uint64_t word;
+    for (; idx + 8 <= n_bytes; idx += 8) {
+        memcpy(&word, data + idx, 8);
+        total += (size_t) __builtin_popcountll(word);
+    }
+    return total + count_bytes_table(data + idx, n_bytes - idx);
+}
+
+// Per-byte popcount with a nibble lookup, summed up into the four 64-bit lanes
+__attribute__((target("avx2"))) static inline __m256i popcount_lanes(const __m256i v) {
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1,
+                                            2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0F);
+    const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low_mask));
+    const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi32(v, 4), low_mask));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+// Carry-save adder, h gets the carries and l the sums of a + b + c
+__attribute__((target("avx2"))) static inline void carry_save(__m256i *const h, __m256i *const l, const __m256i a,
+                                                              const __m256i b, const __m256i c) {
+    const __m256i u = _mm256_xor_si256(a, b);
+    *h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+    *l = _mm256_xor_si256(u, c);
+}
+
+#define LOAD_LANE(n) _mm256_loadu_si256((const __m256i *) (data + ((idx + (n)) << 5)))
+
+__attribute__((target("avx2"))) static size_t count_bytes_avx2(const uint8_t *const data, const size_t n_bytes) {
+    const size_t lanes = n_bytes >> 5;
+    __m256i total = _mm256_setzero_si256();
+    __m256i ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256(), fours = _mm256_setzero_si256(),
+            eights = _mm256_setzero_si256(), sixteens;
+    __m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+    size_t idx = 0;
+    for (; idx + 16 <= lanes; idx += 16) {
+        carry_save(&twos_a, &ones, ones, LOAD_LANE(0), LOAD_LANE(1));
+        carry_save(&twos_b, &ones, ones, LOAD_LANE(2), LOAD_LANE(3));
+        carry_save(&fours_a, &twos, twos, twos_a, twos_b);
+        carry_save(&twos_a, &ones, ones, LOAD_LANE(4), LOAD_LANE(5));
+        carry_save(&twos_b, &ones, ones, LOAD_LANE(6), LOAD_LANE(7));
+        carry_save(&fours_b, &twos, twos, twos_a, twos_b);
+        carry_save(&eights_a, &fours, fours, fours_a, fours_b);
+        carry_save(&twos_a, &ones, ones, LOAD_LANE(8), LOAD_LANE(9));
+        carry_save(&twos_b, &ones, ones, LOAD_LANE(10), LOAD_LANE(11));
+        carry_save(&fours_a, &twos, twos, twos_a, twos_b);
+        carry_save(&twos_a, &ones, ones, LOAD_LANE(12), LOAD_LANE(13));
+        carry_save(&twos_b, &ones, ones, LOAD_LANE(14), LOAD_LANE(15));
+        carry_save(&fours_b, &twos, twos, twos_a, twos_b);
+        carry_save(&eights_b, &fours, fours, fours_a, fours_b);
+        carry_save(&sixteens, &eights, eights, eights_a, eights_b);
+        total = _mm256_add_epi64(total, popcount_lanes(sixteens));
+    }
+    total = _mm256_slli_epi64(total, 4);
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(eights), 3));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(fours), 2));
+    total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(twos), 1));
+    total = _mm256_add_epi64(total, popcount_lanes(ones));
+    for (; idx < lanes; ++idx) {
+        total = _mm256_add_epi64(total, popcount_lanes(LOAD_LANE(0)));
+    }
+
+    uint64_t sums[4];
+    _mm256_storeu_si256((__m256i *) sums, total);
+    return (size_t) (sums[0] + sums[1] + sums[2] + sums[3]) +
+           count_bytes_popcnt(data + (lanes << 5), n_bytes - (lanes << 5));
+}
+
+#undef LOAD_LANE
+#endif
+
+//
+///
+// ATOMIC MODE
+///
+//
+
+// Two threads doing data[n] |= bit at the same time can lose one of the writes, and two threads
+// doing ffz then set can both get the same bit. Atomic mode routes every change through the
+// __atomic builtins instead. Bits and ranges are a fetch_or/and/xor on the 64-bit words holding them,
+// which is enough since the old value tells us exactly what changed. Claiming a zero scans like ffz
+// does and then takes the bit with a 64-bit CAS on its word, moving on to the next zero in the word
+// if someone else beat us to it. Every full word is only ever touched 64 bits at a time, and the
+// short word at the end only ever a byte at a time, so no two threads race at different widths.
+// Nobody ever holds a lock, so a stalled thread can't stall anyone else.
+//
+// The summary is where it gets interesting. Each level's bits become hints that may be set when
+// there's nothing below them, but never clear when there is. Setting is always safe. Clearing
+// is done optimistically: clear the bit, then look at what it summarizes again, and put it back
+// (with the rest of the path above it) if a zero showed up in the meantime. Everything is
+// SEQ_CST, so whoever clears last is guaranteed to see the other thread's release.
+
+static inline void count_adjust(bitmap_t *const bitmap, const size_t delta) {
+    if (FLAG_CHECK(bitmap, COUNTED) && delta) {
+        __atomic_add_fetch(&bitmap->set_count, delta, __ATOMIC_RELAXED);
+    }
+}
+
+// Applies op to the bits of data word idx (in map order), returns which of them were set before
+static uint64_t atomic_word_update(bitmap_t *const bitmap, const size_t idx, const uint64_t bits, const bit_op_t op) {
+    if (((idx + 1) << 3) <= bitmap->byte_count) {
+        uint64_t *const word = (uint64_t *) (bitmap->data + (idx << 3));
+        const uint64_t word_bits = word_from_bytes(bits);
+        uint64_t old;
+        switch (op) {
+            case BIT_SET: old = __atomic_fetch_or(word, word_bits, __ATOMIC_SEQ_CST); break;
+            case BIT_RESET: old = __atomic_fetch_and(word, ~word_bits, __ATOMIC_SEQ_CST); break;
+            default: old = __atomic_fetch_xor(word, word_bits, __ATOMIC_SEQ_CST); break;
+        }
+        return word_from_bytes(old) & bits;
+    }
+    // The short word at the end isn't a full uint64_t, do it a byte at a time like atomic_claim_word
+    uint64_t old = 0;
+    for (size_t byte = idx << 3; byte < bitmap->byte_count; ++byte) {
+        const unsigned shift = (unsigned) ((byte & 0x07) << 3);
+        const uint8_t byte_bits = (uint8_t) (bits >> shift);
+        if (!byte_bits) {
+            continue;
+        }
+        uint8_t previous;
+        switch (op) {
+            case BIT_SET: previous = __atomic_fetch_or(&bitmap->data[byte], byte_bits, __ATOMIC_SEQ_CST); break;
+            case BIT_RESET:
+                previous = __atomic_fetch_and(&bitmap->data[byte], (uint8_t) ~byte_bits, __ATOMIC_SEQ_CST);
+                break;
+            default: previous = __atomic_fetch_xor(&bitmap->data[byte], byte_bits, __ATOMIC_SEQ_CST); break;
+        }
+        old |= (uint64_t) previous << shift;
+    }
+    return old & bits;
+}
+
+static bool atomic_bit_update(bitmap_t *const bitmap, const size_t bit, const bit_op_t op) {
+    const bool was_set = atomic_word_update(bitmap, bit >> 6, UINT64_C(1) << (bit & 63), op) != 0;
+    if (op != BIT_RESET && !was_set) {
+        count_adjust(bitmap, 1);
+    } else if (op != BIT_SET && was_set) {
+        count_adjust(bitmap, (size_t) -1);
+    }
+    if (FLAG_CHECK(bitmap, SUMMARY)) {
+        summary_update_atomic(bitmap, bit >> 6);
+    }
+    return was_set;
+}
+
+static void atomic_range_update(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value) {
+    // A word at a time, the old values keep the count exact without a second pass
+    const size_t last = start + count - 1;
+    size_t changed = 0;
+    for (size_t idx = start >> 6; idx <= last >> 6; ++idx) {
+        uint64_t bits = UINT64_MAX;
+        if (idx == start >> 6) {
+            bits &= UINT64_MAX << (start & 63);
+        }
+        if (idx == last >> 6) {
+            bits &= UINT64_MAX >> (63 - (last & 63));
+        }
+        const uint64_t old = atomic_word_update(bitmap, idx, bits, value ? BIT_SET : BIT_RESET);
+        changed += (size_t) __builtin_popcountll(value ? bits & ~old : old);
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            summary_update_atomic(bitmap, idx);
+        }
+    }
+    count_adjust(bitmap, value ? changed : (size_t) 0 - changed);
+}
+
+// Takes a zero out of data word idx at or after bit start, SIZE_MAX if the word has none left
+static size_t atomic_claim_word(bitmap_t *const bitmap, const size_t idx, const size_t start) {
+    uint64_t allowed = word_valid_mask(bitmap, idx);
+    if ((idx << 6) < start) {
+        allowed &= UINT64_MAX << (start & 63);
+    }
+    if (((idx + 1) << 3) <= bitmap->byte_count) {
+        uint64_t *const word = (uint64_t *) (bitmap->data + (idx << 3));
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        for (;;) {
+            const uint64_t free_bits = ~word_from_bytes(old) & allowed;
+            if (!free_bits) {
+                return SIZE_MAX;
+            }
+            const unsigned bit = (unsigned) __builtin_ctzll(free_bits);
+            // on failure old is refreshed, so just go again
+            if (__atomic_compare_exchange_n(word, &old, old | word_from_bytes(UINT64_C(1) << bit), true,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                return (idx << 6) + bit;
+            }
+        }
+    }
+    // The short word at the end isn't a full uint64_t, do it a byte at a time
+    for (size_t byte = idx << 3; byte < bitmap->byte_count; ++byte) {
+        const uint8_t byte_allowed = (uint8_t) (allowed >> ((byte & 0x07) << 3));
+        uint8_t old = __atomic_load_n(&bitmap->data[byte], __ATOMIC_RELAXED);
+        while ((uint8_t) ~old & byte_allowed) {
+            const unsigned bit = (unsigned) __builtin_ctz((uint8_t) ~old & byte_allowed);
+            if (__atomic_compare_exchange_n(&bitmap->data[byte], &old, (uint8_t) (old | mask[bit]), true,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                return (byte << 3) + bit;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t atomic_claim_zero(bitmap_t *const bitmap, const size_t start) {
+    size_t position = start;
+    for (;;) {
+        // The scan is only a hint here, the CAS is what decides
+        const size_t candidate = bitmap_scan(bitmap, position, false);
+        if (candidate == SIZE_MAX) {
+            return SIZE_MAX;
+        }
+        const size_t word = candidate >> 6;
+        const size_t result = atomic_claim_word(bitmap, word, position);
+        if (FLAG_CHECK(bitmap, SUMMARY)) {
+            // either we filled it or it was already full, both mean the hint may need clearing
+            summary_update_atomic(bitmap, word);
+        }
+        if (result != SIZE_MAX) {
+            count_adjust(bitmap, 1);
+            return result;
+        }
+        position = (word + 1) << 6;
+    }
+}
+
+// Whether entry idx of the given level has anything under it
+static inline bool summary_has_zero_below(const bitmap_t *const bitmap, const unsigned level, const size_t idx) {
+    return level ? __atomic_load_n(&bitmap->summary[level - 1][idx], __ATOMIC_SEQ_CST) != 0
+                 : word_has_zero(bitmap, idx);
+}
+
+static void summary_update_atomic(bitmap_t *const bitmap, const size_t word) {
+    size_t idx = word;
+    unsigned level = 0;
+    // Clear upwards for as long as we're emptying out words, checking again after each clear
+    for (; level < bitmap->summary_levels; ++level, idx >>= 6) {
+        if (summary_has_zero_below(bitmap, level, idx)) {
+            break;
+        }
+        uint64_t *const entry = &bitmap->summary[level][idx >> 6];
+        const uint64_t bit = UINT64_C(1) << (idx & 63);
+        const uint64_t left = __atomic_and_fetch(entry, ~bit, __ATOMIC_SEQ_CST);
+        if (summary_has_zero_below(bitmap, level, idx)) {
+            // a zero showed up while we were clearing, it's on us to put the path back
+            break;
+        }
+        if (left) {
+            return;
+        }
+    }
+    // Mark the path the rest of the way up, stopping when it was already marked
+    // (the plain load first keeps every claim from bouncing the same summary line around)
+    for (; level < bitmap->summary_levels; ++level, idx >>= 6) {
+        uint64_t *const entry = &bitmap->summary[level][idx >> 6];
+        const uint64_t bit = UINT64_C(1) << (idx & 63);
+        if ((__atomic_load_n(entry, __ATOMIC_SEQ_CST) & bit) ||
+            (__atomic_fetch_or(entry, bit, __ATOMIC_SEQ_CST) & bit)) {
+            break;
+        }
+    }
+}
+
+//
+///
+// BITMAP ALGEBRA
+///
+//
+
+// Checking an FBM against what's actually reachable is an xor and a scan, so it should go at
+// memory speed. Everything works on whole bytes, the undetermined bits past bit_count get combined
+// along with the rest (harmless, nobody is supposed to look at them) and the comparisons mask them off.
+
+static bool bitmap_combine(bitmap_t *const dst, const bitmap_t *const src, const combine_op_t op) {
+    if (dst && src && dst->bit_count == src->bit_count) {
+        bool combined = true;
+        if (FLAG_CHECK(dst, COMPRESSED) || FLAG_CHECK(src, COMPRESSED)) {
+            combined = chunked_combine(dst, src, op);
+        } else {
+            combine_kernel(dst->data, src->data, dst->byte_count, op);
+        }
+        if (FLAG_CHECK(dst, COUNTED)) {
+            dst->flags &= ~COUNTED;
+            dst->set_count = bitmap_total_set(dst);
+            dst->flags |= COUNTED;
+        }
+        if (FLAG_CHECK(dst, SUMMARY)) {
+            summary_rebuild(dst);
+        }
+        return combined;
+    }
+    return false;
+}
+
+static size_t first_difference_bytes(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes) {
+    return difference_kernel(a, b, n_bytes);
+}
+
+static inline uint64_t combine_word(const uint64_t dst, const uint64_t src, const combine_op_t op) {
+    switch (op) {
+        case OP_AND: return dst & src;
+        case OP_OR: return dst | src;
+        case OP_XOR: return dst ^ src;
+        default: return dst & ~src;
+    }
+}
+
+static void combine_bytes_scalar(uint8_t *const dst, const uint8_t *const src, const size_t n_bytes,
+                                 const combine_op_t op) {
+    size_t idx = 0;
+    uint64_t word_dst, word_src;
+    for (; idx + 8 <= n_bytes; idx += 8) {
+        memcpy(&word_dst, dst + idx, 8);
+        memcpy(&word_src, src + idx, 8);
+        word_dst = combine_word(word_dst, word_src, op);
+        memcpy(dst + idx, &word_dst, 8);
+    }
+    for (; idx < n_bytes; ++idx) {
+        dst[idx] = (uint8_t) combine_word(dst[idx], src[idx], op);
+    }
+}
+
+static size_t difference_bytes_scalar(const uint8_t *const a, const uint8_t *const b, const size_t n_bytes) {
+    size_t idx = 0;
+    uint64_t word_a, word_b;
+    for (; idx + 8 <= n_bytes; idx += 8) {
+        memcpy(&word_a, a + idx, 8);
+        memcpy(&word_b, b + idx, 8);
+        if (word_a != word_b) {
+            break;
+        }
+    }
+    for (; idx < n_bytes && a[idx] == b[idx]; ++idx) {
+    }
+    return idx;
+}
+
+#ifdef BITMAP_X86
+// The op switch is hoisted out of the loop so each case is a straight load/op/store
+#define COMBINE_LOOP(expr)                                                              \
+    for (; idx + 32 <= n_bytes; idx += 32) {                                            \
+        const __m256i lane_dst = _mm256_loadu_si256((const __m256i *) (dst + idx));     \
+        const __m256i lane_src = _mm256_loadu_si256((const __m256i *) (src + idx));     \
+        _mm256_storeu_si256((__m256i *) (dst + idx), expr);                             \
+    }
+
+__attribute__((target("avx2"))) static void combine_bytes_avx2(uint8_t *const dst, const uint8_t *const src,
+                                                                const size_t n_bytes, const combine_op_t op) {
+    size_t idx = 0;
+    switch (op) {
+        case OP_AND: COMBINE_LOOP(_mm256_and_si256(lane_dst, lane_src)) break;
+        case OP_OR: COMBINE_LOOP(_mm256_or_si256(lane_dst, lane_src)) break;
+        case OP_XOR: COMBINE_LOOP(_mm256_xor_si256(lane_dst, lane_src)) break;
+        default: COMBINE_LOOP(_mm256_andnot_si256(lane_src, lane_dst)) break;
+    }
+    combine_bytes_scalar(dst + idx, src + idx, n_bytes - idx, op);
+}
+
+#undef COMBINE_LOOP
+
+__attribute__((target("avx2"))) static size_t difference_bytes_avx2(const uint8_t *const a, const uint8_t *const b,
+                                                                     const size_t n_bytes) {
+    size_t idx = 0;
+    for (; idx + 32 <= n_bytes; idx += 32) {
+        const __m256i lane_a = _mm256_loadu_si256((const __m256i *) (a + idx));
+        const __m256i lane_b = _mm256_loadu_si256((const __m256i *) (b + idx));
+        const uint32_t same = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(lane_a, lane_b));
+        if (same != UINT32_MAX) {
+            return idx + (size_t) __builtin_ctz(~same);
+        }
+    }
+    return idx + difference_bytes_scalar(a + idx, b + idx, n_bytes - idx);
+}
+#endif
+
+//
+///
+// COMPRESSED CONTAINERS
+///
+//
+
+// A flat FBM for a big device is mostly 0xFF with the odd hole, or mostly zero with the odd
+// allocation, and either way most of it is wasted. The compressed layout is the Roaring one
+// (Chambi, Lemire et al. - "Better bitmap performance with Roaring bitmaps"): the map is cut into
+// 64K bit chunks and each chunk is stored as whichever container is smallest for what's in it:
+//   ARRAY  - the sorted set bits, up to ARRAY_MAX of them (8KiB at most, same as a bitset)
+//   RUN    - sorted (first, last) pairs, so a full or empty-ish chunk is a handful of bytes
+//   BITSET - the plain 1024 words, for anything too busy for the other two
+// An empty chunk is an ARRAY with nothing allocated. Single bit changes work on the container in
+// place, and anything that would overflow it (or anything bulk) goes through the bits as a plain
+// bitset and gets re-encoded by container_store, which picks the smallest container again.
+// Every container knows its cardinality, which makes full and empty chunks one compare to skip.
+
+#define ARRAY_MAX 4096
+#define RUN_MAX 2048
+
+static inline uint32_t chunk_bits(const bitmap_t *const bitmap, const size_t chunk) {
+    const size_t remaining = bitmap->bit_count - (chunk << CHUNK_SHIFT);
+    return remaining >= CHUNK_BITS ? CHUNK_BITS : (uint32_t) remaining;
+}
+
+// Makes the container an empty ARRAY
+static void container_clear(container_t *const container) {
+    free(container->values);
+    free(container->words);
+    memset(container, 0x00, sizeof(container_t));
+}
+
+// Makes sure values can hold at least count uint16_t's
+static bool container_reserve(container_t *const container, const uint32_t count) {
+    if (count > container->capacity) {
+        uint32_t capacity = container->capacity ? container->capacity * 2 : 8;
+        capacity = capacity < count ? count : capacity;
+        uint16_t *const values = (uint16_t *) realloc(container->values, capacity * sizeof(uint16_t));
+        if (!values) {
+            return false;
+        }
+        container->values = values;
+        container->capacity = capacity;
+    }
+    return true;
+}
+
+// First array entry >= x
+static uint32_t array_lower_bound(const uint16_t *const values, const uint32_t size, const uint32_t x) {
+    uint32_t low = 0, high = size;
+    while (low < high) {
+        const uint32_t mid = (low + high) >> 1;
+        if (values[mid] < x) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// First run that ends at or after x
+static uint32_t run_lower_bound(const uint16_t *const runs, const uint32_t size, const uint32_t x) {
+    uint32_t low = 0, high = size;
+    while (low < high) {
+        const uint32_t mid = (low + high) >> 1;
+        if (runs[(mid << 1) + 1] < x) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Sets or clears bits first through last (inclusive) of a chunk's worth of words
+static void words_update(uint64_t *const words, const uint32_t first, const uint32_t last, const bool value) {
+    for (uint32_t idx = first >> 6; idx <= last >> 6; ++idx) {
+        uint64_t bits = UINT64_MAX;
+        if (idx == first >> 6) {
+            bits &= UINT64_MAX << (first & 63);
+        }
+        if (idx == last >> 6) {
+            bits &= UINT64_MAX >> (63 - (last & 63));
+        }
+        words[idx] = value ? words[idx] | bits : words[idx] & ~bits;
+    }
+}
+
+// Next bit of the requested value at or after from, CHUNK_NONE if there isn't one before length
+static uint32_t words_next(const uint64_t *const words, const uint32_t from, const bool value, const uint32_t length) {
+    if (from >= length) {
+        return CHUNK_NONE;
+    }
+    const uint64_t flip = value ? 0 : UINT64_MAX;
+    uint32_t idx = from >> 6;
+    uint64_t bits = (words[idx] ^ flip) & (UINT64_MAX << (from & 63));
+    while (!bits) {
+        if (++idx == CHUNK_WORDS) {
+            return CHUNK_NONE;
+        }
+        bits = words[idx] ^ flip;
+    }
+    const uint32_t result = (idx << 6) + (uint32_t) __builtin_ctzll(bits);
+    return result < length ? result : CHUNK_NONE;
+}
+
+// Set bits in [first, end)
+static uint32_t words_count_range(const uint64_t *const words, const uint32_t first, const uint32_t end) {
+    uint32_t total = 0;
+    for (uint32_t idx = first >> 6; idx <= (end - 1) >> 6; ++idx) {
+        uint64_t bits = words[idx];
+        if (idx == first >> 6) {
+            bits &= UINT64_MAX << (first & 63);
+        }
+        if (idx == (end - 1) >> 6) {
+            bits &= UINT64_MAX >> (63 - ((end - 1) & 63));
+        }
+        total += (uint32_t) __builtin_popcountll(bits);
+    }
+    return total;
+}
+
+static bool container_test(const container_t *const container, const uint32_t low) {
+    switch (container->type) {
+        case CONTAINER_ARRAY: {
+            const uint32_t idx = array_lower_bound(container->values, container->size, low);
+            return idx < container->size && container->values[idx] == low;
+        }
+        case CONTAINER_BITSET: return (container->words[low >> 6] >> (low & 63)) & 1;
+        default: {
+            const uint32_t idx = run_lower_bound(container->values, container->size, low);
+            return idx < container->size && container->values[idx << 1] <= low;
+        }
+    }
+}
+
+// Expands the container into a chunk's worth of words
+static void container_load(const container_t *const container, uint64_t *const words) {
+    if (container->type == CONTAINER_BITSET) {
+        memcpy(words, container->words, CHUNK_WORDS * sizeof(uint64_t));
+        return;
+    }
+    memset(words, 0x00, CHUNK_WORDS * sizeof(uint64_t));
+    for (uint32_t idx = 0; idx < container->size; ++idx) {
+        if (container->type == CONTAINER_ARRAY) {
+            words[container->values[idx] >> 6] |= UINT64_C(1) << (container->values[idx] & 63);
+        } else {
+            words_update(words, container->values[idx << 1], container->values[(idx << 1) + 1], true);
+        }
+    }
+}
+
+// Re-encodes the container from the given words as whichever container is smallest
+// (anything in the words past length is dropped). False if it couldn't get the memory, and
+// then the container is left the way it was.
+static bool container_store(container_t *const container, uint64_t *const words, const uint32_t length) {
+    if (length < CHUNK_BITS) {
+        words_update(words, length, CHUNK_BITS - 1, false);
+    }
+    // A run starts at every set bit whose neighbour below is clear
+    uint32_t cardinality = 0, runs = 0;
+    uint64_t carry = 0;
+    for (uint32_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+        cardinality += (uint32_t) __builtin_popcountll(words[idx]);
+        runs += (uint32_t) __builtin_popcountll(words[idx] & ~((words[idx] << 1) | carry));
+        carry = words[idx] >> 63;
+    }
+
+    container_t fresh;
+    memset(&fresh, 0x00, sizeof(container_t));
+    fresh.cardinality = cardinality;
+    if (cardinality && runs * 2 <= cardinality && runs <= RUN_MAX) {
+        // 4 bytes a run beats 2 bytes a bit and the 8KiB bitset
+        fresh.type = CONTAINER_RUN;
+        if (!container_reserve(&fresh, runs << 1)) {
+            return false;
+        }
+        uint32_t first = words_next(words, 0, true, length);
+        while (first != CHUNK_NONE) {
+            uint32_t end = words_next(words, first, false, length);
+            end = end == CHUNK_NONE ? length : end;
+            fresh.values[fresh.size << 1] = (uint16_t) first;
+            fresh.values[(fresh.size << 1) + 1] = (uint16_t) (end - 1);
+            ++fresh.size;
+            first = words_next(words, end, true, length);
+        }
+    } else if (cardinality <= ARRAY_MAX) {
+        fresh.type = CONTAINER_ARRAY;
+        if (cardinality && !container_reserve(&fresh, cardinality)) {
+            return false;
+        }
+        for (uint32_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+            for (uint64_t bits = words[idx]; bits; bits &= bits - 1) {
+                fresh.values[fresh.size++] = (uint16_t) ((idx << 6) + (uint32_t) __builtin_ctzll(bits));
+            }
+        }
+    } else {
+        fresh.type = CONTAINER_BITSET;
+        fresh.words = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+        if (!fresh.words) {
+            return false;
+        }
+        memcpy(fresh.words, words, CHUNK_WORDS * sizeof(uint64_t));
+    }
+    container_clear(container);
+    *container = fresh;
+    return true;
+}
+
+// Everything set (one run) or everything clear (empty array). False if it couldn't get the
+// memory, and then the container is left the way it was, like container_store.
+static bool container_fill(container_t *const container, const bool value, const uint32_t length) {
+    container_t fresh;
+    memset(&fresh, 0x00, sizeof(container_t));
+    if (value) {
+        if (!container_reserve(&fresh, 2)) {
+            return false;
+        }
+        fresh.type = CONTAINER_RUN;
+        fresh.values[0] = 0;
+        fresh.values[1] = (uint16_t) (length - 1);
+        fresh.size = 1;
+        fresh.cardinality = length;
+    }
+    container_clear(container);
+    *container = fresh;
+    return true;
+}
+
+// The slow path for a single bit, when changing it in place would overflow the container.
+// False (and the bit left alone) if it couldn't get the memory.
+static bool container_rebuild_with(container_t *const container, const uint32_t low, const bool value,
+                                   const uint32_t length) {
+    uint64_t words[CHUNK_WORDS];
+    container_load(container, words);
+    words_update(words, low, low, value);
+    return container_store(container, words, length);
+}
+
+// Sets the bit, returns true if it wasn't set before (false if it's still clear for lack of memory)
+static bool container_set(container_t *const container, const uint32_t low, const uint32_t length) {
+    switch (container->type) {
+        case CONTAINER_ARRAY: {
+            const uint32_t idx = array_lower_bound(container->values, container->size, low);
+            if (idx < container->size && container->values[idx] == low) {
+                return false;
+            }
+            if (container->size == ARRAY_MAX || !container_reserve(container, container->size + 1)) {
+                return container_rebuild_with(container, low, true, length);
+            }
+            memmove(container->values + idx + 1, container->values + idx,
+                    (container->size - idx) * sizeof(uint16_t));
+            container->values[idx] = (uint16_t) low;
+            ++container->size;
+            break;
+        }
+        case CONTAINER_BITSET: {
+            const uint64_t bit = UINT64_C(1) << (low & 63);
+            if (container->words[low >> 6] & bit) {
+                return false;
+            }
+            container->words[low >> 6] |= bit;
+            // a full bitset is still right if there's no memory for the run
+            if (container->cardinality + 1 == length && container_fill(container, true, length)) {
+                return true;
+            }
+            break;
+        }
+        default: {
+            uint16_t *const runs = container->values;
+            const uint32_t idx = run_lower_bound(runs, container->size, low);
+            if (idx < container->size && runs[idx << 1] <= low) {
+                return false;
+            }
+            const bool join_previous = idx > 0 && runs[((idx - 1) << 1) + 1] + 1u == low;
+            const bool join_next = idx < container->size && runs[idx << 1] == low + 1;
+            if (join_previous && join_next) {
+                // the bit was the only gap between two runs
+                runs[((idx - 1) << 1) + 1] = runs[(idx << 1) + 1];
+                memmove(runs + (idx << 1), runs + ((idx + 1) << 1),
+                        ((container->size - idx - 1) << 1) * sizeof(uint16_t));
+                --container->size;
+            } else if (join_previous) {
+                runs[((idx - 1) << 1) + 1] = (uint16_t) low;
+            } else if (join_next) {
+                runs[idx << 1] = (uint16_t) low;
+            } else if (container->size == RUN_MAX || !container_reserve(container, (container->size + 1) << 1)) {
+                return container_rebuild_with(container, low, true, length);
+            } else {
+                memmove(container->values + ((idx + 1) << 1), container->values + (idx << 1),
+                        ((container->size - idx) << 1) * sizeof(uint16_t));
+                container->values[idx << 1] = (uint16_t) low;
+                container->values[(idx << 1) + 1] = (uint16_t) low;
+                ++container->size;
+            }
+            break;
+        }
+    }
+    ++container->cardinality;
+    return true;
+}
+
+// Clears the bit, returns true if it was set before (false if it's still set for lack of memory)
+static bool container_reset(container_t *const container, const uint32_t low, const uint32_t length) {
+    switch (container->type) {
+        case CONTAINER_ARRAY: {
+            const uint32_t idx = array_lower_bound(container->values, container->size, low);
+            if (idx == container->size || container->values[idx] != low) {
+                return false;
+            }
+            memmove(container->values + idx, container->values + idx + 1,
+                    (container->size - idx - 1) * sizeof(uint16_t));
+            --container->size;
+            break;
+        }
+        case CONTAINER_BITSET: {
+            const uint64_t bit = UINT64_C(1) << (low & 63);
+            if (!(container->words[low >> 6] & bit)) {
+                return false;
+            }
+            // Only shrink well under ARRAY_MAX so a map sitting on the line doesn't convert every time
+            // (and if there's no memory to shrink into, the bitset can still just drop the bit)
+            if (container->cardinality - 1 <= ARRAY_MAX / 2 && container_rebuild_with(container, low, false, length)) {
+                return true;
+            }
+            container->words[low >> 6] &= ~bit;
+            break;
+        }
+        default: {
+            uint16_t *const runs = container->values;
+            const uint32_t idx = run_lower_bound(runs, container->size, low);
+            if (idx == container->size || runs[idx << 1] > low) {
+                return false;
+            }
+            const uint32_t first = runs[idx << 1], last = runs[(idx << 1) + 1];
+            if (first == last) {
+                memmove(runs + (idx << 1), runs + ((idx + 1) << 1),
+                        ((container->size - idx - 1) << 1) * sizeof(uint16_t));
+                --container->size;
+            } else if (low == first) {
+                ++runs[idx << 1];
+            } else if (low == last) {
+                --runs[(idx << 1) + 1];
+            } else if (container->size == RUN_MAX || !container_reserve(container, (container->size + 1) << 1)) {
+                return container_rebuild_with(container, low, false, length);
+            } else {
+                // splitting a run in two, values may have moved
+                uint16_t *const moved = container->values;
+                memmove(moved + ((idx + 1) << 1), moved + (idx << 1),
+                        ((container->size - idx) << 1) * sizeof(uint16_t));
+                moved[(idx << 1) + 1] = (uint16_t) (low - 1);
+                moved[(idx + 1) << 1] = (uint16_t) (low + 1);
+                ++container->size;
+            }
+            break;
+        }
+    }
+    if (--container->cardinality == 0) {
+        container_clear(container);
+    }
+    return true;
+}
+
+static uint32_t container_next(const container_t *const container, const uint32_t from, const bool value,
+                               const uint32_t length) {
+    if (from >= length) {
+        return CHUNK_NONE;
+    }
+    uint32_t result = from;
+    switch (container->type) {
+        case CONTAINER_ARRAY: {
+            uint32_t idx = array_lower_bound(container->values, container->size, from);
+            if (value) {
+                return idx < container->size ? container->values[idx] : CHUNK_NONE;
+            }
+            // walk past whatever is set back to back from here
+            for (; idx < container->size && container->values[idx] == result; ++idx, ++result) {
+            }
+            break;
+        }
+        case CONTAINER_BITSET: return words_next(container->words, from, value, length);
+        default: {
+            const uint32_t idx = run_lower_bound(container->values, container->size, from);
+            const bool inside = idx < container->size && container->values[idx << 1] <= from;
+            if (value) {
+                if (idx == container->size) {
+                    return CHUNK_NONE;
+                }
+                result = inside ? from : container->values[idx << 1];
+            } else if (inside) {
+                // runs never touch, so the bit after one is always clear
+                result = container->values[(idx << 1) + 1] + 1u;
+            }
+            break;
+        }
+    }
+    return result < length ? result : CHUNK_NONE;
+}
+
+// Set bits in [first, end)
+static uint32_t container_count_range(const container_t *const container, const uint32_t first,
+                                      const uint32_t end) {
+    switch (container->type) {
+        case CONTAINER_ARRAY:
+            return array_lower_bound(container->values, container->size, end) -
+                   array_lower_bound(container->values, container->size, first);
+        case CONTAINER_BITSET: return words_count_range(container->words, first, end);
+        default: {
+            uint32_t total = 0;
+            for (uint32_t idx = run_lower_bound(container->values, container->size, first);
+                 idx < container->size && container->values[idx << 1] < end; ++idx) {
+                const uint32_t run_first = container->values[idx << 1], run_last = container->values[(idx << 1) + 1];
+                total += (run_last < end - 1 ? run_last : end - 1) - (run_first > first ? run_first : first) + 1;
+            }
+            return total;
+        }
+    }
+}
+
+// Chunk access that works on either layout, for the operations that go through plain words
+static void chunk_load(const bitmap_t *const bitmap, const size_t chunk, uint64_t *const words) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        container_load(&bitmap->chunks[chunk], words);
+        return;
+    }
+    const size_t word_total = (bitmap->byte_count + 7) >> 3;
+    for (size_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+        const size_t word = (chunk << (CHUNK_SHIFT - 6)) + idx;
+        words[idx] = word < word_total
+                         ? load_word(bitmap->data, bitmap->byte_count, word) & word_valid_mask(bitmap, word)
+                         : 0;
+    }
+}
+
+// False if a compressed chunk couldn't get the memory, it keeps its old bits then
+static bool chunk_store(bitmap_t *const bitmap, const size_t chunk, uint64_t *const words) {
+    if (FLAG_CHECK(bitmap, COMPRESSED)) {
+        return container_store(&bitmap->chunks[chunk], words, chunk_bits(bitmap, chunk));
+    }
+    for (size_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+        const size_t offset = ((chunk << (CHUNK_SHIFT - 6)) + idx) << 3;
+        if (offset >= bitmap->byte_count) {
+            break;
+        }
+        const uint64_t word = word_from_bytes(words[idx]);
+        memcpy(bitmap->data + offset, &word, bitmap->byte_count - offset < 8 ? bitmap->byte_count - offset : 8);
+    }
+    return true;
+}
+
+static bool compressed_test(const bitmap_t *const bitmap, const size_t bit) {
+    return container_test(&bitmap->chunks[bit >> CHUNK_SHIFT], bit & (CHUNK_BITS - 1));
+}
+
+// Returns true if the bit changed
+static bool compressed_update(bitmap_t *const bitmap, const size_t bit, const bool value) {
+    const size_t chunk = bit >> CHUNK_SHIFT;
+    container_t *const container = &bitmap->chunks[chunk];
+    const uint32_t low = bit & (CHUNK_BITS - 1);
+    return value ? container_set(container, low, chunk_bits(bitmap, chunk))
+                 : container_reset(container, low, chunk_bits(bitmap, chunk));
+}
+
+// False if some chunk couldn't get the memory, that chunk keeps its old bits and the rest still change
+static bool compressed_range_update(bitmap_t *const bitmap, const size_t start, const size_t count, const bool value) {
+    const size_t end = start + count;
+    uint64_t words[CHUNK_WORDS];
+    bool updated = true;
+    for (size_t chunk = start >> CHUNK_SHIFT; chunk <= (end - 1) >> CHUNK_SHIFT; ++chunk) {
+        const size_t base = chunk << CHUNK_SHIFT;
+        const uint32_t length = chunk_bits(bitmap, chunk);
+        const uint32_t first = start > base ? (uint32_t) (start - base) : 0;
+        const uint32_t last = end - base < length ? (uint32_t) (end - base - 1) : length - 1;
+        if (first == 0 && last == length - 1) {
+            updated = container_fill(&bitmap->chunks[chunk], value, length) && updated;
+        } else {
+            container_load(&bitmap->chunks[chunk], words);
+            words_update(words, first, last, value);
+            updated = container_store(&bitmap->chunks[chunk], words, length) && updated;
+        }
+    }
+    return updated;
+}
+
+static size_t compressed_count_range(const bitmap_t *const bitmap, const size_t start, const size_t count) {
+    const size_t end = start + count;
+    size_t total = 0;
+    for (size_t chunk = start >> CHUNK_SHIFT; chunk <= (end - 1) >> CHUNK_SHIFT; ++chunk) {
+        const size_t base = chunk << CHUNK_SHIFT;
+        const uint32_t length = chunk_bits(bitmap, chunk);
+        const uint32_t first = start > base ? (uint32_t) (start - base) : 0;
+        const uint32_t stop = end - base < length ? (uint32_t) (end - base) : length;
+        total += container_count_range(&bitmap->chunks[chunk], first, stop);
+    }
+    return total;
+}
+
+static size_t compressed_scan(const bitmap_t *const bitmap, const size_t start, const bool value) {
+    uint32_t low = start & (CHUNK_BITS - 1);
+    for (size_t chunk = start >> CHUNK_SHIFT; chunk < bitmap->chunk_count; ++chunk, low = 0) {
+        const container_t *const container = &bitmap->chunks[chunk];
+        const uint32_t length = chunk_bits(bitmap, chunk);
+        // full and empty chunks are skipped without looking inside
+        if (container->cardinality == (value ? 0 : length)) {
+            continue;
+        }
+        const uint32_t found = container_next(container, low, value, length);
+        if (found != CHUNK_NONE) {
+            return (chunk << CHUNK_SHIFT) + found;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static size_t compressed_total_set(const bitmap_t *const bitmap) {
+    size_t total = 0;
+    for (size_t chunk = 0; chunk < bitmap->chunk_count; ++chunk) {
+        total += bitmap->chunks[chunk].cardinality;
+    }
+    return total;
+}
+
+// Both false if some chunk couldn't get the memory, like compressed_range_update
+static bool compressed_format(bitmap_t *const bitmap, const uint8_t pattern) {
+    uint64_t words[CHUNK_WORDS];
+    bool formatted = true;
+    for (size_t chunk = 0; chunk < bitmap->chunk_count; ++chunk) {
+        if (pattern == 0x00 || pattern == 0xFF) {
+            formatted = container_fill(&bitmap->chunks[chunk], pattern, chunk_bits(bitmap, chunk)) && formatted;
+        } else {
+            memset(words, pattern, sizeof(words));
+            formatted = container_store(&bitmap->chunks[chunk], words, chunk_bits(bitmap, chunk)) && formatted;
+        }
+    }
+    return formatted;
+}
+
+static bool compressed_invert(bitmap_t *const bitmap) {
+    uint64_t words[CHUNK_WORDS];
+    bool inverted = true;
+    for (size_t chunk = 0; chunk < bitmap->chunk_count; ++chunk) {
+        container_t *const container = &bitmap->chunks[chunk];
+        const uint32_t length = chunk_bits(bitmap, chunk);
+        if (container->cardinality == 0 || container->cardinality == length) {
+            inverted = container_fill(container, container->cardinality == 0, length) && inverted;
+        } else {
+            container_load(container, words);
+            for (size_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+                words[idx] = ~words[idx];
+            }
+            inverted = container_store(container, words, length) && inverted;
+        }
+    }
+    return inverted;
+}
+
+static void compressed_destroy(bitmap_t *const bitmap) {
+    for (size_t chunk = 0; chunk < bitmap->chunk_count; ++chunk) {
+        container_clear(&bitmap->chunks[chunk]);
+    }
+    free(bitmap->chunks);
+}
+
+// False if some chunk of a compressed dst couldn't get the memory, like compressed_range_update
+static bool chunked_combine(bitmap_t *const dst, const bitmap_t *const src, const combine_op_t op) {
+    uint64_t dst_words[CHUNK_WORDS], src_words[CHUNK_WORDS];
+    bool combined = true;
+    const size_t chunk_total = (dst->bit_count + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+    for (size_t chunk = 0; chunk < chunk_total; ++chunk) {
+        chunk_load(dst, chunk, dst_words);
+        chunk_load(src, chunk, src_words);
+        for (size_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+            dst_words[idx] = combine_word(dst_words[idx], src_words[idx], op);
+        }
+        combined = chunk_store(dst, chunk, dst_words) && combined;
+    }
+    return combined;
+}
+
+static size_t chunked_first_difference(const bitmap_t *const a, const bitmap_t *const b) {
+    uint64_t a_words[CHUNK_WORDS], b_words[CHUNK_WORDS];
+    const size_t chunk_total = (a->bit_count + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+    for (size_t chunk = 0; chunk < chunk_total; ++chunk) {
+        chunk_load(a, chunk, a_words);
+        chunk_load(b, chunk, b_words);
+        // (both loads mask off everything past bit_count)
+        for (size_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+            if (a_words[idx] != b_words[idx]) {
+                return (chunk << CHUNK_SHIFT) + (idx << 6) + (size_t) __builtin_ctzll(a_words[idx] ^ b_words[idx]);
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Serialized form, all little endian:
+//   u32 magic, u64 bit_count, then for every chunk:
+//   u8 type, u32 cardinality, u32 size, then size u16's (ARRAY), size u16 pairs (RUN) or 1024 u64's (BITSET)
+#define SERIAL_MAGIC UINT32_C(0x43504D42)  // "BMPC"
+
+typedef struct {
+    uint8_t *buffer;
+    size_t size, used;
+} serial_writer_t;
+
+// Writes bytes little end first, as long as there's room, and always counts them
+static void serial_put(serial_writer_t *const writer, const uint64_t value, const unsigned bytes) {
+    if (writer->buffer && writer->used + bytes <= writer->size) {
+        for (unsigned idx = 0; idx < bytes; ++idx) {
+            writer->buffer[writer->used + idx] = (uint8_t) (value >> (idx << 3));
+        }
+    }
+    writer->used += bytes;
+}
+
+typedef struct {
+    const uint8_t *buffer;
+    size_t size, used;
+    bool ok;
+} serial_reader_t;
+
+static uint64_t serial_get(serial_reader_t *const reader, const unsigned bytes) {
+    uint64_t value = 0;
+    if (reader->ok && reader->size - reader->used >= bytes) {
+        for (unsigned idx = 0; idx < bytes; ++idx) {
+            value |= (uint64_t) reader->buffer[reader->used + idx] << (idx << 3);
+        }
+        reader->used += bytes;
+    } else {
+        reader->ok = false;
+    }
+    return value;
+}
+
+static void serial_put_container(serial_writer_t *const writer, const container_t *const container) {
+    serial_put(writer, container->type, 1);
+    serial_put(writer, container->cardinality, 4);
+    if (container->type == CONTAINER_BITSET) {
+        serial_put(writer, 0, 4);
+        for (uint32_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+            serial_put(writer, container->words[idx], 8);
+        }
+    } else {
+        serial_put(writer, container->size, 4);
+        const uint32_t values = container->type == CONTAINER_RUN ? container->size << 1 : container->size;
+        for (uint32_t idx = 0; idx < values; ++idx) {
+            serial_put(writer, container->values[idx], 2);
+        }
+    }
+}
+
+// Reads a container and checks it's one container_store could have made, false if it isn't
+static bool serial_get_container(serial_reader_t *const reader, container_t *const container, const uint32_t length) {
+    const uint32_t type = (uint32_t) serial_get(reader, 1);
+    const uint32_t cardinality = (uint32_t) serial_get(reader, 4);
+    const uint32_t size = (uint32_t) serial_get(reader, 4);
+    if (!reader->ok || cardinality > length) {
+        return false;
+    }
+    container->type = (container_type_t) type;
+    container->cardinality = cardinality;
+    if (type == CONTAINER_BITSET) {
+        container->words = (uint64_t *) malloc(CHUNK_WORDS * sizeof(uint64_t));
+        if (!container->words) {
+            return false;
+        }
+        for (uint32_t idx = 0; idx < CHUNK_WORDS; ++idx) {
+            container->words[idx] = serial_get(reader, 8);
+        }
+        return reader->ok && words_next(container->words, length, true, CHUNK_BITS) == CHUNK_NONE &&
+               words_count_range(container->words, 0, CHUNK_BITS) == cardinality;
+    }
+    if (type != CONTAINER_ARRAY && type != CONTAINER_RUN) {
+        return false;
+    }
+    const uint32_t values = type == CONTAINER_RUN ? size << 1 : size;
+    if (size > (type == CONTAINER_RUN ? RUN_MAX : ARRAY_MAX) || (values && !container_reserve(container, values))) {
+        return false;
+    }
+    uint32_t total = 0, previous_end = 0;
+    for (uint32_t idx = 0; idx < size; ++idx) {
+        if (type == CONTAINER_ARRAY) {
+            const uint32_t bit = (uint32_t) serial_get(reader, 2);
+            if (bit >= length || (idx && bit < previous_end)) {
+                return false;
+            }
+            container->values[idx] = (uint16_t) bit;
+            previous_end = bit + 1;
+            ++total;
+        } else {
+            const uint32_t first = (uint32_t) serial_get(reader, 2), last = (uint32_t) serial_get(reader, 2);
+            // runs have to be in order, in range, and have a gap between them
+            if (first > last || last >= length || (idx && first <= previous_end)) {
+                return false;
+            }
+            container->values[idx << 1] = (uint16_t) first;
+            container->values[(idx << 1) + 1] = (uint16_t) last;
+            previous_end = last + 1;
+            total += last - first + 1;
+        }
+        container->size = idx + 1;
+    }
+    return reader->ok && total == cardinality;
+}
+
+size_t bitmap_serialize(const bitmap_t *const bitmap, void *const buffer, const size_t size) {
+    if (bitmap) {
+        serial_writer_t writer = {(uint8_t *) buffer, size, 0};
+        serial_put(&writer, SERIAL_MAGIC, 4);
+        serial_put(&writer, bitmap->bit_count, 8);
+        const size_t chunk_total = (bitmap->bit_count + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+        uint64_t words[CHUNK_WORDS];
+        for (size_t chunk = 0; chunk < chunk_total; ++chunk) {
+            if (FLAG_CHECK(bitmap, COMPRESSED)) {
+                serial_put_container(&writer, &bitmap->chunks[chunk]);
+            } else {
+                // flat maps get compressed a chunk at a time on the way out
+                container_t container;
+                memset(&container, 0x00, sizeof(container_t));
+                chunk_load(bitmap, chunk, words);
+                if (!container_store(&container, words, chunk_bits(bitmap, chunk))) {
+                    return 0;
+                }
+                serial_put_container(&writer, &container);
+                container_clear(&container);
+            }
+        }
+        return writer.used;
+    }
+    return 0;
+}
+
+bitmap_t *bitmap_deserialize(const void *const buffer, const size_t size) {
+    if (buffer) {
+        serial_reader_t reader = {(const uint8_t *) buffer, size, 0, true};
+        const uint32_t magic = (uint32_t) serial_get(&reader, 4);
+        const uint64_t bit_count = serial_get(&reader, 8);
+        if (reader.ok && magic == SERIAL_MAGIC && bit_count && bit_count <= SIZE_MAX - CHUNK_BITS) {
+            bitmap_t *bitmap = bitmap_create_compressed((size_t) bit_count);
+            if (bitmap) {
+                size_t chunk = 0;
+                for (; chunk < bitmap->chunk_count; ++chunk) {
+                    if (!serial_get_container(&reader, &bitmap->chunks[chunk], chunk_bits(bitmap, chunk))) {
+                        break;
+                    }
+                }
+                if (chunk == bitmap->chunk_count && reader.used == size) {
+                    return bitmap;
+                }
+                bitmap_destroy(bitmap);
+            }
+        }
+    }
+    return NULL;
+}
@@ -1,7 +1,18 @@
+#undef NDEBUG  // the tests are all asserts, they have to run in every build type
 #include "../include/bitmap.h"
+
+// Lets the compressed tests run the bitmap out of memory, every allocation fails while this is set
+static bool allocations_fail = false;
+static void *test_malloc(size_t size) { return allocations_fail ? NULL : malloc(size); }
+static void *test_realloc(void *ptr, size_t size) { return allocations_fail ? NULL : realloc(ptr, size); }
+#define malloc test_malloc
+#define realloc test_realloc
 #include "../src/bitmap.c"
+#undef malloc
+#undef realloc
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -121,6 +132,20 @@ void bitmap_test_b();
 
 void bitmap_test_c();
 
+void bitmap_test_d();
+
+void bitmap_test_e();
+
+void bitmap_test_f();
+
+void bitmap_test_g();
+
+void bitmap_test_h();
+
+void bitmap_test_i();
+
+void bitmap_test_j();
+
 int main() {
     // EVERYTHING ELSE
     bitmap_test_a();
@@ -131,6 +156,27 @@ int main() {
     // OVERLAY INVERT TOTAL_SET
     bitmap_test_c();
 
+    // SUMMARY
+    bitmap_test_d();
+
+    // RANGES
+    bitmap_test_e();
+
+    // POPCOUNT AND COUNTED MODE
+    bitmap_test_f();
+
+    // ITERATORS AND RUNS
+    bitmap_test_g();
+
+    // ATOMIC MODE
+    bitmap_test_h();
+
+    // AND OR XOR ANDNOT EQUAL DIFFERENCE
+    bitmap_test_i();
+
+    // COMPRESSED LAYOUT AND SERIALIZATION
+    bitmap_test_j();
+
     // Done. GO TEAM!
 
     puts("TESTS PASSED");
@@ -138,7 +184,7 @@ int main() {
 
 void bitmap_test_a() {
     bitmap_t *bitmap_A = NULL, *bitmap_B = NULL;
-    const size_t test_bit_count = 58;  //, test_byte_count = 8;
+    const size_t test_bit_count = 58, test_byte_count = 8;
     // 58 bits = 7.2 bytes
 
     // INIT/DESTRUCT to get them out of the way
@@ -554,6 +600,66 @@ void bitmap_test_b() {
 
     assert(bitmap_ffz(bitmap_A) == 57);
 
+    assert(bitmap_ffz_from(bitmap_A, 0) == 57);
+    assert(bitmap_ffz_from(bitmap_A, 57) == 57);
+    bitmap_reset(bitmap_A, 3);
+    assert(bitmap_ffz_from(bitmap_A, 4) == 57);
+    assert(bitmap_ffz_from(bitmap_A, 3) == 3);
+    bitmap_set(bitmap_A, 57);
+    assert(bitmap_ffz_from(bitmap_A, 4) == SIZE_MAX);
+    assert(bitmap_ffz_from(bitmap_A, test_bit_count) == SIZE_MAX);
+    assert(bitmap_ffz_from(NULL, 0) == SIZE_MAX);
+
+    // runs: 3 is a hole of one, 57 a hole of one at the very end
+    bitmap_reset(bitmap_A, 57);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 1) == 3);
+    assert(bitmap_find_zero_run(bitmap_A, 4, 1) == 57);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 2) == SIZE_MAX);
+    for (size_t i = 20; i < 30; ++i) {
+        bitmap_reset(bitmap_A, i);
+    }
+    assert(bitmap_find_zero_run(bitmap_A, 0, 2) == 20);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 10) == 20);
+    assert(bitmap_find_zero_run(bitmap_A, 21, 9) == 21);
+    assert(bitmap_find_zero_run(bitmap_A, 21, 10) == SIZE_MAX);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 11) == SIZE_MAX);
+    assert(bitmap_find_zero_run(bitmap_A, 0, 0) == SIZE_MAX);
+    assert(bitmap_find_zero_run(NULL, 0, 1) == SIZE_MAX);
+    bitmap_format(bitmap_A, 0x00);
+    assert(bitmap_find_zero_run(bitmap_A, 0, test_bit_count) == 0);
+    assert(bitmap_find_zero_run(bitmap_A, 1, test_bit_count) == SIZE_MAX);
+
+    bitmap_destroy(bitmap_A);
+
+    // Big enough to go through the word skipping, odd enough to have a partial last word
+    const size_t big_bit_count = 4099;
+    bitmap_A = bitmap_create(big_bit_count);
+    assert(bitmap_A);
+
+    assert(bitmap_ffs(bitmap_A) == SIZE_MAX);
+    assert(bitmap_ffz(bitmap_A) == 0);
+
+    bitmap_set(bitmap_A, 4000);
+    assert(bitmap_ffs(bitmap_A) == 4000);
+    bitmap_set(bitmap_A, 63);
+    assert(bitmap_ffs(bitmap_A) == 63);
+
+    bitmap_format(bitmap_A, 0xFF);
+    assert(bitmap_ffz(bitmap_A) == SIZE_MAX);
+    assert(bitmap_ffs(bitmap_A) == 0);
+
+    // every word and lane boundary, and the leftover bits at the end
+    for (size_t i = 0; i < big_bit_count; ++i) {
+        bitmap_reset(bitmap_A, i);
+        assert(bitmap_ffz(bitmap_A) == i);
+        bitmap_set(bitmap_A, i);
+    }
+
+    // the garbage past the last bit shouldn't be found
+    bitmap_format(bitmap_A, 0x00);
+    bitmap_A->data[bitmap_A->byte_count - 1] = 0xF8;
+    assert(bitmap_ffs(bitmap_A) == SIZE_MAX);
+
     bitmap_destroy(bitmap_A);
 }
 
@@ -626,3 +732,722 @@ void bitmap_test_c() {
     assert(bitmap_a);
     assert(bitmap_total_set(bitmap_a) == 35);
 }
+
+// Plain linear search to check the summarized answers against
+size_t reference_ffz(const bitmap_t *const bitmap) {
+    for (size_t i = 0; i < bitmap->bit_count; ++i) {
+        if (!bitmap_test(bitmap, i)) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+void bitmap_test_d() {
+    bitmap_t *bitmap_a;
+    // Three levels worth, with a partial last word
+    const size_t test_bit_count = 300001;
+
+    assert(bitmap_enable_summary(NULL) == false);
+
+    bitmap_a = bitmap_create(test_bit_count);
+    assert(bitmap_a);
+    assert(bitmap_enable_summary(bitmap_a));
+    assert(bitmap_a->summary_levels == 3);
+    // second time is a no-op
+    assert(bitmap_enable_summary(bitmap_a));
+
+    assert(bitmap_ffz(bitmap_a) == 0);
+
+    bitmap_format(bitmap_a, 0xFF);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+
+    // Walk a hole from the back to the front, checking against the slow way
+    for (size_t i = test_bit_count; i-- > 0;) {
+        if (i % 997 == 0 || i > test_bit_count - 70) {
+            bitmap_reset(bitmap_a, i);
+            assert(bitmap_ffz(bitmap_a) == i);
+            assert(bitmap_ffz(bitmap_a) == reference_ffz(bitmap_a));
+        }
+    }
+
+    // starting points in the middle of words and past the last hole
+    assert(bitmap_ffz_from(bitmap_a, 1) == 997);
+    assert(bitmap_ffz_from(bitmap_a, 998) == 997 * 2);
+    assert(bitmap_ffz_from(bitmap_a, test_bit_count - 69) == test_bit_count - 69);
+    assert(bitmap_ffz_from(bitmap_a, test_bit_count - 1) == test_bit_count - 1);
+    assert(bitmap_ffz_from(bitmap_a, test_bit_count) == SIZE_MAX);
+
+    // and fill them back in from the front
+    for (size_t i = 0; i < test_bit_count; ++i) {
+        if (!bitmap_test(bitmap_a, i)) {
+            bitmap_flip(bitmap_a, i);
+            assert(bitmap_ffz(bitmap_a) == reference_ffz(bitmap_a));
+        }
+    }
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+
+    bitmap_invert(bitmap_a);
+    assert(bitmap_ffz(bitmap_a) == 0);
+    assert(bitmap_ffs(bitmap_a) == SIZE_MAX);
+    bitmap_set(bitmap_a, 0);
+    assert(bitmap_ffz(bitmap_a) == 1);
+
+    bitmap_destroy(bitmap_a);
+
+    // Overlays get the tree built from what's already there
+    uint8_t arr[40];
+    memset(arr, 0xFF, 40);
+    arr[33] = 0xEF;
+    bitmap_a = bitmap_overlay(320, arr);
+    assert(bitmap_a);
+    assert(bitmap_enable_summary(bitmap_a));
+    assert(bitmap_ffz(bitmap_a) == 33 * 8 + 4);
+    bitmap_set(bitmap_a, 33 * 8 + 4);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    bitmap_destroy(bitmap_a);
+    assert(arr[33] == 0xFF);
+}
+
+void bitmap_test_e() {
+    bitmap_t *bitmap_a;
+    const size_t test_bit_count = 203;
+
+    bitmap_a = bitmap_create(test_bit_count);
+    assert(bitmap_a);
+    assert(bitmap_enable_summary(bitmap_a));
+
+    // inside one byte
+    bitmap_set_range(bitmap_a, 2, 3);
+    assert(bitmap_a->data[0] == 0x1C);
+    assert(memcmp_fixed(bitmap_a->data + 1, 0x00, bitmap_a->byte_count - 1));
+    assert(bitmap_count_range(bitmap_a, 0, test_bit_count) == 3);
+    assert(bitmap_test_range_all(bitmap_a, 2, 3));
+    assert(!bitmap_test_range_all(bitmap_a, 1, 3));
+    assert(bitmap_test_range_any(bitmap_a, 0, 3));
+    assert(!bitmap_test_range_any(bitmap_a, 5, 100));
+    bitmap_reset_range(bitmap_a, 3, 1);
+    assert(bitmap_a->data[0] == 0x14);
+
+    // partial head, whole bytes, partial tail
+    bitmap_format(bitmap_a, 0x00);
+    bitmap_set_range(bitmap_a, 13, 170);
+    for (size_t i = 0; i < test_bit_count; ++i) {
+        assert(bitmap_test(bitmap_a, i) == (i >= 13 && i < 183));
+    }
+    assert(bitmap_count_range(bitmap_a, 0, test_bit_count) == 170);
+    assert(bitmap_count_range(bitmap_a, 10, 10) == 7);
+    assert(bitmap_test_range_all(bitmap_a, 13, 170));
+    assert(!bitmap_test_range_all(bitmap_a, 13, 171));
+    assert(!bitmap_test_range_all(bitmap_a, 12, 170));
+    assert(bitmap_test_range_any(bitmap_a, 0, 14));
+    assert(!bitmap_test_range_any(bitmap_a, 0, 13));
+    assert(!bitmap_test_range_any(bitmap_a, 183, 20));
+    assert(bitmap_ffz_from(bitmap_a, 13) == 183);
+
+    bitmap_reset_range(bitmap_a, 20, 100);
+    for (size_t i = 0; i < test_bit_count; ++i) {
+        assert(bitmap_test(bitmap_a, i) == ((i >= 13 && i < 20) || (i >= 120 && i < 183)));
+    }
+    assert(bitmap_ffz_from(bitmap_a, 13) == 20);
+    assert(bitmap_test_range_any(bitmap_a, 20, 101));
+    assert(!bitmap_test_range_any(bitmap_a, 20, 100));
+
+    // a zero buried in the middle of the interior
+    bitmap_set_range(bitmap_a, 0, test_bit_count);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    assert(bitmap_test_range_all(bitmap_a, 0, test_bit_count));
+    bitmap_reset(bitmap_a, 100);
+    assert(!bitmap_test_range_all(bitmap_a, 1, 200));
+    assert(bitmap_count_range(bitmap_a, 0, test_bit_count) == test_bit_count - 1);
+
+    // off the end and bad input does nothing
+    bitmap_reset_range(bitmap_a, 200, 4);
+    bitmap_reset_range(bitmap_a, 0, 0);
+    bitmap_set_range(NULL, 0, 4);
+    assert(bitmap_count_range(bitmap_a, 0, test_bit_count) == test_bit_count - 1);
+    assert(!bitmap_test_range_all(bitmap_a, 200, 4));
+    assert(!bitmap_test_range_any(bitmap_a, 200, 4));
+    assert(bitmap_count_range(bitmap_a, 200, 4) == 0);
+    assert(bitmap_count_range(NULL, 0, 4) == 0);
+
+    bitmap_destroy(bitmap_a);
+}
+
+void bitmap_test_f() {
+    // every kernel agrees with the table on every length and alignment
+    uint8_t data[1100];
+    srand(6);
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = (uint8_t) rand();
+    }
+    for (size_t offset = 0; offset < 9; ++offset) {
+        for (size_t n = 0; n + offset <= sizeof(data); n += 7) {
+            assert(count_bytes(data + offset, n) == count_bytes_table(data + offset, n));
+#ifdef BITMAP_X86
+            if (__builtin_cpu_supports("popcnt")) {
+                assert(count_bytes_popcnt(data + offset, n) == count_bytes_table(data + offset, n));
+            }
+            if (__builtin_cpu_supports("avx2")) {
+                assert(count_bytes_avx2(data + offset, n) == count_bytes_table(data + offset, n));
+            }
+#endif
+        }
+    }
+
+    // counted mode tracks every way of changing the data
+    const size_t test_bit_count = 10007;
+    bitmap_t *bitmap_a = bitmap_create(test_bit_count);
+    assert(bitmap_a);
+    assert(!bitmap_enable_count(NULL));
+    bitmap_set(bitmap_a, 5);
+    assert(bitmap_enable_count(bitmap_a));
+    assert(bitmap_enable_count(bitmap_a));
+    assert(bitmap_total_set(bitmap_a) == 1);
+
+    bitmap_set(bitmap_a, 5);
+    bitmap_set(bitmap_a, 6);
+    bitmap_reset(bitmap_a, 7);
+    bitmap_flip(bitmap_a, 8);
+    bitmap_flip(bitmap_a, 5);
+    assert(bitmap_total_set(bitmap_a) == 2);
+
+    bitmap_set_range(bitmap_a, 0, 100);
+    assert(bitmap_total_set(bitmap_a) == 100);
+    bitmap_set_range(bitmap_a, 50, 5000);
+    assert(bitmap_total_set(bitmap_a) == 5050);
+    bitmap_reset_range(bitmap_a, 3, 4000);
+    assert(bitmap_total_set(bitmap_a) == 1050);
+    bitmap_reset_range(bitmap_a, 10000, 10);
+    assert(bitmap_total_set(bitmap_a) == 1050);
+
+    bitmap_invert(bitmap_a);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count - 1050);
+    bitmap_format(bitmap_a, 0xFF);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count);
+    bitmap_format(bitmap_a, 0x01);
+    assert(bitmap_total_set(bitmap_a) == (test_bit_count + 7) / 8);
+
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t bit = (size_t) rand() % test_bit_count;
+        switch (rand() % 3) {
+            case 0: bitmap_set(bitmap_a, bit); break;
+            case 1: bitmap_reset(bitmap_a, bit); break;
+            default: bitmap_flip(bitmap_a, bit); break;
+        }
+    }
+    assert(bitmap_a->set_count == count_bytes_table(bitmap_a->data, bitmap_a->byte_count));
+
+    bitmap_destroy(bitmap_a);
+}
+
+// Checks runs come in order, are maximal, and only cover set bits, and tallies what they cover
+typedef struct {
+    const bitmap_t *bitmap;
+    size_t next_allowed, covered, runs;
+} run_check_t;
+
+void run_check(size_t start, size_t length, void *arg) {
+    run_check_t *const check = (run_check_t *) arg;
+    assert(length);
+    assert(start >= check->next_allowed);
+    assert(start == 0 || !bitmap_test(check->bitmap, start - 1));
+    assert(start + length == check->bitmap->bit_count || !bitmap_test(check->bitmap, start + length));
+    for (size_t i = start; i < start + length; ++i) {
+        assert(bitmap_test(check->bitmap, i));
+    }
+    check->next_allowed = start + length + 1;
+    check->covered += length;
+    ++check->runs;
+}
+
+void bitmap_test_g() {
+    const size_t test_bit_count = 5003;
+    bitmap_t *bitmap_a = bitmap_create(test_bit_count);
+    assert(bitmap_a);
+    bitmap_iter_t iter;
+
+    // empty map, both ways
+    bitmap_iter_init(&iter, bitmap_a, 0);
+    assert(bitmap_iter_next_set(&iter) == SIZE_MAX);
+    assert(bitmap_iter_next_set(&iter) == SIZE_MAX);
+    bitmap_iter_init(&iter, bitmap_a, 4999);
+    assert(bitmap_iter_next_zero(&iter) == 4999);
+    assert(bitmap_iter_next_zero(&iter) == 5000);
+    assert(bitmap_iter_next_zero(&iter) == 5001);
+    assert(bitmap_iter_next_zero(&iter) == 5002);
+    assert(bitmap_iter_next_zero(&iter) == SIZE_MAX);
+
+    // bad input
+    bitmap_iter_init(NULL, bitmap_a, 0);
+    bitmap_iter_init(&iter, NULL, 0);
+    assert(bitmap_iter_next_set(&iter) == SIZE_MAX);
+    assert(bitmap_iter_next_zero(NULL) == SIZE_MAX);
+    bitmap_for_each_run(NULL, run_check, NULL);
+    bitmap_for_each_run(bitmap_a, NULL, NULL);
+
+    // sparse bits, short runs, long runs, and one running off the end
+    srand(7);
+    for (size_t i = 0; i < 100; ++i) {
+        bitmap_set(bitmap_a, (size_t) rand() % test_bit_count);
+    }
+    bitmap_set_range(bitmap_a, 1000, 700);
+    bitmap_set_range(bitmap_a, 4900, 103);
+
+    for (int pass = 0; pass < 2; ++pass) {
+        // second pass has the summary steering the zero scans
+        if (pass) {
+            assert(bitmap_enable_summary(bitmap_a));
+        }
+        size_t set_seen = 0, zero_seen = 0, found;
+        size_t expected = 0;
+        bitmap_iter_init(&iter, bitmap_a, 0);
+        while ((found = bitmap_iter_next_set(&iter)) != SIZE_MAX) {
+            for (; expected < found; ++expected) {
+                assert(!bitmap_test(bitmap_a, expected));
+            }
+            assert(bitmap_test(bitmap_a, found));
+            expected = found + 1;
+            ++set_seen;
+        }
+        for (; expected < test_bit_count; ++expected) {
+            assert(!bitmap_test(bitmap_a, expected));
+        }
+        bitmap_iter_init(&iter, bitmap_a, 0);
+        while ((found = bitmap_iter_next_zero(&iter)) != SIZE_MAX) {
+            assert(!bitmap_test(bitmap_a, found));
+            ++zero_seen;
+        }
+        assert(set_seen == bitmap_total_set(bitmap_a));
+        assert(set_seen + zero_seen == test_bit_count);
+
+        run_check_t check = {bitmap_a, 0, 0, 0};
+        bitmap_for_each_run(bitmap_a, run_check, &check);
+        assert(check.covered == set_seen);
+        assert(check.runs < set_seen);
+    }
+
+    // for_each still sees every bit one at a time
+    for_each_counter = 0;
+    size_t zero = 0;
+    bitmap_format(bitmap_a, 0x00);
+    bitmap_set_range(bitmap_a, 10, 3);
+    bitmap_set(bitmap_a, 64);
+    bitmap_for_each(bitmap_a, &for_each_test, &zero);
+    assert(for_each_counter == 10 + 11 + 12 + 64);
+
+    bitmap_destroy(bitmap_a);
+}
+
+#define CLAIM_THREADS 8
+
+typedef struct {
+    bitmap_t *bitmap;
+    uint8_t *owner;
+    size_t claims;
+} claim_worker_t;
+
+// Claims until the map is full, giving every 5th claim back, and marks the owner table as it goes
+void *claim_worker(void *arg) {
+    claim_worker_t *const worker = (claim_worker_t *) arg;
+    size_t bit, attempts = 0;
+    while ((bit = bitmap_claim_zero(worker->bitmap, 0)) != SIZE_MAX) {
+        if (++attempts % 5 == 0) {
+            bitmap_reset(worker->bitmap, bit);
+            continue;
+        }
+        // owner entries are only ever written once if nobody double claims
+        assert(__atomic_fetch_add(&worker->owner[bit], 1, __ATOMIC_RELAXED) == 0);
+        ++worker->claims;
+    }
+    return NULL;
+}
+
+void bitmap_test_h() {
+    const size_t test_bit_count = 100003;
+    bitmap_t *bitmap_a = bitmap_create(test_bit_count);
+    assert(bitmap_a);
+    assert(!bitmap_enable_atomic(NULL));
+
+    // single threaded it behaves exactly like the plain map
+    assert(bitmap_enable_summary(bitmap_a));
+    assert(bitmap_enable_count(bitmap_a));
+    assert(bitmap_enable_atomic(bitmap_a));
+    assert(bitmap_claim_zero(bitmap_a, 0) == 0);
+    assert(bitmap_claim_zero(bitmap_a, 0) == 1);
+    assert(bitmap_claim_zero(bitmap_a, 70) == 70);
+    assert(!bitmap_test_and_set(bitmap_a, 2));
+    assert(bitmap_test_and_set(bitmap_a, 2));
+    bitmap_flip(bitmap_a, 3);
+    bitmap_flip(bitmap_a, 1);
+    bitmap_reset(bitmap_a, 70);
+    assert(bitmap_total_set(bitmap_a) == 3);
+    assert(bitmap_ffz(bitmap_a) == 1);
+    bitmap_set_range(bitmap_a, 0, 200);
+    assert(bitmap_total_set(bitmap_a) == 200);
+    bitmap_reset_range(bitmap_a, 5, 10);
+    assert(bitmap_total_set(bitmap_a) == 190);
+    assert(bitmap_claim_zero(bitmap_a, 0) == 5);
+    bitmap_set_range(bitmap_a, 0, test_bit_count);
+    assert(bitmap_claim_zero(bitmap_a, 0) == SIZE_MAX);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    // the very last bits live in the short word
+    bitmap_reset(bitmap_a, test_bit_count - 1);
+    assert(bitmap_claim_zero(bitmap_a, 50) == test_bit_count - 1);
+    assert(bitmap_claim_zero(bitmap_a, 50) == SIZE_MAX);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count);
+    // ranges across words and into the short word, the count has to follow
+    bitmap_reset_range(bitmap_a, 60, 10);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count - 10);
+    assert(bitmap_ffz(bitmap_a) == 60);
+    bitmap_reset_range(bitmap_a, test_bit_count - 100, 100);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count - 110);
+    assert(bitmap_claim_zero(bitmap_a, 70) == test_bit_count - 100);
+    bitmap_set_range(bitmap_a, 0, test_bit_count);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    bitmap_destroy(bitmap_a);
+
+    // the same with no summary, and from a map that isn't atomic at all
+    bitmap_a = bitmap_create(100);
+    assert(bitmap_claim_zero(bitmap_a, 10) == 10);
+    assert(!bitmap_test_and_set(bitmap_a, 11));
+    assert(bitmap_test_and_set(bitmap_a, 11));
+    assert(bitmap_claim_zero(NULL, 0) == SIZE_MAX);
+    assert(bitmap_enable_atomic(bitmap_a));
+    assert(bitmap_claim_zero(bitmap_a, 10) == 12);
+    bitmap_destroy(bitmap_a);
+
+    // misaligned overlays are turned down
+    uint64_t backing[4] = {0};
+    bitmap_a = bitmap_overlay(64, (uint8_t *) backing + 1);
+    assert(!bitmap_enable_atomic(bitmap_a));
+    bitmap_destroy(bitmap_a);
+
+    // now race for every bit
+    // (nothing the threads depend on goes inside an assert, they have to run either way)
+    uint8_t *owner = (uint8_t *) calloc(test_bit_count, 1);
+    assert(owner);
+    bitmap_a = bitmap_create(test_bit_count);
+    bitmap_enable_summary(bitmap_a);
+    bitmap_enable_count(bitmap_a);
+    bitmap_enable_atomic(bitmap_a);
+    assert(FLAG_CHECK(bitmap_a, SUMMARY) && FLAG_CHECK(bitmap_a, COUNTED) && FLAG_CHECK(bitmap_a, ATOMIC));
+
+    pthread_t threads[CLAIM_THREADS];
+    claim_worker_t workers[CLAIM_THREADS];
+    size_t started = 0;
+    for (; started < CLAIM_THREADS; ++started) {
+        workers[started] = (claim_worker_t){bitmap_a, owner, 0};
+        if (pthread_create(&threads[started], NULL, claim_worker, &workers[started])) {
+            break;
+        }
+    }
+    assert(started == CLAIM_THREADS);
+    size_t claims = 0;
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+        claims += workers[i].claims;
+    }
+    assert(claims == test_bit_count);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    for (size_t i = 0; i < test_bit_count; ++i) {
+        assert(owner[i] == 1);
+    }
+    // and the summary still finds a hole once one opens up
+    bitmap_reset(bitmap_a, 77777);
+    assert(bitmap_ffz(bitmap_a) == 77777);
+
+    free(owner);
+    bitmap_destroy(bitmap_a);
+}
+
+// What bitmap_and/or/xor/andnot should do to one bit
+bool expected_op(const int op, const bool x, const bool y) {
+    switch (op) {
+        case 0: return x && y;
+        case 1: return x || y;
+        case 2: return x != y;
+        default: return x && !y;
+    }
+}
+
+void bitmap_test_i() {
+    // a size that leaves a vector, some words and some leftover bits
+    const size_t test_bit_count = 8 * 300 + 5;
+    bitmap_t *bitmap_a = bitmap_create(test_bit_count);
+    bitmap_t *bitmap_b = bitmap_create(test_bit_count);
+    bitmap_t *bitmap_c = bitmap_create(test_bit_count + 1);
+    assert(bitmap_a && bitmap_b && bitmap_c);
+
+    srand(9);
+    for (size_t i = 0; i < bitmap_a->byte_count; ++i) {
+        bitmap_a->data[i] = (uint8_t) rand();
+        bitmap_b->data[i] = (uint8_t) rand();
+    }
+    uint8_t *original = (uint8_t *) malloc(bitmap_a->byte_count);
+    assert(original);
+    memcpy(original, bitmap_a->data, bitmap_a->byte_count);
+
+    // each op against the per-bit answer, resetting a in between
+    for (int op = 0; op < 4; ++op) {
+        memcpy(bitmap_a->data, original, bitmap_a->byte_count);
+        bitmap_t *const before = bitmap_import(test_bit_count, original);
+        switch (op) {
+            case 0: assert(bitmap_and(bitmap_a, bitmap_b)); break;
+            case 1: assert(bitmap_or(bitmap_a, bitmap_b)); break;
+            case 2: assert(bitmap_xor(bitmap_a, bitmap_b)); break;
+            default: assert(bitmap_andnot(bitmap_a, bitmap_b)); break;
+        }
+        for (size_t i = 0; i < test_bit_count; ++i) {
+            assert(bitmap_test(bitmap_a, i) == expected_op(op, bitmap_test(before, i), bitmap_test(bitmap_b, i)));
+        }
+        bitmap_destroy(before);
+    }
+
+    // every kernel agrees with the scalar one, at every alignment
+    uint8_t scratch_a[200], scratch_b[200];
+    for (size_t offset = 0; offset < 9; ++offset) {
+        for (size_t n = 0; n + offset <= sizeof(scratch_a); n += 13) {
+            memcpy(scratch_a, original, sizeof(scratch_a));
+            memcpy(scratch_b, original, sizeof(scratch_b));
+            combine_bytes_scalar(scratch_a + offset, bitmap_b->data, n, OP_XOR);
+            combine_kernel(scratch_b + offset, bitmap_b->data, n, OP_XOR);
+            assert(memcmp(scratch_a, scratch_b, sizeof(scratch_a)) == 0);
+            assert(first_difference_bytes(scratch_a + offset, original + offset, n) ==
+                   difference_bytes_scalar(scratch_a + offset, original + offset, n));
+        }
+    }
+
+    // equality and the first difference, including junk in the undetermined tail
+    memcpy(bitmap_a->data, bitmap_b->data, bitmap_b->byte_count);
+    assert(bitmap_equal(bitmap_a, bitmap_b));
+    assert(bitmap_first_difference(bitmap_a, bitmap_b) == SIZE_MAX);
+    bitmap_a->data[bitmap_a->byte_count - 1] ^= 0xE0;
+    assert(bitmap_equal(bitmap_a, bitmap_b));
+    bitmap_flip(bitmap_a, test_bit_count - 1);
+    assert(bitmap_first_difference(bitmap_a, bitmap_b) == test_bit_count - 1);
+    bitmap_flip(bitmap_a, 1234);
+    assert(bitmap_first_difference(bitmap_a, bitmap_b) == 1234);
+    assert(!bitmap_equal(bitmap_a, bitmap_b));
+
+    // mismatched sizes and bad input
+    assert(!bitmap_and(bitmap_a, bitmap_c));
+    assert(!bitmap_or(NULL, bitmap_b));
+    assert(!bitmap_xor(bitmap_a, NULL));
+    assert(!bitmap_equal(bitmap_a, bitmap_c));
+    assert(!bitmap_equal(NULL, NULL));
+    assert(bitmap_first_difference(bitmap_a, bitmap_c) == SIZE_MAX);
+
+    // overlays work, and the summary and count follow along
+    uint64_t backing[38] = {0};
+    bitmap_t *overlay = bitmap_overlay(test_bit_count, backing);
+    assert(overlay);
+    assert(bitmap_enable_summary(overlay));
+    assert(bitmap_enable_count(overlay));
+    assert(bitmap_or(overlay, bitmap_b));
+    assert(bitmap_equal(overlay, bitmap_b));
+    assert(bitmap_total_set(overlay) == count_bytes_table(bitmap_b->data, bitmap_b->byte_count - 1) +
+                                            bit_totals[bitmap_b->data[bitmap_b->byte_count - 1] & 0x1F]);
+    bitmap_format(bitmap_a, 0xFF);
+    assert(bitmap_andnot(overlay, bitmap_a));
+    assert(bitmap_total_set(overlay) == 0);
+    assert(bitmap_ffz(overlay) == 0);
+    assert(bitmap_xor(overlay, bitmap_a));
+    assert(bitmap_ffz(overlay) == SIZE_MAX);
+    bitmap_destroy(overlay);
+
+    free(original);
+    bitmap_destroy(bitmap_a);
+    bitmap_destroy(bitmap_b);
+    bitmap_destroy(bitmap_c);
+}
+
+// Compressed and flat should always agree, on everything
+void check_same(const bitmap_t *const compressed, const bitmap_t *const flat) {
+    assert(bitmap_first_difference(compressed, flat) == SIZE_MAX);
+    assert(bitmap_equal(flat, compressed));
+    assert(bitmap_total_set(compressed) == bitmap_total_set(flat));
+    assert(bitmap_ffz(compressed) == bitmap_ffz(flat));
+    assert(bitmap_ffs(compressed) == bitmap_ffs(flat));
+    for (size_t start = 0; start < flat->bit_count; start += 4099) {
+        assert(bitmap_ffz_from(compressed, start) == bitmap_ffz_from(flat, start));
+        assert(bitmap_count_range(compressed, start, flat->bit_count - start) ==
+               bitmap_count_range(flat, start, flat->bit_count - start));
+        assert(bitmap_find_zero_run(compressed, start, 70) == bitmap_find_zero_run(flat, start, 70));
+    }
+    for (const container_t *container = compressed->chunks; container < compressed->chunks + compressed->chunk_count;
+         ++container) {
+        assert(container->type != CONTAINER_ARRAY || container->size == container->cardinality);
+        assert(container->type != CONTAINER_ARRAY || container->size <= ARRAY_MAX);
+        assert(container->type != CONTAINER_RUN || container->size <= RUN_MAX);
+    }
+}
+
+void bitmap_test_j() {
+    // three full chunks and a short one
+    const size_t test_bit_count = 3 * 65536 + 777;
+    bitmap_t *bitmap_a = bitmap_create_compressed(test_bit_count);
+    bitmap_t *bitmap_b = bitmap_create(test_bit_count);
+    assert(bitmap_a && bitmap_b);
+    assert(bitmap_create_compressed(0) == NULL);
+    assert(bitmap_export(bitmap_a) == NULL);
+    assert(!bitmap_enable_summary(bitmap_a));
+    assert(!bitmap_enable_atomic(bitmap_a));
+    assert(bitmap_enable_count(bitmap_a));
+    assert(bitmap_get_bits(bitmap_a) == test_bit_count);
+    assert(bitmap_ffz(bitmap_a) == 0);
+    assert(bitmap_ffs(bitmap_a) == SIZE_MAX);
+    check_same(bitmap_a, bitmap_b);
+
+    // sparse, then dense enough to turn the array into a bitset
+    for (size_t i = 0; i < 6000; ++i) {
+        bitmap_set(bitmap_a, i * 7);
+        bitmap_set(bitmap_b, i * 7);
+    }
+    assert(bitmap_a->chunks[0].type == CONTAINER_BITSET);
+    check_same(bitmap_a, bitmap_b);
+
+    // one long run swallows it
+    bitmap_set_range(bitmap_a, 10, 65536 * 2);
+    bitmap_set_range(bitmap_b, 10, 65536 * 2);
+    assert(bitmap_a->chunks[1].type == CONTAINER_RUN && bitmap_a->chunks[1].size == 1);
+    check_same(bitmap_a, bitmap_b);
+
+    // holes punched in a full chunk split the run
+    for (size_t i = 65536; i < 65536 * 2; i += 1000) {
+        bitmap_reset(bitmap_a, i);
+        bitmap_reset(bitmap_b, i);
+    }
+    assert(bitmap_a->chunks[1].type == CONTAINER_RUN);
+    check_same(bitmap_a, bitmap_b);
+
+    // and enough of them turns it into a bitset
+    for (size_t i = 65536; i < 65536 * 2; i += 3) {
+        bitmap_reset(bitmap_a, i);
+        bitmap_reset(bitmap_b, i);
+    }
+    assert(bitmap_a->chunks[1].type == CONTAINER_BITSET);
+    check_same(bitmap_a, bitmap_b);
+
+    // everything else, at random
+    srand(10);
+    for (size_t i = 0; i < 200000; ++i) {
+        const size_t bit = (size_t) rand() % test_bit_count;
+        switch (rand() % 8) {
+            case 0:
+            case 1: bitmap_set(bitmap_a, bit); bitmap_set(bitmap_b, bit); break;
+            case 2:
+            case 3: bitmap_reset(bitmap_a, bit); bitmap_reset(bitmap_b, bit); break;
+            case 4: bitmap_flip(bitmap_a, bit); bitmap_flip(bitmap_b, bit); break;
+            case 5: assert(bitmap_test_and_set(bitmap_a, bit) == bitmap_test_and_set(bitmap_b, bit)); break;
+            case 6: assert(bitmap_claim_zero(bitmap_a, bit) == bitmap_claim_zero(bitmap_b, bit)); break;
+            default: {
+                const size_t count = (size_t) rand() % 3000 + 1;
+                if (bit + count <= test_bit_count) {
+                    if (rand() & 1) {
+                        bitmap_set_range(bitmap_a, bit, count);
+                        bitmap_set_range(bitmap_b, bit, count);
+                    } else {
+                        bitmap_reset_range(bitmap_a, bit, count);
+                        bitmap_reset_range(bitmap_b, bit, count);
+                    }
+                }
+                break;
+            }
+        }
+        assert(bitmap_test(bitmap_a, bit) == bitmap_test(bitmap_b, bit));
+        if (i % 20000 == 0) {
+            check_same(bitmap_a, bitmap_b);
+        }
+    }
+    check_same(bitmap_a, bitmap_b);
+
+    bitmap_invert(bitmap_a);
+    bitmap_invert(bitmap_b);
+    check_same(bitmap_a, bitmap_b);
+
+    // runs come out the same from either layout
+    run_check_t check_a = {bitmap_a, 0, 0, 0}, check_b = {bitmap_b, 0, 0, 0};
+    bitmap_for_each_run(bitmap_a, run_check, &check_a);
+    bitmap_for_each_run(bitmap_b, run_check, &check_b);
+    assert(check_a.covered == check_b.covered && check_a.runs == check_b.runs);
+
+    // round trip through the serialized form, from both layouts
+    const size_t serial_size = bitmap_serialize(bitmap_a, NULL, 0);
+    assert(serial_size && serial_size == bitmap_serialize(bitmap_b, NULL, 0));
+    uint8_t *serial = (uint8_t *) malloc(serial_size);
+    assert(serial);
+    assert(bitmap_serialize(bitmap_b, serial, serial_size) == serial_size);
+    bitmap_t *bitmap_c = bitmap_deserialize(serial, serial_size);
+    assert(bitmap_c);
+    check_same(bitmap_c, bitmap_b);
+    bitmap_destroy(bitmap_c);
+
+    // anything truncated, padded, or scribbled on is turned down
+    assert(bitmap_deserialize(serial, serial_size - 1) == NULL);
+    assert(bitmap_deserialize(serial, serial_size + 1) == NULL);
+    assert(bitmap_deserialize(NULL, serial_size) == NULL);
+    serial[0] ^= 0x01;
+    assert(bitmap_deserialize(serial, serial_size) == NULL);
+    serial[0] ^= 0x01;
+    serial[12] = 7;  // first container's type
+    assert(bitmap_deserialize(serial, serial_size) == NULL);
+    free(serial);
+
+    // algebra across the layouts
+    bitmap_format(bitmap_b, 0x00);
+    bitmap_set_range(bitmap_b, 1000, 100000);
+    assert(bitmap_and(bitmap_a, bitmap_b));
+    bitmap_t *reference = bitmap_create(test_bit_count);
+    assert(bitmap_or(reference, bitmap_a));
+    check_same(bitmap_a, reference);
+    assert(bitmap_count_range(bitmap_a, 0, 1000) == 0);
+    assert(bitmap_count_range(bitmap_a, 101000, test_bit_count - 101000) == 0);
+    assert(bitmap_xor(bitmap_a, bitmap_a));
+    assert(bitmap_total_set(bitmap_a) == 0);
+
+    // format, both the cheap patterns and the other kind
+    bitmap_format(bitmap_a, 0xFF);
+    assert(bitmap_total_set(bitmap_a) == test_bit_count);
+    assert(bitmap_ffz(bitmap_a) == SIZE_MAX);
+    assert(bitmap_claim_zero(bitmap_a, 0) == SIZE_MAX);
+    bitmap_format(bitmap_a, 0x0F);
+    bitmap_format(reference, 0x0F);
+    check_same(bitmap_a, reference);
+
+    // out of memory, whatever can't be re-encoded stays the way it was
+    bitmap_t *tight = bitmap_create_compressed(test_bit_count);
+    assert(tight && bitmap_enable_count(tight));
+    bitmap_format(reference, 0x00);
+    for (size_t bit = 0; bit < 16; bit += 2) {
+        bitmap_set(tight, bit);  // an array with no room left
+        bitmap_set(reference, bit);
+    }
+    for (size_t first = 65536; first < 2 * 65536; first += 16384) {
+        bitmap_set_range(tight, first, 1000);  // a run list with no room left
+        bitmap_set_range(reference, first, 1000);
+    }
+    bitmap_t *other = bitmap_create(test_bit_count);
+    assert(other);
+    bitmap_set(other, 100);
+    allocations_fail = true;
+    assert(bitmap_test_and_set(tight, 100));
+    bitmap_set(tight, 101);
+    bitmap_reset(tight, 65536 + 100);
+    bitmap_set_range(tight, 0, 65536);
+    bitmap_set_range(tight, 2 * 65536, 10);
+    assert(!bitmap_or(tight, other));
+    allocations_fail = false;
+    check_same(tight, reference);
+    assert(!bitmap_test_and_set(tight, 100));
+    bitmap_reset(tight, 65536 + 100);
+    assert(!bitmap_test(tight, 65536 + 100));
+
+    bitmap_destroy(other);
+    bitmap_destroy(tight);
+    bitmap_destroy(reference);
+    bitmap_destroy(bitmap_a);
+    bitmap_destroy(bitmap_b);
+}
@@ -0,0 +1,322 @@
+#include "block_store.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Not a test, just numbers. Run it from a release build if you want them to mean anything.
+// Anything that isn't comparing backends runs on a RAM image so the disk stays out of it.
+
+#define BENCH_FNAME "bench.bs"
+#define BENCH_FILE_BLOCKS 16384
+#define BENCH_THREAD_MAX 8
+#define BENCH_CHURN_ROUNDS 200000
+#define BENCH_RANDOM_READS 200000
+#define BENCH_SCAN_BATCH 256
+#define BENCH_ASYNC_DEPTH 64
+#define BENCH_COLD_FILES 64
+#define BENCH_COLD_FILE_BLOCKS 256
+#define BENCH_COLD_RANDOM_READS 4096
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Allocates count blocks like a big sequential file would, returns ns per allocation
+static double allocate_file(block_store_t *const bs, const unsigned count) {
+    const double start = now_ns();
+    for (unsigned i = 0; i < count; ++i) {
+        if (!block_store_allocate(bs)) {
+            break;
+        }
+    }
+    return (now_ns() - start) / count;
+}
+
+static void bench_policy(const char *const name, const alloc_policy_t policy) {
+    // filling the whole device from empty
+    block_store_t *bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    if (!bs) {
+        return;
+    }
+    block_store_set_alloc_policy(bs, policy);
+    const double fill_ns = allocate_file(bs, 65536 - 16);
+
+    // a large file on a device that's mostly full with the holes scattered through the front
+    for (unsigned i = 16; i < 49152; ++i) {
+        if (i % 3 == 0) {
+            block_store_release(bs, i);
+        }
+    }
+    const double file_ns = allocate_file(bs, BENCH_FILE_BLOCKS);
+
+    printf("%-10s fill device %6.1f ns/block   large file on fragmented device %6.1f ns/block\n", name, fill_ns,
+           file_ns);
+    block_store_close(bs);
+}
+
+// Each thread allocates a handful of blocks and gives them back, over and over
+static void *churn(void *arg) {
+    block_store_t *const bs = (block_store_t *) arg;
+    unsigned held[8];
+    for (unsigned round = 0; round < BENCH_CHURN_ROUNDS / 8; ++round) {
+        for (unsigned i = 0; i < 8; ++i) {
+            held[i] = block_store_allocate(bs);
+        }
+        for (unsigned i = 0; i < 8; ++i) {
+            block_store_release(bs, held[i]);
+        }
+    }
+    return NULL;
+}
+
+static void bench_threads(const char *const name, const alloc_policy_t policy) {
+    block_store_t *bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    if (!bs) {
+        return;
+    }
+    block_store_set_alloc_policy(bs, policy);
+    // half full so there's some searching to do
+    for (unsigned i = 0; i < 32768; ++i) {
+        block_store_allocate(bs);
+    }
+    printf("%-10s", name);
+    for (unsigned threads = 1; threads <= BENCH_THREAD_MAX; threads <<= 1) {
+        pthread_t workers[BENCH_THREAD_MAX];
+        const double start = now_ns();
+        for (unsigned i = 0; i < threads; ++i) {
+            pthread_create(&workers[i], NULL, churn, bs);
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            pthread_join(workers[i], NULL);
+        }
+        const double elapsed = now_ns() - start;
+        printf("   %u threads %7.2f Mops/s", threads, (2.0 * BENCH_CHURN_ROUNDS * threads) / elapsed * 1e3);
+    }
+    puts("");
+    block_store_close(bs);
+}
+
+// A big sequential transfer one block_store_read/write at a time vs one vectored call
+static void bench_vectored(void) {
+    block_store_t *bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    uint8_t *buffer = (uint8_t *) calloc(BENCH_FILE_BLOCKS, 512);
+    block_read_vec_t *reads = (block_read_vec_t *) calloc(BENCH_FILE_BLOCKS, sizeof(block_read_vec_t));
+    block_write_vec_t *writes = (block_write_vec_t *) calloc(BENCH_FILE_BLOCKS, sizeof(block_write_vec_t));
+    if (bs && buffer && reads && writes) {
+        for (unsigned i = 0; i < BENCH_FILE_BLOCKS; ++i) {
+            reads[i] = (block_read_vec_t){16 + i, buffer + 512 * i};
+            writes[i] = (block_write_vec_t){16 + i, buffer + 512 * i};
+        }
+        // fault the mapping in first so neither side pays for it
+        block_store_writev(bs, writes, BENCH_FILE_BLOCKS);
+        const double mib = BENCH_FILE_BLOCKS * 512.0 / (1 << 20);
+        double start = now_ns();
+        for (unsigned i = 0; i < BENCH_FILE_BLOCKS; ++i) {
+            block_store_read(bs, 16 + i, buffer + 512 * i);
+        }
+        const double read_ns = now_ns() - start;
+        start = now_ns();
+        block_store_readv(bs, reads, BENCH_FILE_BLOCKS);
+        const double readv_ns = now_ns() - start;
+        start = now_ns();
+        for (unsigned i = 0; i < BENCH_FILE_BLOCKS; ++i) {
+            block_store_write(bs, 16 + i, buffer + 512 * i);
+        }
+        const double write_ns = now_ns() - start;
+        start = now_ns();
+        block_store_writev(bs, writes, BENCH_FILE_BLOCKS);
+        const double writev_ns = now_ns() - start;
+        printf("read  %8.1f MiB/s   readv  %8.1f MiB/s\n", mib / read_ns * 1e9, mib / readv_ns * 1e9);
+        printf("write %8.1f MiB/s   writev %8.1f MiB/s\n", mib / write_ns * 1e9, mib / writev_ns * 1e9);
+    }
+    free(writes);
+    free(reads);
+    free(buffer);
+    block_store_close(bs);
+}
+
+static int compare_double(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Random single block reads (latency percentiles) and a full sequential scan (throughput) of a filled image
+// The image was just written so it's all in the page cache, DIRECT is the only one that goes to the device
+static void bench_backend(const char *const name, const bs_backend_t backend) {
+    block_store_t *bs = block_store_open_backend(BENCH_FNAME, backend);
+    double *latency = (double *) malloc(BENCH_RANDOM_READS * sizeof(double));
+    block_read_vec_t *reads = (block_read_vec_t *) calloc(BENCH_SCAN_BATCH, sizeof(block_read_vec_t));
+    uint8_t *buffer = (uint8_t *) calloc(BENCH_SCAN_BATCH, 512);
+    if (bs && latency && reads && buffer) {
+        srand(42);
+        for (unsigned i = 0; i < BENCH_RANDOM_READS; ++i) {
+            const unsigned block = 16 + rand() % (65536 - 16);
+            const double start = now_ns();
+            block_store_read(bs, block, buffer);
+            latency[i] = now_ns() - start;
+        }
+        qsort(latency, BENCH_RANDOM_READS, sizeof(double), compare_double);
+
+        const double start = now_ns();
+        for (unsigned first = 16; first < 65536; first += BENCH_SCAN_BATCH) {
+            const unsigned count = 65536 - first < BENCH_SCAN_BATCH ? 65536 - first : BENCH_SCAN_BATCH;
+            for (unsigned i = 0; i < count; ++i) {
+                reads[i] = (block_read_vec_t){first + i, buffer + 512 * i};
+            }
+            block_store_readv(bs, reads, count);
+        }
+        const double scan_ns = now_ns() - start;
+        printf("%-7s random read p50 %7.0f ns  p99 %7.0f ns  p99.9 %7.0f ns  max %8.0f ns   scan %7.1f MiB/s\n", name,
+               latency[BENCH_RANDOM_READS / 2], latency[BENCH_RANDOM_READS / 100 * 99],
+               latency[BENCH_RANDOM_READS / 1000 * 999], latency[BENCH_RANDOM_READS - 1],
+               (65536 - 16) * 512.0 / (1 << 20) / scan_ns * 1e9);
+    }
+    free(buffer);
+    free(reads);
+    free(latency);
+    block_store_close(bs);
+}
+
+static void bench_backends(void) {
+    // fill the image so nobody gets to read holes
+    block_store_t *bs = block_store_create(BENCH_FNAME);
+    uint8_t block[512];
+    if (!bs) {
+        return;
+    }
+    for (unsigned i = 16; i < 65536; ++i) {
+        memset(block, i, sizeof(block));
+        block_store_write(bs, i, block);
+    }
+    block_store_close(bs);
+    bench_backend("mmap", BS_BACKEND_MMAP);
+    bench_backend("pread", BS_BACKEND_PREAD);
+    bench_backend("direct", BS_BACKEND_DIRECT);
+}
+
+// Cold start: everything dropped from the page cache, then BENCH_COLD_FILES files of BENCH_COLD_FILE_BLOCKS
+// scattered over the image are read through, hinted the way f16fs does on open, all up front, or not at all
+// Then random single blocks, with and without RANDOM turning readahead off
+enum { HINT_NONE, HINT_AT_OPEN, HINT_UP_FRONT };
+
+static double cold_files(block_store_t *const bs, const int hint) {
+    uint8_t block[512];
+    block_store_advise(bs, 0, 65536, BS_ADVISE_DONTNEED);
+    const double start = now_ns();
+    for (unsigned f = 0; hint == HINT_UP_FRONT && f < BENCH_COLD_FILES; ++f) {
+        block_store_advise(bs, 16 + f * 1000, BENCH_COLD_FILE_BLOCKS, BS_ADVISE_WILLNEED);
+    }
+    for (unsigned f = 0; f < BENCH_COLD_FILES; ++f) {
+        if (hint == HINT_AT_OPEN) {
+            block_store_advise(bs, 16 + f * 1000, BENCH_COLD_FILE_BLOCKS, BS_ADVISE_WILLNEED);
+        }
+        for (unsigned i = 0; i < BENCH_COLD_FILE_BLOCKS; ++i) {
+            block_store_read(bs, 16 + f * 1000 + i, block);
+        }
+    }
+    return (now_ns() - start) / 1e6;
+}
+
+static double cold_random(block_store_t *const bs, const bs_advice_t advice) {
+    uint8_t block[512];
+    block_store_advise(bs, 0, 65536, BS_ADVISE_DONTNEED);
+    block_store_advise(bs, 0, 65536, advice);
+    srand(7);
+    const double start = now_ns();
+    for (unsigned i = 0; i < BENCH_COLD_RANDOM_READS; ++i) {
+        block_store_read(bs, 16 + rand() % (65536 - 16), block);
+    }
+    const double elapsed = (now_ns() - start) / 1e6;
+    block_store_advise(bs, 0, 65536, BS_ADVISE_NORMAL);
+    return elapsed;
+}
+
+static void bench_advise(const char *const name, const bs_backend_t backend) {
+    block_store_t *bs = block_store_open_backend(BENCH_FNAME, backend);
+    if (!bs) {
+        return;
+    }
+    printf("%-7s files: none %7.1f ms  at open %7.1f ms  up front %7.1f ms", name, cold_files(bs, HINT_NONE),
+           cold_files(bs, HINT_AT_OPEN), cold_files(bs, HINT_UP_FRONT));
+    printf("   random: normal %7.1f ms  random %7.1f ms\n", cold_random(bs, BS_ADVISE_NORMAL),
+           cold_random(bs, BS_ADVISE_RANDOM));
+    block_store_close(bs);
+}
+
+// Ingest: BENCH_FILE_BLOCKS scattered block writes, one at a time vs kept BENCH_ASYNC_DEPTH deep
+static void bench_async(const char *const name, const bs_backend_t backend) {
+    uint8_t *buffer = NULL;
+    if (posix_memalign((void **) &buffer, 4096, BENCH_FILE_BLOCKS * 512)) {
+        return;
+    }
+    memset(buffer, 0xA5, BENCH_FILE_BLOCKS * 512);
+    // every 5th block so nothing merges into bigger writes behind our back
+    printf("%-7s", name);
+    block_store_t *bs = block_store_create_backend(BENCH_FNAME, backend);
+    if (bs) {
+        const double start = now_ns();
+        for (unsigned i = 0; i < BENCH_FILE_BLOCKS; ++i) {
+            block_store_write(bs, 16 + 5 * (i % 13000), buffer + 512 * i);
+        }
+        printf("   sync %7.1f MiB/s", BENCH_FILE_BLOCKS * 512.0 / (1 << 20) / (now_ns() - start) * 1e9);
+        block_store_close(bs);
+    }
+    const bs_async_t engines[] = {BS_ASYNC_URING, BS_ASYNC_THREADS};
+    const char *const engine_names[] = {"io_uring", "threads"};
+    for (unsigned e = 0; e < 2; ++e) {
+        bs = block_store_create_backend(BENCH_FNAME, backend);
+        if (bs && block_store_enable_async(bs, BENCH_ASYNC_DEPTH, engines[e]) &&
+            block_store_register_buffers(bs, buffer, BENCH_FILE_BLOCKS)) {
+            block_completion_t completions[BENCH_ASYNC_DEPTH];
+            unsigned submitted = 0, finished = 0;
+            const double start = now_ns();
+            while (finished < BENCH_FILE_BLOCKS) {
+                while (submitted < BENCH_FILE_BLOCKS &&
+                       block_store_submit_write(bs, 16 + 5 * (submitted % 13000), buffer + 512 * submitted,
+                                                submitted)) {
+                    ++submitted;
+                }
+                finished += block_store_poll(bs, completions, BENCH_ASYNC_DEPTH, true);
+            }
+            const double elapsed = now_ns() - start;
+            printf("   %s %7.1f MiB/s", engine_names[e], BENCH_FILE_BLOCKS * 512.0 / (1 << 20) / elapsed * 1e9);
+        }
+        block_store_close(bs);
+    }
+    puts("");
+    free(buffer);
+}
+
+int main() {
+    printf("block_store_allocate, %d block file\n", BENCH_FILE_BLOCKS);
+    bench_policy("first fit", BS_FIRST_FIT);
+    bench_policy("next fit", BS_NEXT_FIT);
+
+    printf("\nallocate/release churn, %d operations per thread\n", 2 * BENCH_CHURN_ROUNDS);
+    bench_threads("first fit", BS_FIRST_FIT);
+    bench_threads("next fit", BS_NEXT_FIT);
+
+    printf("\nsequential transfer, %d blocks\n", BENCH_FILE_BLOCKS);
+    bench_vectored();
+
+    printf("\nbackends, %d random reads and a full scan in %d block batches\n", BENCH_RANDOM_READS, BENCH_SCAN_BATCH);
+    bench_backends();
+
+    printf("\ncold reads, %d files of %d blocks then %d random blocks, with and without hints\n", BENCH_COLD_FILES,
+           BENCH_COLD_FILE_BLOCKS, BENCH_COLD_RANDOM_READS);
+    bench_advise("mmap", BS_BACKEND_MMAP);
+    bench_advise("pread", BS_BACKEND_PREAD);
+
+    printf("\nscattered writes, %d blocks, async kept %d deep\n", BENCH_FILE_BLOCKS, BENCH_ASYNC_DEPTH);
+    bench_async("mmap", BS_BACKEND_MMAP);
+    bench_async("pread", BS_BACKEND_PREAD);
+    bench_async("direct", BS_BACKEND_DIRECT);
+    remove(BENCH_FNAME);
+    return 0;
+}
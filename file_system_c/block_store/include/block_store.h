@@ -5,12 +5,107 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Back store object
 // It's an opaque object whose implementation is up to you
 // (and implementation DOES NOT go here)
 typedef struct block_store block_store_t;
 
+// How block_store_allocate picks a block
+//  FIRST_FIT always takes the lowest free block
+//  NEXT_FIT picks up where the last allocation left off and wraps around
+typedef enum { BS_FIRST_FIT, BS_NEXT_FIT } alloc_policy_t;
+
+// Where the image lives while the block_store is open
+//  MMAP maps the whole image, reads and writes are memcpys (the default)
+//  PREAD goes through pread/pwrite, only the FBM (written back on close) and pinned blocks stay in memory
+//  DIRECT is PREAD with O_DIRECT, skipping the page cache entirely
+//  RAM never touches a file, the image is gone once it's closed (so it can be created but not opened)
+typedef enum { BS_BACKEND_MMAP, BS_BACKEND_PREAD, BS_BACKEND_DIRECT, BS_BACKEND_RAM } bs_backend_t;
+
+// What does the work behind block_store_submit_read/write
+//  URING uses io_uring, THREADS a small pool of threads doing block_store_read/write
+//  AUTO takes io_uring when the kernel has it and falls back to the threads
+typedef enum { BS_ASYNC_AUTO, BS_ASYNC_URING, BS_ASYNC_THREADS } bs_async_t;
+
+// How a range of blocks is about to be used, for block_store_advise
+//  NORMAL undoes SEQUENTIAL/RANDOM, WILLNEED starts reading it in now, DONTNEED lets it drop out of memory
+typedef enum {
+    BS_ADVISE_NORMAL,
+    BS_ADVISE_WILLNEED,
+    BS_ADVISE_SEQUENTIAL,
+    BS_ADVISE_RANDOM,
+    BS_ADVISE_DONTNEED
+} bs_advice_t;
+
+// A finished asynchronous request
+typedef struct {
+    uint64_t tag;  // whatever was passed in at submit
+    int result;  // 0 on success, a negative errno on failure
+} block_completion_t;
+
+// What the background flusher has done so far
+typedef struct {
+    uint64_t passes;  // syncs it has run, for any reason
+    uint64_t pages;  // 4KiB pages those syncs wrote back
+    uint64_t threshold_passes;  // passes started by crossing the dirty threshold
+    uint64_t age_passes;  // passes started by pages getting older than the age limit
+    uint64_t failures;  // passes where some of the sync failed
+} block_flusher_stats_t;
+
+// One block of a vectored read/write, each buffer is a whole block
+typedef struct {
+    unsigned block_id;
+    void *dst;
+} block_read_vec_t;
+
+typedef struct {
+    unsigned block_id;
+    const void *src;
+} block_write_vec_t;
+
+// count blocks from first, for block_store_sync_ranges
+typedef struct {
+    unsigned first;
+    unsigned count;
+} block_range_t;
+
+// The hooks under a block_store, it keeps the FBM, dirty tracking and asynchronous requests on top of them
+// Everything is whole blocks, and ids are checked before a hook ever sees them
+// Hooks can be called from several threads at once
+typedef struct {
+    // count blocks starting at block_id to/from one buffer
+    bool (*read)(void *device, const unsigned block_id, void *dst, const size_t count);
+    bool (*write)(void *device, const unsigned block_id, const void *src, const size_t count);
+    // optional, a whole vector at once, otherwise each run of adjacent blocks and buffers goes to read/write
+    bool (*readv)(void *device, const block_read_vec_t *vec, size_t count);
+    bool (*writev)(void *device, const block_write_vec_t *vec, size_t count);
+    // optional, the whole image in memory until close, which block_store_get_ro/get_rw point straight into
+    // Without it blocks handed out by those get copied and the FBM is kept in memory and written back on close
+    void *(*map)(void *device);
+    // makes count blocks from first durable
+    bool (*flush)(void *device, const unsigned first, const unsigned count);
+    // optional, starts count blocks from first on their way to disk without waiting for them
+    // With it a sync hands each run here and then calls flush once over all of them, otherwise flush gets each run
+    bool (*writeback)(void *device, const unsigned first, const unsigned count);
+    // optional, told about blocks changing hands
+    void (*allocated)(void *device, const unsigned first, const unsigned count);
+    void (*released)(void *device, const unsigned first, const unsigned count);
+    // optional, hands the storage behind count blocks from first back to the host, they read back as zeros after
+    // Always whole 4KiB pages of free blocks. Returns the bytes that actually came back, -1 if it couldn't
+    int64_t (*discard)(void *device, const unsigned first, const unsigned count);
+    // optional, a hint about how count blocks from first are about to be used, nothing may change on disk
+    bool (*advise)(void *device, const unsigned first, const unsigned count, const bs_advice_t advice);
+    // optional, a file holding the image from offset 0 that io_uring can go straight to, -1 if there isn't one
+    int (*fd)(void *device);
+    // buffers io_uring hands to that file have to be aligned to this (O_DIRECT), 0 if anything goes
+    size_t fd_align;
+    // called once, by block_store_close
+    void (*close)(void *device);
+} block_device_t;
+
 ///
 /// Creates a new block_store file at the specified location
 ///  and returns a block_store object linked to it
@@ -19,6 +114,17 @@ typedef struct block_store block_store_t;
 ///
 block_store_t *block_store_create(const char *const fname);
 
+///
+/// Creates a new block_store file with the given geometry
+///  Block 0 holds a superblock recording it and the FBM follows, so opening the file later gets the same geometry
+///  block_store_create's images have no superblock and are always 65536 blocks of 512 bytes
+/// \param fname the file to create
+/// \param block_size bytes per block, a power of two from 512 to 65536
+/// \param block_count blocks in the image, a multiple of 8 from 64 to 2^31
+/// \return a pointer to the new object, NULL on error (or if the geometry isn't one of those)
+///
+block_store_t *block_store_create_ex(const char *const fname, const size_t block_size, const size_t block_count);
+
 ///
 /// Opens the specified block_store file
 ///  and returns a block_store object linked to it
@@ -27,6 +133,50 @@ block_store_t *block_store_create(const char *const fname);
 ///
 block_store_t *block_store_open(const char *const fname);
 
+///
+/// Creates a new block_store file like block_store_create, using the given backend
+/// \param fname the file to create (ignored for RAM)
+/// \param backend how the image is accessed
+/// \return a pointer to the new object, NULL on error (or if the filesystem can't do O_DIRECT)
+///
+block_store_t *block_store_create_backend(const char *const fname, const bs_backend_t backend);
+
+///
+/// Creates a new block_store file like block_store_create_ex, using the given backend
+/// \param fname the file to create (ignored for RAM)
+/// \param block_size bytes per block, a power of two from 512 to 65536
+/// \param block_count blocks in the image, a multiple of 8 from 64 to 2^31
+/// \param backend how the image is accessed
+/// \return a pointer to the new object, NULL on error
+///
+block_store_t *block_store_create_ex_backend(const char *const fname, const size_t block_size,
+                                             const size_t block_count, const bs_backend_t backend);
+
+///
+/// Opens the specified block_store file like block_store_open, using the given backend
+///  Every backend reads and writes the same on-disk layout
+/// \param fname the file to open
+/// \param backend how the image is accessed
+/// \return a pointer to the new object, NULL on error (or if the filesystem can't do O_DIRECT)
+///
+block_store_t *block_store_open_backend(const char *const fname, const bs_backend_t backend);
+
+///
+/// Puts a block_store on top of any device
+/// \param ops the device's hooks, read, write, flush and close are required
+/// \param device handed to every hook, the block_store owns it from here on (close goes to ops->close)
+/// \param format start with an empty FBM instead of the device's, nothing else on the device is touched
+/// \return a pointer to the new object, NULL on error (the device is still the caller's then)
+///
+block_store_t *block_store_attach(const block_device_t *const ops, void *const device, const bool format);
+
+///
+/// Reserves disk space for the whole image, images are created sparse otherwise
+/// \param bs block_store object
+/// \return bool indicating success, false if the device isn't a file or the filesystem can't do it
+///
+bool block_store_preallocate(block_store_t *const bs);
+
 ///
 /// Closes and frees a block_store object
 /// \param bs block_store to close
@@ -40,6 +190,33 @@ void block_store_close(block_store_t *const bs);
 ///
 unsigned block_store_allocate(block_store_t *const bs);
 
+///
+/// Allocates a run of physically contiguous blocks
+///  Follows the same policy as block_store_allocate
+/// \param bs the block_store to allocate from
+/// \param count the number of blocks needed
+/// \param first where to put the id of the first block in the run
+/// \return bool indicating success, nothing is allocated on failure
+///
+bool block_store_allocate_run(block_store_t *const bs, const unsigned count, unsigned *const first);
+
+///
+/// Allocates a block as close after the given one as possible
+///  Falls back to wherever block_store_allocate would go if goal isn't usable
+/// \param bs the block_store to allocate from
+/// \param goal the block id wanted
+/// \return id of the allocated block, 0 on error
+///
+unsigned block_store_allocate_near(block_store_t *const bs, const unsigned goal);
+
+///
+/// Sets the policy block_store_allocate uses (FIRST_FIT by default)
+/// \param bs the block_store to configure
+/// \param policy the policy to use from now on
+/// \return bool indicating success
+///
+bool block_store_set_alloc_policy(block_store_t *const bs, const alloc_policy_t policy);
+
 ///
 /// Requests the allocation of a specified block id
 /// \param bs block_store to allocate from
@@ -55,6 +232,67 @@ bool block_store_request(block_store_t *const bs, const unsigned block_id);
 ///
 void block_store_release(block_store_t *const bs, const unsigned block_id);
 
+///
+/// Releases a run of blocks so they may be used later
+/// \param bs block_store object
+/// \param first first block to release
+/// \param count number of blocks to release
+///
+void block_store_release_range(block_store_t *const bs, const unsigned first, const unsigned count);
+
+///
+/// Turns discard mode on or off (off by default)
+///  With it on, releasing the last block in use in a 4KiB page gives that page back to the host
+///  (a hole punched in the file, or the memory dropped for RAM)
+/// \param bs block_store object
+/// \param enable whether released pages get discarded
+/// \return bool indicating success, false if the device can't discard
+///
+bool block_store_set_discard(block_store_t *const bs, const bool enable);
+
+///
+/// Discards every free 4KiB page, discard mode or not
+///  Pages are briefly marked in use while they go, a block_store_request for one of them can fail meanwhile
+/// \param bs block_store object
+/// \return bytes given back to the host by this call, 0 on error or if the device can't discard
+///
+uint64_t block_store_trim(block_store_t *const bs);
+
+///
+/// Totals up what discards have given back to the host since the block_store was opened
+/// \param bs block_store object
+/// \return bytes reclaimed, 0 on error
+///
+uint64_t block_store_get_reclaimed_bytes(const block_store_t *const bs);
+
+///
+/// Counts the blocks still available for allocation
+/// \param bs block_store object
+/// \return number of free blocks, 0 on error
+///
+unsigned block_store_get_free_blocks(const block_store_t *const bs);
+
+///
+/// Returns the size of a block, every read and write buffer has to be at least this big
+/// \param bs block_store object
+/// \return bytes per block, 0 on error
+///
+size_t block_store_get_block_size(const block_store_t *const bs);
+
+///
+/// Returns the number of blocks in the image, including the ones block_store keeps for itself
+/// \param bs block_store object
+/// \return the block count, 0 on error
+///
+unsigned block_store_get_block_count(const block_store_t *const bs);
+
+///
+/// Returns the first block that can be allocated, everything before it is the superblock and FBM
+/// \param bs block_store object
+/// \return the first data block, 0 on error
+///
+unsigned block_store_get_first_data_block(const block_store_t *const bs);
+
 ///
 /// Reads data from the specified block to the given data buffer
 /// \param bs the object to read from
@@ -64,6 +302,16 @@ void block_store_release(block_store_t *const bs, const unsigned block_id);
 ///
 bool block_store_read(block_store_t *const bs, const unsigned block_id, void *const dst);
 
+///
+/// Reads a run of consecutive blocks into one buffer, in one go
+/// \param bs the object to read from
+/// \param first the first block to read
+/// \param count number of blocks to read
+/// \param dst the buffer to write to, count blocks long
+/// \return bool indicating success, nothing is read if any block of the run is bad
+///
+bool block_store_read_range(block_store_t *const bs, const unsigned first, const unsigned count, void *const dst);
+
 ///
 /// Writes data from the given buffer to the specified block
 /// \param bs the object to write to
@@ -73,6 +321,191 @@ bool block_store_read(block_store_t *const bs, const unsigned block_id, void *co
 ///
 bool block_store_write(block_store_t *const bs, const unsigned block_id, const void *const src);
 
+///
+/// Reads a list of blocks into their buffers
+///  Entries with consecutive block ids and back-to-back buffers are copied in one go
+/// \param bs the object to read from
+/// \param vec the blocks to read and where each one goes
+/// \param count number of entries in vec
+/// \return bool indicating success, nothing is read if any entry is bad
+///
+bool block_store_readv(block_store_t *const bs, const block_read_vec_t *const vec, const size_t count);
+
+///
+/// Writes a list of buffers to their blocks
+///  Entries with consecutive block ids and back-to-back buffers are copied in one go
+/// \param bs the object to write to
+/// \param vec the blocks to write and where each one comes from
+/// \param count number of entries in vec
+/// \return bool indicating success, nothing is written if any entry is bad
+///
+bool block_store_writev(block_store_t *const bs, const block_write_vec_t *const vec, const size_t count);
+
+///
+/// Gets a read-only pointer straight to the specified block, no copy is made
+///  The pointer stays valid until the block_store is closed
+///  The positional backends keep a copy of the block in memory from then on (pinned) and point to that
+/// \param bs the object to read from
+/// \param block_id the block wanted
+/// \return pointer to the block's block_store_get_block_size(bs) bytes, NULL on error
+///
+const void *block_store_get_ro(const block_store_t *const bs, const unsigned block_id);
+
+///
+/// Gets a writable pointer straight to the specified block and marks the block dirty
+///  The pointer stays valid until the block_store is closed
+///  The positional backends pin the block like block_store_get_ro and write it back on close
+/// \param bs the object to write to
+/// \param block_id the block wanted
+/// \return pointer to the block's block_store_get_block_size(bs) bytes, NULL on error
+///
+void *block_store_get_rw(block_store_t *const bs, const unsigned block_id);
+
+///
+/// Checks whether a block was written or handed out writable since the last clear
+/// \param bs block_store object
+/// \param block_id the block to check
+/// \return bool indicating the block is dirty, false on error
+///
+bool block_store_is_dirty(const block_store_t *const bs, const unsigned block_id);
+
+///
+/// Counts the dirty blocks
+/// \param bs block_store object
+/// \return number of dirty blocks, 0 on error
+///
+unsigned block_store_get_dirty_blocks(const block_store_t *const bs);
+
+///
+/// Marks every block clean
+/// \param bs block_store object
+///
+void block_store_clear_dirty(block_store_t *const bs);
+
+///
+/// Tells the block_store how a range of blocks is about to be used
+///  The image backends madvise the mapping (DONTNEED drops the file's cached pages too), PREAD posix_fadvises the
+///  file. DIRECT has no cache to manage and RAM nowhere to read from, they take no hints.
+///  Only a hint, nothing read or written changes. Pinned copies are unaffected.
+/// \param bs block_store object
+/// \param first first block of the range
+/// \param count number of blocks in the range
+/// \param advice how the range will be used
+/// \return bool indicating the hint was passed on, false on error or if the device takes no hints
+///
+bool block_store_advise(block_store_t *const bs, const unsigned first, const unsigned count,
+                        const bs_advice_t advice);
+
+///
+/// Makes everything written so far durable
+///  Only 4KiB pages written (or handed out writable) since the last sync are flushed, plus the FBM
+///  Changes made through a get_rw pointer after the sync started may or may not make it
+/// \param bs block_store object
+/// \return bool indicating success, pages that failed stay unsynced for next time
+///
+bool block_store_sync(block_store_t *const bs);
+
+///
+/// Makes the written blocks in a range durable, like block_store_sync
+///  The FBM only goes if the range covers it (block 0 up to the first data block)
+///  Whole pages are flushed, so blocks sharing a page with the range can go too
+/// \param bs block_store object
+/// \param first first block to sync
+/// \param count number of blocks to sync
+/// \return bool indicating success
+///
+bool block_store_sync_range(block_store_t *const bs, const unsigned first, const unsigned count);
+
+///
+/// Makes the written blocks in several ranges durable, like block_store_sync_range on each
+///  On a device with writeback (the file backends) that's one flush of the device for all of them
+/// \param bs block_store object
+/// \param ranges the ranges to sync, in any order
+/// \param count number of entries in ranges
+/// \return bool indicating success, nothing is synced if any range is bad
+///
+bool block_store_sync_ranges(block_store_t *const bs, const block_range_t *const ranges, const size_t count);
+
+///
+/// Counts the 4KiB pages written since they were last synced
+/// \param bs block_store object
+/// \return number of unsynced pages, 0 on error
+///
+unsigned block_store_get_unsynced_pages(const block_store_t *const bs);
+
+///
+/// Starts a thread that syncs in the background, so writeback happens a little at a time
+///  It syncs whenever more than dirty_bytes are unsynced, or when something has been unsynced for max_age_ms
+///  (checked a few times per max_age_ms). block_store_close has it do a last sync before it's stopped
+/// \param bs block_store object
+/// \param dirty_bytes how much can be unsynced before it syncs, 0 for no limit
+/// \param max_age_ms how long something can stay unsynced, 0 for no limit
+/// \return bool indicating success, false if it's already running or both limits are 0
+///
+bool block_store_enable_flusher(block_store_t *const bs, const size_t dirty_bytes, const unsigned max_age_ms);
+
+///
+/// Gets the background flusher's counters
+/// \param bs block_store object
+/// \param stats where to put them
+/// \return bool indicating success, false if there's no flusher
+///
+bool block_store_get_flusher_stats(const block_store_t *const bs, block_flusher_stats_t *const stats);
+
+///
+/// Sets the block_store up for asynchronous requests
+///  Submitting and polling belong to one thread at a time, everything else stays safe to call alongside
+/// \param bs block_store object
+/// \param depth the most requests that can be in flight (submitted and not yet polled), up to 4096
+/// \param engine what does the work
+/// \return bool indicating success, false if it's already set up or the engine isn't available
+///
+bool block_store_enable_async(block_store_t *const bs, const unsigned depth, const bs_async_t engine);
+
+///
+/// Registers a buffer region with the asynchronous engine so requests inside it skip the per-request page pinning
+///  Only one region, it stays registered until close. Can't be done with requests in flight
+/// \param bs block_store object
+/// \param buffers start of the region
+/// \param count the region's size in blocks
+/// \return bool indicating success
+///
+bool block_store_register_buffers(block_store_t *const bs, void *const buffers, const size_t count);
+
+///
+/// Queues an asynchronous read of a block, it goes out with the next poll
+///  dst has to stay put until the request comes back from block_store_poll
+/// \param bs the object to read from
+/// \param block_id the block to read
+/// \param dst the buffer to read into
+/// \param tag handed back with the completion
+/// \return bool indicating the request was queued, false on error or when depth requests are in flight
+///
+bool block_store_submit_read(block_store_t *const bs, const unsigned block_id, void *const dst, const uint64_t tag);
+
+///
+/// Queues an asynchronous write of a block, it goes out with the next poll
+///  src has to stay put until the request comes back from block_store_poll
+/// \param bs the object to write to
+/// \param block_id the block to write
+/// \param src the buffer to write from
+/// \param tag handed back with the completion
+/// \return bool indicating the request was queued, false on error or when depth requests are in flight
+///
+bool block_store_submit_write(block_store_t *const bs, const unsigned block_id, const void *const src,
+                              const uint64_t tag);
+
+///
+/// Sends off everything queued and collects finished requests
+/// \param bs block_store object
+/// \param completions where to put the finished requests
+/// \param max room in completions
+/// \param wait block until at least one request finishes (if any are in flight)
+/// \return number of completions filled in, 0 on error
+///
+size_t block_store_poll(block_store_t *const bs, block_completion_t *const completions, const size_t max,
+                        const bool wait);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,34 +1,128 @@
+#define _GNU_SOURCE  // O_DIRECT, preadv/pwritev
+
 #include "block_store.h"
 
 #include <bitmap.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define BLOCK_COUNT 65536
-#define BLOCK_SIZE 512
-#define FBM_BLOCK_COUNT 16
-#define BYTE_TOTAL ((BLOCK_COUNT) * (BLOCK_SIZE))
-#define DATA_BLOCK_BYTE_TOTAL ((65536 - (FBM_BLOCK_COUNT)) * (BLOCK_SIZE))
-#define FBM_BYTE_TOTAL ((BLOCK_SIZE) * (FBM_BLOCK_COUNT))
-#define DATA_BLOCK_START (FBM_BLOCK_COUNT)
+// The original geometry, images without a superblock are always this (FBM in blocks 0-15, data after)
+#define LEGACY_BLOCK_COUNT 65536
+#define LEGACY_BLOCK_SIZE 512
+#define LEGACY_FBM_BLOCKS 16
+
+// What block_store_create_ex takes
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+#define BLOCK_COUNT_MIN 64
+#define BLOCK_COUNT_MAX (1u << 31)
+
+// Block 0 of an image with a superblock, the FBM follows it
+// Legacy images start with FBM bits 0-15, which are always set, so the magic can't be mistaken for one
+#define SUPERBLOCK_MAGIC "bstore\0\1"
+#define SUPERBLOCK_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t fbm_blocks;
+} superblock_t;
+
+// Where things are on a particular image
+typedef struct {
+    size_t block_size;
+    unsigned block_count;
+    unsigned fbm_first;  // 0 for legacy, 1 after the superblock
+    unsigned fbm_blocks;
+    unsigned data_start;  // first block that can be allocated
+} geometry_t;
+
+// O_DIRECT wants the memory, offset and length aligned, blocks take care of the last two
+// 4KiB keeps the memory side happy on anything with bigger sectors than ours
+#define DIRECT_ALIGN 4096
+// big enough for a chunk of small blocks or one of the biggest
+#define BOUNCE_BYTES 65536
+// how many buffers one preadv/pwritev gets
+#define IOV_BLOCKS 64
+// Discards and sync tracking go in whole 4KiB pages (or whole blocks, if those are bigger)
+#define PAGE_BYTES 4096
+
+// Asynchronous requests, ASYNC_THREADS only matters when there's no io_uring
+#define ASYNC_DEPTH_MAX 4096
+#define ASYNC_THREADS 4
+
+// How often the flusher looks at the age of what's unsynced, as a fraction of the age limit
+#define FLUSHER_TICKS_PER_AGE 4
+
+typedef struct async_queue async_queue_t;
+typedef struct flusher flusher_t;
 
 
 struct block_store {
-    int fd;
+    const block_device_t *ops;
+    void *device;
+    size_t block_size;
+    unsigned block_count;
+    unsigned fbm_first;  // the FBM's first block and how many it takes up, see geometry_t
+    unsigned fbm_count;
+    unsigned data_start;
+    unsigned page_blocks;  // blocks per PAGE_BYTES, at least 1
+    unsigned page_count;
+    uint8_t *image;  // the device's memory if it has some (ops->map), NULL otherwise
     bitmap_t *fbm;
-    uint8_t *data_blocks;
+    uint8_t *fbm_blocks;  // where the FBM lives, the front of image or its own buffer when there's no image
+    uint8_t **pinned;  // no image only, per-block copies handed out by get_ro/get_rw
+    bitmap_t *writable;  // no image only, pinned blocks that were handed out writable
+    alloc_policy_t policy;
+    size_t cursor;  // where NEXT_FIT starts looking, only ever a hint so it's read and written atomically
+    bitmap_t *dirty;  // blocks handed out writable or written since the last clear
+    bitmap_t *unsynced;  // per page, written (or handed out writable) since the last sync
+    bool discard;  // give pages back to the device as they're freed
+    uint64_t reclaimed;  // bytes the device has given back to the host, atomic
+    async_queue_t *async;  // NULL until block_store_enable_async
+    flusher_t *flusher;  // NULL until block_store_enable_flusher
 };
 
-int create_file(const char *const fname) {
+static void async_destroy(async_queue_t *const q);
+static void flusher_dirtied(block_store_t *const bs);
+static void flusher_destroy(flusher_t *const f);
+
+// DEVICES
+// MMAP and RAM are one image in memory, mapped from the file or just allocated
+// PREAD and DIRECT go to the file with positional I/O every time
+
+typedef struct {
+    int fd;  // -1 for RAM
+    uint8_t *image;
+    size_t block_size;
+    size_t bytes;
+} memory_device_t;
+
+typedef struct {
+    int fd;
+    bool direct;
+    size_t block_size;
+} file_device_t;
+
+int create_file(const char *const fname, const int flags, const size_t bytes) {
     if (fname) {
-        int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
-            if (ftruncate(fd, BYTE_TOTAL) != -1) {
+            if (ftruncate(fd, (off_t) bytes) != -1) {
                 return fd;
             }
             close(fd);
@@ -36,12 +130,12 @@ int create_file(const char *const fname) {
     }
     return -1;
 }
-int check_file(const char *const fname) {
+int check_file(const char *const fname, const int flags, const size_t bytes) {
     if (fname) {
-        int fd = open(fname, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        int fd = open(fname, O_RDWR | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
         if (fd != -1) {
             struct stat file_info;
-            if (fstat(fd, &file_info) != -1 && file_info.st_size == BYTE_TOTAL) {
+            if (fstat(fd, &file_info) != -1 && (size_t) file_info.st_size == bytes) {
                 return fd;
             }
             close(fd);
@@ -50,98 +144,1620 @@ int check_file(const char *const fname) {
     return -1;
 }
 
+static bool memory_read(void *device, const unsigned block_id, void *dst, const size_t count) {
+    const memory_device_t *const memory = (const memory_device_t *) device;
+    memcpy(dst, memory->image + memory->block_size * block_id, memory->block_size * count);
+    return true;
+}
 
-block_store_t *block_store_init(const bool init, const char *const fname) {
-    if (fname) {
-        block_store_t *bs = (block_store_t *) malloc(sizeof(block_store_t));
-        if (bs) {
-            bs->fd = init ? create_file(fname) : check_file(fname);
-            if (bs->fd != -1) {
-                bs->data_blocks = (uint8_t *) mmap(NULL, BYTE_TOTAL, PROT_READ | PROT_WRITE, MAP_SHARED, bs->fd, 0);
-                if (bs->data_blocks != (uint8_t *) MAP_FAILED) {
+static bool memory_write(void *device, const unsigned block_id, const void *src, const size_t count) {
+    const memory_device_t *const memory = (const memory_device_t *) device;
+    memcpy(memory->image + memory->block_size * block_id, src, memory->block_size * count);
+    return true;
+}
+
+static void *memory_map(void *device) {
+    return ((memory_device_t *) device)->image;
+}
+
+static bool memory_flush(void *device, const unsigned first, const unsigned count) {
+    memory_device_t *const memory = (memory_device_t *) device;
+    if (memory->fd == -1) {
+        // RAM has nowhere to flush to
+        return true;
+    }
+    // msync wants page boundaries
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = first * memory->block_size / page * page;
+    const size_t end = (first + count) * memory->block_size;
+    return msync(memory->image + start, end - start, MS_SYNC) == 0;
+}
+
+// What the file takes up on disk, st_blocks is always in 512 byte units
+static int64_t allocated_bytes(const int fd) {
+    struct stat file_info;
+    return fstat(fd, &file_info) == 0 ? (int64_t) file_info.st_blocks * 512 : -1;
+}
+
+// The measured difference is what gets reported, punching a range that was never written reclaims nothing
+// Racing discards and writes can blur it a little, it's a counter not an accounting system
+static int64_t punch_hole(const int fd, const off_t offset, const off_t length) {
+    const int64_t before = allocated_bytes(fd);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) != 0) {
+        return -1;
+    }
+    const int64_t after = allocated_bytes(fd);
+    return before > after ? before - after : 0;
+}
+
+// A punched hole drops the file's pages, the mapping faults in zeros the next time they're touched
+// RAM drops its pages the same way through madvise, mincore says how many were there to drop
+// (a read of a dropped page maps the shared zero page, which mincore counts all the same)
+static int64_t memory_discard(void *device, const unsigned first, const unsigned count) {
+    memory_device_t *const memory = (memory_device_t *) device;
+    const size_t length = count * memory->block_size;
+    if (memory->fd != -1) {
+        return punch_hole(memory->fd, (off_t) (first * memory->block_size), (off_t) length);
+    }
+    uint8_t *const start = memory->image + first * memory->block_size;
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    int64_t resident = 0;
+    if ((uintptr_t) start % page == 0 && length % page == 0) {
+        unsigned char present[64];
+        for (size_t done = 0; done < length;) {
+            const size_t chunk = length - done < sizeof(present) * page ? length - done : sizeof(present) * page;
+            if (mincore(start + done, chunk, present) == 0) {
+                for (size_t i = 0; i < chunk / page; ++i) {
+                    resident += (present[i] & 1) ? (int64_t) page : 0;
+                }
+            }
+            done += chunk;
+        }
+    }
+    return madvise(start, length, MADV_DONTNEED) == 0 ? resident : -1;
+}
+
+static bool memory_advise(void *device, const unsigned first, const unsigned count, const bs_advice_t advice) {
+    memory_device_t *const memory = (memory_device_t *) device;
+    if (memory->fd == -1) {
+        // DONTNEED would zero an anonymous mapping, and there's nothing to read ahead from
+        return false;
+    }
+    static const int to_madvise[] = {MADV_NORMAL, MADV_WILLNEED, MADV_SEQUENTIAL, MADV_RANDOM, MADV_DONTNEED};
+    // madvise wants page boundaries
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t start = first * memory->block_size / page * page;
+    const size_t end = (first + count) * memory->block_size;
+    if (madvise(memory->image + start, end - start, to_madvise[advice]) != 0) {
+        return false;
+    }
+    // unmapping them doesn't get them out of the page cache, the file has to be told as well
+    return advice != BS_ADVISE_DONTNEED ||
+           posix_fadvise(memory->fd, (off_t) start, (off_t) (end - start), POSIX_FADV_DONTNEED) == 0;
+}
+
+static int memory_fd(void *device) {
+    return ((memory_device_t *) device)->fd;
+}
+
+static void memory_close(void *device) {
+    memory_device_t *const memory = (memory_device_t *) device;
+    munmap(memory->image, memory->bytes);
+    if (memory->fd != -1) {
+        close(memory->fd);
+    }
+    free(memory);
+}
+
+// fname NULL makes a RAM device
+static memory_device_t *memory_device_open(const char *const fname, const bool init, const geometry_t *const geometry) {
+    memory_device_t *memory = (memory_device_t *) calloc(1, sizeof(memory_device_t));
+    if (memory) {
+        memory->block_size = geometry->block_size;
+        memory->bytes = geometry->block_size * geometry->block_count;
+        if (!fname) {
+            memory->fd = -1;
+            // an anonymous mapping rather than calloc, it's page aligned so discard can madvise it
+            memory->image =
+                (uint8_t *) mmap(NULL, memory->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory->image != (uint8_t *) MAP_FAILED) {
+                return memory;
+            }
+        } else {
+            memory->fd = init ? create_file(fname, 0, memory->bytes) : check_file(fname, 0, memory->bytes);
+            if (memory->fd != -1) {
+                memory->image =
+                    (uint8_t *) mmap(NULL, memory->bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memory->fd, 0);
+                if (memory->image != (uint8_t *) MAP_FAILED) {
                     // Woo hoo! Done. Mostly. Kinda.
-                    if (init) {
-                        // init FBM and wipe remaining data
-                        // Could/should be done in create_file
-                        // but it's so much easier here...
-                        memset(bs->data_blocks, 0xFF, FBM_BLOCK_COUNT >> 3);
-                        memset(bs->data_blocks + FBM_BYTE_TOTAL, 0x00, DATA_BLOCK_BYTE_TOTAL);
+                    // create_file truncated it, so a new image already reads back as zeros without a page
+                    // being touched (wiping it here would fault in and dirty all of it and un-sparse the file)
+                    // No madvise up front, the FBM is two pages and faulted in once. Whoever knows how the data
+                    // will be read says so with block_store_advise
+                    return memory;
+                }
+                close(memory->fd);
+            }
+        }
+        free(memory);
+    }
+    return NULL;
+}
+
+// pread/pwrite can come up short or get interrupted, these keep at it until it's all moved
+static bool pread_all(const int fd, uint8_t *dst, size_t size, off_t offset) {
+    while (size) {
+        const ssize_t moved = pread(fd, dst, size, offset);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return false;
+        }
+        dst += moved;
+        size -= moved;
+        offset += moved;
+    }
+    return true;
+}
+
+static bool pwrite_all(const int fd, const uint8_t *src, size_t size, off_t offset) {
+    while (size) {
+        const ssize_t moved = pwrite(fd, src, size, offset);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved <= 0) {
+            return false;
+        }
+        src += moved;
+        size -= moved;
+        offset += moved;
+    }
+    return true;
+}
+
+// Unaligned buffers can't be handed to O_DIRECT, they go through an aligned bounce buffer a chunk at a time
+static bool file_read(void *device, const unsigned block_id, void *dst, const size_t count) {
+    const file_device_t *const file = (const file_device_t *) device;
+    const size_t block_size = file->block_size;
+    off_t offset = (off_t) (block_id * block_size);
+    if (!file->direct || (uintptr_t) dst % DIRECT_ALIGN == 0) {
+        return pread_all(file->fd, (uint8_t *) dst, count * block_size, offset);
+    }
+    uint8_t bounce[BOUNCE_BYTES] __attribute__((aligned(DIRECT_ALIGN)));
+    const size_t bounce_blocks = BOUNCE_BYTES / block_size;
+    uint8_t *out = (uint8_t *) dst;
+    for (size_t left = count; left;) {
+        const size_t chunk = left < bounce_blocks ? left : bounce_blocks;
+        if (!pread_all(file->fd, bounce, chunk * block_size, offset)) {
+            return false;
+        }
+        memcpy(out, bounce, chunk * block_size);
+        out += chunk * block_size;
+        offset += chunk * block_size;
+        left -= chunk;
+    }
+    return true;
+}
+
+static bool file_write(void *device, const unsigned block_id, const void *src, const size_t count) {
+    const file_device_t *const file = (const file_device_t *) device;
+    const size_t block_size = file->block_size;
+    off_t offset = (off_t) (block_id * block_size);
+    if (!file->direct || (uintptr_t) src % DIRECT_ALIGN == 0) {
+        return pwrite_all(file->fd, (const uint8_t *) src, count * block_size, offset);
+    }
+    uint8_t bounce[BOUNCE_BYTES] __attribute__((aligned(DIRECT_ALIGN)));
+    const size_t bounce_blocks = BOUNCE_BYTES / block_size;
+    const uint8_t *in = (const uint8_t *) src;
+    for (size_t left = count; left;) {
+        const size_t chunk = left < bounce_blocks ? left : bounce_blocks;
+        memcpy(bounce, in, chunk * block_size);
+        if (!pwrite_all(file->fd, bounce, chunk * block_size, offset)) {
+            return false;
+        }
+        in += chunk * block_size;
+        offset += chunk * block_size;
+        left -= chunk;
+    }
+    return true;
+}
+
+// Consecutive block ids become one preadv however scattered the buffers are
+// preadv only gets what it can take whole, anything else (short transfers, unaligned O_DIRECT buffers)
+// goes a block at a time through file_read
+static bool file_readv(void *device, const block_read_vec_t *vec, size_t count) {
+    const file_device_t *const file = (const file_device_t *) device;
+    struct iovec iov[IOV_BLOCKS];
+    while (count) {
+        size_t run = 0;
+        while (run < count && run < IOV_BLOCKS && vec[run].block_id == vec->block_id + run &&
+               (!file->direct || (uintptr_t) vec[run].dst % DIRECT_ALIGN == 0)) {
+            iov[run] = (struct iovec){vec[run].dst, file->block_size};
+            ++run;
+        }
+        const ssize_t moved = run > 1 ? preadv(file->fd, iov, run, (off_t) (vec->block_id * file->block_size)) : 0;
+        run = run ? run : 1;
+        for (size_t i = moved > 0 ? (size_t) moved / file->block_size : 0; i < run; ++i) {
+            if (!file_read(device, vec[i].block_id, vec[i].dst, 1)) {
+                return false;
+            }
+        }
+        vec += run;
+        count -= run;
+    }
+    return true;
+}
+
+static bool file_writev(void *device, const block_write_vec_t *vec, size_t count) {
+    const file_device_t *const file = (const file_device_t *) device;
+    struct iovec iov[IOV_BLOCKS];
+    while (count) {
+        size_t run = 0;
+        while (run < count && run < IOV_BLOCKS && vec[run].block_id == vec->block_id + run &&
+               (!file->direct || (uintptr_t) vec[run].src % DIRECT_ALIGN == 0)) {
+            // iovec isn't const, pwritev doesn't write through it
+            iov[run] = (struct iovec){(void *) vec[run].src, file->block_size};
+            ++run;
+        }
+        const ssize_t moved = run > 1 ? pwritev(file->fd, iov, run, (off_t) (vec->block_id * file->block_size)) : 0;
+        run = run ? run : 1;
+        for (size_t i = moved > 0 ? (size_t) moved / file->block_size : 0; i < run; ++i) {
+            if (!file_write(device, vec[i].block_id, vec[i].src, 1)) {
+                return false;
+            }
+        }
+        vec += run;
+        count -= run;
+    }
+    return true;
+}
+
+static bool file_flush(void *device, const unsigned first, const unsigned count) {
+    // there's no durable way to sync just part of a file, the range is all we'd have liked to do
+    (void) first;
+    (void) count;
+    return fdatasync(((file_device_t *) device)->fd) == 0;
+}
+
+static bool file_writeback(void *device, const unsigned first, const unsigned count) {
+    // only starts the writes, the fdatasync in file_flush waits for them and makes them (and the metadata) durable
+    const file_device_t *const file = (const file_device_t *) device;
+    return sync_file_range(file->fd, (off_t) (first * file->block_size), (off_t) (count * file->block_size),
+                           SYNC_FILE_RANGE_WRITE) == 0;
+}
+
+static int64_t file_discard(void *device, const unsigned first, const unsigned count) {
+    const file_device_t *const file = (const file_device_t *) device;
+    return punch_hole(file->fd, (off_t) (first * file->block_size), (off_t) (count * file->block_size));
+}
+
+static bool file_advise(void *device, const unsigned first, const unsigned count, const bs_advice_t advice) {
+    static const int to_fadvise[] = {POSIX_FADV_NORMAL, POSIX_FADV_WILLNEED, POSIX_FADV_SEQUENTIAL,
+                                     POSIX_FADV_RANDOM, POSIX_FADV_DONTNEED};
+    const file_device_t *const file = (const file_device_t *) device;
+    return posix_fadvise(file->fd, (off_t) (first * file->block_size), (off_t) (count * file->block_size),
+                         to_fadvise[advice]) == 0;
+}
+
+static int file_fd(void *device) {
+    return ((file_device_t *) device)->fd;
+}
+
+static void file_close(void *device) {
+    close(((file_device_t *) device)->fd);
+    free(device);
+}
+
+static file_device_t *file_device_open(const char *const fname, const bool init, const bool direct,
+                                       const geometry_t *const geometry) {
+    file_device_t *file = (file_device_t *) calloc(1, sizeof(file_device_t));
+    if (file) {
+        file->direct = direct;
+        file->block_size = geometry->block_size;
+        const int flags = direct ? O_DIRECT : 0;
+        const size_t bytes = geometry->block_size * geometry->block_count;
+        // a freshly truncated file already reads back as zeros, nothing needs wiping
+        file->fd = init ? create_file(fname, flags, bytes) : check_file(fname, flags, bytes);
+        if (file->fd != -1) {
+            return file;
+        }
+        free(file);
+    }
+    return NULL;
+}
+
+// msync already goes page by page, a run at a time is no worse than all of them at once
+static const block_device_t memory_device = {memory_read, memory_write, NULL, NULL, memory_map, memory_flush, NULL,
+                                             NULL, NULL, memory_discard, memory_advise, memory_fd, 0, memory_close};
+static const block_device_t file_device = {file_read, file_write, file_readv, file_writev, NULL, file_flush,
+                                           file_writeback, NULL, NULL, file_discard, file_advise, file_fd, 0,
+                                           file_close};
+// O_DIRECT skips the page cache, so there's nothing for a hint to do
+static const block_device_t direct_device = {file_read, file_write, file_readv, file_writev, NULL, file_flush,
+                                             file_writeback, NULL, NULL, file_discard, NULL, file_fd, DIRECT_ALIGN,
+                                             file_close};
+
+// A device with no image has nothing for get_ro/get_rw to point into, so a block gets its own copy
+// the first time someone asks and keeps it until close. Reads and writes of that block use the copy from then on.
+static uint8_t *pin_block(const block_store_t *const bs, const unsigned block_id) {
+    uint8_t *block = __atomic_load_n(&bs->pinned[block_id], __ATOMIC_ACQUIRE);
+    if (!block) {
+        void *fresh = NULL;
+        if (posix_memalign(&fresh, DIRECT_ALIGN, bs->block_size) || !bs->ops->read(bs->device, block_id, fresh, 1)) {
+            free(fresh);
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&bs->pinned[block_id], &block, fresh, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            block = fresh;
+        } else {
+            // someone else pinned it first, block has theirs now
+            free(fresh);
+        }
+    }
+    return block;
+}
+
+// No image, so only the FBM (and whatever gets pinned) is kept in memory
+// The FBM is read in here and written back on close
+static bool load_fbm(block_store_t *const bs, const bool format) {
+    void *fbm_blocks = NULL;
+    if (posix_memalign(&fbm_blocks, DIRECT_ALIGN, bs->fbm_count * bs->block_size) == 0) {
+        bs->fbm_blocks = (uint8_t *) fbm_blocks;
+        bs->pinned = (uint8_t **) calloc(bs->block_count, sizeof(uint8_t *));
+        bs->writable = bitmap_create(bs->block_count);
+        if (bs->pinned && bs->writable && bitmap_enable_atomic(bs->writable)) {
+            return format || bs->ops->read(bs->device, bs->fbm_first, bs->fbm_blocks, bs->fbm_count);
+        }
+    }
+    return false;
+}
+
+static void drop_copies(block_store_t *const bs) {
+    if (!bs->image) {
+        if (bs->pinned) {
+            for (size_t i = 0; i < bs->block_count; ++i) {
+                free(bs->pinned[i]);
+            }
+            free(bs->pinned);
+        }
+        bitmap_destroy(bs->writable);
+        free(bs->fbm_blocks);
+    }
+}
+
+static const geometry_t legacy_geometry = {LEGACY_BLOCK_SIZE, LEGACY_BLOCK_COUNT, 0, LEGACY_FBM_BLOCKS,
+                                           LEGACY_FBM_BLOCKS};
+
+// Returns false for anything block_store_create_ex wouldn't make
+static bool make_geometry(geometry_t *const geometry, const size_t block_size, const size_t block_count) {
+    if (block_size < BLOCK_SIZE_MIN || block_size > BLOCK_SIZE_MAX || (block_size & (block_size - 1)) ||
+        block_count < BLOCK_COUNT_MIN || block_count > BLOCK_COUNT_MAX || block_count % 8) {
+        return false;
+    }
+    geometry->block_size = block_size;
+    geometry->block_count = (unsigned) block_count;
+    geometry->fbm_first = 1;
+    geometry->fbm_blocks = (unsigned) ((block_count / 8 + block_size - 1) / block_size);
+    geometry->data_start = 1 + geometry->fbm_blocks;
+    return true;
+}
+
+// Reads the geometry off an existing image: the superblock if there is one, legacy if it's the legacy size
+static bool probe_geometry(const char *const fname, geometry_t *const geometry) {
+    bool found = false;
+    const int fd = fname ? open(fname, O_RDONLY) : -1;
+    if (fd != -1) {
+        superblock_t superblock;
+        struct stat file_info;
+        if (fstat(fd, &file_info) == 0 && pread_all(fd, (uint8_t *) &superblock, sizeof(superblock), 0)) {
+            if (memcmp(superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic)) == 0) {
+                found = superblock.version == SUPERBLOCK_VERSION &&
+                        make_geometry(geometry, superblock.block_size, superblock.block_count) &&
+                        geometry->fbm_blocks == superblock.fbm_blocks;
+            } else if (file_info.st_size == (off_t) LEGACY_BLOCK_SIZE * LEGACY_BLOCK_COUNT) {
+                *geometry = legacy_geometry;
+                found = true;
+            }
+        }
+        close(fd);
+    }
+    return found;
+}
+
+// Block 0 of a fresh image, only for geometries that have one
+static bool write_superblock(block_store_t *const bs) {
+    void *block = NULL;
+    if (posix_memalign(&block, DIRECT_ALIGN, bs->block_size) == 0) {
+        memset(block, 0x00, bs->block_size);
+        superblock_t superblock = {.version = SUPERBLOCK_VERSION,
+                                   .block_size = (uint32_t) bs->block_size,
+                                   .block_count = bs->block_count,
+                                   .fbm_blocks = bs->fbm_count};
+        memcpy(superblock.magic, SUPERBLOCK_MAGIC, sizeof(superblock.magic));
+        memcpy(block, &superblock, sizeof(superblock));
+        bool written = true;
+        if (bs->image) {
+            memcpy(bs->image, block, bs->block_size);
+        } else {
+            written = bs->ops->write(bs->device, 0, block, 1);
+        }
+        free(block);
+        return written;
+    }
+    return false;
+}
+
+static block_store_t *attach_geometry(const block_device_t *const ops, void *const device, const bool format,
+                                      const geometry_t *const geometry) {
+    if (ops && ops->read && ops->write && ops->flush && ops->close) {
+        block_store_t *bs = (block_store_t *) calloc(1, sizeof(block_store_t));
+        if (bs) {
+            bs->ops = ops;
+            bs->device = device;
+            bs->block_size = geometry->block_size;
+            bs->block_count = geometry->block_count;
+            bs->fbm_first = geometry->fbm_first;
+            bs->fbm_count = geometry->fbm_blocks;
+            bs->data_start = geometry->data_start;
+            bs->page_blocks = bs->block_size < PAGE_BYTES ? (unsigned) (PAGE_BYTES / bs->block_size) : 1;
+            bs->page_count = (bs->block_count + bs->page_blocks - 1) / bs->page_blocks;
+            bs->policy = BS_FIRST_FIT;
+            bs->cursor = 0;
+            bs->image = ops->map ? (uint8_t *) ops->map(device) : NULL;
+            bs->fbm_blocks = bs->image ? bs->image + bs->fbm_first * bs->block_size : NULL;
+            if (bs->image || load_fbm(bs, format)) {
+                if (format) {
+                    memset(bs->fbm_blocks, 0x00, bs->fbm_count * bs->block_size);
+                }
+                bs->fbm = bitmap_overlay(bs->block_count, bs->fbm_blocks);
+                if (bs->fbm && (!format || !bs->fbm_first || write_superblock(bs))) {
+                    if (format) {
+                        // the superblock and FBM blocks are always in use
+                        bitmap_set_range(bs->fbm, 0, bs->data_start);
                     }
-                    // Not quite sure what to do with madvise
-                    // Honestly, I feel like a split mapping may be best
-                    // Sequential for the FBM, random for the data
-                    // but I'll just not mess with it unless I get the time to profile them
-                    // madvise()
-                    bs->fbm = bitmap_overlay(BLOCK_COUNT, bs->data_blocks);
-                    if (bs->fbm) {
-                        return bs;
+                    // Keeps allocation a handful of word probes however full the FBM gets
+                    // and the free count a field read instead of an 8KiB popcount
+                    // Atomic goes last, it makes allocate/request/release safe to call from any thread
+                    if (bitmap_enable_summary(bs->fbm) && bitmap_enable_count(bs->fbm) &&
+                        bitmap_enable_atomic(bs->fbm)) {
+                        // nothing is dirty until someone gets a writable pointer or writes
+                        bs->dirty = bitmap_create(bs->block_count);
+                        bs->unsynced = bitmap_create(bs->page_count);
+                        if (bs->dirty && bs->unsynced) {
+                            if (bitmap_enable_count(bs->dirty) && bitmap_enable_atomic(bs->dirty) &&
+                                bitmap_enable_count(bs->unsynced) && bitmap_enable_atomic(bs->unsynced)) {
+                                return bs;
+                            }
+                        }
+                        bitmap_destroy(bs->unsynced);
+                        bitmap_destroy(bs->dirty);
                     }
-                    munmap(bs->data_blocks, BYTE_TOTAL);
                 }
-                close(bs->fd);
+                bitmap_destroy(bs->fbm);
             }
+            drop_copies(bs);
             free(bs);
         }
     }
     return NULL;
 }
 
+block_store_t *block_store_attach(const block_device_t *const ops, void *const device, const bool format) {
+    return attach_geometry(ops, device, format, &legacy_geometry);
+}
+
+// geometry is what to create, NULL to use whatever the image was created with
+block_store_t *block_store_init(const bool init, const char *const fname, const bs_backend_t backend,
+                                const geometry_t *geometry) {
+    geometry_t found;
+    if (!geometry) {
+        if (init) {
+            geometry = &legacy_geometry;
+        } else if (probe_geometry(fname, &found)) {
+            geometry = &found;
+        } else {
+            return NULL;
+        }
+    }
+    const block_device_t *ops = NULL;
+    void *device = NULL;
+    if (backend == BS_BACKEND_MMAP && fname) {
+        ops = &memory_device;
+        device = memory_device_open(fname, init, geometry);
+    } else if (backend == BS_BACKEND_RAM && init) {
+        // nothing to open, a RAM image is gone once it's closed
+        ops = &memory_device;
+        device = memory_device_open(NULL, true, geometry);
+    } else if (backend == BS_BACKEND_PREAD || backend == BS_BACKEND_DIRECT) {
+        ops = backend == BS_BACKEND_DIRECT ? &direct_device : &file_device;
+        device = file_device_open(fname, init, backend == BS_BACKEND_DIRECT, geometry);
+    }
+    if (device) {
+        block_store_t *bs = attach_geometry(ops, device, init, geometry);
+        if (bs) {
+            return bs;
+        }
+        ops->close(device);
+    }
+    return NULL;
+}
+
 block_store_t *block_store_create(const char *const fname) {
-    return block_store_init(true, fname);
+    return block_store_init(true, fname, BS_BACKEND_MMAP, NULL);
+}
+
+block_store_t *block_store_create_ex(const char *const fname, const size_t block_size, const size_t block_count) {
+    return block_store_create_ex_backend(fname, block_size, block_count, BS_BACKEND_MMAP);
 }
 
 block_store_t *block_store_open(const char *const fname) {
-    return block_store_init(false, fname);
+    return block_store_init(false, fname, BS_BACKEND_MMAP, NULL);
+}
+
+block_store_t *block_store_create_backend(const char *const fname, const bs_backend_t backend) {
+    return block_store_init(true, fname, backend, NULL);
+}
+
+block_store_t *block_store_create_ex_backend(const char *const fname, const size_t block_size,
+                                             const size_t block_count, const bs_backend_t backend) {
+    geometry_t geometry;
+    return make_geometry(&geometry, block_size, block_count) ? block_store_init(true, fname, backend, &geometry)
+                                                             : NULL;
+}
+
+block_store_t *block_store_open_backend(const char *const fname, const bs_backend_t backend) {
+    return block_store_init(false, fname, backend, NULL);
 }
 
 void block_store_close(block_store_t *const bs) {
     if (bs) {
+        // anything still in flight finishes first, the results go nowhere
+        async_destroy(bs->async);
+        // then the flusher gets one last pass before it's stopped
+        flusher_destroy(bs->flusher);
+        if (!bs->image) {
+            // without an image we hold the FBM and anything handed out writable, they go back to the device now
+            bitmap_iter_t iter;
+            bitmap_iter_init(&iter, bs->writable, 0);
+            for (size_t block = bitmap_iter_next_set(&iter); block != SIZE_MAX; block = bitmap_iter_next_set(&iter)) {
+                bs->ops->write(bs->device, block, bs->pinned[block], 1);
+            }
+            bs->ops->write(bs->device, bs->fbm_first, bs->fbm_blocks, bs->fbm_count);
+        }
+        bitmap_destroy(bs->unsynced);
+        bitmap_destroy(bs->dirty);
         bitmap_destroy(bs->fbm);
-        munmap(bs->data_blocks, BYTE_TOTAL);
-        close(bs->fd);
+        drop_copies(bs);
+        bs->ops->close(bs->device);
         free(bs);
     }
 }
 
+// Sparse is the default, this is for when running out of disk halfway through a write isn't acceptable
+// Mode 0 fallocate hands out zeroed (unwritten) extents, the data isn't actually written
+bool block_store_preallocate(block_store_t *const bs) {
+    if (bs && bs->ops->fd) {
+        const int fd = bs->ops->fd(bs->device);
+        return fd != -1 && fallocate(fd, 0, 0, (off_t) (bs->block_size * bs->block_count)) == 0;
+    }
+    return false;
+}
+
+// Finding and setting happen in one step (bitmap_claim_zero) so racing threads never get the same block
 unsigned block_store_allocate(block_store_t *const bs) {
     if (bs) {
-        size_t free_block = bitmap_ffz(bs->fbm);
+        size_t free_block;
+        if (bs->policy == BS_NEXT_FIT) {
+            const size_t cursor = __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED);
+            free_block = bitmap_claim_zero(bs->fbm, cursor);
+            if (free_block == SIZE_MAX && cursor) {
+                // wrap around
+                free_block = bitmap_claim_zero(bs->fbm, 0);
+            }
+        } else {
+            free_block = bitmap_claim_zero(bs->fbm, 0);
+        }
         if (free_block != SIZE_MAX) {
-            bitmap_set(bs->fbm, free_block);
+            __atomic_store_n(&bs->cursor, free_block + 1 < bs->block_count ? free_block + 1 : 0, __ATOMIC_RELAXED);
+            if (bs->ops->allocated) {
+                bs->ops->allocated(bs->device, free_block, 1);
+            }
             return free_block;
         }
     }
     return 0;
 }
 
+bool block_store_allocate_run(block_store_t *const bs, const unsigned count, unsigned *const first) {
+    if (bs && first && count && count <= bs->block_count) {
+        const size_t start = bs->policy == BS_NEXT_FIT ? __atomic_load_n(&bs->cursor, __ATOMIC_RELAXED) : 0;
+        size_t run = bitmap_find_zero_run(bs->fbm, start, count);
+        if (run == SIZE_MAX && start) {
+            run = bitmap_find_zero_run(bs->fbm, 0, count);
+        }
+        while (run != SIZE_MAX) {
+            // Someone else can grab part of the run between finding and taking it,
+            // so take it a block at a time and give it all back if that happens
+            size_t block = run;
+            while (block < run + count && !bitmap_test_and_set(bs->fbm, block)) {
+                ++block;
+            }
+            if (block == run + count) {
+                __atomic_store_n(&bs->cursor, run + count < bs->block_count ? run + count : 0, __ATOMIC_RELAXED);
+                *first = run;
+                if (bs->ops->allocated) {
+                    bs->ops->allocated(bs->device, run, count);
+                }
+                return true;
+            }
+            if (block > run) {
+                bitmap_reset_range(bs->fbm, run, block - run);
+            }
+            run = bitmap_find_zero_run(bs->fbm, block, count);
+            if (run == SIZE_MAX && start) {
+                run = bitmap_find_zero_run(bs->fbm, 0, count);
+            }
+        }
+    }
+    return false;
+}
+
+unsigned block_store_allocate_near(block_store_t *const bs, const unsigned goal) {
+    if (bs) {
+        if (goal >= bs->data_start && goal < bs->block_count) {
+            size_t free_block = bitmap_claim_zero(bs->fbm, goal);
+            if (free_block != SIZE_MAX) {
+                if (bs->ops->allocated) {
+                    bs->ops->allocated(bs->device, free_block, 1);
+                }
+                return free_block;
+            }
+        }
+        return block_store_allocate(bs);
+    }
+    return 0;
+}
+
+bool block_store_set_alloc_policy(block_store_t *const bs, const alloc_policy_t policy) {
+    if (bs && (policy == BS_FIRST_FIT || policy == BS_NEXT_FIT)) {
+        bs->policy = policy;
+        return true;
+    }
+    return false;
+}
+
 bool block_store_request(block_store_t *const bs, const unsigned block_id) {
-    if (bs && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT) {
-        if (!bitmap_test(bs->fbm, block_id)) {
-            bitmap_set(bs->fbm, block_id);
+    if (bs && block_id >= bs->data_start && block_id < bs->block_count) {
+        if (!bitmap_test_and_set(bs->fbm, block_id)) {
+            if (bs->ops->allocated) {
+                bs->ops->allocated(bs->device, block_id, 1);
+            }
             return true;
         }
     }
     return false;
 }
 
+// DISCARD
+// Freed blocks only go back to the host a whole page at a time. A page that still has a block in use waits
+// until its last one is released (or a trim comes along), so the FBM itself is the batch.
+
+// Takes a free page out from under the allocators so nothing lands in it mid punch
+static bool claim_page(block_store_t *const bs, const unsigned first) {
+    for (unsigned i = 0; i < bs->page_blocks; ++i) {
+        if (bitmap_test_and_set(bs->fbm, first + i)) {
+            // someone got there first, put back what we took
+            bitmap_reset_range(bs->fbm, first, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void discard_claimed(block_store_t *const bs, const unsigned first, const unsigned count) {
+    if (count) {
+        const int64_t reclaimed = bs->ops->discard(bs->device, first, count);
+        if (reclaimed > 0) {
+            __atomic_add_fetch(&bs->reclaimed, (uint64_t) reclaimed, __ATOMIC_RELAXED);
+        }
+        if (bs->writable) {
+            // what's pinned there is garbage now, close writing it back would just undo the punch
+            bitmap_reset_range(bs->writable, first, count);
+        }
+        bitmap_reset_range(bs->fbm, first, count);
+    }
+}
+
+// Discards every free page that overlaps the range, runs of them go down as one call
+static void discard_free_pages(block_store_t *const bs, const unsigned first, const unsigned count) {
+    const unsigned end = (first + count + bs->page_blocks - 1) / bs->page_blocks * bs->page_blocks;
+    unsigned run = first / bs->page_blocks * bs->page_blocks, claimed = 0;
+    for (unsigned page = run; page < end; page += bs->page_blocks) {
+        if (!bitmap_test_range_any(bs->fbm, page, bs->page_blocks) && claim_page(bs, page)) {
+            claimed += bs->page_blocks;
+        } else {
+            discard_claimed(bs, run, claimed);
+            run = page + bs->page_blocks;
+            claimed = 0;
+        }
+    }
+    discard_claimed(bs, run, claimed);
+}
+
+bool block_store_set_discard(block_store_t *const bs, const bool enable) {
+    if (bs && bs->ops->discard) {
+        __atomic_store_n(&bs->discard, enable, __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
+uint64_t block_store_trim(block_store_t *const bs) {
+    if (bs && bs->ops->discard) {
+        const uint64_t before = __atomic_load_n(&bs->reclaimed, __ATOMIC_RELAXED);
+        discard_free_pages(bs, bs->data_start, bs->block_count - bs->data_start);
+        return __atomic_load_n(&bs->reclaimed, __ATOMIC_RELAXED) - before;
+    }
+    return 0;
+}
+
+uint64_t block_store_get_reclaimed_bytes(const block_store_t *const bs) {
+    if (bs) {
+        return __atomic_load_n(&bs->reclaimed, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
 void block_store_release(block_store_t *const bs, const unsigned block_id) {
-    if (bs && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT) {
+    if (bs && block_id >= bs->data_start && block_id < bs->block_count) {
         bitmap_reset(bs->fbm, block_id);
+        if (bs->ops->released) {
+            bs->ops->released(bs->device, block_id, 1);
+        }
+        if (__atomic_load_n(&bs->discard, __ATOMIC_RELAXED)) {
+            discard_free_pages(bs, block_id, 1);
+        }
+    }
+}
+
+void block_store_release_range(block_store_t *const bs, const unsigned first, const unsigned count) {
+    if (bs && first >= bs->data_start && first < bs->block_count && count <= bs->block_count - first) {
+        bitmap_reset_range(bs->fbm, first, count);
+        if (bs->ops->released && count) {
+            bs->ops->released(bs->device, first, count);
+        }
+        if (__atomic_load_n(&bs->discard, __ATOMIC_RELAXED) && count) {
+            discard_free_pages(bs, first, count);
+        }
     }
 }
 
+unsigned block_store_get_free_blocks(const block_store_t *const bs) {
+    if (bs) {
+        return bs->block_count - bitmap_total_set(bs->fbm);
+    }
+    return 0;
+}
+
+size_t block_store_get_block_size(const block_store_t *const bs) {
+    return bs ? bs->block_size : 0;
+}
+
+unsigned block_store_get_block_count(const block_store_t *const bs) {
+    return bs ? bs->block_count : 0;
+}
+
+unsigned block_store_get_first_data_block(const block_store_t *const bs) {
+    return bs ? bs->data_start : 0;
+}
+
 bool block_store_read(block_store_t *const bs, const unsigned block_id, void *const dst) {
-    if (bs && dst && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT /* && bitmap_set(bs->fbm,block_id) */) {
-        memcpy(dst, bs->data_blocks + (BLOCK_SIZE * block_id), BLOCK_SIZE);
+    if (bs && dst && block_id >= bs->data_start && block_id < bs->block_count /* && bitmap_set(bs->fbm,block_id) */) {
+        if (bs->pinned) {
+            const uint8_t *pinned = __atomic_load_n(&bs->pinned[block_id], __ATOMIC_ACQUIRE);
+            if (pinned) {
+                memcpy(dst, pinned, bs->block_size);
+                return true;
+            }
+        }
+        return bs->ops->read(bs->device, block_id, dst, 1);
+    }
+    return false;
+}
+
+bool block_store_read_range(block_store_t *const bs, const unsigned first, const unsigned count, void *const dst) {
+    if (bs && dst && count && first >= bs->data_start && first < bs->block_count && count <= bs->block_count - first) {
+        if (!bs->ops->read(bs->device, first, dst, count)) {
+            return false;
+        }
+        // pinned blocks are newer than the device, same as readv
+        if (bs->pinned) {
+            for (unsigned i = 0; i < count; ++i) {
+                const uint8_t *pinned = __atomic_load_n(&bs->pinned[first + i], __ATOMIC_ACQUIRE);
+                if (pinned) {
+                    memcpy((uint8_t *) dst + bs->block_size * i, pinned, bs->block_size);
+                }
+            }
+        }
         return true;
     }
     return false;
 }
 
+// Dirty is per block and belongs to whoever calls clear_dirty, unsynced is per page and belongs to sync
+static void mark_dirty(block_store_t *const bs, const unsigned first, const unsigned count) {
+    bitmap_set_range(bs->dirty, first, count);
+    const unsigned first_page = first / bs->page_blocks;
+    bitmap_set_range(bs->unsynced, first_page, (first + count - 1) / bs->page_blocks - first_page + 1);
+    if (__atomic_load_n(&bs->flusher, __ATOMIC_ACQUIRE)) {
+        flusher_dirtied(bs);
+    }
+}
 
 bool block_store_write(block_store_t *const bs, const unsigned block_id, const void *const src) {
-    if (bs && src && block_id >= DATA_BLOCK_START && block_id <= BLOCK_COUNT /* && bitmap_set(bs->fbm,block_id) */) {
-        memcpy(bs->data_blocks + (BLOCK_SIZE * block_id), src, BLOCK_SIZE);
+    if (bs && src && block_id >= bs->data_start && block_id < bs->block_count /* && bitmap_set(bs->fbm,block_id) */) {
+        if (bs->pinned) {
+            // pinned copies are written through so the device never falls behind them
+            uint8_t *pinned = __atomic_load_n(&bs->pinned[block_id], __ATOMIC_ACQUIRE);
+            if (pinned) {
+                memcpy(pinned, src, bs->block_size);
+            }
+        }
+        if (bs->ops->write(bs->device, block_id, src, 1)) {
+            mark_dirty(bs, block_id, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs of adjacent blocks going to/from adjacent buffers become one device call (one memcpy for an image)
+// unless the device takes the whole vector itself
+// Everything is checked before anything is copied so a bad entry can't leave half a transfer behind
+bool block_store_readv(block_store_t *const bs, const block_read_vec_t *const vec, const size_t count) {
+    if (bs && vec && count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!vec[i].dst || vec[i].block_id < bs->data_start || vec[i].block_id >= bs->block_count) {
+                return false;
+            }
+        }
+        if (bs->ops->readv) {
+            if (!bs->ops->readv(bs->device, vec, count)) {
+                return false;
+            }
+        } else {
+            for (size_t i = 0, run; i < count; i += run) {
+                run = 1;
+                while (i + run < count && vec[i + run].block_id == vec[i].block_id + run &&
+                       (uint8_t *) vec[i + run].dst == (uint8_t *) vec[i].dst + bs->block_size * run) {
+                    ++run;
+                }
+                if (!bs->ops->read(bs->device, vec[i].block_id, vec[i].dst, run)) {
+                    return false;
+                }
+            }
+        }
+        if (bs->pinned) {
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t *pinned = __atomic_load_n(&bs->pinned[vec[i].block_id], __ATOMIC_ACQUIRE);
+                if (pinned) {
+                    memcpy(vec[i].dst, pinned, bs->block_size);
+                }
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+bool block_store_writev(block_store_t *const bs, const block_write_vec_t *const vec, const size_t count) {
+    if (bs && vec && count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!vec[i].src || vec[i].block_id < bs->data_start || vec[i].block_id >= bs->block_count) {
+                return false;
+            }
+        }
+        if (bs->pinned) {
+            for (size_t i = 0; i < count; ++i) {
+                uint8_t *pinned = __atomic_load_n(&bs->pinned[vec[i].block_id], __ATOMIC_ACQUIRE);
+                if (pinned) {
+                    memcpy(pinned, vec[i].src, bs->block_size);
+                }
+            }
+        }
+        if (bs->ops->writev) {
+            if (!bs->ops->writev(bs->device, vec, count)) {
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                mark_dirty(bs, vec[i].block_id, 1);
+            }
+            return true;
+        }
+        for (size_t i = 0, run; i < count; i += run) {
+            run = 1;
+            while (i + run < count && vec[i + run].block_id == vec[i].block_id + run &&
+                   (const uint8_t *) vec[i + run].src == (const uint8_t *) vec[i].src + bs->block_size * run) {
+                ++run;
+            }
+            if (!bs->ops->write(bs->device, vec[i].block_id, vec[i].src, run)) {
+                return false;
+            }
+            mark_dirty(bs, vec[i].block_id, run);
+        }
+        return true;
+    }
+    return false;
+}
+
+// The pointers go straight into the device's image, nothing gets copied (without an image a copy gets pinned)
+// They stay good until the block_store is closed
+const void *block_store_get_ro(const block_store_t *const bs, const unsigned block_id) {
+    if (bs && block_id >= bs->data_start && block_id < bs->block_count) {
+        if (bs->image) {
+            return bs->image + (bs->block_size * block_id);
+        }
+        return pin_block(bs, block_id);
+    }
+    return NULL;
+}
+
+void *block_store_get_rw(block_store_t *const bs, const unsigned block_id) {
+    if (bs && block_id >= bs->data_start && block_id < bs->block_count) {
+        uint8_t *block = bs->image ? bs->image + (bs->block_size * block_id) : pin_block(bs, block_id);
+        if (block) {
+            // marked up front, we can't see when the caller actually writes
+            mark_dirty(bs, block_id, 1);
+            if (!bs->image) {
+                bitmap_set(bs->writable, block_id);
+            }
+        }
+        return block;
+    }
+    return NULL;
+}
+
+bool block_store_is_dirty(const block_store_t *const bs, const unsigned block_id) {
+    if (bs && block_id < bs->block_count) {
+        return bitmap_test(bs->dirty, block_id);
+    }
+    return false;
+}
+
+unsigned block_store_get_dirty_blocks(const block_store_t *const bs) {
+    if (bs) {
+        return bitmap_total_set(bs->dirty);
+    }
+    return 0;
+}
+
+void block_store_clear_dirty(block_store_t *const bs) {
+    if (bs) {
+        bitmap_reset_range(bs->dirty, 0, bs->block_count);
+    }
+}
+
+bool block_store_advise(block_store_t *const bs, const unsigned first, const unsigned count,
+                        const bs_advice_t advice) {
+    if (bs && bs->ops->advise && count && first < bs->block_count && count <= bs->block_count - first &&
+        advice >= BS_ADVISE_NORMAL && advice <= BS_ADVISE_DONTNEED) {
+        return bs->ops->advise(bs->device, first, count, advice);
+    }
+    return false;
+}
+
+// SYNC
+// Only pages written since the last sync go to the device, a run of them at a time
+// A page's bit is cleared before it's flushed, so a write racing the flush leaves it set for next time
+// A device with writeback gets each run started and then one flush for everything, otherwise flush gets each run
+
+static bool sync_run(block_store_t *const bs, const unsigned first, const unsigned count) {
+    if (!bs->image && first >= bs->data_start) {
+        // pinned copies handed out writable are the only place their changes are, they go down first
+        for (unsigned block = first; block < first + count; ++block) {
+            if (bitmap_test(bs->writable, block) && !bs->ops->write(bs->device, block, bs->pinned[block], 1)) {
+                return false;
+            }
+        }
+    }
+    return bs->ops->writeback ? bs->ops->writeback(bs->device, first, count) : bs->ops->flush(bs->device, first, count);
+}
+
+// One range of block_store_sync_ranges, up to the flush that ends it
+static bool sync_range_runs(block_store_t *const bs, const unsigned first, const unsigned count) {
+    bool synced = true;
+    if (first < bs->data_start) {
+        // the FBM changes with every allocation, it isn't worth tracking, asking for it gets it
+        if (!bs->image) {
+            synced = bs->ops->write(bs->device, bs->fbm_first, bs->fbm_blocks, bs->fbm_count);
+        }
+        synced = synced && sync_run(bs, 0, bs->data_start);
+    }
+    const size_t last_page = (first + count - 1) / bs->page_blocks;
+    bitmap_iter_t iter;
+    bitmap_iter_init(&iter, bs->unsynced, first / bs->page_blocks);
+    size_t page = bitmap_iter_next_set(&iter);
+    while (page <= last_page && page != SIZE_MAX) {
+        size_t pages = 1;
+        while (page + pages <= last_page && bitmap_test(bs->unsynced, page + pages)) {
+            ++pages;
+        }
+        bitmap_reset_range(bs->unsynced, page, pages);
+        // the whole pages go, even the parts outside the range, they're on their way to disk anyway
+        const unsigned page_first = page * bs->page_blocks;
+        const unsigned run_first = page_first < bs->data_start ? bs->data_start : page_first;
+        if (!sync_run(bs, run_first, (page + pages) * bs->page_blocks - run_first)) {
+            // still needs doing
+            bitmap_set_range(bs->unsynced, page, pages);
+            synced = false;
+        }
+        bitmap_iter_init(&iter, bs->unsynced, page + pages);
+        page = bitmap_iter_next_set(&iter);
+    }
+    return synced;
+}
+
+bool block_store_sync_range(block_store_t *const bs, const unsigned first, const unsigned count) {
+    const block_range_t range = {first, count};
+    return block_store_sync_ranges(bs, &range, 1);
+}
+
+bool block_store_sync_ranges(block_store_t *const bs, const block_range_t *const ranges, const size_t count) {
+    if (bs && ranges && count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!ranges[i].count || ranges[i].first >= bs->block_count ||
+                ranges[i].count > bs->block_count - ranges[i].first) {
+                return false;
+            }
+        }
+        bool synced = true;
+        unsigned low = bs->block_count, high = 0;
+        for (size_t i = 0; i < count; ++i) {
+            synced = sync_range_runs(bs, ranges[i].first, ranges[i].count) && synced;
+            low = ranges[i].first < low ? ranges[i].first : low;
+            high = ranges[i].first + ranges[i].count > high ? ranges[i].first + ranges[i].count : high;
+        }
+        // the runs were only started, this is what makes them all durable
+        if (bs->ops->writeback && !bs->ops->flush(bs->device, low, high - low)) {
+            // which pages the runs took is gone by now, so every page in the ranges is left for next time
+            for (size_t i = 0; i < count; ++i) {
+                const size_t first_page = ranges[i].first / bs->page_blocks;
+                bitmap_set_range(bs->unsynced, first_page,
+                                 (ranges[i].first + ranges[i].count - 1) / bs->page_blocks - first_page + 1);
+            }
+            synced = false;
+        }
+        return synced;
+    }
+    return false;
+}
+
+bool block_store_sync(block_store_t *const bs) {
+    return bs && block_store_sync_range(bs, 0, bs->block_count);
+}
+
+unsigned block_store_get_unsynced_pages(const block_store_t *const bs) {
+    if (bs) {
+        return bitmap_total_set(bs->unsynced);
+    }
+    return 0;
+}
+
+// ASYNCHRONOUS REQUESTS
+// Submissions queue up and go out together on the next poll, which also hands back whatever has finished
+// io_uring does the work where the kernel has it, otherwise a few threads doing block_store_read/write stand in
+
+typedef struct {
+    unsigned block_id;
+    bool write;
+    void *buffer;
+    uint64_t tag;
+} async_request_t;
+
+struct async_queue {
+    block_store_t *bs;
+    bs_async_t engine;
+    unsigned depth;
+    unsigned outstanding;  // submitted and not handed back by poll yet
+    unsigned in_engine;  // the part of outstanding the engine has
+    block_completion_t *ready;  // done on the spot at submit, handed back by the next poll
+    unsigned ready_count;
+    uint8_t *fixed;  // the registered buffer region, NULL if there isn't one
+    size_t fixed_bytes;
+
+    // io_uring
+    int fd;  // the device's
+    int ring_fd;
+    unsigned to_submit;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // thread pool, requests[request_head..request_visible) are up for grabs
+    pthread_t workers[ASYNC_THREADS];
+    unsigned worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    bool stop;
+    async_request_t *requests;
+    size_t request_head, request_visible, request_tail;
+    block_completion_t *completions;
+    size_t completion_head, completion_tail;
+};
+
+static void uring_teardown(async_queue_t *const q) {
+    if (q->sqes && q->sqes != MAP_FAILED) {
+        munmap(q->sqes, q->sqes_size);
+    }
+    if (q->cq_ring && q->cq_ring != MAP_FAILED && q->cq_ring != q->sq_ring) {
+        munmap(q->cq_ring, q->cq_ring_size);
+    }
+    if (q->sq_ring && q->sq_ring != MAP_FAILED) {
+        munmap(q->sq_ring, q->sq_ring_size);
+    }
+    // closing the ring drops any registered buffers with it
+    if (q->ring_fd != -1) {
+        close(q->ring_fd);
+    }
+    q->ring_fd = -1;
+}
+
+// Raw syscalls, there's no liburing to lean on
+static bool uring_setup(async_queue_t *const q) {
+    // io_uring needs a file to point at
+    q->fd = q->bs->ops->fd ? q->bs->ops->fd(q->bs->device) : -1;
+    if (q->fd == -1) {
+        return false;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    q->ring_fd = (int) syscall(__NR_io_uring_setup, q->depth, &params);
+    if (q->ring_fd < 0) {
+        q->ring_fd = -1;
+        return false;
+    }
+    // the kernel rounds the entries up, depth still caps what goes in flight so neither ring can overflow
+    q->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    q->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        q->sq_ring_size = q->cq_ring_size = q->sq_ring_size > q->cq_ring_size ? q->sq_ring_size : q->cq_ring_size;
+    }
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                      IORING_OFF_SQ_RING);
+    q->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                     ? q->sq_ring
+                     : mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->ring_fd,
+                            IORING_OFF_CQ_RING);
+    q->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = (struct io_uring_sqe *) mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                           q->ring_fd, IORING_OFF_SQES);
+    if (q->sq_ring == MAP_FAILED || q->cq_ring == MAP_FAILED || q->sqes == MAP_FAILED) {
+        uring_teardown(q);
+        return false;
+    }
+    uint8_t *const sq = (uint8_t *) q->sq_ring, *const cq = (uint8_t *) q->cq_ring;
+    q->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    q->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    q->sq_array = (unsigned *) (sq + params.sq_off.array);
+    q->cq_head = (unsigned *) (cq + params.cq_off.head);
+    q->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    q->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    // a ring that can't do plain READ/WRITE (pre 5.6) is no use to us
+    const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *) calloc(1, probe_size);
+    const bool usable = probe && syscall(__NR_io_uring_register, q->ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                        probe->last_op >= IORING_OP_WRITE &&
+                        (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                        (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!usable) {
+        uring_teardown(q);
+    }
+    return usable;
+}
+
+static void uring_prepare(async_queue_t *const q, const async_request_t *const request) {
+    // only we ever move the tail, the kernel just reads it
+    const unsigned tail = *q->sq_tail;
+    const unsigned index = tail & *q->sq_mask;
+    struct io_uring_sqe *const sqe = &q->sqes[index];
+    const bool fixed = q->fixed && (uint8_t *) request->buffer >= q->fixed &&
+                       (uint8_t *) request->buffer + q->bs->block_size <= q->fixed + q->fixed_bytes;
+    memset(sqe, 0, sizeof(*sqe));
+    if (request->write) {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    } else {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    }
+    sqe->fd = q->fd;
+    sqe->off = (uint64_t) request->block_id * q->bs->block_size;
+    sqe->addr = (uint64_t) (uintptr_t) request->buffer;
+    sqe->len = (uint32_t) q->bs->block_size;
+    sqe->buf_index = 0;
+    sqe->user_data = request->tag;
+    q->sq_array[index] = index;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++q->to_submit;
+}
+
+static size_t uring_poll(async_queue_t *const q, block_completion_t *const completions, const size_t max,
+                         const bool wait) {
+    const unsigned min_complete = wait && q->in_engine ? 1 : 0;
+    if (q->to_submit || min_complete) {
+        int entered;
+        do {
+            entered = (int) syscall(__NR_io_uring_enter, q->ring_fd, q->to_submit, min_complete,
+                                    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        } while (entered < 0 && errno == EINTR);
+        // anything the kernel didn't take goes on the next poll
+        if (entered > 0) {
+            q->to_submit -= entered;
+        }
+    }
+    unsigned head = *q->cq_head;
+    const unsigned tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    size_t reaped = 0;
+    for (; head != tail && reaped < max; ++head, ++reaped) {
+        const struct io_uring_cqe *const cqe = &q->cqes[head & *q->cq_mask];
+        completions[reaped].tag = cqe->user_data;
+        completions[reaped].result = (size_t) cqe->res == q->bs->block_size ? 0 : (cqe->res < 0 ? cqe->res : -EIO);
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+static void *async_worker(void *arg) {
+    async_queue_t *const q = (async_queue_t *) arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (!q->stop && q->request_head == q->request_visible) {
+            pthread_cond_wait(&q->work, &q->lock);
+        }
+        if (q->request_head == q->request_visible) {
+            // stopping and nothing left
+            break;
+        }
+        const async_request_t request = q->requests[q->request_head++ % q->depth];
+        pthread_mutex_unlock(&q->lock);
+        const bool done = request.write ? block_store_write(q->bs, request.block_id, request.buffer)
+                                        : block_store_read(q->bs, request.block_id, request.buffer);
+        pthread_mutex_lock(&q->lock);
+        q->completions[q->completion_tail++ % q->depth] = (block_completion_t){request.tag, done ? 0 : -EIO};
+        pthread_cond_signal(&q->done);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void pool_stop(async_queue_t *const q) {
+    pthread_mutex_lock(&q->lock);
+    q->stop = true;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+    for (unsigned i = 0; i < q->worker_count; ++i) {
+        pthread_join(q->workers[i], NULL);
+    }
+    pthread_cond_destroy(&q->done);
+    pthread_cond_destroy(&q->work);
+    pthread_mutex_destroy(&q->lock);
+    free(q->completions);
+    free(q->requests);
+}
+
+static bool pool_start(async_queue_t *const q) {
+    q->requests = (async_request_t *) calloc(q->depth, sizeof(async_request_t));
+    q->completions = (block_completion_t *) calloc(q->depth, sizeof(block_completion_t));
+    if (!q->requests || !q->completions) {
+        free(q->completions);
+        free(q->requests);
+        return false;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+    while (q->worker_count < ASYNC_THREADS && !pthread_create(&q->workers[q->worker_count], NULL, async_worker, q)) {
+        ++q->worker_count;
+    }
+    if (!q->worker_count) {
+        pool_stop(q);
+        return false;
+    }
+    return true;
+}
+
+static size_t pool_poll(async_queue_t *const q, block_completion_t *const completions, const size_t max,
+                        const bool wait) {
+    pthread_mutex_lock(&q->lock);
+    if (q->request_visible != q->request_tail) {
+        q->request_visible = q->request_tail;
+        pthread_cond_broadcast(&q->work);
+    }
+    while (wait && q->in_engine && q->completion_head == q->completion_tail) {
+        pthread_cond_wait(&q->done, &q->lock);
+    }
+    size_t reaped = 0;
+    for (; q->completion_head != q->completion_tail && reaped < max; ++reaped) {
+        completions[reaped] = q->completions[q->completion_head++ % q->depth];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return reaped;
+}
+
+static void async_destroy(async_queue_t *const q) {
+    if (q) {
+        block_completion_t discard[64];
+        while (q->outstanding) {
+            block_store_poll(q->bs, discard, 64, true);
+        }
+        if (q->engine == BS_ASYNC_URING) {
+            uring_teardown(q);
+        } else {
+            pool_stop(q);
+        }
+        free(q->ready);
+        free(q);
+    }
+}
+
+bool block_store_enable_async(block_store_t *const bs, const unsigned depth, const bs_async_t engine) {
+    if (bs && !bs->async && depth && depth <= ASYNC_DEPTH_MAX &&
+        (engine == BS_ASYNC_AUTO || engine == BS_ASYNC_URING || engine == BS_ASYNC_THREADS)) {
+        async_queue_t *q = (async_queue_t *) calloc(1, sizeof(async_queue_t));
+        if (q) {
+            q->bs = bs;
+            q->depth = depth;
+            q->ring_fd = -1;
+            q->ready = (block_completion_t *) calloc(depth, sizeof(block_completion_t));
+            if (q->ready) {
+                if (engine != BS_ASYNC_THREADS && uring_setup(q)) {
+                    q->engine = BS_ASYNC_URING;
+                    bs->async = q;
+                    return true;
+                }
+                if (engine != BS_ASYNC_URING && pool_start(q)) {
+                    q->engine = BS_ASYNC_THREADS;
+                    bs->async = q;
+                    return true;
+                }
+            }
+            free(q->ready);
+            free(q);
+        }
+    }
+    return false;
+}
+
+bool block_store_register_buffers(block_store_t *const bs, void *const buffers, const size_t count) {
+    if (bs && bs->async && buffers && count && !bs->async->fixed && !bs->async->outstanding) {
+        async_queue_t *const q = bs->async;
+        if (q->engine == BS_ASYNC_URING) {
+            struct iovec region = {buffers, count * bs->block_size};
+            if (syscall(__NR_io_uring_register, q->ring_fd, IORING_REGISTER_BUFFERS, &region, 1) != 0) {
+                return false;
+            }
+        }
+        // the threads don't care, but remembering it keeps the two engines behaving the same
+        q->fixed = (uint8_t *) buffers;
+        q->fixed_bytes = count * bs->block_size;
+        return true;
+    }
+    return false;
+}
+
+static bool async_submit(block_store_t *const bs, const unsigned block_id, const bool write, void *const buffer,
+                         const uint64_t tag) {
+    if (bs && bs->async && buffer && block_id >= bs->data_start && block_id < bs->block_count &&
+        bs->async->outstanding < bs->async->depth) {
+        async_queue_t *const q = bs->async;
+        // Pinned blocks have to go through their copy and O_DIRECT can't take an unaligned buffer
+        // so io_uring doesn't get those, they're done right here and handed back by the next poll
+        if (q->engine == BS_ASYNC_URING &&
+            ((bs->pinned && __atomic_load_n(&bs->pinned[block_id], __ATOMIC_ACQUIRE)) ||
+             (bs->ops->fd_align && (uintptr_t) buffer % bs->ops->fd_align))) {
+            const bool done = write ? block_store_write(bs, block_id, buffer) : block_store_read(bs, block_id, buffer);
+            q->ready[q->ready_count++] = (block_completion_t){tag, done ? 0 : -EIO};
+        } else {
+            const async_request_t request = {block_id, write, buffer, tag};
+            if (q->engine == BS_ASYNC_URING) {
+                uring_prepare(q, &request);
+                if (write) {
+                    mark_dirty(bs, block_id, 1);
+                }
+            } else {
+                q->requests[q->request_tail++ % q->depth] = request;
+            }
+            ++q->in_engine;
+        }
+        ++q->outstanding;
+        return true;
+    }
+    return false;
+}
+
+bool block_store_submit_read(block_store_t *const bs, const unsigned block_id, void *const dst, const uint64_t tag) {
+    return async_submit(bs, block_id, false, dst, tag);
+}
+
+bool block_store_submit_write(block_store_t *const bs, const unsigned block_id, const void *const src,
+                              const uint64_t tag) {
+    // nothing writes through the buffer, it just shares a request type with reads
+    return async_submit(bs, block_id, true, (void *) src, tag);
+}
+
+size_t block_store_poll(block_store_t *const bs, block_completion_t *const completions, const size_t max,
+                        const bool wait) {
+    if (bs && bs->async && completions && max) {
+        async_queue_t *const q = bs->async;
+        size_t reaped = 0;
+        while (reaped < max && q->ready_count) {
+            completions[reaped++] = q->ready[--q->ready_count];
+        }
+        // only block if there was nothing to hand back already
+        const size_t finished = q->engine == BS_ASYNC_URING
+                                    ? uring_poll(q, completions + reaped, max - reaped, wait && !reaped)
+                                    : pool_poll(q, completions + reaped, max - reaped, wait && !reaped);
+        q->in_engine -= finished;
+        reaped += finished;
+        q->outstanding -= reaped;
+        return reaped;
+    }
+    return 0;
+}
+
+// FLUSHER
+// A thread that syncs unsynced pages in the background so the kernel's own writeback doesn't have to
+// catch up all at once. It goes when there's more than the threshold unsynced (writers wake it), or when
+// pages have been sitting unsynced for longer than the age limit (it checks on a timer).
+
+struct flusher {
+    block_store_t *bs;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t threshold_pages;  // SIZE_MAX for no threshold
+    uint64_t max_age_ns;  // 0 for no age limit
+    bool stop;
+    bool kicked;  // a writer crossed the threshold, atomic so writers can check it without the lock
+    block_flusher_stats_t stats;  // only the flusher writes these, atomically so anyone can read them
+};
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Writers call this after every mark, it's a count read unless the threshold was just crossed
+static void flusher_dirtied(block_store_t *const bs) {
+    flusher_t *const f = bs->flusher;
+    if (!__atomic_load_n(&f->kicked, __ATOMIC_RELAXED) && bitmap_total_set(bs->unsynced) >= f->threshold_pages &&
+        !__atomic_exchange_n(&f->kicked, true, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&f->lock);
+        pthread_cond_signal(&f->wake);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+static void flusher_pass(flusher_t *const f, uint64_t *const counter) {
+    const unsigned before = block_store_get_unsynced_pages(f->bs);
+    const bool synced = block_store_sync(f->bs);
+    const unsigned after = block_store_get_unsynced_pages(f->bs);
+    __atomic_add_fetch(&f->stats.passes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&f->stats.pages, before > after ? before - after : 0, __ATOMIC_RELAXED);
+    if (counter) {
+        __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+    }
+    if (!synced) {
+        __atomic_add_fetch(&f->stats.failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *flusher_run(void *arg) {
+    flusher_t *const f = (flusher_t *) arg;
+    uint64_t dirty_since = 0;  // when we first saw something unsynced, 0 if it's all synced
+    pthread_mutex_lock(&f->lock);
+    while (!f->stop) {
+        if (f->max_age_ns) {
+            const uint64_t tick = monotonic_ns() + f->max_age_ns / FLUSHER_TICKS_PER_AGE;
+            const struct timespec deadline = {(time_t) (tick / 1000000000u), (long) (tick % 1000000000u)};
+            int waited = 0;
+            while (!f->stop && !__atomic_load_n(&f->kicked, __ATOMIC_RELAXED) && waited != ETIMEDOUT) {
+                waited = pthread_cond_timedwait(&f->wake, &f->lock, &deadline);
+            }
+        } else {
+            while (!f->stop && !__atomic_load_n(&f->kicked, __ATOMIC_RELAXED)) {
+                pthread_cond_wait(&f->wake, &f->lock);
+            }
+        }
+        if (f->stop) {
+            break;
+        }
+        // cleared before the pass, anything dirtied during it kicks again
+        const bool kicked = __atomic_exchange_n(&f->kicked, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&f->lock);
+
+        const uint64_t now = monotonic_ns();
+        const unsigned pages = block_store_get_unsynced_pages(f->bs);
+        if (!pages) {
+            dirty_since = 0;
+        } else if (kicked && pages >= f->threshold_pages) {
+            flusher_pass(f, &f->stats.threshold_passes);
+            dirty_since = 0;
+        } else if (!dirty_since) {
+            dirty_since = now;
+        } else if (f->max_age_ns && now - dirty_since >= f->max_age_ns) {
+            flusher_pass(f, &f->stats.age_passes);
+            dirty_since = 0;
+        }
+        pthread_mutex_lock(&f->lock);
+    }
+    pthread_mutex_unlock(&f->lock);
+    // the handoff to close, whatever's left goes now
+    if (block_store_get_unsynced_pages(f->bs)) {
+        flusher_pass(f, NULL);
+    }
+    return NULL;
+}
+
+static void flusher_destroy(flusher_t *const f) {
+    if (f) {
+        pthread_mutex_lock(&f->lock);
+        f->stop = true;
+        pthread_cond_signal(&f->wake);
+        pthread_mutex_unlock(&f->lock);
+        pthread_join(f->thread, NULL);
+        // nobody is writing any more, writers don't need to see it go
+        f->bs->flusher = NULL;
+        pthread_cond_destroy(&f->wake);
+        pthread_mutex_destroy(&f->lock);
+        free(f);
+    }
+}
+
+bool block_store_enable_flusher(block_store_t *const bs, const size_t dirty_bytes, const unsigned max_age_ms) {
+    if (bs && !bs->flusher && (dirty_bytes || max_age_ms)) {
+        flusher_t *f = (flusher_t *) calloc(1, sizeof(flusher_t));
+        if (f) {
+            const size_t page_bytes = bs->page_blocks * bs->block_size;
+            f->bs = bs;
+            f->threshold_pages = dirty_bytes ? (dirty_bytes + page_bytes - 1) / page_bytes : SIZE_MAX;
+            f->max_age_ns = (uint64_t) max_age_ms * 1000000u;
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            // timed waits are against CLOCK_MONOTONIC, the wall clock can jump
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&f->wake, &attr);
+            pthread_condattr_destroy(&attr);
+            pthread_mutex_init(&f->lock, NULL);
+            if (!pthread_create(&f->thread, NULL, flusher_run, f)) {
+                __atomic_store_n(&bs->flusher, f, __ATOMIC_RELEASE);
+                return true;
+            }
+            pthread_cond_destroy(&f->wake);
+            pthread_mutex_destroy(&f->lock);
+            free(f);
+        }
+    }
+    return false;
+}
+
+bool block_store_get_flusher_stats(const block_store_t *const bs, block_flusher_stats_t *const stats) {
+    if (bs && bs->flusher && stats) {
+        const block_flusher_stats_t *const from = &bs->flusher->stats;
+        stats->passes = __atomic_load_n(&from->passes, __ATOMIC_RELAXED);
+        stats->pages = __atomic_load_n(&from->pages, __ATOMIC_RELAXED);
+        stats->threshold_passes = __atomic_load_n(&from->threshold_passes, __ATOMIC_RELAXED);
+        stats->age_passes = __atomic_load_n(&from->age_passes, __ATOMIC_RELAXED);
+        stats->failures = __atomic_load_n(&from->failures, __ATOMIC_RELAXED);
         return true;
     }
     return false;
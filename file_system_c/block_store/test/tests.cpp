@@ -1,7 +1,12 @@
 #include <iostream>
 #include <cstddef>
 #include <cstring>
+#include <chrono>
+#include <thread>
+#include <vector>
 #include "gtest/gtest.h"
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "block_store.h"
 
@@ -132,6 +137,17 @@ TEST(bs_request_release, fbm_attack) {
         ASSERT_FALSE(block_store_read(bs,i,buffer));
         ASSERT_FALSE(block_store_write(bs,i,buffer));
     }
+    // one past the end is the first bit after the FBM, which on an mmap'd image is the first data block
+    const unsigned count = block_store_get_block_count(bs);
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_FALSE(block_store_request(bs, count));
+    ASSERT_FALSE(block_store_request(bs, count + 1));
+    block_store_release(bs, count);
+    block_store_release(bs, count + 1);
+    ASSERT_TRUE(block_store_read(bs, 16, buffer));
+    ASSERT_EQ(buffer[0], 0);
+    ASSERT_EQ(block_store_get_free_blocks(bs), count - 16);
     block_store_close(bs);
 }
 
@@ -144,6 +160,985 @@ TEST(bs_request, fill_device) {
     block_store_close(bs);
 }
 
+TEST(bs_alloc_policy, next_fit) {
+    block_store_t *bs = block_store_create("test_m.bs");
+    ASSERT_NE(nullptr, bs);
+
+    ASSERT_FALSE(block_store_set_alloc_policy(NULL, BS_NEXT_FIT));
+    ASSERT_FALSE(block_store_set_alloc_policy(bs, (alloc_policy_t) 42));
+
+    // first fit goes right back to the hole
+    unsigned block_a = block_store_allocate(bs);
+    unsigned block_b = block_store_allocate(bs);
+    ASSERT_EQ(block_a + 1, block_b);
+    block_store_release(bs, block_a);
+    ASSERT_EQ(block_store_allocate(bs), block_a);
+
+    // next fit keeps going
+    ASSERT_TRUE(block_store_set_alloc_policy(bs, BS_NEXT_FIT));
+    block_store_release(bs, block_a);
+    ASSERT_EQ(block_store_allocate(bs), block_b + 1);
+    ASSERT_EQ(block_store_allocate(bs), block_b + 2);
+
+    // until it falls off the end and wraps around to the hole
+    for (unsigned i = block_b + 3; i < 65536; ++i) {
+        ASSERT_TRUE(block_store_request(bs, i));
+    }
+    ASSERT_EQ(block_store_allocate(bs), block_a);
+    ASSERT_EQ(block_store_allocate(bs), 0);
+
+    ASSERT_TRUE(block_store_set_alloc_policy(bs, BS_FIRST_FIT));
+    block_store_release(bs, block_b);
+    ASSERT_EQ(block_store_allocate(bs), block_b);
+
+    block_store_close(bs);
+}
+
+TEST(bs_allocate_run, basic) {
+    block_store_t *bs = block_store_create("test_n.bs");
+    ASSERT_NE(nullptr, bs);
+
+    unsigned first = 0;
+    ASSERT_FALSE(block_store_allocate_run(NULL, 4, &first));
+    ASSERT_FALSE(block_store_allocate_run(bs, 4, NULL));
+    ASSERT_FALSE(block_store_allocate_run(bs, 0, &first));
+    ASSERT_FALSE(block_store_allocate_run(bs, 65536, &first));
+
+    // punch a few holes, only the big one fits
+    ASSERT_TRUE(block_store_request(bs, 18));
+    ASSERT_TRUE(block_store_request(bs, 21));
+    ASSERT_TRUE(block_store_request(bs, 30));
+    ASSERT_TRUE(block_store_allocate_run(bs, 8, &first));
+    ASSERT_EQ(first, 22u);
+    for (unsigned i = 22; i < 30; ++i) {
+        ASSERT_FALSE(block_store_request(bs, i));
+    }
+    ASSERT_TRUE(block_store_allocate_run(bs, 2, &first));
+    ASSERT_EQ(first, 16u);
+
+    // too big for what's left
+    ASSERT_FALSE(block_store_allocate_run(bs, 65536 - 30, &first));
+    ASSERT_TRUE(block_store_allocate_run(bs, 65536 - 31, &first));
+    ASSERT_EQ(first, 31u);
+    ASSERT_FALSE(block_store_allocate_run(bs, 3, &first));
+    ASSERT_TRUE(block_store_allocate_run(bs, 2, &first));
+    ASSERT_EQ(first, 19u);
+
+    block_store_close(bs);
+}
+
+TEST(bs_allocate_near, basic) {
+    block_store_t *bs = block_store_create("test_o.bs");
+    ASSERT_NE(nullptr, bs);
+
+    ASSERT_EQ(block_store_allocate_near(NULL, 100), 0u);
+    ASSERT_EQ(block_store_allocate_near(bs, 100), 100u);
+    ASSERT_EQ(block_store_allocate_near(bs, 100), 101u);
+    ASSERT_EQ(block_store_allocate_near(bs, 99), 99u);
+
+    // junk goals just allocate normally
+    ASSERT_EQ(block_store_allocate_near(bs, 3), 16u);
+    ASSERT_EQ(block_store_allocate_near(bs, 65536), 17u);
+
+    // nothing at or after the goal, wrap around
+    ASSERT_TRUE(block_store_request(bs, 65535));
+    ASSERT_EQ(block_store_allocate_near(bs, 65535), 18u);
+
+    block_store_close(bs);
+}
+
+TEST(bs_release_range, basic) {
+    block_store_t *bs = block_store_create("test_p.bs");
+    ASSERT_NE(nullptr, bs);
+
+    unsigned first = 0;
+    ASSERT_TRUE(block_store_allocate_run(bs, 100, &first));
+    ASSERT_EQ(first, 16u);
+
+    block_store_release_range(bs, 20, 10);
+    ASSERT_TRUE(block_store_allocate_run(bs, 10, &first));
+    ASSERT_EQ(first, 20u);
+
+    // can't release the FBM, or past the end
+    block_store_release_range(bs, 0, 20);
+    block_store_release_range(bs, 65530, 7);
+    block_store_release_range(NULL, 20, 10);
+    for (unsigned i = 0; i < 116; ++i) {
+        ASSERT_FALSE(block_store_request(bs, i));
+    }
+
+    block_store_release_range(bs, 16, 100);
+    ASSERT_TRUE(block_store_allocate_run(bs, 100, &first));
+    ASSERT_EQ(first, 16u);
+
+    block_store_close(bs);
+}
+
+TEST(bs_get_free_blocks, basic) {
+    block_store_t *bs = block_store_create("test_q.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+
+    unsigned first = 0;
+    ASSERT_TRUE(block_store_allocate_run(bs, 100, &first));
+    ASSERT_NE(0u, block_store_allocate(bs));
+    ASSERT_TRUE(block_store_request(bs, 1000));
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 118u);
+
+    block_store_release(bs, 1000);
+    block_store_release_range(bs, 16, 50);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 67u);
+    block_store_close(bs);
+
+    // the count is rebuilt from the FBM on open
+    bs = block_store_open("test_q.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 67u);
+    block_store_close(bs);
+
+    ASSERT_EQ(block_store_get_free_blocks(NULL), 0u);
+}
+
+TEST(bs_allocate, threaded) {
+    block_store_t *bs = block_store_create("test_r.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_alloc_policy(bs, BS_NEXT_FIT));
+
+    // everybody allocates until the device is full, nobody should get a block twice
+    const unsigned thread_count = 8;
+    std::vector<std::vector<unsigned>> claimed(thread_count);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        threads.emplace_back([bs, &claimed, t]() {
+            unsigned block, allocations = 0;
+            while ((block = block_store_allocate(bs)) != 0) {
+                claimed[t].push_back(block);
+                // give a few back to keep the summary busy
+                if (++allocations % 7 == 0) {
+                    block_store_release(bs, block);
+                    claimed[t].pop_back();
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<bool> seen(65536, false);
+    size_t total = 0;
+    for (const auto &list : claimed) {
+        for (unsigned block : list) {
+            ASSERT_GE(block, 16u);
+            ASSERT_FALSE(seen[block]);
+            seen[block] = true;
+            ++total;
+        }
+    }
+    // the released ones got picked back up by someone before the device ran out
+    ASSERT_EQ(total, 65536u - 16u);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 0u);
+    block_store_close(bs);
+}
+
+TEST(bs_get_block, basic) {
+    block_store_t *bs = block_store_create("test_s.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), 0u);
+
+    // the FBM and anything out of range aren't handed out
+    ASSERT_EQ(nullptr, block_store_get_ro(bs, 0));
+    ASSERT_EQ(nullptr, block_store_get_rw(bs, 15));
+    ASSERT_EQ(nullptr, block_store_get_ro(bs, 65536));
+    ASSERT_EQ(nullptr, block_store_get_rw(NULL, 100));
+
+    uint8_t buffer[512];
+    memset(buffer, 0xAB, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 100, buffer));
+    const uint8_t *ro = (const uint8_t *) block_store_get_ro(bs, 100);
+    ASSERT_NE(nullptr, ro);
+    ASSERT_EQ(0, memcmp(ro, buffer, sizeof(buffer)));
+    ASSERT_TRUE(block_store_is_dirty(bs, 100));
+
+    // reading doesn't dirty anything, handing out a writable pointer does
+    ASSERT_NE(nullptr, block_store_get_ro(bs, 200));
+    ASSERT_FALSE(block_store_is_dirty(bs, 200));
+    uint8_t *rw = (uint8_t *) block_store_get_rw(bs, 200);
+    ASSERT_NE(nullptr, rw);
+    ASSERT_TRUE(block_store_is_dirty(bs, 200));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), 2u);
+    memset(rw, 0xCD, 512);
+    ASSERT_TRUE(block_store_read(bs, 200, buffer));
+    ASSERT_EQ(buffer[0], 0xCD);
+    ASSERT_EQ(buffer[511], 0xCD);
+
+    block_store_clear_dirty(bs);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), 0u);
+    ASSERT_FALSE(block_store_is_dirty(bs, 100));
+    block_store_close(bs);
+
+    // writes through the pointer land in the file
+    bs = block_store_open("test_s.bs");
+    ASSERT_NE(nullptr, bs);
+    ro = (const uint8_t *) block_store_get_ro(bs, 200);
+    ASSERT_NE(nullptr, ro);
+    ASSERT_EQ(ro[0], 0xCD);
+    ASSERT_EQ(ro[511], 0xCD);
+    block_store_close(bs);
+}
+
+TEST(bs_readv_writev, basic) {
+    block_store_t *bs = block_store_create("test_t.bs");
+    ASSERT_NE(nullptr, bs);
+
+    // a contiguous run, a jump, and one going backwards into a separate buffer
+    std::vector<uint8_t> data(512 * 6), other(512);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i / 512 + 1);
+    }
+    memset(other.data(), 0x77, other.size());
+    block_write_vec_t writes[] = {{100, &data[0]},   {101, &data[512]},  {102, &data[1024]}, {200, &data[1536]},
+                                  {201, &data[2048]}, {50, &data[2560]}, {49, other.data()}};
+    ASSERT_TRUE(block_store_writev(bs, writes, 7));
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), 7u);
+
+    uint8_t buffer[512];
+    ASSERT_TRUE(block_store_read(bs, 102, buffer));
+    ASSERT_EQ(buffer[0], 3);
+    ASSERT_TRUE(block_store_read(bs, 50, buffer));
+    ASSERT_EQ(buffer[511], 6);
+    ASSERT_TRUE(block_store_read(bs, 49, buffer));
+    ASSERT_EQ(buffer[0], 0x77);
+
+    std::vector<uint8_t> back(512 * 7, 0);
+    block_read_vec_t reads[] = {{100, &back[0]},    {101, &back[512]},  {102, &back[1024]}, {200, &back[1536]},
+                                {201, &back[2048]}, {50, &back[2560]}, {49, &back[3072]}};
+    ASSERT_TRUE(block_store_readv(bs, reads, 7));
+    ASSERT_EQ(0, memcmp(back.data(), data.data(), data.size()));
+    ASSERT_EQ(0, memcmp(&back[3072], other.data(), 512));
+
+    // one bad entry fails the lot before anything moves
+    memset(back.data(), 0, back.size());
+    reads[3].block_id = 65536;
+    ASSERT_FALSE(block_store_readv(bs, reads, 7));
+    ASSERT_EQ(back[0], 0);
+    writes[6].block_id = 3;
+    memset(buffer, 0, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 100, buffer));
+    ASSERT_FALSE(block_store_writev(bs, writes, 7));
+    ASSERT_TRUE(block_store_read(bs, 100, buffer));
+    ASSERT_EQ(buffer[0], 0);
+
+    ASSERT_FALSE(block_store_readv(bs, NULL, 1));
+    ASSERT_FALSE(block_store_writev(bs, writes, 0));
+    ASSERT_FALSE(block_store_readv(NULL, reads, 1));
+    block_store_close(bs);
+}
+
+// A run comes back in one buffer, pinned blocks included
+static void check_read_range(const char *const fname, const bs_backend_t backend) {
+    block_store_t *bs = block_store_create_backend(fname, backend);
+    ASSERT_NE(nullptr, bs);
+
+    std::vector<uint8_t> data(512 * 40);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 7 + i / 512);
+    }
+    for (unsigned i = 0; i < 40; ++i) {
+        ASSERT_TRUE(block_store_write(bs, 300 + i, &data[512 * i]));
+    }
+    // a positional backend keeps this one in memory from now on, the run has to pick the change up
+    uint8_t *pinned = (uint8_t *) block_store_get_rw(bs, 310);
+    ASSERT_NE(nullptr, pinned);
+    pinned[0] = data[512 * 10] = 0xEE;
+
+    std::vector<uint8_t> back(data.size(), 0);
+    ASSERT_TRUE(block_store_read_range(bs, 300, 40, back.data()));
+    ASSERT_EQ(back, data);
+    ASSERT_TRUE(block_store_read_range(bs, 65535, 1, back.data()));
+
+    // a run off either end, or an empty one, reads nothing
+    memset(back.data(), 0, back.size());
+    ASSERT_FALSE(block_store_read_range(bs, 65530, 7, back.data()));
+    ASSERT_FALSE(block_store_read_range(bs, 65536, 1, back.data()));
+    ASSERT_FALSE(block_store_read_range(bs, 3, 40, back.data()));
+    ASSERT_FALSE(block_store_read_range(bs, 300, 0, back.data()));
+    ASSERT_FALSE(block_store_read_range(bs, 300, 40, NULL));
+    ASSERT_FALSE(block_store_read_range(NULL, 300, 40, back.data()));
+    ASSERT_EQ(back[0], 0);
+    block_store_close(bs);
+}
+
+TEST(bs_read_range, mmap) {
+    check_read_range("test_ad.bs", BS_BACKEND_MMAP);
+}
+
+TEST(bs_read_range, pread) {
+    check_read_range("test_ae.bs", BS_BACKEND_PREAD);
+}
+
+// Everything a positional backend does has to land where the mmap backend expects it
+static void check_backend(const bs_backend_t backend) {
+    block_store_t *bs = block_store_create_backend("test_u.bs", backend);
+    if (!bs && backend == BS_BACKEND_DIRECT) {
+        GTEST_SKIP() << "no O_DIRECT here";
+    }
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+    ASSERT_EQ(block_store_allocate(bs), 16u);
+    ASSERT_TRUE(block_store_request(bs, 3000));
+
+    uint8_t buffer[512], back[512];
+    memset(buffer, 0x5A, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_TRUE(block_store_read(bs, 16, back));
+    ASSERT_EQ(0, memcmp(buffer, back, sizeof(buffer)));
+
+    // unaligned buffers have to work too (O_DIRECT bounces them)
+    std::vector<uint8_t> run(512 * 4 + 1);
+    for (size_t i = 0; i < run.size(); ++i) {
+        run[i] = (uint8_t) i;
+    }
+    block_write_vec_t writes[] = {{400, &run[1]}, {401, &run[513]}, {402, &run[1025]}, {403, &run[1537]}};
+    ASSERT_TRUE(block_store_writev(bs, writes, 4));
+
+    // a pinned block stays in sync with plain reads and writes, and goes back to the file on close
+    uint8_t *rw = (uint8_t *) block_store_get_rw(bs, 3000);
+    ASSERT_NE(nullptr, rw);
+    memset(rw, 0x11, 512);
+    ASSERT_TRUE(block_store_read(bs, 3000, back));
+    ASSERT_EQ(back[0], 0x11);
+    const uint8_t *ro = (const uint8_t *) block_store_get_ro(bs, 16);
+    ASSERT_NE(nullptr, ro);
+    ASSERT_EQ(ro[0], 0x5A);
+    memset(buffer, 0x22, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_EQ(ro[0], 0x22);
+    block_store_close(bs);
+
+    bs = block_store_open("test_u.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 18u);
+    ASSERT_FALSE(block_store_request(bs, 3000));
+    ASSERT_TRUE(block_store_read(bs, 3000, back));
+    ASSERT_EQ(back[511], 0x11);
+    ASSERT_TRUE(block_store_read(bs, 16, back));
+    ASSERT_EQ(back[0], 0x22);
+    std::vector<uint8_t> run_back(512 * 4);
+    block_read_vec_t reads[] = {{400, &run_back[0]}, {401, &run_back[512]}, {402, &run_back[1024]},
+                                {403, &run_back[1536]}};
+    ASSERT_TRUE(block_store_readv(bs, reads, 4));
+    ASSERT_EQ(0, memcmp(run_back.data(), &run[1], run_back.size()));
+    ASSERT_EQ(block_store_allocate(bs), 17u);
+    block_store_close(bs);
+
+    // and back the other way
+    bs = block_store_open_backend("test_u.bs", backend);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 19u);
+    ASSERT_TRUE(block_store_readv(bs, reads, 4));
+    ASSERT_EQ(0, memcmp(run_back.data(), &run[1], run_back.size()));
+    block_store_close(bs);
+}
+
+TEST(bs_backend, pread) {
+    check_backend(BS_BACKEND_PREAD);
+}
+
+TEST(bs_backend, direct) {
+    check_backend(BS_BACKEND_DIRECT);
+}
+
+TEST(bs_backend, bad_backend) {
+    ASSERT_EQ(nullptr, block_store_create_backend("test_u.bs", (bs_backend_t) 42));
+    ASSERT_EQ(nullptr, block_store_open_backend(NULL, BS_BACKEND_PREAD));
+}
+
+// Pushes more writes than fit in flight, reads them all back, and checks every tag comes back once
+static void check_async(const bs_async_t engine, const bs_backend_t backend) {
+    block_store_t *bs = block_store_create_backend("test_v.bs", backend);
+    ASSERT_NE(nullptr, bs);
+    if (!block_store_enable_async(bs, 8, engine)) {
+        block_store_close(bs);
+        GTEST_SKIP() << "no io_uring here";
+    }
+    ASSERT_FALSE(block_store_enable_async(bs, 8, engine));
+
+    const unsigned count = 100;
+    std::vector<uint8_t> data(512 * count), back(512 * count, 0);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 7 + i / 512);
+    }
+    // the second half of the reads land in a registered region
+    ASSERT_TRUE(block_store_register_buffers(bs, &back[512 * count / 2], count / 2));
+    ASSERT_FALSE(block_store_register_buffers(bs, back.data(), count));
+
+    // a pinned block gets its copy updated (and never goes through io_uring)
+    const uint8_t *pinned = (const uint8_t *) block_store_get_ro(bs, 1005);
+    ASSERT_NE(nullptr, pinned);
+
+    block_completion_t completions[16];
+    std::vector<int> seen(2 * count, 0);
+    auto submit_all = [&](const bool write) {
+        unsigned submitted = 0, finished = 0;
+        while (finished < count) {
+            while (submitted < count &&
+                   (write ? block_store_submit_write(bs, 1000 + submitted, &data[512 * submitted], submitted)
+                          : block_store_submit_read(bs, 1000 + submitted, &back[512 * submitted], count + submitted))) {
+                ++submitted;
+            }
+            const size_t reaped = block_store_poll(bs, completions, 16, true);
+            ASSERT_GT(reaped, 0u);
+            for (size_t i = 0; i < reaped; ++i) {
+                ASSERT_EQ(completions[i].result, 0);
+                ASSERT_LT(completions[i].tag, 2u * count);
+                ++seen[completions[i].tag];
+            }
+            finished += reaped;
+        }
+    };
+    submit_all(true);
+    ASSERT_EQ(pinned[0], data[512 * 5]);
+    submit_all(false);
+    for (int times : seen) {
+        ASSERT_EQ(times, 1);
+    }
+    ASSERT_EQ(0, memcmp(data.data(), back.data(), data.size()));
+    ASSERT_EQ(block_store_poll(bs, completions, 16, true), 0u);
+
+    uint8_t buffer[512];
+    ASSERT_FALSE(block_store_submit_read(bs, 3, buffer, 0));
+    ASSERT_FALSE(block_store_submit_write(bs, 65536, buffer, 0));
+    ASSERT_FALSE(block_store_submit_read(bs, 100, NULL, 0));
+
+    // close waits for anything left in flight
+    ASSERT_TRUE(block_store_submit_write(bs, 2000, &data[0], 0));
+    block_store_close(bs);
+    bs = block_store_open("test_v.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_read(bs, 2000, buffer));
+    ASSERT_EQ(0, memcmp(buffer, data.data(), 512));
+    ASSERT_TRUE(block_store_read(bs, 1099, buffer));
+    ASSERT_EQ(0, memcmp(buffer, &data[512 * 99], 512));
+    ASSERT_FALSE(block_store_submit_read(bs, 100, buffer, 0));
+    ASSERT_EQ(block_store_poll(bs, completions, 16, false), 0u);
+    block_store_close(bs);
+}
+
+TEST(bs_async, uring) {
+    check_async(BS_ASYNC_URING, BS_BACKEND_MMAP);
+}
+
+TEST(bs_async, uring_pread) {
+    check_async(BS_ASYNC_URING, BS_BACKEND_PREAD);
+}
+
+TEST(bs_async, threads) {
+    check_async(BS_ASYNC_THREADS, BS_BACKEND_MMAP);
+}
+
+TEST(bs_async, threads_pread) {
+    check_async(BS_ASYNC_THREADS, BS_BACKEND_PREAD);
+}
+
+TEST(bs_backend, ram) {
+    ASSERT_EQ(nullptr, block_store_open_backend("test_w.bs", BS_BACKEND_RAM));
+    block_store_t *bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+    ASSERT_EQ(block_store_allocate(bs), 16u);
+
+    uint8_t buffer[512], back[512];
+    memset(buffer, 0x3C, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_TRUE(block_store_read(bs, 16, back));
+    ASSERT_EQ(0, memcmp(buffer, back, sizeof(buffer)));
+    ASSERT_TRUE(block_store_read(bs, 65535, back));
+    ASSERT_EQ(back[0], 0);
+    ASSERT_FALSE(block_store_read(bs, 65536, back));
+    uint8_t *rw = (uint8_t *) block_store_get_rw(bs, 16);
+    ASSERT_NE(nullptr, rw);
+    ASSERT_EQ(rw[0], 0x3C);
+
+    // there's no file for io_uring, so only the threads can do async
+    ASSERT_FALSE(block_store_enable_async(bs, 4, BS_ASYNC_URING));
+    ASSERT_TRUE(block_store_enable_async(bs, 4, BS_ASYNC_AUTO));
+    ASSERT_TRUE(block_store_submit_read(bs, 16, back, 7));
+    block_completion_t completion;
+    ASSERT_EQ(block_store_poll(bs, &completion, 1, true), 1u);
+    ASSERT_EQ(completion.tag, 7u);
+    ASSERT_EQ(completion.result, 0);
+    block_store_close(bs);
+}
+
+// A device that keeps its image to itself (no map) and counts what block_store asks of it
+struct counting_device {
+    std::vector<uint8_t> image = std::vector<uint8_t>(65536 * 512, 0);
+    unsigned reads = 0, writes = 0, allocated = 0, released = 0, flushes = 0, writebacks = 0;
+    bool closed = false;
+};
+
+static bool counting_read(void *device, const unsigned block_id, void *dst, const size_t count) {
+    counting_device *counter = (counting_device *) device;
+    memcpy(dst, &counter->image[512 * block_id], 512 * count);
+    counter->reads += count;
+    return true;
+}
+
+static bool counting_write(void *device, const unsigned block_id, const void *src, const size_t count) {
+    counting_device *counter = (counting_device *) device;
+    memcpy(&counter->image[512 * block_id], src, 512 * count);
+    counter->writes += count;
+    return true;
+}
+
+static bool counting_flush(void *device, const unsigned, const unsigned) {
+    ((counting_device *) device)->flushes += 1;
+    return true;
+}
+
+static bool counting_writeback(void *device, const unsigned, const unsigned) {
+    ((counting_device *) device)->writebacks += 1;
+    return true;
+}
+
+static void counting_allocated(void *device, const unsigned, const unsigned count) {
+    ((counting_device *) device)->allocated += count;
+}
+
+static void counting_released(void *device, const unsigned, const unsigned count) {
+    ((counting_device *) device)->released += count;
+}
+
+static void counting_close(void *device) {
+    ((counting_device *) device)->closed = true;
+}
+
+TEST(bs_attach, counting_device) {
+    const block_device_t ops = {counting_read, counting_write, NULL, NULL, NULL, counting_flush, counting_writeback,
+                                counting_allocated, counting_released, NULL, NULL, NULL, 0, counting_close};
+    ASSERT_EQ(nullptr, block_store_attach(NULL, NULL, true));
+    const block_device_t missing = {counting_read, NULL, NULL, NULL, NULL, counting_flush, NULL, NULL, NULL, NULL, NULL,
+                                    NULL, 0, NULL};
+    counting_device device;
+    ASSERT_EQ(nullptr, block_store_attach(&missing, &device, true));
+
+    block_store_t *bs = block_store_attach(&ops, &device, true);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(device.reads, 0u);
+    ASSERT_FALSE(block_store_set_discard(bs, true));
+    ASSERT_EQ(block_store_trim(bs), 0u);
+    unsigned first;
+    ASSERT_TRUE(block_store_allocate_run(bs, 10, &first));
+    ASSERT_EQ(block_store_allocate(bs), 26u);
+    ASSERT_TRUE(block_store_request(bs, 500));
+    ASSERT_EQ(device.allocated, 12u);
+    block_store_release(bs, 26);
+    block_store_release_range(bs, first, 5);
+    ASSERT_EQ(device.released, 6u);
+
+    // adjacent blocks in adjacent buffers go down as one call
+    std::vector<uint8_t> data(512 * 4, 0x42);
+    block_write_vec_t writes[] = {{100, &data[0]}, {101, &data[512]}, {102, &data[1024]}, {103, &data[1536]}};
+    ASSERT_TRUE(block_store_writev(bs, writes, 4));
+    ASSERT_EQ(device.writes, 4u);
+    ASSERT_EQ(device.image[512 * 103], 0x42);
+
+    // every run (and the FBM) is started on its own, one flush waits for all of them
+    ASSERT_TRUE(block_store_write(bs, 40000, &data[0]));
+    const block_range_t ranges[] = {{40000, 1}, {0, 1}, {100, 4}};
+    ASSERT_TRUE(block_store_sync_ranges(bs, ranges, 3));
+    ASSERT_EQ(device.writebacks, 3u);
+    ASSERT_EQ(device.flushes, 1u);
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 0u);
+
+    // no image, so a pointer means a pinned copy that only goes back on close
+    uint8_t *rw = (uint8_t *) block_store_get_rw(bs, 500);
+    ASSERT_NE(nullptr, rw);
+    ASSERT_EQ(device.reads, 1u);
+    rw[0] = 0x99;
+    ASSERT_EQ(device.image[512 * 500], 0);
+    uint8_t back[512];
+    ASSERT_TRUE(block_store_read(bs, 500, back));
+    ASSERT_EQ(back[0], 0x99);
+    ASSERT_EQ(device.reads, 1u);
+    block_store_close(bs);
+    ASSERT_TRUE(device.closed);
+    ASSERT_EQ(device.image[512 * 500], 0x99);
+
+    // the FBM went back to the device too
+    device.closed = false;
+    bs = block_store_attach(&ops, &device, false);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u - 6u);
+    block_store_close(bs);
+}
+
+TEST(bs_create, sparse) {
+    block_store_t *bs = block_store_create("test_x.bs");
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[512];
+    ASSERT_TRUE(block_store_read(bs, 40000, buffer));
+    ASSERT_EQ(buffer[0], 0);
+    ASSERT_EQ(buffer[511], 0);
+    block_store_close(bs);
+
+    // the FBM is all that should've hit the disk
+    struct stat st;
+    ASSERT_EQ(0, stat("test_x.bs", &st));
+    ASSERT_EQ(st.st_size, 65536 * 512);
+    ASSERT_LT(st.st_blocks * 512, 1024 * 1024);
+
+    bs = block_store_open("test_x.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+    ASSERT_FALSE(block_store_preallocate(NULL));
+    if (block_store_preallocate(bs)) {
+        ASSERT_EQ(0, stat("test_x.bs", &st));
+        ASSERT_GE(st.st_blocks * 512, 65536 * 512);
+    }
+    ASSERT_TRUE(block_store_read(bs, 40000, buffer));
+    ASSERT_EQ(buffer[0], 0);
+    block_store_close(bs);
+
+    bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_preallocate(bs));
+    block_store_close(bs);
+}
+
+// Writes a block past the first data block, reopens with the backend and checks the geometry came back
+static void check_geometry(const bs_backend_t backend, const size_t block_size, const unsigned block_count) {
+    block_store_t *bs = block_store_create_ex_backend("test_ac.bs", block_size, block_count, backend);
+    if (!bs && backend == BS_BACKEND_DIRECT) {
+        GTEST_SKIP() << "no O_DIRECT here";
+    }
+    ASSERT_NE(nullptr, bs);
+    // the superblock and then one bit per block
+    const unsigned data_start = 1 + (block_count / 8 + block_size - 1) / block_size;
+    ASSERT_EQ(block_store_get_block_size(bs), block_size);
+    ASSERT_EQ(block_store_get_block_count(bs), block_count);
+    ASSERT_EQ(block_store_get_first_data_block(bs), data_start);
+    ASSERT_EQ(block_store_get_free_blocks(bs), block_count - data_start);
+    ASSERT_EQ(block_store_allocate(bs), data_start);
+
+    std::vector<uint8_t> buffer(block_size), check(block_size);
+    for (size_t i = 0; i < block_size; ++i) {
+        buffer[i] = (uint8_t) (i * 7);
+    }
+    ASSERT_FALSE(block_store_write(bs, 0, buffer.data()));
+    ASSERT_FALSE(block_store_write(bs, data_start - 1, buffer.data()));
+    ASSERT_FALSE(block_store_write(bs, block_count, buffer.data()));
+    ASSERT_TRUE(block_store_write(bs, data_start, buffer.data()));
+    ASSERT_TRUE(block_store_write(bs, block_count - 1, buffer.data()));
+    block_store_close(bs);
+
+    struct stat st;
+    ASSERT_EQ(0, stat("test_ac.bs", &st));
+    ASSERT_EQ((size_t) st.st_size, block_size * block_count);
+
+    bs = block_store_open_backend("test_ac.bs", backend);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_block_size(bs), block_size);
+    ASSERT_EQ(block_store_get_block_count(bs), block_count);
+    ASSERT_EQ(block_store_get_first_data_block(bs), data_start);
+    ASSERT_EQ(block_store_get_free_blocks(bs), block_count - data_start - 1);
+    ASSERT_TRUE(block_store_read(bs, data_start, check.data()));
+    ASSERT_EQ(buffer, check);
+    ASSERT_TRUE(block_store_read(bs, block_count - 1, check.data()));
+    ASSERT_EQ(buffer, check);
+    block_store_close(bs);
+}
+
+TEST(bs_create_ex, geometry) {
+    ASSERT_EQ(nullptr, block_store_create_ex(NULL, 4096, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex("test_ac.bs", 256, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex("test_ac.bs", 131072, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex("test_ac.bs", 3000, 1024));
+    ASSERT_EQ(nullptr, block_store_create_ex("test_ac.bs", 4096, 1020));
+    ASSERT_EQ(nullptr, block_store_create_ex("test_ac.bs", 4096, 32));
+    ASSERT_EQ(0u, block_store_get_block_size(NULL));
+    ASSERT_EQ(0u, block_store_get_block_count(NULL));
+    ASSERT_EQ(0u, block_store_get_first_data_block(NULL));
+
+    ASSERT_NO_FATAL_FAILURE(check_geometry(BS_BACKEND_MMAP, 4096, 1024));
+    ASSERT_NO_FATAL_FAILURE(check_geometry(BS_BACKEND_PREAD, 65536, 64));
+    ASSERT_NO_FATAL_FAILURE(check_geometry(BS_BACKEND_DIRECT, 1024, 100000));
+    ASSERT_NO_FATAL_FAILURE(check_geometry(BS_BACKEND_MMAP, 512, 131072));
+
+    // images from block_store_create have no superblock and still open as they always did
+    block_store_t *bs = block_store_create("test_ac.bs");
+    ASSERT_NE(nullptr, bs);
+    block_store_close(bs);
+    bs = block_store_open("test_ac.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_block_size(bs), 512u);
+    ASSERT_EQ(block_store_get_block_count(bs), 65536u);
+    ASSERT_EQ(block_store_get_first_data_block(bs), 16u);
+    block_store_close(bs);
+
+    // and anything that's neither doesn't open
+    ASSERT_EQ(0, truncate("test_ac.bs", 65536 * 512 - 512));
+    ASSERT_EQ(nullptr, block_store_open("test_ac.bs"));
+}
+
+// 8 pages of data (16-79), then released in ways that do and don't free whole pages
+static void check_discard(const bs_backend_t backend) {
+    block_store_t *bs = block_store_create_backend("test_y.bs", backend);
+    if (!bs && backend == BS_BACKEND_DIRECT) {
+        GTEST_SKIP() << "no O_DIRECT here";
+    }
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_set_discard(bs, true));
+    unsigned first;
+    ASSERT_TRUE(block_store_allocate_run(bs, 64, &first));
+    ASSERT_EQ(first, 16u);
+    std::vector<uint8_t> data(512 * 64, 0x6B);
+    for (unsigned i = 0; i < 64; ++i) {
+        ASSERT_TRUE(block_store_write(bs, first + i, &data[512 * i]));
+    }
+    // a lone block isn't a page, nothing goes yet
+    block_store_release(bs, 16);
+    ASSERT_EQ(block_store_get_reclaimed_bytes(bs), 0u);
+    // the rest of that page frees it
+    block_store_release_range(bs, 17, 7);
+    const uint64_t one_page = block_store_get_reclaimed_bytes(bs);
+    ASSERT_GT(one_page, 0u);
+    uint8_t back[512];
+    ASSERT_TRUE(block_store_read(bs, 20, back));
+    ASSERT_EQ(back[0], 0);
+    ASSERT_EQ(back[511], 0);
+    // the allocators never noticed the claim
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u - 56u);
+    ASSERT_TRUE(block_store_read(bs, 24, back));
+    ASSERT_EQ(back[0], 0x6B);
+
+    // with discard off nothing happens until a trim
+    ASSERT_TRUE(block_store_set_discard(bs, false));
+    block_store_release_range(bs, 24, 56);
+    ASSERT_EQ(block_store_get_reclaimed_bytes(bs), one_page);
+    ASSERT_TRUE(block_store_read(bs, 30, back));
+    ASSERT_EQ(back[0], 0x6B);
+    ASSERT_GT(block_store_trim(bs), 0u);
+    ASSERT_GT(block_store_get_reclaimed_bytes(bs), one_page);
+    // nothing left to give back (before reading, RAM counts the zero page a read maps in as resident)
+    ASSERT_EQ(block_store_trim(bs), 0u);
+    ASSERT_TRUE(block_store_read(bs, 30, back));
+    ASSERT_EQ(back[0], 0);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+    block_store_close(bs);
+}
+
+TEST(bs_discard, mmap) {
+    ASSERT_NO_FATAL_FAILURE(check_discard(BS_BACKEND_MMAP));
+    struct stat st;
+    ASSERT_EQ(0, stat("test_y.bs", &st));
+    ASSERT_LT(st.st_blocks * 512, 64 * 1024);
+    block_store_t *bs = block_store_open("test_y.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_free_blocks(bs), 65536u - 16u);
+    block_store_close(bs);
+}
+
+TEST(bs_discard, pread) {
+    ASSERT_NO_FATAL_FAILURE(check_discard(BS_BACKEND_PREAD));
+}
+
+TEST(bs_discard, direct) {
+    ASSERT_NO_FATAL_FAILURE(check_discard(BS_BACKEND_DIRECT));
+}
+
+TEST(bs_discard, ram) {
+    ASSERT_NO_FATAL_FAILURE(check_discard(BS_BACKEND_RAM));
+    ASSERT_FALSE(block_store_set_discard(NULL, true));
+    ASSERT_EQ(block_store_trim(NULL), 0u);
+    ASSERT_EQ(block_store_get_reclaimed_bytes(NULL), 0u);
+}
+
+// Only what was written since the last sync is left to sync
+static void check_sync(const bs_backend_t backend) {
+    block_store_t *bs = block_store_create_backend("test_z.bs", backend);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 0u);
+    ASSERT_TRUE(block_store_sync(bs));
+
+    uint8_t buffer[512];
+    memset(buffer, 0x4D, sizeof(buffer));
+    // blocks 16 and 17 share a page, 100 and 1000 don't
+    ASSERT_EQ(block_store_allocate(bs), 16u);
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_TRUE(block_store_write(bs, 17, buffer));
+    ASSERT_TRUE(block_store_write(bs, 100, buffer));
+    uint8_t *rw = (uint8_t *) block_store_get_rw(bs, 1000);
+    ASSERT_NE(nullptr, rw);
+    memset(rw, 0x4E, 512);
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 3u);
+
+    ASSERT_TRUE(block_store_sync_range(bs, 0, 64));
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 2u);
+    ASSERT_TRUE(block_store_sync_range(bs, 1000, 1));
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 1u);
+    // dirty is a separate thing, sync leaves it alone
+    ASSERT_TRUE(block_store_is_dirty(bs, 16));
+    ASSERT_TRUE(block_store_sync(bs));
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 0u);
+    ASSERT_EQ(block_store_get_dirty_blocks(bs), 4u);
+
+    // the writable copy made it to the file without a close
+    FILE *file = fopen("test_z.bs", "rb");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(0, fseek(file, 1000 * 512, SEEK_SET));
+    ASSERT_EQ(fgetc(file), 0x4E);
+    // and so did the FBM, block 16 is taken
+    ASSERT_EQ(0, fseek(file, 2, SEEK_SET));
+    ASSERT_NE(fgetc(file), 0);
+    fclose(file);
+
+    // several ranges at once
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_TRUE(block_store_write(bs, 100, buffer));
+    ASSERT_TRUE(block_store_write(bs, 1000, buffer));
+    const block_range_t ranges[] = {{1000, 1}, {100, 1}};
+    ASSERT_TRUE(block_store_sync_ranges(bs, ranges, 2));
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 1u);
+
+    ASSERT_FALSE(block_store_sync_range(bs, 0, 0));
+    ASSERT_FALSE(block_store_sync_range(bs, 65535, 2));
+    const block_range_t bad[] = {{16, 1}, {65535, 2}};
+    ASSERT_FALSE(block_store_sync_ranges(bs, bad, 2));
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 1u);
+    ASSERT_FALSE(block_store_sync_ranges(bs, NULL, 1));
+    ASSERT_FALSE(block_store_sync_ranges(bs, ranges, 0));
+    ASSERT_FALSE(block_store_sync(NULL));
+    ASSERT_EQ(block_store_get_unsynced_pages(NULL), 0u);
+    block_store_close(bs);
+}
+
+TEST(bs_sync, mmap) {
+    check_sync(BS_BACKEND_MMAP);
+}
+
+TEST(bs_sync, pread) {
+    check_sync(BS_BACKEND_PREAD);
+}
+
+// Waits up to a couple of seconds for the flusher to get to it and leave at most left pages unsynced
+static bool wait_for_flusher(block_store_t *bs, uint64_t block_flusher_stats_t::*counter, const unsigned left) {
+    block_flusher_stats_t stats;
+    for (int i = 0; i < 200; ++i) {
+        if (block_store_get_flusher_stats(bs, &stats) && stats.*counter && block_store_get_unsynced_pages(bs) <= left) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+TEST(bs_flusher, threshold) {
+    block_store_t *bs = block_store_create("test_aa.bs");
+    ASSERT_NE(nullptr, bs);
+    block_flusher_stats_t stats;
+    ASSERT_FALSE(block_store_get_flusher_stats(bs, &stats));
+    ASSERT_FALSE(block_store_enable_flusher(bs, 0, 0));
+    ASSERT_FALSE(block_store_enable_flusher(NULL, 4096, 0));
+    // 16 pages and no age limit
+    ASSERT_TRUE(block_store_enable_flusher(bs, 16 * 4096, 0));
+    ASSERT_FALSE(block_store_enable_flusher(bs, 16 * 4096, 0));
+    ASSERT_TRUE(block_store_get_flusher_stats(bs, &stats));
+    ASSERT_EQ(stats.passes, 0u);
+
+    uint8_t buffer[512];
+    memset(buffer, 0x21, sizeof(buffer));
+    for (unsigned page = 2; page < 10; ++page) {
+        ASSERT_TRUE(block_store_write(bs, page * 8, buffer));
+    }
+    // under the threshold nothing happens
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_TRUE(block_store_get_flusher_stats(bs, &stats));
+    ASSERT_EQ(stats.passes, 0u);
+    ASSERT_EQ(block_store_get_unsynced_pages(bs), 8u);
+
+    for (unsigned page = 10; page < 30; ++page) {
+        ASSERT_TRUE(block_store_write(bs, page * 8, buffer));
+    }
+    // a pass can start before the last writes land, it only has to get things back under the threshold
+    ASSERT_TRUE(wait_for_flusher(bs, &block_flusher_stats_t::threshold_passes, 15));
+    ASSERT_TRUE(block_store_get_flusher_stats(bs, &stats));
+    ASSERT_GE(stats.pages, 16u);
+    ASSERT_EQ(stats.age_passes, 0u);
+    ASSERT_EQ(stats.failures, 0u);
+    block_store_close(bs);
+}
+
+TEST(bs_flusher, age) {
+    block_store_t *bs = block_store_create_backend("test_aa.bs", BS_BACKEND_PREAD);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_enable_flusher(bs, 0, 40));
+    uint8_t buffer[512];
+    memset(buffer, 0x22, sizeof(buffer));
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    ASSERT_TRUE(wait_for_flusher(bs, &block_flusher_stats_t::age_passes, 0));
+    block_flusher_stats_t stats;
+    ASSERT_TRUE(block_store_get_flusher_stats(bs, &stats));
+    ASSERT_EQ(stats.pages, 1u);
+    ASSERT_EQ(stats.threshold_passes, 0u);
+    block_store_close(bs);
+}
+
+TEST(bs_flusher, close) {
+    // neither limit comes close, close still has it sync what's left and waits for it
+    block_store_t *bs = block_store_create_backend(NULL, BS_BACKEND_RAM);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_TRUE(block_store_enable_flusher(bs, 1024 * 1024, 60000));
+    uint8_t buffer[512] = {0};
+    ASSERT_TRUE(block_store_write(bs, 16, buffer));
+    block_store_close(bs);
+}
+
+// Hints never change what's read back, even DONTNEED on blocks that haven't been synced
+static void check_advise(const bs_backend_t backend, const bool takes_hints) {
+    block_store_t *bs = block_store_create_backend("test_ab.bs", backend);
+    if (!bs && backend == BS_BACKEND_DIRECT) {
+        GTEST_SKIP() << "no O_DIRECT here";
+    }
+    ASSERT_NE(nullptr, bs);
+    uint8_t buffer[512], back[512];
+    memset(buffer, 0x5E, sizeof(buffer));
+    for (unsigned block = 16; block < 80; ++block) {
+        ASSERT_TRUE(block_store_write(bs, block, buffer));
+    }
+    const bs_advice_t advice[] = {BS_ADVISE_WILLNEED, BS_ADVISE_SEQUENTIAL, BS_ADVISE_RANDOM, BS_ADVISE_DONTNEED,
+                                  BS_ADVISE_NORMAL};
+    for (const bs_advice_t hint : advice) {
+        ASSERT_EQ(takes_hints, block_store_advise(bs, 16, 64, hint));
+        // not page aligned, it gets rounded out
+        ASSERT_EQ(takes_hints, block_store_advise(bs, 21, 3, hint));
+        ASSERT_TRUE(block_store_read(bs, 21, back));
+        ASSERT_EQ(0, memcmp(buffer, back, sizeof(buffer)));
+    }
+    ASSERT_FALSE(block_store_advise(bs, 16, 0, BS_ADVISE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 65535, 2, BS_ADVISE_WILLNEED));
+    ASSERT_FALSE(block_store_advise(bs, 16, 1, (bs_advice_t) 42));
+    ASSERT_FALSE(block_store_advise(NULL, 16, 1, BS_ADVISE_WILLNEED));
+    block_store_close(bs);
+}
+
+TEST(bs_advise, mmap) {
+    check_advise(BS_BACKEND_MMAP, true);
+}
+
+TEST(bs_advise, pread) {
+    check_advise(BS_BACKEND_PREAD, true);
+}
+
+TEST(bs_advise, direct) {
+    check_advise(BS_BACKEND_DIRECT, false);
+}
+
+TEST(bs_advise, ram) {
+    check_advise(BS_BACKEND_RAM, false);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,111 @@
+#include "f16fs.h"
+#include "block_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Not a test, just numbers. Run it from a release build if you want them to mean anything.
+// Runs against real files in the working directory, f16fs only speaks paths.
+
+#define BENCH_FNAME "bench.f16fs"
+#define BENCH_FORMATS 20
+#define BENCH_FILE_BYTES (24 * 1024 * 1024)
+#define BENCH_CHUNK_BYTES (64 * 1024)
+#define BENCH_READ_PASSES 5
+
+static double now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//what the image actually costs on disk, not what ls says
+static double footprint_kib(const char *fname) {
+	struct stat st;
+	if(stat(fname, &st) != 0){
+		return -1;
+	}
+	return st.st_blocks * 512 / 1024.0;
+}
+
+static void bench_format(void) {
+	double elapsed = 0;
+	for(int i = 0; i < BENCH_FORMATS; i++){
+		const double start = now_ns();
+		F16FS_t *fs = fs_format(BENCH_FNAME);
+		if(fs == NULL){
+			return;
+		}
+		fs_unmount(fs);
+		elapsed += now_ns() - start;
+	}
+	printf("format + unmount %8.3f ms   on disk %8.1f KiB\n", elapsed / BENCH_FORMATS / 1e6,
+		footprint_kib(BENCH_FNAME));
+
+	//what the same image costs once the space is reserved up front
+	block_store_t *bs = block_store_open(BENCH_FNAME);
+	if(bs == NULL){
+		return;
+	}
+	const double start = now_ns();
+	const bool reserved = block_store_preallocate(bs);
+	elapsed = now_ns() - start;
+	block_store_close(bs);
+	if(reserved){
+		printf("preallocate      %8.3f ms   on disk %8.1f KiB\n", elapsed / 1e6, footprint_kib(BENCH_FNAME));
+	} else {
+		printf("preallocate      not supported here\n");
+	}
+}
+
+//a big file read front to back in BENCH_CHUNK_BYTES pieces, the block map gets walked for every block
+//format 1 goes through block pointers and indirect tables, format 2 through extents, same 512 byte blocks
+static void bench_sequential_read(int version) {
+	F16FS_t *fs = version == 1 ? fs_format(BENCH_FNAME) : fs_format_ex(BENCH_FNAME, 512, 65536);
+	uint8_t *buffer = malloc(BENCH_CHUNK_BYTES);
+	if(fs == NULL || buffer == NULL || fs_create(fs, "/big", FS_REGULAR) != 0){
+		free(buffer);
+		if(fs != NULL){
+			fs_unmount(fs);
+		}
+		return;
+	}
+	for(int i = 0; i < BENCH_CHUNK_BYTES; i++){
+		buffer[i] = (uint8_t) i;
+	}
+	int fd = fs_open(fs, "/big");
+	for(size_t written = 0; written < BENCH_FILE_BYTES; written += BENCH_CHUNK_BYTES){
+		if(fs_write(fs, fd, buffer, BENCH_CHUNK_BYTES) != BENCH_CHUNK_BYTES){
+			printf("sequential read  format %d: couldn't write the file\n", version);
+			free(buffer);
+			fs_unmount(fs);
+			return;
+		}
+	}
+
+	double elapsed = 0;
+	for(int pass = 0; pass < BENCH_READ_PASSES; pass++){
+		fs_seek(fs, fd, 0, FS_SEEK_SET);
+		const double start = now_ns();
+		for(size_t read = 0; read < BENCH_FILE_BYTES; read += BENCH_CHUNK_BYTES){
+			fs_read(fs, fd, buffer, BENCH_CHUNK_BYTES);
+		}
+		elapsed += now_ns() - start;
+	}
+	printf("sequential read  format %d: %8.1f MiB/s\n", version,
+		(double) BENCH_FILE_BYTES * BENCH_READ_PASSES / (1024 * 1024) / (elapsed / 1e9));
+
+	free(buffer);
+	fs_unmount(fs);
+}
+
+int main(void) {
+	bench_format();
+	bench_sequential_read(1);
+	bench_sequential_read(2);
+	unlink(BENCH_FNAME);
+	return 0;
+}
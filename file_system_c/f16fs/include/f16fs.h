@@ -32,6 +32,30 @@ typedef struct {
 ///
 F16FS_t *fs_format(const char *path);
 
+///
+/// Formats (and mounts) an F16FS file with the given block geometry
+///   This makes a format 2 volume: 32 bit block pointers and 128 byte inodes,
+///   regular files are mapped by extents (runs of contiguous blocks) instead of the pointers
+///   fs_format makes the original format 1 volume, fs_mount takes either
+///   Pointer fan-out and the inode table's size follow the block size, fs_mount reads it back
+/// \param fname The file to format
+/// \param block_size Bytes per block, a power of two from 512 to 65536
+/// \param block_count Blocks in the volume, a multiple of 8 from 64 to 2^31
+/// \return Mounted F16FS object, NULL on error
+///
+F16FS_t *fs_format_ex(const char *path, size_t block_size, size_t block_count);
+
+///
+/// Copies a volume into a newly formatted format 2 volume, for moving format 1 volumes onto the new format
+///   Every directory and regular file is copied, the source is left as it was
+/// \param src_path The volume to copy, must not be mounted
+/// \param dst_path The file to format, formatted like fs_format_ex
+/// \param block_size Bytes per block of the new volume
+/// \param block_count Blocks in the new volume
+/// \return 0 on success, < 0 on error (the new volume may be partly written)
+///
+int fs_migrate(const char *src_path, const char *dst_path, size_t block_size, size_t block_count);
+
 ///
 /// Mounts an F16FS object and prepares it for use
 /// \param fname The file to mount
@@ -112,6 +136,25 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte);
 ///
 ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte);
 
+///
+/// Makes everything written to the file linked to the descriptor durable
+///   Only the file's own blocks (data, indirect tables and its inode) and the free block map are synced
+///   Directory entries are not, a newly created file needs fs_sync_dir on its directory too
+/// \param fs The F16FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(F16FS_t *fs, int fd);
+
+///
+/// Makes a directory's entries durable, the part of creating (or moving) a file that fs_fsync leaves out
+///   The directory's block and the inodes its entries point to are synced, along with the free block map
+/// \param fs The F16FS containing the directory
+/// \param path Absolute path to the directory
+/// \return 0 on success, < 0 on error
+///
+int fs_sync_dir(F16FS_t *fs, const char *path);
+
 ///
 /// Deletes the specified file
 ///   Directories can only be removed when empty
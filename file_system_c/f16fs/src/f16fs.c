@@ -3,7 +3,17 @@
 #include <stdio.h>
 #include <math.h>
 
-
+//the most blocks fs_read/fs_write hand to the block store in one vectored call
+#define IO_BATCH_BLOCKS 64
+//how much of a file fs_open asks the block store to start reading in
+#define PREFETCH_BYTES (128 * 1024)
+//format 1 block pointers are 16 bits, so a format 1 volume can't have more blocks than this
+#define FORMAT1_MAX_BLOCKS 65536
+#define INODE_COUNT 256
+//how much of a file fs_migrate moves at a time, a whole number of blocks at any block size
+#define MIGRATE_CHUNK_BYTES 65536
+
+//the on-disk format fs_format makes: no header, 64 byte inodes with 16 bit pointers, up to double indirect
 typedef struct {
 	uint8_t file_type;
 	uint8_t use_flag;	//0 for unused, 1 for used
@@ -13,11 +23,78 @@ typedef struct {
 	uint16_t direct_block_ptr_array[6];	//will simply be block_store block_id
 	uint16_t indirect_block_ptr;
 	uint16_t double_indirect_block_ptr;
+} inode_v1_t;
+
+//an extent maps a run of a file's logical blocks onto physically contiguous blocks
+//in an index node physical is the node one level down instead, and length goes unused
+typedef struct {
+	uint32_t logical;	//the first logical block it covers
+	uint32_t physical;
+	uint32_t length;
+} extent_t;
+
+//starts every node of an extent tree, the node's entries follow it sorted by logical block
+//the root is in the inode, every other node is a whole block
+typedef struct {
+	uint16_t count;
+	uint16_t depth;		//0 for a leaf (the entries are extents), otherwise how many levels of nodes are below it
+} extent_header_t;
+
+//the extent tree's root fills the part of the inode the block pointers would
+#define INLINE_EXTENTS 9
+//deep enough for a tree of single block extents over 2^31 blocks of 512 bytes
+#define EXTENT_MAX_DEPTH 8
+//inode flags, format 1 inodes don't have any
+#define INODE_EXTENTS 0x01	//mapped by an extent tree instead of block pointers
+
+//format 2 (fs_format_ex) inodes are 128 bytes with 32 bit pointers
+//regular files on a format 2 volume are mapped by extents instead, directories still use the pointers
+//the inode table in memory is always these, format 1 inodes are widened when they're loaded
+typedef struct {
+	uint8_t file_type;
+	uint8_t use_flag;	//0 for unused, 1 for used
+	uint8_t flags;
+	uint8_t padding;
+	int32_t num_blocks_in_use;
+	uint64_t file_size;
+	union {
+		struct {
+			uint32_t direct_block_ptr_array[12];	//will simply be block_store block_id
+			uint32_t indirect_block_ptr;
+			uint32_t double_indirect_block_ptr;
+		};
+		struct {	//INODE_EXTENTS
+			extent_header_t extent_header;
+			extent_t extents[INLINE_EXTENTS];
+		};
+	};
 } inode_t;
 
+//the first block after the block store's own on a format 2 volume, the inode table follows it
+//a format 1 volume has the root inode there, and an inode starts with its file type (never 'F')
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t inode_bytes;
+	uint32_t inode_count;
+	uint32_t ptr_bytes;
+} volume_header_t;
+
+#define VOLUME_MAGIC "F16FS\0v2"
+
+//the piece of a file's block map a descriptor last went through, so the next lookup near it skips the walk down
+//from the inode: for block pointers the indirect table the block's pointer sits in, for extents the block's extent
+typedef struct {
+	unsigned generation;	//the inode's map_generation when this was filled, it's stale once they differ
+	unsigned first_block;	//the first logical block the piece maps
+	unsigned block_count;	//how many it maps, 0 when nothing is cached
+	unsigned physical;		//the table's block, or the block first_block maps to
+} block_map_cache_t;
+
 typedef struct {
 	int inode_index;
 	unsigned long offset;
+	block_map_cache_t map;
 } file_descriptor_t;
 
 struct F16FS {
@@ -25,6 +102,31 @@ struct F16FS {
 	file_descriptor_t file_descriptors[256];
 	inode_t inodes[256];
 	int total_files;
+	unsigned alloc_goal[256];	//per inode, the last data block we handed out (0 if we don't know yet)
+	//per inode, bumped whenever a descriptor's block_map_cache_t could be wrong about it: an extent grew or was added
+	//(cached extents have a length), or the file was removed (its tables and blocks went back to the block store)
+	//a table never moves once it's there, new pointers just fill in, so writes to block-pointer files don't bump it
+	unsigned map_generation[256];
+	//the volume's format and geometry, worked out when it's formatted or mounted
+	int version;			//1 or 2, see inode_v1_t and inode_t
+	int block_size;
+	int ptr_bytes;			//2 or 4, how wide a block pointer is on disk
+	int ptrs_per_table;		//block pointers in one indirect table
+	int direct_ptrs;		//6 or 12
+	unsigned inode_start;	//the inode table's first block, after the block store's own (and the header for format 2)
+	unsigned inode_blocks;	//blocks the inode table takes up, the root directory is the block after
+	int inodes_per_block;
+};
+
+//physically contiguous blocks being collected into one run, the action gets the run once a block doesn't continue it
+//fs_fsync, prefetch_file and release_file_blocks all go through a file's blocks this way, see add_to_run
+typedef struct block_run block_run_t;
+typedef int (*run_action_t)(F16FS_t* fs, const block_run_t* run);
+struct block_run {
+	unsigned start;
+	unsigned length;		//0 while nothing is collected
+	run_action_t action;
+	void* context;			//whatever else the action needs, the list of ranges sync_block_run adds to
 };
 
 typedef struct{
@@ -33,21 +135,159 @@ typedef struct{
 	uint8_t num_entries;
 }directory_t;
 
+//reads the volume's geometry off its block store and works out the format's layout
+//\takes: F16FS_t file system struct with its block store opened, and the format version (0 to read it off the volume)
+//\returns 0 on success, -1 if the volume isn't one we know or has more blocks than a block pointer can reach
+int load_geometry(F16FS_t* fs, int version);
+
+//formats a freshly created block store: an inode table holding only the root and an empty root directory
+//the block store is closed if anything goes wrong
+//\takes: the block store to format, NULL (a failed create) is passed through, and the format version
+//\returns a mounted F16FS_t, NULL on error
+F16FS_t* format_block_store(block_store_t* store, int version);
+
+//reads and writes one entry of an indirect table, whatever width the volume's pointers are
+//\takes: F16FS_t file system struct, the table (where it sits in the block store), the entry, and the new value
+//\returns the block pointer
+unsigned table_get(const F16FS_t* fs, const void* table, int index);
+void table_set(const F16FS_t* fs, void* table, int index, unsigned block_ptr);
+
+//adds every block under an indirect table to a run in logical order, each table after the blocks it points to
+//\takes: F16FS_t file system struct, the table's block, how many levels of tables it heads (1 points at data),
+//\and the run being collected (see add_to_run)
+//\returns the run's action results or'd together
+int walk_table(F16FS_t* fs, unsigned table_block, int depth, block_run_t* run);
+
+//copies the directory tree under a path from one mounted volume to another, regular files' data included
+//\takes: the source and destination F16FS_t and the directory's path (the same on both)
+//\returns 0 on success, -1 on error
+int copy_tree(F16FS_t* src, F16FS_t* dst, const char* path);
+
+//copies one block's worth of the inode table from the block store into fs->inodes, or back out
+//\takes: F16FS_t file system struct, which block of the table (0 is the first), and 1 to write it out or 0 to read it in
+//\returns 0 on success, -1 on error
+int transfer_inode_block(F16FS_t* fs, unsigned table_block, uint8_t write_flag);
+
+//directories only take up the front of their block, these copy that part in or out
+//\takes: F16FS_t file system struct, the directory's block, and the directory to fill or write
+//\returns 0 on success, -1 on error
+int read_directory(F16FS_t* fs, unsigned block_ptr, directory_t* directory);
+int write_directory(F16FS_t* fs, unsigned block_ptr, const directory_t* directory);
+
 //traverses a directory path to return the parent inode of the ultimate destination
 //\takes a F16FS file system struct and a dyn_array of parsed path tokens
 //\returns an inode_t struct or NULL on error
 inode_t* directory_traversal(F16FS_t* fs, dyn_array_t* tokens);
 
-//simple helper function to free all the memory mallocs from directory traversal to keep the code cleaner
-void directory_traversal_frees(directory_t *root_directory, directory_t *working_directory, inode_t *root_inode);
-
 //gets a block number ("block ptr") from block store in file system, allocates a block if neccessary
 //\takes: F16FS_t file ssytem struct
 //\an inode index that is used to index into files systems inode table
 //\a block number to start at based on where we want to start writing or read in a file
 //\a flag that indicates if this is being called by read or write so we can differentiate when to allocate blocks while writing
+//\and the calling descriptor's block map cache (NULL if there isn't a descriptor), it's used and refilled
 //\returns a valid block number on success, -1 on error
-int get_block_ptr(F16FS_t* fs, int inode_index_for_write, int block_to_start_at, uint8_t read_write_flag);
+int get_block_ptr(F16FS_t* fs, int inode_index_for_write, int block_to_start_at, uint8_t read_write_flag, block_map_cache_t* cache);
+
+//gets an indirect table of block pointers where it sits in the block store, no copy is made
+//when writing and there's no table yet, a zeroed one is allocated and its block number stored in table_block
+//\takes: F16FS_t file system struct, the inode index of the file, the logical block number that needs the table,
+//\where the table's block number lives, and the read/write flag from get_block_ptr
+//\returns a pointer to the table's pointers (read them with table_get), NULL if there is no table (or no room for one)
+const void* get_table(F16FS_t* fs, int inode_index, int block, uint32_t* table_block, uint8_t read_write_flag);
+
+//get_block_ptr for extent-mapped files, blocks are only ever added past the end of the file
+//\takes: the same as get_block_ptr
+//\returns a valid block number on success (0 for a block that isn't mapped when reading), -1 on error
+int get_extent_block_ptr(F16FS_t* fs, int inode_index, unsigned block, uint8_t read_write_flag, block_map_cache_t* cache);
+
+//looks up where a run of a file's logical blocks starts, whichever way the file is mapped
+//\takes: F16FS_t file system struct, the inode index of the file, the logical block,
+//\where to put how many blocks from there on are physically contiguous (for block pointers, only as far as the
+//\inode's direct pointers or the table in the cache go), and the calling descriptor's block map cache (or NULL)
+//\returns the block number, 0 if the block isn't mapped (run_length is 0 then too)
+unsigned map_block_run(F16FS_t* fs, int inode_index, unsigned block, unsigned* run_length, block_map_cache_t* cache);
+
+//looks a logical block up in a file's extent tree, one binary search per level unless the cache already has its extent
+//\takes: F16FS_t file system struct, the inode index of the file, the logical block, where to put the run length
+//\(the rest of the block's extent), and the calling descriptor's block map cache (or NULL)
+//\returns the block number, 0 if the block isn't mapped
+unsigned map_extent(F16FS_t* fs, int inode_index, unsigned block, unsigned* run_length, block_map_cache_t* cache);
+
+//checks whether a descriptor's block map cache maps a logical block and is still good
+//\takes: F16FS_t file system struct, the inode index of the file, the cache (NULL is a miss) and the logical block
+//\returns true on a hit
+bool map_cache_hit(const F16FS_t* fs, int inode_index, const block_map_cache_t* cache, unsigned block);
+
+//fills a descriptor's block map cache, a NULL cache is left alone
+//\takes: F16FS_t file system struct, the inode index of the file, the cache, and the piece of the map (see block_map_cache_t)
+void map_cache_fill(const F16FS_t* fs, int inode_index, block_map_cache_t* cache, unsigned first_block, unsigned block_count, unsigned physical);
+
+//finds the entry of an extent tree node that covers a logical block, the last one starting at or before it
+//\takes: the node's header (its entries follow it) and the logical block
+//\returns the entry's index, -1 if the block comes before every entry
+int find_extent(const extent_header_t* node, unsigned block);
+
+//maps a block past the end of a file's extent tree, the last extent just grows when the block is right after it
+//a full leaf gets a new sibling (and its parent if that's full too), a full root moves down into a new node,
+//the tree only ever grows along its right edge
+//\takes: F16FS_t file system struct, the inode index of the file, the logical block and the block it maps to
+//\returns 0 on success, -1 if the block isn't past the end or there was no room for a new node
+int append_extent(F16FS_t* fs, int inode_index, unsigned block, unsigned block_ptr);
+
+//gets an extent tree node to change it, the root lives in the inode and the rest in the block store
+//\takes: F16FS_t file system struct, the inode of the file and the node's block (0 for the root)
+//\returns the node's header, NULL on error
+extent_header_t* get_extent_node(F16FS_t* fs, inode_t* inode, unsigned node_block);
+
+//adds every block of an extent-mapped file to a run in logical order, each node after the blocks under it like walk_table
+//\takes: F16FS_t file system struct, the node to start at (the root in the inode for the whole file),
+//\and the run being collected (see add_to_run)
+//\returns the run's action results or'd together
+int walk_extents(F16FS_t* fs, const extent_header_t* node, block_run_t* run);
+
+//allocates a data block for a file, trying to land it right after the file's previous block
+//\takes: F16FS_t file system struct, the inode index of the file, and the logical block number being allocated
+//\returns the new block number, 0 on error
+unsigned allocate_data_block(F16FS_t* fs, int inode_index, int block);
+
+//allocates an indirect table block for a file, placed a table's worth of blocks past the file's data
+//so the data blocks the table points at can still go down contiguously
+//\takes: F16FS_t file system struct, the inode index of the file, and the logical block number that needs the table
+//\returns the new block number, 0 on error
+unsigned allocate_table_block(F16FS_t* fs, int inode_index, int block);
+
+//releases every block a file owns (data and indirect tables) back to the block store
+//physically contiguous blocks are released as one range
+//\takes: F16FS_t file system struct and the inode of the file
+void release_file_blocks(F16FS_t* fs, const inode_t* inode);
+
+//adds physically contiguous blocks to the run being collected, if they don't continue it the run goes to its action first
+//\takes: F16FS_t file system struct, the run, the first block and how many follow it (block 0 just flushes the run)
+//\returns the action's result, 0 if it didn't run
+int add_to_run(F16FS_t* fs, block_run_t* run, unsigned block_ptr, unsigned count);
+
+//the run actions for release_file_blocks and fs_fsync, release the run or add it to the dyn_array of
+//block_range_t in its context for sync_ranges
+//\takes: F16FS_t file system struct and the run
+//\returns 0 on success, -1 if the run couldn't be added (releasing can't fail)
+int release_block_run(F16FS_t* fs, const block_run_t* run);
+int sync_block_run(F16FS_t* fs, const block_run_t* run);
+
+//syncs the ranges fs_fsync or fs_sync_dir collected and the free block map, all in one block store call
+//so a file backed volume is flushed once instead of once a range
+//\takes: F16FS_t file system struct and the dyn_array of block_range_t, which is destroyed
+//\returns 0 on success, -1 on error
+int sync_ranges(F16FS_t* fs, dyn_array_t* ranges);
+
+//asks the block store to start reading in a file's tables and the first PREFETCH_BYTES of its data
+//only a hint, nothing is read here and nothing fails if the block store doesn't take hints
+//\takes: F16FS_t file system struct and the inode index of the file
+void prefetch_file(F16FS_t* fs, int inode_index);
+
+//the run action for prefetch_file, hints count blocks from first
+//\takes: F16FS_t file system struct and the run
+//\returns 0, hints can't fail
+int prefetch_block_run(F16FS_t* fs, const block_run_t* run);
 
 
 
@@ -58,76 +298,292 @@ F16FS_t *fs_format(const char *path){
 		return NULL;
 	}
 
-	int i, j = 0;
-	unsigned blockid;
+	return format_block_store(block_store_create(path), 1);
+}
+
+F16FS_t *fs_format_ex(const char *path, size_t block_size, size_t block_count){
+
+	//parameter validation, the block store checks the geometry
+	if(path == NULL || strcmp(path, "") == 0){
+		return NULL;
+	}
+
+	return format_block_store(block_store_create_ex(path, block_size, block_count), 2);
+}
+
+int fs_migrate(const char *src_path, const char *dst_path, size_t block_size, size_t block_count){
+
+	//parameter validation, formatting over the source would lose it
+	if(src_path == NULL || dst_path == NULL || strcmp(src_path, dst_path) == 0){
+		return -1;
+	}
+
+	F16FS_t *src = fs_mount(src_path);
+	if(src == NULL){
+		return -1;
+	}
+	F16FS_t *dst = fs_format_ex(dst_path, block_size, block_count);
+	if(dst == NULL){
+		fs_unmount(src);
+		return -1;
+	}
+
+	int result = copy_tree(src, dst, "/");
+
+	fs_unmount(src);
+	if(fs_unmount(dst) != 0){
+		result = -1;
+	}
+	return result;
+}
+
+int copy_tree(F16FS_t* src, F16FS_t* dst, const char* path){
+
+	dyn_array_t *records = fs_get_dir(src, path);
+	if(records == NULL){
+		return -1;
+	}
+
+	uint8_t *buffer = (uint8_t*) malloc(MIGRATE_CHUNK_BYTES);
+	int result = buffer != NULL ? 0 : -1;
+	size_t i;
+
+	for(i = 0; result == 0 && i < dyn_array_size(records); i++){
+		const file_record_t *record = dyn_array_at(records, i);
+		char child_path[128];
+		snprintf(child_path, sizeof(child_path), "%s/%s", strcmp(path, "/") == 0 ? "" : path, record->name);
+
+		if(fs_create(dst, child_path, record->type) != 0){
+			result = -1;
+		}else if(record->type == FS_DIRECTORY){
+			result = copy_tree(src, dst, child_path);
+		}else{
+			//a whole chunk at a time keeps every read and write but the last on block boundaries
+			int src_fd = fs_open(src, child_path);
+			int dst_fd = fs_open(dst, child_path);
+			uint64_t left = src->inodes[record->inode_index].file_size;
+			if(src_fd < 0 || dst_fd < 0){
+				result = -1;
+			}
+			while(result == 0 && left > 0){
+				size_t chunk = left < MIGRATE_CHUNK_BYTES ? (size_t) left : MIGRATE_CHUNK_BYTES;
+				if(fs_read(src, src_fd, buffer, chunk) != (ssize_t) chunk || fs_write(dst, dst_fd, buffer, chunk) != (ssize_t) chunk){
+					result = -1;
+				}
+				left -= chunk;
+			}
+			fs_close(src, src_fd);
+			fs_close(dst, dst_fd);
+		}
+	}
+
+	free(buffer);
+	dyn_array_destroy(records);
+	return result;
+}
+
+F16FS_t* format_block_store(block_store_t* store, int version){
+
+	int i;
+
+	if(store == NULL){
+		return NULL;
+	}
 
 	F16FS_t *f16fs = (F16FS_t*) calloc(1, sizeof(F16FS_t));
 
 	//make sure calloc didn't fail
 	if(f16fs == NULL){
+		block_store_close(store);
 		return NULL;
 	}
 
-	f16fs->fs = block_store_create(path);
+	f16fs->fs = store;
+
+	if(load_geometry(f16fs, version) != 0){
+		block_store_close(store);
+		free(f16fs);
+		return NULL;
+	}
+
+	//format 2 starts with a header saying so, first fit hands out the block right after the block store's own
+	if(version == 2){
+		volume_header_t *header = block_store_get_rw(f16fs->fs, block_store_allocate(f16fs->fs));
+		if(header == NULL){
+			block_store_close(store);
+			free(f16fs);
+			return NULL;
+		}
+		memcpy(header->magic, VOLUME_MAGIC, sizeof(header->magic));
+		header->version = 2;
+		header->inode_bytes = sizeof(inode_t);
+		header->inode_count = INODE_COUNT;
+		header->ptr_bytes = sizeof(uint32_t);
+	}
 
 	//format inodes on filesystem
-	//each inode is 64 bytes; there will be 32 data blocks worth of 
-	//inodes(*512 byte data block size)so the inode table will be 16kb = 256 actual inodes
-	//and 8 inodes per block so use an array of 8 inodes to stamp that structure into each
-	//of the 32 blocks of inodes
-	inode_t inodes[8] = {{0}};
+	//there are 256 inodes (64 bytes each in format 1, 128 in format 2), so the inode table is 16kb or 32kb, spread over
+	//however many blocks that takes (32 of them for format 1 at 512 bytes); the calloc above already zeroed the table
+	//in memory and a fresh image reads back as zeros, so only the block holding the root inode gets written
+	inode_t *root = &(f16fs->inodes[0]);
 
 	//set up root inode
-	inodes[0].file_type = FS_DIRECTORY;
-	inodes[0].file_size = sizeof(directory_t);
-	inodes[0].use_flag = 1;
-	inodes[0].direct_block_ptr_array[0] = 48;
-
-	//root inode now lives at blockid 16 and has a direct block pointer pointing to blockid 48, the location of root directory
-	blockid = block_store_allocate(f16fs->fs);
-	block_store_write(f16fs->fs, blockid, inodes);
-	
-	//reset to 0 before looping to initialize the rest of our inodes
-	inodes[0].file_type = 0;
-	inodes[0].file_size = 0;
-	inodes[0].use_flag = 0;
-	inodes[0].direct_block_ptr_array[0] = 0;
+	root->file_type = FS_DIRECTORY;
+	root->file_size = sizeof(directory_t);
+	root->use_flag = 1;
+	root->direct_block_ptr_array[0] = f16fs->inode_start + f16fs->inode_blocks;
 
-	//initialize the other 31 inodes
-	for(i = 1; i < 32; i++){
-		blockid = block_store_allocate(f16fs->fs);
-		block_store_write(f16fs->fs, blockid, inodes);
+	//the inode table comes next
+	for(i = 0; i < (int) f16fs->inode_blocks; i++){
+		block_store_allocate(f16fs->fs);
 	}
 
+	//root inode now lives in the first inode block and has a direct block pointer to the root directory right after the table
+	transfer_inode_block(f16fs, 0, 1);
+
 	//initialize file descriptors to invalid state
 	for(i = 0; i < 256; i++){
 		f16fs->file_descriptors[i].inode_index = -1;
 	}
 	
-	//initialize root directory
-	blockid = block_store_allocate(f16fs->fs);
-	directory_t *root = (directory_t*) calloc(1,sizeof(directory_t));
+	//claim the root directory, an empty directory is all zeros so there's nothing to write
+	block_store_allocate(f16fs->fs);
 
-	block_store_write(f16fs->fs, blockid, root);
+	//the fixed layout above relies on first fit, file data doesn't need to rescan the front of the disk every time
+	block_store_set_alloc_policy(f16fs->fs, BS_NEXT_FIT);
 
-	//store inodeTable in f16fs struct
-	for(i = 0; i < 32; i++){	//32 512 byte blocks of inodes
-		block_store_read(f16fs->fs, i + 16, inodes);
-		memcpy(&(f16fs->inodes[j]), inodes, sizeof(inodes));
-		j += 8;
+	return f16fs;
+}
+
+int load_geometry(F16FS_t* fs, int version){
+
+	unsigned first_block = block_store_get_first_data_block(fs->fs);
+	unsigned block_count = block_store_get_block_count(fs->fs);
+
+	//a volume with a header is format 2, anything else is taken to be format 1
+	if(version == 0){
+		const volume_header_t *header = block_store_get_ro(fs->fs, first_block);
+		if(header == NULL){
+			return -1;
+		}
+		if(memcmp(header->magic, VOLUME_MAGIC, sizeof(header->magic)) != 0){
+			version = 1;
+		}else if(header->version == 2 && header->inode_bytes == sizeof(inode_t) && header->inode_count == INODE_COUNT
+			&& header->ptr_bytes == sizeof(uint32_t)){
+			version = 2;
+		}else{
+			return -1;
+		}
 	}
 
+	fs->version = version;
+	fs->block_size = (int) block_store_get_block_size(fs->fs);
+	if(version == 1){
+		if(block_count > FORMAT1_MAX_BLOCKS){
+			return -1;
+		}
+		fs->ptr_bytes = sizeof(uint16_t);
+		fs->direct_ptrs = 6;
+		fs->inode_start = first_block;
+		fs->inodes_per_block = fs->block_size / (int) sizeof(inode_v1_t);
+	}else{
+		fs->ptr_bytes = sizeof(uint32_t);
+		fs->direct_ptrs = 12;
+		fs->inode_start = first_block + 1;
+		fs->inodes_per_block = fs->block_size / (int) sizeof(inode_t);
+	}
+	fs->ptrs_per_table = fs->block_size / fs->ptr_bytes;
+	fs->inode_blocks = (INODE_COUNT + fs->inodes_per_block - 1) / fs->inodes_per_block;
 
-	free(root);
+	//the inode table and root directory have to fit
+	if(fs->inode_start + fs->inode_blocks >= block_count){
+		return -1;
+	}
+	return 0;
+}
 
-	return f16fs;
+int transfer_inode_block(F16FS_t* fs, unsigned table_block, uint8_t write_flag){
+
+	//the last block of the table isn't full if the table doesn't take up whole blocks (big blocks)
+	int first = table_block * fs->inodes_per_block;
+	int count = INODE_COUNT - first < fs->inodes_per_block ? INODE_COUNT - first : fs->inodes_per_block;
+	int i, j;
+
+	//format 2 inodes are the ones in memory, format 1 inodes get narrowed on the way out and widened on the way in
+	if(write_flag){
+		uint8_t *block = block_store_get_rw(fs->fs, fs->inode_start + table_block);
+		if(block == NULL){
+			return -1;
+		}
+		if(fs->version == 2){
+			memcpy(block, &(fs->inodes[first]), count * sizeof(inode_t));
+			return 0;
+		}
+		for(i = 0; i < count; i++){
+			const inode_t *inode = &(fs->inodes[first + i]);
+			inode_v1_t *disk_inode = &(((inode_v1_t*) block)[i]);
+			memset(disk_inode, 0, sizeof(inode_v1_t));
+			disk_inode->file_type = inode->file_type;
+			disk_inode->use_flag = inode->use_flag;
+			disk_inode->file_size = inode->file_size;
+			disk_inode->num_blocks_in_use = inode->num_blocks_in_use;
+			for(j = 0; j < 6; j++){
+				disk_inode->direct_block_ptr_array[j] = inode->direct_block_ptr_array[j];
+			}
+			disk_inode->indirect_block_ptr = inode->indirect_block_ptr;
+			disk_inode->double_indirect_block_ptr = inode->double_indirect_block_ptr;
+		}
+	}else{
+		const uint8_t *block = block_store_get_ro(fs->fs, fs->inode_start + table_block);
+		if(block == NULL){
+			return -1;
+		}
+		if(fs->version == 2){
+			memcpy(&(fs->inodes[first]), block, count * sizeof(inode_t));
+			return 0;
+		}
+		for(i = 0; i < count; i++){
+			inode_t *inode = &(fs->inodes[first + i]);
+			const inode_v1_t *disk_inode = &(((const inode_v1_t*) block)[i]);
+			memset(inode, 0, sizeof(inode_t));
+			inode->file_type = disk_inode->file_type;
+			inode->use_flag = disk_inode->use_flag;
+			inode->file_size = disk_inode->file_size;
+			inode->num_blocks_in_use = disk_inode->num_blocks_in_use;
+			for(j = 0; j < 6; j++){
+				inode->direct_block_ptr_array[j] = disk_inode->direct_block_ptr_array[j];
+			}
+			inode->indirect_block_ptr = disk_inode->indirect_block_ptr;
+			inode->double_indirect_block_ptr = disk_inode->double_indirect_block_ptr;
+		}
+	}
+	return 0;
+}
+
+int read_directory(F16FS_t* fs, unsigned block_ptr, directory_t* directory){
+
+	const directory_t *block = block_store_get_ro(fs->fs, block_ptr);
+	if(block == NULL){
+		return -1;
+	}
+	memcpy(directory, block, sizeof(directory_t));
+	return 0;
+}
+
+int write_directory(F16FS_t* fs, unsigned block_ptr, const directory_t* directory){
+
+	directory_t *block = block_store_get_rw(fs->fs, block_ptr);
+	if(block == NULL){
+		return -1;
+	}
+	memcpy(block, directory, sizeof(directory_t));
+	return 0;
 }
 
 
 F16FS_t *fs_mount(const char *path){
 
-	inode_t inodes[8];
-	int i, j = 0;
+	unsigned i;
 
 	//parameter validation
 	if(path == NULL || strcmp(path, "") == 0){
@@ -143,18 +599,28 @@ F16FS_t *fs_mount(const char *path){
 		return NULL;
 	}
 
+	//everything past here is placed by the volume's format and the block store's geometry
+	if(load_geometry(f16fs, 0) != 0){
+		block_store_close(f16fs->fs);
+		free(f16fs);
+		return NULL;
+	}
+
 	//initialize file descriptors to invalid state
 	for(i = 0; i < 256; i++){
 		f16fs->file_descriptors[i].inode_index = -1;
 	}
 
+	//the whole table is read right below, let the block store go get it in one go
+	block_store_advise(f16fs->fs, f16fs->inode_start, f16fs->inode_blocks, BS_ADVISE_WILLNEED);
+
 	//store inodeTable in f16fs struct
-	for(i = 0; i < 32; i++){	//32 512 byte blocks of inodes
-		block_store_read(f16fs->fs, i + 16, inodes);
-		memcpy(&(f16fs->inodes[j]), inodes, sizeof(inodes));
-		j += 8;
+	for(i = 0; i < f16fs->inode_blocks; i++){
+		transfer_inode_block(f16fs, i, 0);
 	}
 
+	block_store_set_alloc_policy(f16fs->fs, BS_NEXT_FIT);
+
 	return f16fs;
 }
 
@@ -165,15 +631,11 @@ int fs_unmount(F16FS_t *fs){
 		return -1;
 	}
 
-	inode_t inodes[8];
-	int i, j = 0;
+	unsigned i;
 
 	//write our modified inodeTable back to the storage device
-	for(i = 0; i < 32; i++){	//32 512 byte blocks of inodes
-		memcpy(inodes, &(fs->inodes[j]), sizeof(inodes));
-		block_store_write(fs->fs, i + 16, inodes);
-		
-		j += 8;
+	for(i = 0; i < fs->inode_blocks; i++){
+		transfer_inode_block(fs, i, 1);
 	}
 
 	//free the block store from memory
@@ -197,38 +659,26 @@ inode_t* directory_traversal(F16FS_t *fs, dyn_array_t* tokens){
 	int num_elements = dyn_array_size(tokens);
 	int i, j = 0;
 
-
-
-	directory_t *root_directory = (directory_t*) calloc(1, sizeof(directory_t));
-	directory_t *working_directory = (directory_t*) calloc(1, sizeof(directory_t));
-	inode_t *root_inode = (inode_t*)calloc(1, sizeof(inode_t));
 	inode_t *parent_inode = (inode_t*)calloc(1, sizeof(inode_t));
 	char path_element[65];
 
-	//start at the root
-	if(!memcpy(root_inode, &(fs->inodes[0]), 64)){	//get root inode into working memory
-		free(root_directory);
-		free(working_directory);
-		free(parent_inode);
-		free(root_inode);
+	if(parent_inode == NULL){
 		return NULL;
 	}
 
-
-	//get the block pointer to root directory from root inode
-	unsigned root_directory_block_ptr = root_inode->direct_block_ptr_array[0];
-
-	block_store_read(fs->fs, root_directory_block_ptr, root_directory);		//get the root directory into working memory
-
 	//if root was the only element in path
 	if(num_elements == 0){
-		free(root_directory);
-		free(working_directory);
+		memcpy(parent_inode, &(fs->inodes[0]), sizeof(inode_t));	//root inode is always inode 0
+		return parent_inode;
+	}
+
+	//start at the root, directories are looked at where they sit in the block store instead of being copied out
+	const directory_t *working_directory = block_store_get_ro(fs->fs, fs->inodes[0].direct_block_ptr_array[0]);
+	if(working_directory == NULL){
 		free(parent_inode);
-		return root_inode;
+		return NULL;
 	}
 
-	memcpy(working_directory, root_directory, 512);		//make a copy of root_directory
 	//scan directory records for path element
 	for(i = 0; i < num_elements; i++){		//for every element in the path
 		int num_entries = working_directory->num_entries;
@@ -241,24 +691,18 @@ inode_t* directory_traversal(F16FS_t *fs, dyn_array_t* tokens){
 			if(strcmp(path_element, working_directory->records[j].name) == 0){		//if we find a match
 
 				if(working_directory->records[j].type == 0 && !dyn_array_empty(tokens)){	//if a path element along the path is a file, we can't open it
-					directory_traversal_frees(root_directory, working_directory, root_inode);
-					if(parent_inode != NULL){
-						free(parent_inode);
-					}
+					free(parent_inode);
 					return NULL;
-				}else if(working_directory->records[j].type == 0 && dyn_array_empty(tokens)){	//if a file is found at the end of the path
-					memcpy(parent_inode, &(fs->inodes[working_directory->records[j].inode_index]), 64);		//get inode for next directory in path
-					block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], working_directory);	//retrieve next directory from storage
-					directory_traversal_frees(root_directory, working_directory, root_inode);
-					return parent_inode;
-				}else if(working_directory->records[j].type == 1 && dyn_array_empty(tokens)){	//if a directory is found at the end of the path
-					memcpy(parent_inode, &(fs->inodes[working_directory->records[j].inode_index]), 64);	//get inode for next directory in path
-					block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], working_directory);	//retrieve next directory from storage
-					directory_traversal_frees(root_directory, working_directory, root_inode);
+				}else if(dyn_array_empty(tokens)){	//if a file or directory is found at the end of the path
+					memcpy(parent_inode, &(fs->inodes[working_directory->records[j].inode_index]), sizeof(inode_t));	//get inode for end of path
 					return parent_inode;
-				}else if(working_directory->records[j].type == 1 && !dyn_array_empty(tokens)){	//if we find a directory along the path, open it and continue
-					memcpy(parent_inode, &(fs->inodes[working_directory->records[j].inode_index]), 64);	//get inode for next directory in path
-					block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], working_directory);	//retrieve next directory from storage
+				}else if(working_directory->records[j].type == 1){	//if we find a directory along the path, open it and continue
+					memcpy(parent_inode, &(fs->inodes[working_directory->records[j].inode_index]), sizeof(inode_t));	//get inode for next directory in path
+					working_directory = block_store_get_ro(fs->fs, parent_inode->direct_block_ptr_array[0]);	//move to next directory
+					if(working_directory == NULL){
+						free(parent_inode);
+						return NULL;
+					}
 				}else{
 					// printf("UNKNOWN ERROR: FILE NOT FOUND\n");
 				}
@@ -268,30 +712,11 @@ inode_t* directory_traversal(F16FS_t *fs, dyn_array_t* tokens){
 
 	}
 
-	directory_traversal_frees(root_directory, working_directory, root_inode);
-	if(parent_inode != NULL){
-		free(parent_inode);
-	}
+	free(parent_inode);
 
 	return NULL;
 }
 
-void directory_traversal_frees(directory_t *root_directory, directory_t *working_directory, inode_t *root_inode){
-
-	if(root_directory != NULL){
-		free(root_directory);
-	}
-
-	if(working_directory != NULL){
-		free(working_directory);
-	}
-	
-	if(root_inode != NULL){
-		free(root_inode);
-	}
-
-}
-
 ///
 /// Creates a new file at the specified location
 ///   Directories along the path that do not exist are NOT created
@@ -367,7 +792,7 @@ int fs_create(F16FS_t *fs, const char *path, file_t type){
 	record->type = type;
 	record->inode_index = free_inode_index;
 
-	block_store_read(fs->fs, parent_directory_block_pointer, parent_directory);		//get the parent directory block from storage
+	read_directory(fs, parent_directory_block_pointer, parent_directory);		//get the parent directory block from storage
 	int new_file_block_pointer;
 	//allocate a block as starting point for new file
 
@@ -421,7 +846,7 @@ int fs_create(F16FS_t *fs, const char *path, file_t type){
 	parent_directory->num_entries++;	//track number of entries in parent directory
 
 	//write updated parent directory back to storage
-	block_store_write(fs->fs, parent_directory_block_pointer, parent_directory);
+	write_directory(fs, parent_directory_block_pointer, parent_directory);
 
 
 	//set up new inode for new file
@@ -434,13 +859,20 @@ int fs_create(F16FS_t *fs, const char *path, file_t type){
 	}else{
 		new_file_inode->file_size = sizeof(directory_t);
 	}
-	new_file_inode->direct_block_ptr_array[0] = new_file_block_pointer;
+	if(type == 0 && fs->version == 2){	//format 2 files are mapped by extents, starting with the block allocated above
+		new_file_inode->flags = INODE_EXTENTS;
+		new_file_inode->extent_header.count = 1;
+		new_file_inode->extents[0] = (extent_t){0, new_file_block_pointer, 1};
+	}else{
+		new_file_inode->direct_block_ptr_array[0] = new_file_block_pointer;
+	}
+	fs->alloc_goal[free_inode_index] = new_file_block_pointer;
 
 	//write new file's inode to inode table
-	memcpy(&(fs->inodes[free_inode_index]), new_file_inode, 64);
+	memcpy(&(fs->inodes[free_inode_index]), new_file_inode, sizeof(inode_t));
 	//Finally, if the file type is a directory, write a directory structure to the file's allocated block
 	if(type == 1){
-		block_store_write(fs->fs, new_file_block_pointer, working_directory);
+		write_directory(fs, new_file_block_pointer, working_directory);
 	}
 
 	dyn_array_destroy(tokens);
@@ -514,20 +946,25 @@ int fs_open(F16FS_t *fs, const char *path){
 		return -1;
 	}
 
-	directory_t *parent_directory = (directory_t*) calloc(1, sizeof(directory_t));
-	file_record_t *record = (file_record_t*) calloc(1, sizeof(file_record_t));
-	inode_t *inode_for_open = (inode_t*)calloc(1, sizeof(inode_t));
-	int inode_index_for_open;
-	
-	block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], parent_directory);	//retrieve directory from storage
+	//look through the parent directory in place
+	const directory_t *parent_directory = block_store_get_ro(fs->fs, parent_inode->direct_block_ptr_array[0]);
+	int inode_index_for_open = -1;
 
 	//find the inode index of the file to be opened
-	for(i = 0; i < parent_directory->num_entries; i++){
+	for(i = 0; parent_directory != NULL && i < parent_directory->num_entries; i++){
 		if(strcmp(filename, parent_directory->records[i].name) == 0){
 			inode_index_for_open = parent_directory->records[i].inode_index;
 		}
 	}
 
+	dyn_array_destroy(tokens);
+	free(parent_inode);
+
+	//the file doesn't exist, or it's a directory which shouldn't be opened
+	if(inode_index_for_open < 0 || fs->inodes[inode_index_for_open].file_type == 1){
+		return -1;
+	}
+
 	int sentinel = -1;
 	i = 0;
 
@@ -535,43 +972,22 @@ int fs_open(F16FS_t *fs, const char *path){
 	while(sentinel < 0 && i < 256){
 		if(fs->file_descriptors[i].inode_index < 0){
 			fs->file_descriptors[i].inode_index = inode_index_for_open;
+			fs->file_descriptors[i].offset = 0;		//a reused descriptor still has the last file's position
+			fs->file_descriptors[i].map.block_count = 0;		//and its block map
 			sentinel = 1;
 		}
 		i++;
 	}
 
 	//ran out of fd descriptors
-	if(i == 256){
-		dyn_array_destroy(tokens);
-		free(parent_inode);
-		free(parent_directory);
-		free(record);
-		free(inode_for_open);		
+	if(sentinel < 0){
 		return -1;
 	}
 
-	int fd_index;
-	if(sentinel == 1){ 		//if an available fd was found
-		fd_index = i - 1;
-	}
-
-	//make a working copy of the inode for the file to be opened and check if it's a directory which shouldn't be opened
-	memcpy(inode_for_open, &(fs->inodes[inode_index_for_open]), 64);
-	if(inode_for_open->file_type == 1){
-		dyn_array_destroy(tokens);
-		free(parent_inode);
-		free(parent_directory);
-		free(record);
-		free(inode_for_open);		
-		return -1;
-	}
+	int fd_index = i - 1;
 
-
-	dyn_array_destroy(tokens);
-	free(parent_inode);
-	free(parent_directory);
-	free(record);
-	free(inode_for_open);
+	//whoever opens a file is about to read or write it
+	prefetch_file(fs, inode_index_for_open);
 
 	return fd_index;
 }
@@ -622,7 +1038,7 @@ off_t fs_seek(F16FS_t *fs, int fd, off_t offset, seek_t whence){
 
 	int inode_index_for_read = fs->file_descriptors[fd].inode_index;
 	unsigned long file_size = fs->inodes[inode_index_for_read].file_size;
-	int new_offset = 0;
+	off_t new_offset = 0;	//files can be bigger than an int on a format 2 volume
 	//bad fd
 	if(fs->file_descriptors[fd].inode_index < 0){
 		return -1;
@@ -637,7 +1053,7 @@ off_t fs_seek(F16FS_t *fs, int fd, off_t offset, seek_t whence){
 		new_offset = fs->file_descriptors[fd].offset + offset;
 	}
 	//if the offset ends up larger than file size, set the seeker to EOF
-	if(new_offset > (int)file_size){
+	if(new_offset > (off_t)file_size){
 		new_offset = file_size;
 	}
 	//if the offset ends up seeking before beginning of file, set the seeker to the beginning of file
@@ -676,18 +1092,21 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte){
 		return -1;
 	}
 
-	//get the inode index for the file we want to write to via the file descriptor
-	inode_t* inode_for_read = (inode_t*)calloc(1, sizeof(inode_t));
+	//get the inode index for the file we want to read from via the file descriptor
 	int inode_index_for_read = fs->file_descriptors[fd].inode_index;
-	memcpy(inode_for_read, &(fs->inodes[inode_index_for_read]), 64);
+	int block_size = fs->block_size;
 	unsigned long file_size = fs->inodes[inode_index_for_read].file_size;
-	int block_offset; 
+
+	//reading past EOF returns data up to EOF
+	if(fs->file_descriptors[fd].offset >= file_size){
+		return 0;
+	}
+	if(nbyte > file_size - fs->file_descriptors[fd].offset){
+		nbyte = file_size - fs->file_descriptors[fd].offset;
+	}
+
 	//find out if we are going to have an offset into a block
-	if(file_size == 0 && nbyte % 512 == nbyte){
-		block_offset = nbyte;
-	}else{
-		block_offset = fs->file_descriptors[fd].offset % 512;	//I changed this from fd.offset to file_size
-	}	
+	int block_offset = fs->file_descriptors[fd].offset % block_size;
 	char * dst_ptr = (char*)dst;
 
 	int bytes_read = 0;
@@ -695,55 +1114,82 @@ ssize_t fs_read(F16FS_t *fs, int fd, void *dst, size_t nbyte){
 
 	//get the location of the block we need to start at
 	int read_block_ptr = -1;
+	//how many blocks from read_block_ptr on are physically contiguous, a lookup gives back a whole extent
+	//(or a table's worth of consecutive pointers) and the reads below keep going along it until it runs out
+	unsigned run_left = 0;
 
-	uint8_t* temp_block = (uint8_t*)calloc(1, 512);
+	uint8_t* temp_block = (uint8_t*)calloc(1, block_size);
 
 	while(bytes_left_to_read > 0){
 		//use offset instead of filesize to find the starting block for read (vs the way we do it in write)
-		read_block_ptr = get_block_ptr(fs, inode_index_for_read, fs->file_descriptors[fd].offset / 512, 1);
+		if(run_left == 0){
+			read_block_ptr = map_block_run(fs, inode_index_for_read, fs->file_descriptors[fd].offset / block_size, &run_left, &(fs->file_descriptors[fd].map));
+		}
 
 		if(read_block_ptr <= 0){	//get_block_ptr failed (i.e. we ran out of blocks)
 			// printf("get_block_ptr failed!\n");
 			free(temp_block);
-			free(inode_for_read);
 			return bytes_read;
 		}
-		if(file_size < 512){	//initialization read
-			block_store_read(fs->fs, read_block_ptr, dst_ptr);
-			dst_ptr += nbyte;
-			bytes_read += nbyte;
-			fs->file_descriptors[fd].offset += nbyte;
-			bytes_left_to_read -= nbyte;
-			block_offset = fs->file_descriptors[fd].offset % 512;
-		}else if(block_offset != 0){		//read from offset within a block
-			block_store_read(fs->fs, read_block_ptr, temp_block);
-			memcpy(dst_ptr, temp_block + block_offset, 512 - block_offset);
-			dst_ptr += 512 - block_offset;
-			bytes_read += 512 - block_offset;
-			fs->file_descriptors[fd].offset += 512 - block_offset;
-			bytes_left_to_read -= 512 - block_offset;
+		if(block_offset != 0 || bytes_left_to_read < block_size){	//the head or tail of a read, part of a block, goes through temp_block so nothing past dst is touched
+			int length = block_size - block_offset < bytes_left_to_read ? block_size - block_offset : bytes_left_to_read;
+			if(!block_store_read(fs->fs, read_block_ptr, temp_block)){
+				free(temp_block);
+				return bytes_read;
+			}
+			memcpy(dst_ptr, temp_block + block_offset, length);
+			dst_ptr += length;
+			bytes_read += length;
+			fs->file_descriptors[fd].offset += length;
+			bytes_left_to_read -= length;
+			if(block_offset + length == block_size){	//done with this block, the next one is along the run
+				read_block_ptr++;
+				run_left--;
+			}
 			block_offset = 0;
-		}else{		//read a normal 512 block
-			block_store_read(fs->fs, read_block_ptr, dst_ptr);
-			dst_ptr += 512;
-			bytes_read += 512;
-			fs->file_descriptors[fd].offset += 512;
-			bytes_left_to_read -= 512;	
+		}else if(run_left > 1){		//a physically contiguous run, as much of it as the read still wants comes straight into dst in one go
+			unsigned count = run_left < (unsigned) (bytes_left_to_read / block_size) ? run_left : (unsigned) (bytes_left_to_read / block_size);
+			if(!block_store_read_range(fs->fs, read_block_ptr, count, dst_ptr)){
+				free(temp_block);
+				return bytes_read;
+			}
+			dst_ptr += block_size * count;
+			bytes_read += block_size * count;
+			fs->file_descriptors[fd].offset += block_size * count;
+			bytes_left_to_read -= block_size * count;
+			read_block_ptr += count;
+			run_left -= count;
+		}else{		//scattered whole blocks, every one we can resolve up front goes to the block store in one call
+			block_read_vec_t batch[IO_BATCH_BLOCKS];
+			int batch_count = 0;
+			while(batch_count < IO_BATCH_BLOCKS && bytes_left_to_read >= block_size * (batch_count + 1)){
+				if(run_left == 0){
+					read_block_ptr = map_block_run(fs, inode_index_for_read, fs->file_descriptors[fd].offset / block_size + batch_count, &run_left, &(fs->file_descriptors[fd].map));
+					//the next loop iteration finds a failed lookup out again and stops, and takes a run the fast way
+					if(read_block_ptr <= 0 || run_left > 1){
+						break;
+					}
+				}
+				batch[batch_count] = (block_read_vec_t){read_block_ptr, dst_ptr + block_size * batch_count};
+				batch_count++;
+				read_block_ptr++;
+				run_left--;
+			}
+			//a failed batch leaves the whole batch unread
+			if(!block_store_readv(fs->fs, batch, batch_count)){
+				free(temp_block);
+				return bytes_read;
+			}
+			dst_ptr += block_size * batch_count;
+			bytes_read += block_size * batch_count;
+			fs->file_descriptors[fd].offset += block_size * batch_count;
+			bytes_left_to_read -= block_size * batch_count;
 		}
 
 	}
 
-	//fix clerical errors from corner cases
-	if(bytes_left_to_read < 0){
-		bytes_read += bytes_left_to_read;
-		fs->file_descriptors[fd].offset += bytes_left_to_read;
-	}
-
-	free(inode_for_read);
 	free(temp_block);
-	return bytes_read;	
-
-
+	return bytes_read;
 }
 
 ///
@@ -776,15 +1222,9 @@ ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte){
 	//get the inode index for the file we want to write to via the file descriptor
 	inode_t* inode_for_write = (inode_t*)calloc(1, sizeof(inode_t));
 	int inode_index_for_write = fs->file_descriptors[fd].inode_index;
-	memcpy(inode_for_write, &(fs->inodes[inode_index_for_write]), 64);
-	unsigned long file_size = fs->inodes[inode_index_for_write].file_size;
+	int block_size = fs->block_size;
+	memcpy(inode_for_write, &(fs->inodes[inode_index_for_write]), sizeof(inode_t));
 	int block_offset; 
-	//find out if we need to offset to within a block
-	if(file_size == 0 && nbyte % 512 == nbyte){
-		block_offset = nbyte;
-	}else{
-		block_offset = file_size % 512;	
-	}	
 	//cast src so we can use ptr arithmetic
 	char * src_ptr = (char*)src;
 
@@ -794,39 +1234,64 @@ ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte){
 	//get the location of the block we need to start at
 	int write_block_ptr = -1;
 
-	uint8_t* temp_block = (uint8_t*)calloc(1, 512);
+	uint8_t* temp_block = (uint8_t*)calloc(1, block_size);
 
 	while(bytes_left_to_write > 0){
-		//by using file size / 512 we can get the block at the current end of file
-		write_block_ptr = get_block_ptr(fs, inode_index_for_write, fs->inodes[inode_index_for_write].file_size / 512, 0);
+		//by using file size / block size we can get the block at the current end of file
+		write_block_ptr = get_block_ptr(fs, inode_index_for_write, fs->inodes[inode_index_for_write].file_size / block_size, 0, &(fs->file_descriptors[fd].map));
 		if(write_block_ptr < 0){	//get_block_ptr failed (i.e. we probably ran out of blocks)
 			// printf("get_block_ptr failed!\n");
 			free(temp_block);
 			free(inode_for_write);
 			return bytes_written;
 		}
-		if(file_size < 512 && nbyte < 512){		//initialization write
-			block_store_write(fs->fs, write_block_ptr, src_ptr);
-			src_ptr += nbyte;
-			bytes_written += nbyte;
-			fs->inodes[inode_index_for_write].file_size += nbyte;
-			bytes_left_to_write -= nbyte;
-			block_offset = bytes_left_to_write % 512;
-		}else if(block_offset != 0){	//write to inside of a block at an offset via read-modify-write
-			block_store_read(fs->fs, write_block_ptr, temp_block);
-			memcpy(temp_block + block_offset, src_ptr, 512 - (512 - block_offset));
-			block_store_write(fs->fs, write_block_ptr, temp_block);
-			src_ptr += 512 - (512 - block_offset);
-			bytes_written += 512 - (512 - block_offset);
-			fs->inodes[inode_index_for_write].file_size += 512 - (512 - block_offset);
-			bytes_left_to_write -= 512 - (512 - block_offset);
-			block_offset = bytes_left_to_write % 512;
-		}else{		//normal write of 512 byte block
-			block_store_write(fs->fs, write_block_ptr, src_ptr);
-			src_ptr += 512;
-			bytes_written += 512;
-			fs->inodes[inode_index_for_write].file_size += 512;
-			bytes_left_to_write -= 512;	
+		//find out if the end of the file is inside its last block
+		block_offset = fs->inodes[inode_index_for_write].file_size % block_size;
+		if(block_offset != 0){	//fill in the rest of a partly written block (or as much as there is) via read-modify-write
+			int length = block_size - block_offset < bytes_left_to_write ? block_size - block_offset : bytes_left_to_write;
+			if(!block_store_read(fs->fs, write_block_ptr, temp_block)){
+				break;
+			}
+			memcpy(temp_block + block_offset, src_ptr, length);
+			if(!block_store_write(fs->fs, write_block_ptr, temp_block)){
+				break;
+			}
+			src_ptr += length;
+			bytes_written += length;
+			fs->inodes[inode_index_for_write].file_size += length;
+			bytes_left_to_write -= length;
+		}else if(bytes_left_to_write < block_size){		//the tail of a write, less than a block, goes through temp_block so nothing past src is read
+			if(!block_store_read(fs->fs, write_block_ptr, temp_block)){
+				break;
+			}
+			memcpy(temp_block, src_ptr, bytes_left_to_write);
+			if(!block_store_write(fs->fs, write_block_ptr, temp_block)){
+				break;
+			}
+			src_ptr += bytes_left_to_write;
+			bytes_written += bytes_left_to_write;
+			fs->inodes[inode_index_for_write].file_size += bytes_left_to_write;
+			bytes_left_to_write = 0;
+		}else{		//normal writes of whole blocks, batched into one block store call like fs_read
+			block_write_vec_t batch[IO_BATCH_BLOCKS];
+			int batch_count = 0;
+			batch[batch_count++] = (block_write_vec_t){write_block_ptr, src_ptr};
+			while(batch_count < IO_BATCH_BLOCKS && bytes_left_to_write >= block_size * (batch_count + 1)){
+				int next_block_ptr = get_block_ptr(fs, inode_index_for_write, fs->inodes[inode_index_for_write].file_size / block_size + batch_count, 0, &(fs->file_descriptors[fd].map));
+				if(next_block_ptr <= 0){	//out of blocks, the next loop iteration finds this out again and stops
+					break;
+				}
+				batch[batch_count] = (block_write_vec_t){next_block_ptr, src_ptr + block_size * batch_count};
+				batch_count++;
+			}
+			//the file only grows by what made it, blocks mapped for a failed batch are just reused by the next write
+			if(!block_store_writev(fs->fs, batch, batch_count)){
+				break;
+			}
+			src_ptr += block_size * batch_count;
+			bytes_written += block_size * batch_count;
+			fs->inodes[inode_index_for_write].file_size += block_size * batch_count;
+			bytes_left_to_write -= block_size * batch_count;
 		}
 	}
 
@@ -840,91 +1305,637 @@ ssize_t fs_write(F16FS_t *fs, int fd, const void *src, size_t nbyte){
 
 }
 
-int get_block_ptr(F16FS_t* fs, int inode_index, int block_to_start_at, uint8_t read_write_flag){
+///
+/// Makes everything written to the file linked to the descriptor durable
+///   Only the file's own blocks (data, indirect tables and its inode) and the free block map are synced
+///   Directory entries are not, a newly created file needs fs_sync_dir on its directory too
+/// \param fs The F16FS containing the file
+/// \param fd The file to sync
+/// \return 0 on success, < 0 on error
+///
+int fs_fsync(F16FS_t *fs, int fd){
+
+	//parameter validation
+	if(fs == NULL || fd > 255 || fd < 0 || fs->file_descriptors[fd].inode_index < 0){
+		return -1;
+	}
 
-	unsigned short block_ptr_array[256] = {0};
-	unsigned short double_indirect_block_ptr_array[256] = {0};
-	unsigned short double_IBP_index = 0;
-	unsigned short subarray_index = 0;
-	unsigned short block_ptr;
+	int inode_index = fs->file_descriptors[fd].inode_index;
+	const inode_t *inode = &(fs->inodes[inode_index]);
+	//the runs are only collected here, sync_ranges syncs them all at once
+	dyn_array_t *ranges = dyn_array_create(0, sizeof(block_range_t), NULL);
+	block_run_t run = {0, 0, sync_block_run, ranges};
+	int i, result = 0;
 
-	//if we need a double indirect
-	if(block_to_start_at >= 262){
-		//if our double_indirect_block_ptr is uninitialized, initialize it by allocating a block full of indirect block pointers
-		if(fs->inodes[inode_index].double_indirect_block_ptr == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
-				// printf("ERROR: ran out of blocks!\n");
-				return -1;			
+	//the inode table only lives in memory until unmount, so the file's inode block goes down first
+	unsigned inode_block = inode_index / fs->inodes_per_block;
+	if(ranges == NULL || transfer_inode_block(fs, inode_block, 1) != 0){
+		dyn_array_destroy(ranges);
+		return -1;
+	}
+
+	//same walk as release_file_blocks, the tables (or extent tree nodes) are synced along with the data they point to
+	if(inode->flags & INODE_EXTENTS){
+		result |= walk_extents(fs, &(inode->extent_header), &run);
+	}else{
+		const uint32_t top_tables[2] = {inode->indirect_block_ptr, inode->double_indirect_block_ptr};
+		for(i = 0; i < fs->direct_ptrs; i++){
+			if(inode->direct_block_ptr_array[i] != 0){
+				result |= add_to_run(fs, &run, inode->direct_block_ptr_array[i], 1);
 			}
-			block_store_write(fs->fs, block_ptr, double_indirect_block_ptr_array);
-			fs->inodes[inode_index].double_indirect_block_ptr = block_ptr;
-		}
-		//copy out double indirect block ptr block to working memory array
-		block_store_read(fs->fs, fs->inodes[inode_index].double_indirect_block_ptr, double_indirect_block_ptr_array);
-		//now we need to find the index to reference in our double IBP array to get to the appropriate sub-array of block pointers
-		double_IBP_index = (block_to_start_at - 262) / 256;
-		//if the subarray is unitiliazed, allocate and write a block ptr sub-array
-		if(double_indirect_block_ptr_array[double_IBP_index] == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
-				// printf("ERROR 1000: ran out of blocks!\n");
-				return -1;			
+		}
+		for(i = 0; i < 2; i++){
+			if(top_tables[i] != 0){
+				result |= walk_table(fs, top_tables[i], i + 1, &run);
 			}
-			block_store_write(fs->fs, block_ptr, block_ptr_array);
-			double_indirect_block_ptr_array[double_IBP_index] = block_ptr;
-			block_store_write(fs->fs, fs->inodes[inode_index].double_indirect_block_ptr, double_indirect_block_ptr_array);
-		}
-		//get index for ultimate double_block_pointer sub-array we need to index into
-		subarray_index = (block_to_start_at - 262 - 256*double_IBP_index);
-		//read out the appropriate block ptr sub-array
-		block_store_read(fs->fs, double_indirect_block_ptr_array[double_IBP_index], block_ptr_array);
-		//if the block we're after is unitialized, allocate it
-		if(block_ptr_array[subarray_index] == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
-				// printf("ERROR 1000: ran out of blocks!\n");	
-				return -1;			
-			}	
-			block_ptr_array[subarray_index] = block_ptr;
-			block_store_write(fs->fs, double_indirect_block_ptr_array[double_IBP_index], block_ptr_array);	
-		}
-		block_ptr = block_ptr_array[subarray_index];
-
-	}
-	if(block_to_start_at >= 6 && block_to_start_at < 262){		//if we need a single indirect
-		if(fs->inodes[inode_index].indirect_block_ptr == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
+		}
+	}
+	result |= add_to_run(fs, &run, fs->inode_start + inode_block, 1);
+	result |= add_to_run(fs, &run, 0, 0);
+
+	return result | sync_ranges(fs, ranges);
+}
+
+///
+/// Makes a directory's entries durable, the part of creating (or moving) a file that fs_fsync leaves out
+///   The directory's block and the inodes its entries point to are synced, along with the free block map
+/// \param fs The F16FS containing the directory
+/// \param path Absolute path to the directory
+/// \return 0 on success, < 0 on error
+///
+int fs_sync_dir(F16FS_t *fs, const char *path){
+
+	//parameter validation, parse_path takes up to 64 characters
+	if(fs == NULL || path == NULL || path[0] != '/' || strlen(path) > 64){
+		return -1;
+	}
+
+	//if the path has a trailing / and isn't the root
+	int path_length = (int)strlen(path);
+	if(path[path_length-1] == '/' && path_length > 1){
+		return -1;
+	}
+
+	dyn_array_t* tokens = parse_path(path);
+	if(tokens == NULL){
+		return -1;
+	}
+
+	//with the whole path in tokens, the traversal ends at the directory itself instead of its parent
+	inode_t* directory_inode = directory_traversal(fs, tokens);
+	dyn_array_destroy(tokens);
+	if(directory_inode == NULL){
+		return -1;
+	}
+	unsigned directory_block = directory_inode->file_type == 1 ? directory_inode->direct_block_ptr_array[0] : 0;
+	free(directory_inode);
+
+	const directory_t *directory = directory_block != 0 ? block_store_get_ro(fs->fs, directory_block) : NULL;
+	dyn_array_t *ranges = dyn_array_create(0, sizeof(block_range_t), NULL);
+	block_run_t run = {0, 0, sync_block_run, ranges};
+	int i, result = 0;
+
+	if(directory == NULL || ranges == NULL){
+		dyn_array_destroy(ranges);
+		return -1;
+	}
+
+	//an entry is only any use if the inode it points at is there too, and the inode table only lives in memory
+	result |= add_to_run(fs, &run, directory_block, 1);
+	for(i = 0; i < directory->num_entries; i++){
+		unsigned inode_block = directory->records[i].inode_index / fs->inodes_per_block;
+		if(transfer_inode_block(fs, inode_block, 1) != 0){
+			result = -1;
+		}
+		result |= add_to_run(fs, &run, fs->inode_start + inode_block, 1);
+	}
+	result |= add_to_run(fs, &run, 0, 0);
+
+	return result | sync_ranges(fs, ranges);
+}
+
+void prefetch_file(F16FS_t* fs, int inode_index){
+
+	const inode_t *inode = &(fs->inodes[inode_index]);
+	block_run_t run = {0, 0, prefetch_block_run, NULL};
+	unsigned mapped = 0;
+	int i;
+
+	//the tables first, finding the data blocks below has to read them
+	//an extent tree's first blocks are read by the lookups right below anyway
+	if(!(inode->flags & INODE_EXTENTS)){
+		if(inode->indirect_block_ptr != 0){
+			block_store_advise(fs->fs, inode->indirect_block_ptr, 1, BS_ADVISE_WILLNEED);
+		}
+		if(inode->double_indirect_block_ptr != 0){
+			block_store_advise(fs->fs, inode->double_indirect_block_ptr, 1, BS_ADVISE_WILLNEED);
+		}
+	}
+
+	int blocks = (int) ((inode->file_size + fs->block_size - 1) / fs->block_size);
+	if(blocks > PREFETCH_BYTES / fs->block_size){
+		blocks = PREFETCH_BYTES / fs->block_size;
+	}
+	for(i = 0; i < blocks; i += mapped > 0 ? (int) mapped : 1){
+		unsigned block_ptr = map_block_run(fs, inode_index, i, &mapped, NULL);
+		if(mapped > (unsigned) (blocks - i)){
+			mapped = blocks - i;
+		}
+		if(block_ptr != 0){
+			//the rest of the run is physically right after its first block, so it all joins the hint at once
+			add_to_run(fs, &run, block_ptr, mapped);
+		}
+	}
+	add_to_run(fs, &run, 0, 0);
+}
+
+int prefetch_block_run(F16FS_t* fs, const block_run_t* run){
+	block_store_advise(fs->fs, run->start, run->length, BS_ADVISE_WILLNEED);
+	return 0;
+}
+
+int sync_block_run(F16FS_t* fs, const block_run_t* run){
+	(void) fs;
+	const block_range_t range = {run->start, run->length};
+	return dyn_array_push_back((dyn_array_t*) run->context, &range) ? 0 : -1;
+}
+
+int sync_ranges(F16FS_t* fs, dyn_array_t* ranges){
+
+	//the free block map goes too, so the blocks in the ranges are still taken after a crash
+	const block_range_t free_block_map = {0, fs->inode_start};
+	bool synced = dyn_array_push_back(ranges, &free_block_map)
+		&& block_store_sync_ranges(fs->fs, dyn_array_front(ranges), dyn_array_size(ranges));
+	dyn_array_destroy(ranges);
+	return synced ? 0 : -1;
+}
+
+int get_block_ptr(F16FS_t* fs, int inode_index, int block_to_start_at, uint8_t read_write_flag, block_map_cache_t* cache){
+
+	inode_t *inode = &(fs->inodes[inode_index]);
+	unsigned block_ptr;
+	int depth;
+
+	if(inode->flags & INODE_EXTENTS){
+		return get_extent_block_ptr(fs, inode_index, block_to_start_at, read_write_flag, cache);
+	}
+
+	if(block_to_start_at < fs->direct_ptrs){		//if we need a direct block pointer
+		//get a direct block pointer
+		if(inode->direct_block_ptr_array[block_to_start_at] == 0 && read_write_flag == 0){
+			if((block_ptr = allocate_data_block(fs, inode_index, block_to_start_at)) == 0){
 				// printf("ERROR: ran out of blocks!\n");
-				return -1;				
+				return -1;
 			}
-			block_store_write(fs->fs, block_ptr, block_ptr_array);
-			fs->inodes[inode_index].indirect_block_ptr = block_ptr;
+			inode->direct_block_ptr_array[block_to_start_at] = block_ptr;
 		}
-		block_store_read(fs->fs, fs->inodes[inode_index].indirect_block_ptr, block_ptr_array);
-		//if we need to initialize a block for our indirect_block_ptr_array index
-		if(block_ptr_array[block_to_start_at - 6] == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
-				// printf("ERROR: ran out of blocks!\n");
-				return -1;				
+		return inode->direct_block_ptr_array[block_to_start_at];
+	}
+
+	//the table the descriptor's last lookup went through covers the next ptrs_per_table blocks, no walking down to it
+	const void *table;
+	uint32_t table_block;
+	unsigned long index;
+	if(map_cache_hit(fs, inode_index, cache, block_to_start_at)){
+		table_block = cache->physical;
+		index = block_to_start_at - cache->first_block;
+		table = block_store_get_ro(fs->fs, table_block);
+		if(table == NULL){
+			return read_write_flag == 0 ? -1 : 0;
+		}
+	}else{
+		//after the direct pointers come a table's worth through the indirect table and a table of tables' worth
+		//through the double indirect
+		index = block_to_start_at - fs->direct_ptrs;
+		unsigned long span = fs->ptrs_per_table;
+		for(depth = 1; index >= span; depth++){
+			if(depth == 2){
+				return read_write_flag == 0 ? -1 : 0;		//past the biggest file the format can hold
 			}
-			block_ptr_array[block_to_start_at - 6] = block_ptr;
-			block_store_write(fs->fs, fs->inodes[inode_index].indirect_block_ptr, block_ptr_array);
+			index -= span;
+			span *= fs->ptrs_per_table;
 		}
-		block_ptr = block_ptr_array[block_to_start_at - 6];
+		uint32_t *top_table = depth == 1 ? &(inode->indirect_block_ptr) : &(inode->double_indirect_block_ptr);
+
+		//the tables are looked at in place, only the entries that change get written
+		//a missing table is an error when writing (we ran out of blocks) and just an unallocated block when reading
+		//if a table is uninitialized, it gets a zeroed block and is hooked into the table (or inode) above it
+		table = get_table(fs, inode_index, block_to_start_at, top_table, read_write_flag);
+		if(table == NULL){
+			return read_write_flag == 0 ? -1 : 0;
+		}
+		table_block = *top_table;
+		for(; depth > 1; depth--){
+			//each entry of this table covers span blocks, find the one our block is under
+			span /= fs->ptrs_per_table;
+			int slot = (int) (index / span);
+			index %= span;
+			uint32_t next_table_block = table_get(fs, table, slot);
+			const void *next_table = get_table(fs, inode_index, block_to_start_at, &next_table_block, read_write_flag);
+			if(next_table == NULL){
+				return read_write_flag == 0 ? -1 : 0;
+			}
+			if(next_table_block != table_get(fs, table, slot)){
+				table_set(fs, block_store_get_rw(fs->fs, table_block), slot, next_table_block);
+			}
+			table = next_table;
+			table_block = next_table_block;
+		}
+		map_cache_fill(fs, inode_index, cache, block_to_start_at - index, fs->ptrs_per_table, table_block);
 	}
-	if(block_to_start_at < 6){		//if we need a direct block pointer
-		//get a direct block pointer
-		if(fs->inodes[inode_index].direct_block_ptr_array[block_to_start_at] == 0 && read_write_flag == 0){
-			if((block_ptr = block_store_allocate(fs->fs)) == 0){
-				// printf("ERROR: ran out of blocks!\n");
-				return -1;				
+
+	//if the block we're after is unitialized, allocate it
+	if(table_get(fs, table, (int) index) == 0 && read_write_flag == 0){
+		if((block_ptr = allocate_data_block(fs, inode_index, block_to_start_at)) == 0){
+			// printf("ERROR 1000: ran out of blocks!\n");
+			return -1;
+		}
+		table_set(fs, block_store_get_rw(fs->fs, table_block), (int) index, block_ptr);
+	}
+
+	return table_get(fs, table, (int) index);
+
+}
+
+const void* get_table(F16FS_t* fs, int inode_index, int block, uint32_t* table_block, uint8_t read_write_flag){
+
+	if(*table_block == 0){
+		if(read_write_flag != 0){
+			return NULL;
+		}
+		unsigned block_ptr = allocate_table_block(fs, inode_index, block);
+		void *table = block_store_get_rw(fs->fs, block_ptr);
+		if(table == NULL){
+			// printf("ERROR: ran out of blocks!\n");
+			return NULL;
+		}
+		memset(table, 0, fs->block_size);		//blocks get reused, so a new table starts out empty
+		*table_block = block_ptr;
+		return table;
+	}
+
+	return block_store_get_ro(fs->fs, *table_block);
+}
+
+unsigned table_get(const F16FS_t* fs, const void* table, int index){
+	if(fs->ptr_bytes == sizeof(uint16_t)){
+		return ((const uint16_t*) table)[index];
+	}
+	return ((const uint32_t*) table)[index];
+}
+
+void table_set(const F16FS_t* fs, void* table, int index, unsigned block_ptr){
+	if(fs->ptr_bytes == sizeof(uint16_t)){
+		((uint16_t*) table)[index] = (uint16_t) block_ptr;
+	}else{
+		((uint32_t*) table)[index] = block_ptr;
+	}
+}
+
+int walk_table(F16FS_t* fs, unsigned table_block, int depth, block_run_t* run){
+
+	const void *table = block_store_get_ro(fs->fs, table_block);
+	int i, result = 0;
+
+	for(i = 0; table != NULL && i < fs->ptrs_per_table; i++){
+		unsigned block_ptr = table_get(fs, table, i);
+		if(block_ptr != 0){
+			if(depth > 1){
+				result |= walk_table(fs, block_ptr, depth - 1, run);
+			}else{
+				result |= add_to_run(fs, run, block_ptr, 1);
 			}
-			fs->inodes[inode_index].direct_block_ptr_array[block_to_start_at] = block_ptr;
-		}		
-		block_ptr = fs->inodes[inode_index].direct_block_ptr_array[block_to_start_at];
+		}
+	}
+	//the table itself goes after everything it points to, the run's action may release it
+	return result | add_to_run(fs, run, table_block, 1);
+}
+
+int get_extent_block_ptr(F16FS_t* fs, int inode_index, unsigned block, uint8_t read_write_flag, block_map_cache_t* cache){
+
+	unsigned run_length;
+	unsigned block_ptr = map_extent(fs, inode_index, block, &run_length, cache);
+
+	if(block_ptr != 0 || read_write_flag != 0){
+		return block_ptr;
+	}
+
+	//writing a block that isn't there yet, it goes on the end of the file's last extent if it lands right after it
+	if((block_ptr = allocate_data_block(fs, inode_index, block)) == 0){
+		// printf("ERROR: ran out of blocks!\n");
+		return -1;
+	}
+	if(append_extent(fs, inode_index, block, block_ptr) != 0){
+		block_store_release(fs->fs, block_ptr);
+		return -1;
+	}
+	return block_ptr;
+}
+
+unsigned map_block_run(F16FS_t* fs, int inode_index, unsigned block, unsigned* run_length, block_map_cache_t* cache){
+
+	if(fs->inodes[inode_index].flags & INODE_EXTENTS){
+		return map_extent(fs, inode_index, block, run_length, cache);
 	}
 
+	int block_ptr = get_block_ptr(fs, inode_index, block, 1, cache);
+	if(block_ptr <= 0){
+		*run_length = 0;
+		return 0;
+	}
 
+	//the pointers after it in the inode, or in the table the lookup just cached, say how far the run goes
+	const inode_t *inode = &(fs->inodes[inode_index]);
+	*run_length = 1;
+	if(block < (unsigned) fs->direct_ptrs){
+		while(block + *run_length < (unsigned) fs->direct_ptrs
+			&& inode->direct_block_ptr_array[block + *run_length] == block_ptr + *run_length){
+			(*run_length)++;
+		}
+	}else if(map_cache_hit(fs, inode_index, cache, block)){
+		const void *table = block_store_get_ro(fs->fs, cache->physical);
+		unsigned index = block - cache->first_block;
+		while(table != NULL && index + *run_length < cache->block_count
+			&& table_get(fs, table, index + *run_length) == block_ptr + *run_length){
+			(*run_length)++;
+		}
+	}
 	return block_ptr;
+}
+
+unsigned map_extent(F16FS_t* fs, int inode_index, unsigned block, unsigned* run_length, block_map_cache_t* cache){
 
+	const extent_header_t *node = &(fs->inodes[inode_index].extent_header);
+
+	//a sequential reader's next run mostly starts in the extent it just read from
+	if(map_cache_hit(fs, inode_index, cache, block)){
+		*run_length = cache->block_count - (block - cache->first_block);
+		return cache->physical + (block - cache->first_block);
+	}
+
+	*run_length = 0;
+	while(node != NULL){
+		int i = find_extent(node, block);
+		if(i < 0){
+			return 0;
+		}
+		const extent_t *entry = &(((const extent_t*) (node + 1))[i]);
+		if(node->depth == 0){
+			//past the end of the extent is a block that isn't mapped (or past the end of the file)
+			if(block - entry->logical >= entry->length){
+				return 0;
+			}
+			*run_length = entry->length - (block - entry->logical);
+			map_cache_fill(fs, inode_index, cache, entry->logical, entry->length, entry->physical);
+			return entry->physical + (block - entry->logical);
+		}
+		node = block_store_get_ro(fs->fs, entry->physical);
+	}
+	return 0;
+}
+
+bool map_cache_hit(const F16FS_t* fs, int inode_index, const block_map_cache_t* cache, unsigned block){
+	//block - first_block wraps around for a block before the piece, so that's a miss too
+	return cache != NULL && cache->block_count > 0 && cache->generation == fs->map_generation[inode_index]
+		&& block - cache->first_block < cache->block_count;
+}
+
+void map_cache_fill(const F16FS_t* fs, int inode_index, block_map_cache_t* cache, unsigned first_block, unsigned block_count, unsigned physical){
+	if(cache != NULL){
+		*cache = (block_map_cache_t){fs->map_generation[inode_index], first_block, block_count, physical};
+	}
+}
+
+int find_extent(const extent_header_t* node, unsigned block){
+
+	const extent_t *entries = (const extent_t*) (node + 1);
+	int low = 0, high = node->count - 1, found = -1;
+
+	while(low <= high){
+		int middle = (low + high) / 2;
+		if(entries[middle].logical <= block){
+			found = middle;
+			low = middle + 1;
+		}else{
+			high = middle - 1;
+		}
+	}
+	return found;
+}
+
+int append_extent(F16FS_t* fs, int inode_index, unsigned block, unsigned block_ptr){
+
+	inode_t *inode = &(fs->inodes[inode_index]);
+	int node_capacity = (fs->block_size - (int) sizeof(extent_header_t)) / (int) sizeof(extent_t);
+	unsigned path[EXTENT_MAX_DEPTH + 1];		//the nodes along the right edge of the tree, path[0] is the root
+	int counts[EXTENT_MAX_DEPTH + 1];
+	int levels = 0, level, i;
+
+	//whatever happens below, the last extent or the nodes above it change, so cached copies of them go stale
+	fs->map_generation[inode_index]++;
+
+	//walk down the right edge to the last leaf
+	const extent_header_t *node = &(inode->extent_header);
+	path[0] = 0;
+	counts[0] = node->count;
+	while(node->depth > 0 && node->count > 0){
+		if(levels == EXTENT_MAX_DEPTH){
+			return -1;
+		}
+		path[++levels] = ((const extent_t*) (node + 1))[node->count - 1].physical;
+		if((node = block_store_get_ro(fs->fs, path[levels])) == NULL){
+			return -1;
+		}
+		counts[levels] = node->count;
+	}
+
+	//the usual case, the block is right after the last extent on both sides
+	if(node->count > 0){
+		const extent_t *last = &(((const extent_t*) (node + 1))[node->count - 1]);
+		if(block < last->logical + last->length){
+			return -1;
+		}
+		if(block == last->logical + last->length && block_ptr == last->physical + last->length){
+			extent_header_t *leaf = get_extent_node(fs, inode, path[levels]);
+			if(leaf == NULL){
+				return -1;
+			}
+			((extent_t*) (leaf + 1))[leaf->count - 1].length++;
+			return 0;
+		}
+	}
+
+	//a new extent goes in the last leaf, if that's full the lowest node on the right edge with room
+	//gets a new right edge hung off it
+	for(level = levels; level >= 0 && counts[level] >= (level == 0 ? INLINE_EXTENTS : node_capacity); level--);
+
+	//nothing has room, the root's entries move down into a new node and the root points at it
+	if(level < 0){
+		if(levels == EXTENT_MAX_DEPTH){
+			return -1;
+		}
+		unsigned moved_block = allocate_table_block(fs, inode_index, block);
+		extent_header_t *moved = moved_block != 0 ? block_store_get_rw(fs->fs, moved_block) : NULL;
+		if(moved == NULL){
+			return -1;
+		}
+		memcpy(moved, &(inode->extent_header), sizeof(extent_header_t) + inode->extent_header.count * sizeof(extent_t));
+		inode->extent_header.depth++;
+		inode->extent_header.count = 1;
+		inode->extents[0] = (extent_t){inode->extents[0].logical, moved_block, 0};
+		for(i = levels; i > 0; i--){
+			path[i + 1] = path[i];
+		}
+		path[1] = moved_block;
+		levels++;
+		//the moved node has a whole block for what fit in the inode, so it's the one with room
+		level = 1;
+	}
+
+	//the levels below the one with room are all full, each gets a new node on the right
+	//they're all allocated first so running out of blocks doesn't leave an empty node in the tree
+	for(i = level + 1; i <= levels; i++){
+		if((path[i] = allocate_table_block(fs, inode_index, block)) == 0){
+			for(i--; i > level; i--){
+				block_store_release(fs->fs, path[i]);
+			}
+			return -1;
+		}
+	}
+	for(i = level + 1; i <= levels; i++){
+		extent_header_t *parent = get_extent_node(fs, inode, path[i - 1]);
+		extent_header_t *new_node = block_store_get_rw(fs->fs, path[i]);
+		if(parent == NULL || new_node == NULL){
+			return -1;
+		}
+		new_node->count = 0;
+		new_node->depth = levels - i;
+		((extent_t*) (parent + 1))[parent->count++] = (extent_t){block, path[i], 0};
+	}
+
+	extent_header_t *leaf = get_extent_node(fs, inode, path[levels]);
+	if(leaf == NULL){
+		return -1;
+	}
+	((extent_t*) (leaf + 1))[leaf->count++] = (extent_t){block, block_ptr, 1};
+	return 0;
+}
+
+extent_header_t* get_extent_node(F16FS_t* fs, inode_t* inode, unsigned node_block){
+	if(node_block == 0){
+		return &(inode->extent_header);
+	}
+	return block_store_get_rw(fs->fs, node_block);
+}
+
+int walk_extents(F16FS_t* fs, const extent_header_t* node, block_run_t* run){
+
+	const extent_t *entries = (const extent_t*) (node + 1);
+	int i, result = 0;
+
+	for(i = 0; i < node->count; i++){
+		if(node->depth > 0){
+			const extent_header_t *child = block_store_get_ro(fs->fs, entries[i].physical);
+			if(child != NULL){
+				result |= walk_extents(fs, child, run);
+			}
+			//a node goes after everything under it, the run's action may release it
+			result |= add_to_run(fs, run, entries[i].physical, 1);
+		}else if(entries[i].length > 0){
+			//an extent is physically contiguous already, so the whole thing joins the run in one go
+			result |= add_to_run(fs, run, entries[i].physical, entries[i].length);
+		}
+	}
+	return result;
+}
+
+unsigned allocate_data_block(F16FS_t* fs, int inode_index, int block){
+
+	//if we don't know where the file left off (fresh mount), look up the block before this one
+	if(fs->alloc_goal[inode_index] == 0 && block > 0){
+		int previous_block = get_block_ptr(fs, inode_index, block - 1, 1, NULL);
+		if(previous_block > 0){
+			fs->alloc_goal[inode_index] = previous_block;
+		}
+	}
+
+	unsigned block_ptr;
+	if(fs->alloc_goal[inode_index] == 0){
+		block_ptr = block_store_allocate(fs->fs);
+	}else{
+		block_ptr = block_store_allocate_near(fs->fs, fs->alloc_goal[inode_index] + 1);
+	}
+
+	if(block_ptr != 0){
+		fs->alloc_goal[inode_index] = block_ptr;
+	}
+	return block_ptr;
+}
+
+unsigned allocate_table_block(F16FS_t* fs, int inode_index, int block){
+
+	//a table is always allocated right before the first data block it points to, so leave room for
+	//that data block and the rest the table points to (256 of them with 512 byte blocks), then the table goes after them
+	unsigned data_goal = fs->alloc_goal[inode_index];
+	if(data_goal == 0 && block > 0){
+		int previous_block = get_block_ptr(fs, inode_index, block - 1, 1, NULL);
+		if(previous_block > 0){
+			data_goal = previous_block;
+		}
+	}
+
+	if(data_goal == 0){
+		return block_store_allocate(fs->fs);
+	}
+	return block_store_allocate_near(fs->fs, data_goal + 1 + fs->ptrs_per_table);
+}
+
+int add_to_run(F16FS_t* fs, block_run_t* run, unsigned block_ptr, unsigned count){
+
+	//still contiguous, keep going
+	if(block_ptr != 0 && run->length > 0 && block_ptr == run->start + run->length){
+		run->length += count;
+		return 0;
+	}
+	int result = run->length > 0 ? run->action(fs, run) : 0;
+	run->start = block_ptr;
+	run->length = block_ptr != 0 ? count : 0;
+	return result;
+}
+
+int release_block_run(F16FS_t* fs, const block_run_t* run){
+	block_store_release_range(fs->fs, run->start, run->length);
+	return 0;
+}
+
+void release_file_blocks(F16FS_t* fs, const inode_t* inode){
+
+	const uint32_t top_tables[2] = {inode->indirect_block_ptr, inode->double_indirect_block_ptr};
+	block_run_t run = {0, 0, release_block_run, NULL};
+	int i;
+
+	//an extent is already a run
+	if(inode->flags & INODE_EXTENTS){
+		walk_extents(fs, &(inode->extent_header), &run);
+		add_to_run(fs, &run, 0, 0);
+		return;
+	}
+
+	//walk the block map in logical order so the data blocks come out in runs
+	for(i = 0; i < fs->direct_ptrs; i++){
+		if(inode->direct_block_ptr_array[i] != 0){
+			add_to_run(fs, &run, inode->direct_block_ptr_array[i], 1);
+		}
+	}
+	//a table is released after the blocks it points to, its own table is still around and it's been read by then
+	//and tables sit right after the data they point to, so they mostly just extend the run
+	for(i = 0; i < 2; i++){
+		if(top_tables[i] != 0){
+			walk_table(fs, top_tables[i], i + 1, &run);
+		}
+	}
+	//flush whatever run is left
+	add_to_run(fs, &run, 0, 0);
 }
 
 ///
@@ -977,7 +1988,7 @@ int fs_remove(F16FS_t *fs, const char *path){
 	inode_t *blanked_inode = (inode_t*)calloc(1, sizeof(inode_t));
 	int inode_index_for_removal = 999;
 	int records_index = 999;
-	block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], parent_directory);	//retrieve directory from storage
+	read_directory(fs, parent_inode->direct_block_ptr_array[0], parent_directory);	//retrieve directory from storage
 
 	//if the parent directory is empty then the file doesn't exist to be removed
 	if(parent_directory->num_entries == 0){
@@ -1012,7 +2023,7 @@ int fs_remove(F16FS_t *fs, const char *path){
 	}
 	i = 0;
 	//make a working copy of the inode for the file to be removed
-	memcpy(inode_for_removal, &(fs->inodes[inode_index_for_removal]), 64);
+	memcpy(inode_for_removal, &(fs->inodes[inode_index_for_removal]), sizeof(inode_t));
 	//if it's a file
 	if(inode_for_removal->file_type == 0){
 		//swap the last record in the parent directory into this spot we want to delete
@@ -1021,30 +2032,16 @@ int fs_remove(F16FS_t *fs, const char *path){
 		}
 		memcpy(&(parent_directory->records[parent_directory->num_entries]), blanked_record, 72);	//blank the last record just to be safe
 		parent_directory->num_entries--;
-		block_store_write(fs->fs, parent_inode->direct_block_ptr_array[0], parent_directory);
+		write_directory(fs, parent_inode->direct_block_ptr_array[0], parent_directory);
 	
 		//free all the blocks used by the file
-		unsigned long file_size = fs->inodes[inode_index_for_removal].file_size;
-		uint8_t read_block_ptr = 99;
-		while(file_size > 0){
-			//use offset instead of filesize to find the starting block for read (vs the way we do it in write)
-			if(file_size <= 512){
-				block_store_release(fs->fs, inode_for_removal->direct_block_ptr_array[0]);;
-				file_size -= 512;
-			}else{
-				read_block_ptr = get_block_ptr(fs, inode_index_for_removal, file_size / 512 + 1, 1);
-				// if(read_block_ptr <= 0){	//get_block_ptr failed (i.e. we ran out of blocks)
-				// 	printf("get_block_ptr failed!\n");
-				// 	return -1;
-				// }
-				block_store_release(fs->fs, read_block_ptr);
-				file_size -= 512;
-			}
-		}
+		release_file_blocks(fs, inode_for_removal);
 		//blank the inode (setting it's state to unused at the same time)
-		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, 64);
+		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, sizeof(inode_t));
+		fs->alloc_goal[inode_index_for_removal] = 0;
+		fs->map_generation[inode_index_for_removal]++;		//descriptors still open on it mustn't find its old blocks
 	}else{		//otherwise it's a directory and we have to see if it's empty first
-		block_store_read(fs->fs, inode_for_removal->direct_block_ptr_array[0], working_directory);
+		read_directory(fs, inode_for_removal->direct_block_ptr_array[0], working_directory);
 		if(working_directory->num_entries > 0){		//can't delete a directory with files in it
 			// printf("ERROR: Cannot delete directory that is not empty!\n");
 			free(parent_directory);
@@ -1059,15 +2056,15 @@ int fs_remove(F16FS_t *fs, const char *path){
 		//free the block
 		block_store_release(fs->fs, inode_for_removal->direct_block_ptr_array[0]);
 		//blank the inode (setting it's state to unused at the same time)
-		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, 64);
+		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, sizeof(inode_t));
 		//swap the last record in the parent directory into this spot we want to delete
 		if((parent_directory->num_entries-1) != records_index){
 			memcpy(&(parent_directory->records[records_index]),&(parent_directory->records[parent_directory->num_entries-1]), 72);
 		}
 		memcpy(&(parent_directory->records[parent_directory->num_entries]), blanked_record, 72);	//blank the last record just to be safe
 		parent_directory->num_entries--;
-		block_store_write(fs->fs, parent_inode->direct_block_ptr_array[0], parent_directory);
-		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, 64);
+		write_directory(fs, parent_inode->direct_block_ptr_array[0], parent_directory);
+		memcpy(&(fs->inodes[inode_index_for_removal]), blanked_inode, sizeof(inode_t));
 	}
 
 
@@ -1133,12 +2130,12 @@ dyn_array_t *fs_get_dir(F16FS_t *fs, const char *path){
 	dyn_array_t *dir_info = dyn_array_create(0, sizeof(file_record_t), NULL);
 	int inode_index_for_open, i;
 	
-	block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], parent_directory);	//retrieve parent directory from storage
+	read_directory(fs, parent_inode->direct_block_ptr_array[0], parent_directory);	//retrieve parent directory from storage
 
 	//special logic for if the path to open is root since my directory_traversal() returns the parent directory of the final path destination
 	if(strcmp(path, "/") == 0){
 
-		block_store_read(fs->fs, parent_inode->direct_block_ptr_array[0], working_directory);	//retrieve root directory from storage
+		read_directory(fs, parent_inode->direct_block_ptr_array[0], working_directory);	//retrieve root directory from storage
 
 		if(working_directory->num_entries == 0){		//if the folder is empty
 			dyn_array_destroy(tokens);
@@ -1172,7 +2169,7 @@ dyn_array_t *fs_get_dir(F16FS_t *fs, const char *path){
 	}
 
 	//retrieve inode of directory we want
-	memcpy(inode_for_open, &(fs->inodes[inode_index_for_open]), 64);		
+	memcpy(inode_for_open, &(fs->inodes[inode_index_for_open]), sizeof(inode_t));		
 
 	if(inode_for_open->file_type == 0){		//we can't return dir info from a FS_REGULAR file type
 		dyn_array_destroy(tokens);
@@ -1185,7 +2182,7 @@ dyn_array_t *fs_get_dir(F16FS_t *fs, const char *path){
 		return NULL;
 	}	
 
-	block_store_read(fs->fs, inode_for_open->direct_block_ptr_array[0], working_directory);	//retrieve directory from storage
+	read_directory(fs, inode_for_open->direct_block_ptr_array[0], working_directory);	//retrieve directory from storage
 
 	if(working_directory->num_entries == 0){		//if the directory is empty
 		dyn_array_destroy(tokens);
@@ -1287,8 +2284,8 @@ int fs_move(F16FS_t *fs, const char *src, const char *dst){
 
 	directory_t* src_parent_directory = (directory_t*) calloc(1, sizeof(directory_t));
 	directory_t* dst_parent_directory = (directory_t*) calloc(1, sizeof(directory_t));
-	block_store_read(fs->fs, src_parent_inode->direct_block_ptr_array[0], src_parent_directory);	//get src parent directory
-	block_store_read(fs->fs, dst_parent_inode->direct_block_ptr_array[0], dst_parent_directory);	//get dst parent directory
+	read_directory(fs, src_parent_inode->direct_block_ptr_array[0], src_parent_directory);	//get src parent directory
+	read_directory(fs, dst_parent_inode->direct_block_ptr_array[0], dst_parent_directory);	//get dst parent directory
 
 	//check if dst already exists
 	for(i = 0; i < dst_parent_directory->num_entries; i++){
@@ -1356,8 +2353,8 @@ int fs_move(F16FS_t *fs, const char *src, const char *dst){
 	src_parent_directory->num_entries--;
 
 	//write modified directories back to storage
-	block_store_write(fs->fs, src_parent_inode->direct_block_ptr_array[0], src_parent_directory);
-	block_store_write(fs->fs, dst_parent_inode->direct_block_ptr_array[0], dst_parent_directory);
+	write_directory(fs, src_parent_inode->direct_block_ptr_array[0], src_parent_directory);
+	write_directory(fs, dst_parent_inode->direct_block_ptr_array[0], dst_parent_directory);
 
 	dyn_array_destroy(src_tokens);
 	dyn_array_destroy(dst_tokens);
@@ -1,5 +1,6 @@
 #include <cstdlib>
 #include <iostream>
+#include <algorithm>
 #include <new>
 #include <vector>
 #include <dyn_array.h>
@@ -98,6 +99,264 @@ TEST(a_tests, format_mount_unmount) {
     score += 2; // congrats, you didn't break it! Have some points.
 }
 
+/*
+    F16FS_t *fs_format_ex(const char *path, size_t block_size, size_t block_count)
+    1. Normal, 4KiB blocks, a 9MiB file and a directory, still there after a remount
+    2. Normal, 64KiB blocks, the whole inode table fits in part of one block
+    3. Error, NULL/empty path
+    4. Error, bad block size or count
+    5. Normal, more blocks than 16 bits reach and a file that goes past block 65535
+*/
+
+TEST(a_tests, format_ex) {
+    const char *test_fname = "a_tests_ex.f16fs";
+
+    // FORMAT_EX 3
+    ASSERT_EQ(fs_format_ex(NULL, 4096, 8192), nullptr);
+    ASSERT_EQ(fs_format_ex("", 4096, 8192), nullptr);
+
+    // FORMAT_EX 4
+    ASSERT_EQ(fs_format_ex(test_fname, 1000, 8192), nullptr);
+    ASSERT_EQ(fs_format_ex(test_fname, 4096, 8190), nullptr);
+
+    // FORMAT_EX 1
+    F16FS_t *fs = fs_format_ex(test_fname, 4096, 8192);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/folder", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/folder/file", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/folder/file");
+    ASSERT_GE(fd, 0);
+    vector<uint8_t> data(4096 * 2250 + 100);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 13 + i / 4096);
+    }
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_fsync(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    dyn_array_t *record_results = fs_get_dir(fs, "/folder");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), 1u);
+    dyn_array_destroy(record_results);
+    fd = fs_open(fs, "/folder/file");
+    ASSERT_GE(fd, 0);
+    vector<uint8_t> back(data.size());
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(back, data);
+    ASSERT_EQ(fs_remove(fs, "/folder/file"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    // FORMAT_EX 2
+    fs = fs_format_ex(test_fname, 65536, 64);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), 65536 * 3 + 5), 65536 * 3 + 5);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_read(fs, fd, back.data(), 65536 * 3 + 5), 65536 * 3 + 5);
+    ASSERT_EQ(memcmp(back.data(), data.data(), 65536 * 3 + 5), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    // FORMAT_EX 5
+    // 36MiB of 512 byte blocks is past block 65535
+    fs = fs_format_ex(test_fname, 512, 131072);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+    fd = fs_open(fs, "/big");
+    ASSERT_GE(fd, 0);
+    vector<uint8_t> big(36 * 1024 * 1024);
+    for (size_t i = 0; i < big.size(); ++i) {
+        big[i] = (uint8_t) (i * 31 + i / 512);
+    }
+    ASSERT_EQ(fs_write(fs, fd, big.data(), big.size()), (ssize_t) big.size());
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/big");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t) big.size());
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+    vector<uint8_t> big_back(big.size());
+    ASSERT_EQ(fs_read(fs, fd, big_back.data(), big_back.size()), (ssize_t) big_back.size());
+    ASSERT_EQ(big_back, big);
+    // everything it had goes back, so it fits again
+    ASSERT_EQ(fs_remove(fs, "/big"), 0);
+    ASSERT_EQ(fs_create(fs, "/big", FS_REGULAR), 0);
+    fd = fs_open(fs, "/big");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_write(fs, fd, big.data(), big.size()), (ssize_t) big.size());
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+    int fs_migrate(const char *src_path, const char *dst_path, size_t block_size, size_t block_count)
+    1. Normal, a format 1 volume with files of every size and a nested directory, all there on the new volume
+    2. Error, NULL paths, the same path twice, a source that doesn't exist
+*/
+
+TEST(a_tests, migrate) {
+    const char *old_fname = "a_tests_old.f16fs";
+    const char *new_fname = "a_tests_new.f16fs";
+
+    // MIGRATE 2
+    ASSERT_LT(fs_migrate(NULL, new_fname, 4096, 8192), 0);
+    ASSERT_LT(fs_migrate(old_fname, NULL, 4096, 8192), 0);
+    ASSERT_LT(fs_migrate(old_fname, old_fname, 4096, 8192), 0);
+    ASSERT_LT(fs_migrate("a_tests_missing.f16fs", new_fname, 4096, 8192), 0);
+
+    // MIGRATE 1
+    // sizes that need the old format's direct, indirect and double indirect pointers
+    F16FS_t *fs = fs_format(old_fname);
+    ASSERT_NE(fs, nullptr);
+    vector<size_t> sizes{0, 100, 512 * 6, 512 * 100 + 7, 512 * 400 + 300};
+    vector<uint8_t> data(512 * 400 + 300);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 5 + i / 512);
+    }
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/inner", FS_DIRECTORY), 0);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        string path = (i % 2 ? "/dir/inner/file_" : "/file_") + std::to_string(i);
+        ASSERT_EQ(fs_create(fs, path.c_str(), FS_REGULAR), 0);
+        int fd = fs_open(fs, path.c_str());
+        ASSERT_GE(fd, 0);
+        if (sizes[i]) {
+            ASSERT_EQ(fs_write(fs, fd, data.data(), sizes[i]), (ssize_t) sizes[i]);
+        }
+    }
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    ASSERT_EQ(fs_migrate(old_fname, new_fname, 4096, 8192), 0);
+
+    fs = fs_mount(new_fname);
+    ASSERT_NE(fs, nullptr);
+    dyn_array_t *record_results = fs_get_dir(fs, "/");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), 4u);
+    dyn_array_destroy(record_results);
+    record_results = fs_get_dir(fs, "/dir/inner");
+    ASSERT_NE(record_results, nullptr);
+    ASSERT_EQ(dyn_array_size(record_results), 2u);
+    dyn_array_destroy(record_results);
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        string path = (i % 2 ? "/dir/inner/file_" : "/file_") + std::to_string(i);
+        int fd = fs_open(fs, path.c_str());
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t) sizes[i]);
+        ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_SET), 0);
+        if (sizes[i]) {
+            vector<uint8_t> back(sizes[i]);
+            ASSERT_EQ(fs_read(fs, fd, back.data(), sizes[i]), (ssize_t) sizes[i]);
+            ASSERT_EQ(memcmp(back.data(), data.data(), sizes[i]), 0);
+        }
+    }
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    // the old volume is still there and still format 1
+    fs = fs_mount(old_fname);
+    ASSERT_NE(fs, nullptr);
+    int fd = fs_open(fs, "/file_4");
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_END), (off_t) sizes[4]);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+    Extent-mapped files (every regular file on a format 2 volume)
+    1. Normal, two files written a block at a time in turn, so every extent is one block and the tree is two levels deep,
+       taking no more tree nodes than they need, read back in odd sized pieces after a remount
+    2. Normal, removing them gives back every block, tree nodes included
+*/
+
+TEST(a_tests, extents) {
+    const char *test_fname = "a_tests_extents.f16fs";
+    const size_t blocks = 1500;
+
+    F16FS_t *fs = fs_format_ex(test_fname, 512, 8192);
+    ASSERT_NE(fs, nullptr);
+
+    // EXTENTS 2 (the baseline)
+    ASSERT_EQ(fs_create(fs, "/fill", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/fill");
+    ASSERT_GE(fd, 0);
+    vector<uint8_t> chunk(512 * 64, 0x5A);
+    size_t fill_bytes = 0;
+    ssize_t written;
+    while ((written = fs_write(fs, fd, chunk.data(), chunk.size())) > 0) {
+        fill_bytes += written;
+    }
+    ASSERT_EQ(fs_remove(fs, "/fill"), 0);
+
+    // EXTENTS 1
+    // 42 extents to a node, so 1500 single block extents need the root to point at nodes that point at leaves
+    vector<uint8_t> data_a(512 * blocks), data_b(512 * blocks);
+    for (size_t i = 0; i < data_a.size(); ++i) {
+        data_a[i] = (uint8_t) (i * 7 + i / 512);
+        data_b[i] = (uint8_t) (i * 11 + i / 512 + 1);
+    }
+    ASSERT_EQ(fs_create(fs, "/a", FS_REGULAR), 0);
+    ASSERT_EQ(fs_create(fs, "/b", FS_REGULAR), 0);
+    int fd_a = fs_open(fs, "/a");
+    int fd_b = fs_open(fs, "/b");
+    ASSERT_GE(fd_a, 0);
+    ASSERT_GE(fd_b, 0);
+    for (size_t i = 0; i < blocks; ++i) {
+        ASSERT_EQ(fs_write(fs, fd_a, data_a.data() + 512 * i, 512), 512);
+        ASSERT_EQ(fs_write(fs, fd_b, data_b.data() + 512 * i, 512), 512);
+    }
+    // what's left is one free run, so filling it shows how many blocks the two trees took: 36 full leaves and the
+    // node over them each, none left part empty when the root moved down
+    ASSERT_EQ(fs_create(fs, "/rest", FS_REGULAR), 0);
+    fd = fs_open(fs, "/rest");
+    ASSERT_GE(fd, 0);
+    size_t rest_bytes = 0;
+    while ((written = fs_write(fs, fd, chunk.data(), chunk.size())) > 0) {
+        rest_bytes += written;
+    }
+    ASSERT_EQ(fill_bytes - rest_bytes, 512 * 2 * (blocks + 37));
+    ASSERT_EQ(fs_remove(fs, "/rest"), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    fd_a = fs_open(fs, "/a");
+    fd_b = fs_open(fs, "/b");
+    ASSERT_GE(fd_a, 0);
+    ASSERT_GE(fd_b, 0);
+    vector<uint8_t> back(data_a.size());
+    ASSERT_EQ(fs_read(fs, fd_a, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(back, data_a);
+    // pieces that start and end inside blocks
+    for (size_t done = 0; done < back.size();) {
+        size_t piece = std::min(back.size() - done, (size_t) 1000);
+        ASSERT_EQ(fs_read(fs, fd_b, back.data() + done, piece), (ssize_t) piece);
+        done += piece;
+    }
+    ASSERT_EQ(back, data_b);
+
+    // EXTENTS 2
+    ASSERT_EQ(fs_remove(fs, "/a"), 0);
+    ASSERT_EQ(fs_remove(fs, "/b"), 0);
+    ASSERT_EQ(fs_create(fs, "/fill", FS_REGULAR), 0);
+    fd = fs_open(fs, "/fill");
+    ASSERT_GE(fd, 0);
+    size_t refill_bytes = 0;
+    while ((written = fs_write(fs, fd, chunk.data(), chunk.size())) > 0) {
+        refill_bytes += written;
+    }
+    ASSERT_EQ(refill_bytes, fill_bytes);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
 /*
 
 int fs_create(F16FS_t *const fs, const char *const fname, const ftype_t ftype);
@@ -737,7 +996,7 @@ TEST(e_tests, remove_file) {
 
     vector<const char *> a_fnames{"/file_a", "/file_b", "/file_c", "/file_d"};
 
-    const char *(test_fname[2]) = {"e_tests_a.f16fs", "e_tests_b.f16fs"};
+    const char *test_fname[2] = {"e_tests_a.f16fs", "e_tests_b.f16fs"};
 
     ASSERT_EQ(system("cp d_tests_full.f16fs e_tests_a.f16fs"), 0);
     ASSERT_EQ(system("cp c_tests.f16fs e_tests_b.f16fs"), 0);
@@ -823,6 +1082,113 @@ TEST(e_tests, remove_file) {
 }
 
 
+TEST(e_tests, remove_releases_blocks) {
+    const char *test_fname = "e_tests_c.f16fs";
+
+    ASSERT_EQ(system("cp d_tests_full.f16fs e_tests_c.f16fs"), 0);
+
+    F16FS_t *fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+
+    // the device is full, so this only works if removing gave everything back (tables included)
+    ASSERT_EQ(fs_remove(fs, "/file_a"), 0);
+    ASSERT_EQ(fs_create(fs, "/file_a", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file_a");
+    ASSERT_GE(fd, 0);
+
+    uint8_t *giant_data_hunk = new (std::nothrow) uint8_t[512 * 256];
+    ASSERT_NE(giant_data_hunk, nullptr);
+    memset(giant_data_hunk, 0x6E, 512 * 256);
+    size_t bytes_written = 0;
+    ssize_t written;
+    while ((written = fs_write(fs, fd, giant_data_hunk, 512 * 256)) > 0) {
+        bytes_written += written;
+    }
+    delete[] giant_data_hunk;
+    ASSERT_EQ(bytes_written, 33398272u);
+
+    fs_unmount(fs);
+}
+
+/*
+    int fs_fsync(F16FS_t *fs, int fd)
+    1. Normal, a file big enough to need both kinds of indirect table, still there after a remount
+    2. Error, FS null
+    3. Error, fd invalid/closed
+*/
+
+TEST(e_tests, fsync) {
+    const char *test_fname = "e_tests_d.f16fs";
+
+    F16FS_t *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/file_a", FS_REGULAR), 0);
+    int fd = fs_open(fs, "/file_a");
+    ASSERT_GE(fd, 0);
+
+    // an empty file syncs fine
+    ASSERT_EQ(fs_fsync(fs, fd), 0);
+
+    vector<uint8_t> data(512 * 300, 0x3F);
+    ASSERT_EQ(fs_write(fs, fd, data.data(), data.size()), (ssize_t) data.size());
+    ASSERT_EQ(fs_fsync(fs, fd), 0);
+    ASSERT_EQ(fs_fsync(fs, fd), 0);
+
+    ASSERT_LT(fs_fsync(NULL, fd), 0);
+    ASSERT_LT(fs_fsync(fs, -1), 0);
+    ASSERT_LT(fs_fsync(fs, 256), 0);
+    ASSERT_EQ(fs_close(fs, fd), 0);
+    ASSERT_LT(fs_fsync(fs, fd), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+
+    fs = fs_mount(test_fname);
+    ASSERT_NE(fs, nullptr);
+    fd = fs_open(fs, "/file_a");
+    ASSERT_GE(fd, 0);
+    vector<uint8_t> back(data.size());
+    ASSERT_EQ(fs_read(fs, fd, back.data(), back.size()), (ssize_t) back.size());
+    ASSERT_EQ(back, data);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
+/*
+    int fs_sync_dir(F16FS_t *fs, const char *path)
+    1. Normal, a file just created in a new directory is on disk without an unmount, seen by mounting the image
+       again alongside
+    2. Normal, the root directory
+    3. Error, FS null
+    4. Error, path null, relative, or with a trailing slash
+    5. Error, path doesn't exist or is a regular file
+*/
+
+TEST(e_tests, sync_dir) {
+    const char *test_fname = "e_tests_e.f16fs";
+
+    F16FS_t *fs = fs_format(test_fname);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_EQ(fs_create(fs, "/dir", FS_DIRECTORY), 0);
+    ASSERT_EQ(fs_create(fs, "/dir/file", FS_REGULAR), 0);
+
+    // SYNC_DIR 1, 2
+    ASSERT_EQ(fs_sync_dir(fs, "/"), 0);
+    ASSERT_EQ(fs_sync_dir(fs, "/dir"), 0);
+    F16FS_t *again = fs_mount(test_fname);
+    ASSERT_NE(again, nullptr);
+    ASSERT_GE(fs_open(again, "/dir/file"), 0);
+
+    // SYNC_DIR 3, 4, 5
+    ASSERT_LT(fs_sync_dir(NULL, "/dir"), 0);
+    ASSERT_LT(fs_sync_dir(fs, NULL), 0);
+    ASSERT_LT(fs_sync_dir(fs, "dir"), 0);
+    ASSERT_LT(fs_sync_dir(fs, "/dir/"), 0);
+    ASSERT_LT(fs_sync_dir(fs, "/nope"), 0);
+    ASSERT_LT(fs_sync_dir(fs, "/dir/file"), 0);
+
+    // the first mount goes last, so its inode table is the one left
+    ASSERT_EQ(fs_unmount(again), 0);
+    ASSERT_EQ(fs_unmount(fs), 0);
+}
+
 /*
     off_t fs_seek(F16FS_t *fs, int fd, off_t offset, seek_t whence)
     1. Normal, wherever, really - make sure it doesn't change a second fd to the file
@@ -1001,6 +1367,112 @@ TEST(h_tests, read) {
     score += 16;
 }
 
+/*
+    fs_read over physically contiguous runs
+    1. Normal, reads from all over a file that crosses the direct/indirect/double indirect boundaries (format 1) or
+       is a few extents long (format 2), starting and ending inside blocks, checked against what was written
+    2. Normal, a read past EOF of a file smaller than a block stops at EOF
+*/
+
+TEST(h_tests, read_runs) {
+    vector<const char *> fnames{"h_tests_runs_1.f16fs", "h_tests_runs_2.f16fs"};
+    vector<uint8_t> data(512 * 600 + 77);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 13 + i / 512);
+    }
+    vector<std::pair<size_t, size_t>> reads{{0, data.size()}, {1, 511}, {100, 512 * 6}, {512 * 5 + 3, 512 * 300},
+                                            {512 * 250, 512 * 40 + 1}, {data.size() - 600, 600}, {data.size() - 1, 5}};
+
+    for (size_t format = 0; format < fnames.size(); ++format) {
+        F16FS_t *fs = format == 0 ? fs_format(fnames[format]) : fs_format_ex(fnames[format], 512, 8192);
+        ASSERT_NE(fs, nullptr);
+
+        // READ_RUNS 1
+        // a second file written in between breaks the first one up into a few runs
+        ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+        ASSERT_EQ(fs_create(fs, "/other", FS_REGULAR), 0);
+        int fd = fs_open(fs, "/file");
+        int fd_other = fs_open(fs, "/other");
+        ASSERT_GE(fd, 0);
+        ASSERT_GE(fd_other, 0);
+        ASSERT_EQ(fs_write(fs, fd, data.data(), 512 * 200), 512 * 200);
+        ASSERT_EQ(fs_write(fs, fd_other, data.data(), 512 * 3), 512 * 3);
+        ASSERT_EQ(fs_write(fs, fd, data.data() + 512 * 200, data.size() - 512 * 200), (ssize_t) (data.size() - 512 * 200));
+        for (const auto &read : reads) {
+            vector<uint8_t> back(read.second + 512, 0);
+            ASSERT_EQ(fs_seek(fs, fd, read.first, FS_SEEK_SET), (off_t) read.first);
+            ssize_t expected = std::min(read.second, data.size() - read.first);
+            ASSERT_EQ(fs_read(fs, fd, back.data(), read.second), expected);
+            ASSERT_EQ(memcmp(back.data(), data.data() + read.first, expected), 0);
+            ASSERT_EQ(fs_seek(fs, fd, 0, FS_SEEK_CUR), (off_t) (read.first + expected));
+        }
+
+        // READ_RUNS 2
+        ASSERT_EQ(fs_create(fs, "/small", FS_REGULAR), 0);
+        fd = fs_open(fs, "/small");
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(fs_write(fs, fd, data.data(), 100), 100);
+        ASSERT_EQ(fs_write(fs, fd, data.data() + 100, 50), 50);
+        vector<uint8_t> back(512, 0);
+        ASSERT_EQ(fs_read(fs, fd, back.data(), 512), 150);
+        ASSERT_EQ(memcmp(back.data(), data.data(), 150), 0);
+        ASSERT_EQ(fs_read(fs, fd, back.data(), 512), 0);
+        ASSERT_EQ(fs_unmount(fs), 0);
+    }
+}
+
+/*
+    fs_read through a descriptor's cached block map
+    1. Normal, a second descriptor keeps writing past what the reader's cache covers, for both formats
+    2. Normal, the file is removed and another file takes its inode, a new descriptor doesn't see the old blocks
+*/
+
+TEST(h_tests, read_cached_map) {
+    vector<const char *> fnames{"h_tests_map_1.f16fs", "h_tests_map_2.f16fs"};
+    vector<uint8_t> data(512 * 700);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (uint8_t) (i * 3 + i / 512);
+    }
+
+    for (size_t format = 0; format < fnames.size(); ++format) {
+        F16FS_t *fs = format == 0 ? fs_format(fnames[format]) : fs_format_ex(fnames[format], 512, 8192);
+        ASSERT_NE(fs, nullptr);
+
+        // READ_CACHED_MAP 1
+        // writes in steps that cross the indirect table boundaries (and grow the extent under the reader)
+        ASSERT_EQ(fs_create(fs, "/file", FS_REGULAR), 0);
+        int fd_w = fs_open(fs, "/file");
+        int fd_r = fs_open(fs, "/file");
+        ASSERT_GE(fd_w, 0);
+        ASSERT_GE(fd_r, 0);
+        vector<uint8_t> back(data.size());
+        size_t done = 0;
+        for (size_t step = 512 * 5 + 100; done < data.size(); step += 512 * 37) {
+            size_t piece = std::min(step, data.size() - done);
+            ASSERT_EQ(fs_write(fs, fd_w, data.data() + done, piece), (ssize_t) piece);
+            ASSERT_EQ(fs_read(fs, fd_r, back.data() + done, piece), (ssize_t) piece);
+            done += piece;
+        }
+        ASSERT_EQ(back, data);
+
+        // READ_CACHED_MAP 2
+        ASSERT_EQ(fs_close(fs, fd_r), 0);
+        ASSERT_EQ(fs_close(fs, fd_w), 0);
+        ASSERT_EQ(fs_remove(fs, "/file"), 0);
+        ASSERT_EQ(fs_create(fs, "/other", FS_REGULAR), 0);
+        fd_w = fs_open(fs, "/other");
+        ASSERT_GE(fd_w, 0);
+        vector<uint8_t> other(512 * 300, 0xC3);
+        ASSERT_EQ(fs_write(fs, fd_w, other.data(), other.size()), (ssize_t) other.size());
+        fd_r = fs_open(fs, "/other");
+        ASSERT_GE(fd_r, 0);
+        back.assign(other.size(), 0);
+        ASSERT_EQ(fs_read(fs, fd_r, back.data(), back.size()), (ssize_t) back.size());
+        ASSERT_EQ(back, other);
+        ASSERT_EQ(fs_unmount(fs), 0);
+    }
+}
+
 #if GRAD_TESTS
 
 /*